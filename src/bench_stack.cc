@@ -0,0 +1,280 @@
+/*
+ * Benchmark of stacking kernels
+ *
+ * Compares the former per-frame code using mdarray operations
+ * (float sums, temporary frames, separate passes) with the fused kernels
+ * and integer accumulators in stack_funcs, using synthetic frames.
+ * Max difference of averaged images is reported (float sums of the
+ * former code are not exact).  The former code runs in one thread, so
+ * the new code is timed both with 1 thread (gain by fusion) and with
+ * n_threads (gain by fusion and threads).
+ *
+ *   bench_stack [width height n_frames n_threads]
+ */
+#include <sli/stdstreamio.h>
+#include <sli/tstring.h>
+#include <sli/mdarray.h>
+#include <math.h>
+#include <string.h>
+#include <sys/time.h>
+#include "MT.h"
+#include "stack_funcs.h"
+#include "thread_funcs.h"
+#include "sys_funcs.h"
+using namespace sli;
+
+static double get_time_sec()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1.0e-6;
+}
+
+/* synthetic frame: sky + stars + noise + a few outliers */
+static void make_frame( size_t width, size_t height, mdarray_float *ret_img )
+{
+    size_t i, ch;
+    ret_img->resize_3d(width, height, 3);
+    for ( ch=0 ; ch < 3 ; ch++ ) {
+	float *p = ret_img->array_ptr(0, 0, ch);
+	for ( i=0 ; i < width * height ; i++ ) {
+	    double v = 1000.0 + 200.0 * (genrand_real2() - 0.5);
+	    if ( (i % 977) == 0 ) v += 30000.0;		/* star */
+	    if ( genrand_real2() < 0.0005 ) v = 65000.0;	/* hot pixel */
+	    p[i] = (float)floor(v) * 256.0;
+	}
+    }
+    return;
+}
+
+/* former code of do_stack_and_save() */
+static void sigma_clip_frame_old( const mdarray_float &img_buf,
+				  long offset_x, long offset_y,
+				  const mdarray_float &sum1,
+				  const mdarray_float &sum2_1,
+				  const mdarray_short &count1,
+				  const int sigma_rgb[],
+				  mdarray_float *sum0, mdarray_float *sum2_0,
+				  mdarray_short *count0,
+				  mdarray_float *img_tmp_buf,
+				  mdarray_uchar *flag_buf )
+{
+    const double av_median[3] = {1.0, 1.0, 1.0};
+    const double target_median[3] = {1.0, 1.0, 1.0};
+    unsigned char *p5 = flag_buf->array_ptr();
+    size_t j;
+
+    img_tmp_buf->clean();
+    img_tmp_buf->add(img_buf, offset_x, offset_y, 0);
+    size_t len_xy = img_tmp_buf->x_length() * img_tmp_buf->y_length();
+
+    (*flag_buf) = 0;
+
+    for ( j=0 ; j < 3 ; j++ ) {
+	size_t k;
+	const float *p0 = sum1.array_ptr_cs(0,0,j);
+	const float *p1 = sum2_1.array_ptr_cs(0,0,j);
+	const short *p2 = count1.array_ptr_cs(0,0,j);
+	const float *p3 = img_tmp_buf->array_ptr_cs(0,0,j);
+	if ( 0 < sigma_rgb[j] ) {
+	    double sigma_factor_limit = sigma_rgb[j] / 10.0;
+	    for ( k=0 ; k < len_xy ; k++ ) {
+		double sum  = p0[k];
+		double mean = sum / (double)(p2[k]);
+		double sum2 = p1[k];
+		double sigma = sqrt( (sum2 - 2 * mean * sum + mean * mean * p2[k])
+				     / (double)(p2[k] - 1) );
+		double pix_val = p3[k] + (av_median[j] - target_median[j]);
+		if ( sigma_factor_limit * sigma < fabs(mean - pix_val) ) {
+		    p5[k] ++;
+		}
+	    }
+	}
+    }
+    for ( j=0 ; j < 3 ; j++ ) {
+	float *p3 = img_tmp_buf->array_ptr(0,0,j);
+	short *p4 = count0->array_ptr(0,0,j);
+	size_t k;
+	for ( k=0 ; k < len_xy ; k++ ) {
+	    if ( 0 < p5[k] ) p3[k] = 0.0;
+	    else p4[k] ++;
+	}
+    }
+
+    (*sum0) += (*img_tmp_buf);
+    (*img_tmp_buf) *= (*img_tmp_buf);
+    (*sum2_0) += (*img_tmp_buf);
+
+    return;
+}
+
+/* 1st pass of the new code; returns elapsed time */
+static double run_pass1_new( thread_pool *tpool, const mdarray_float frames[],
+			     size_t n_frames, stack_accum *accum1 )
+{
+    double t0;
+    size_t i;
+
+    accum1->init(frames[0].x_length(), frames[0].y_length(), true);
+    t0 = get_time_sec();
+    for ( i=0 ; i < n_frames ; i++ ) {
+	long offset_x = (long)(i % 5) - 2, offset_y = (long)(i % 3) - 1;
+	stack_add_frame(tpool, frames[i % 2], offset_x, offset_y, accum1);
+    }
+    return get_time_sec() - t0;
+}
+
+/* sigma-clipping pass of the new code; returns elapsed time */
+static double run_pass2_new( thread_pool *tpool, const mdarray_float frames[],
+			     size_t n_frames, const stack_accum &accum1,
+			     const int sigma_rgb[], stack_accum *accum0 )
+{
+    const double av_median[3] = {1.0, 1.0, 1.0};
+    const double target_median[3] = {1.0, 1.0, 1.0};
+    double t0;
+    size_t i;
+
+    accum0->init(frames[0].x_length(), frames[0].y_length(), true);
+    t0 = get_time_sec();
+    for ( i=0 ; i < n_frames ; i++ ) {
+	long offset_x = (long)(i % 5) - 2, offset_y = (long)(i % 3) - 1;
+	stack_sigma_clip_frame(tpool, frames[i % 2], offset_x, offset_y,
+			       accum1, sigma_rgb, av_median, target_median,
+			       false, accum0);
+    }
+    return get_time_sec() - t0;
+}
+
+/* max of |a - b| */
+static double get_max_diff( const mdarray_float &a, const mdarray_float &b )
+{
+    const float *pa = a.array_ptr_cs();
+    const float *pb = b.array_ptr_cs();
+    double ret = 0.0;
+    size_t i;
+    if ( a.length() != b.length() ) return -1.0;
+    for ( i=0 ; i < a.length() ; i++ ) {
+	double d = fabs((double)pa[i] - (double)pb[i]);
+	if ( ret < d ) ret = d;
+    }
+    return ret;
+}
+
+int main( int argc, char *argv[] )
+{
+    stdstreamio sio;
+    size_t width = 6000, height = 4000, n_frames = 8;
+    int n_threads = get_number_of_cpus();
+    const int sigma_rgb[3] = {30, 30, 30};
+    mdarray_float frames[2];
+    mdarray_float sum1(false), sum2_1(false);
+    mdarray_float sum0_old(false), sum2_0_old(false);
+    mdarray_short count1(false), count0_old(false);
+    stack_accum accum1, accum0;
+    mdarray_float avg_old(false), avg_new(false);
+    mdarray_float img_tmp_buf(false);
+    mdarray_uchar flag_buf(false);
+    thread_pool tpool, tpool_1;
+    double t0, t_old_1, t_new_1, t_new_n1, t_old_2, t_new_2, t_new_n2;
+    size_t i;
+    int return_status = -1;
+
+    if ( 5 <= argc ) {
+	tstring argstr;
+	argstr = argv[1];  width = argstr.atol();
+	argstr = argv[2];  height = argstr.atol();
+	argstr = argv[3];  n_frames = argstr.atol();
+	argstr = argv[4];  n_threads = argstr.atoi();
+    }
+    else if ( 1 < argc ) {
+	sio.eprintf("Benchmark of stacking kernels\n");
+	sio.eprintf("\n");
+	sio.eprintf("[USAGE]\n");
+	sio.eprintf("$ %s [width height n_frames n_threads]\n", argv[0]);
+	goto quit;
+    }
+    if ( width < 16 || height < 16 || n_frames < 2 || n_threads < 1 ) {
+	sio.eprintf("[ERROR] invalid arguments\n");
+	goto quit;
+    }
+
+    sio.printf("frame = %zd x %zd x 3,  frames = %zd,  threads = %d,  "
+	       "kernel = %s\n", width, height, n_frames, n_threads,
+	       stack_sigma_clip_kernel_name());
+    sio.printf("(old: 1 thread; new: 1 thread and %d threads)\n", n_threads);
+
+    init_genrand(12345);
+    make_frame(width, height, &frames[0]);
+    make_frame(width, height, &frames[1]);
+
+    /*
+     * 1st pass: sum and sum^2
+     */
+    sum1.resize(frames[0]);
+    sum2_1.resize(frames[0]);
+    t0 = get_time_sec();
+    for ( i=0 ; i < n_frames ; i++ ) {
+	const mdarray_float &img_buf = frames[i % 2];
+	long offset_x = (long)(i % 5) - 2, offset_y = (long)(i % 3) - 1;
+	sum1.add(img_buf, offset_x, offset_y, 0);
+	sum2_1.add(img_buf * img_buf, offset_x, offset_y, 0);
+    }
+    t_old_1 = get_time_sec() - t0;
+
+    tpool_1.start(1);
+    tpool.start(n_threads);
+    t_new_1 = run_pass1_new(&tpool_1, frames, n_frames, &accum1);
+    t_new_n1 = run_pass1_new(&tpool, frames, n_frames, &accum1);
+
+    count1.resize(frames[0]);
+    count1 = (int)n_frames;
+    accum1.count = (int)n_frames;
+
+    avg_old = sum1;
+    avg_old /= count1;
+    stack_get_average(&tpool, accum1, n_frames, &avg_new);
+    sio.printf("1st pass:       old %8.3f sec,  new %8.3f sec  (x %.2f),  "
+	       "%d threads %8.3f sec  (x %.2f)  max diff = %g\n",
+	       t_old_1, t_new_1, t_old_1 / t_new_1,
+	       n_threads, t_new_n1, t_old_1 / t_new_n1,
+	       get_max_diff(avg_old, avg_new));
+
+    /*
+     * sigma-clipping pass
+     */
+
+    sum0_old.resize(frames[0]);
+    sum2_0_old.resize(frames[0]);
+    count0_old.resize(frames[0]);
+    img_tmp_buf.resize(frames[0]);
+    flag_buf.resize_2d(width, height);
+    t0 = get_time_sec();
+    for ( i=0 ; i < n_frames ; i++ ) {
+	long offset_x = (long)(i % 5) - 2, offset_y = (long)(i % 3) - 1;
+	sigma_clip_frame_old(frames[i % 2], offset_x, offset_y,
+			     sum1, sum2_1, count1, sigma_rgb,
+			     &sum0_old, &sum2_0_old, &count0_old,
+			     &img_tmp_buf, &flag_buf);
+    }
+    t_old_2 = get_time_sec() - t0;
+    img_tmp_buf.init(false);
+    flag_buf.init(false);
+
+    t_new_2 = run_pass2_new(&tpool_1, frames, n_frames, accum1, sigma_rgb,
+			    &accum0);
+    t_new_n2 = run_pass2_new(&tpool, frames, n_frames, accum1, sigma_rgb,
+			     &accum0);
+
+    avg_old = sum0_old;
+    avg_old /= count0_old;
+    stack_get_average(&tpool, accum0, n_frames, &avg_new);
+    sio.printf("sigma-clipping: old %8.3f sec,  new %8.3f sec  (x %.2f),  "
+	       "%d threads %8.3f sec  (x %.2f)  max diff = %g\n",
+	       t_old_2, t_new_2, t_old_2 / t_new_2,
+	       n_threads, t_new_n2, t_old_2 / t_new_n2,
+	       get_max_diff(avg_old, avg_new));
+
+    return_status = 0;
+ quit:
+    return return_status;
+}
@@ -0,0 +1,442 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <sli/stdstreamio.h>
+
+#include "checkpoint_funcs.h"
+#include "sys_funcs.h"
+
+using namespace sli;
+
+static const char Checkpoint_magic[8] = {'S','T','K','C','K','P','T','4'};
+
+/* limit of length of a filename in checkpoint */
+static const int64_t Max_len_filename = 4096;
+
+
+/*
+ * class stack_checkpoint
+ */
+
+stack_checkpoint::stack_checkpoint()
+  : ref_size(0), ref_mtime(0), ref_mtime_nsec(0),
+    ref_sztype(0), has_ref(true), n_iterations(0),
+    n_workers(0), worker_id(0),
+    offset_x(false), offset_y(false), frame_size(false),
+    frame_mtime(false), frame_mtime_nsec(false), n_frames(0)
+{
+}
+
+void stack_checkpoint::clear()
+{
+    this->ref_filename = "";
+    this->ref_size = 0;
+    this->ref_mtime = 0;
+    this->ref_mtime_nsec = 0;
+    this->ref_sztype = 0;
+    this->has_ref = true;
+    this->n_iterations = 0;
+    this->n_workers = 0;
+    this->worker_id = 0;
+    this->frame_names.init();
+    this->offset_x.init(false);
+    this->offset_y.init(false);
+    this->frame_size.init(false);
+    this->frame_mtime.init(false);
+    this->frame_mtime_nsec.init(false);
+    this->n_frames = 0;
+    return;
+}
+
+/* absolute path (filename as is when current directory is unknown) */
+static void get_frame_path( const char *filename, tstring *ret_path )
+{
+    if ( get_absolute_path(filename, ret_path) < 0 ) *ret_path = filename;
+    return;
+}
+
+void stack_checkpoint::set_reference( const char *filename, int sztype )
+{
+    get_frame_path(filename, &(this->ref_filename));
+    this->ref_sztype = sztype;
+    if ( get_file_key(filename, &(this->ref_size), &(this->ref_mtime),
+		      &(this->ref_mtime_nsec)) < 0 ) {
+	this->ref_size = -1;			/* never matches */
+	this->ref_mtime = 0;
+	this->ref_mtime_nsec = 0;
+    }
+    return;
+}
+
+bool stack_checkpoint::is_reference( const char *filename ) const
+{
+    tstring path;
+    long long size, mtime;
+    long mtime_nsec;
+    get_frame_path(filename, &path);
+    if ( path != this->ref_filename.cstr() ) return false;
+    if ( get_file_key(filename, &size, &mtime, &mtime_nsec) < 0 ) {
+	return false;
+    }
+    return ( size == this->ref_size && mtime == this->ref_mtime &&
+	     mtime_nsec == this->ref_mtime_nsec );
+}
+
+long stack_checkpoint::find_frame( const char *filename ) const
+{
+    tstring path;
+    size_t i;
+    get_frame_path(filename, &path);
+    for ( i=0 ; i < this->n_frames ; i++ ) {
+	if ( this->frame_names[i] == path.cstr() ) return i;
+    }
+    return -1;
+}
+
+void stack_checkpoint::append_frame( const char *filename,
+				     long offset_x, long offset_y )
+{
+    long long size, mtime;
+    long mtime_nsec;
+    if ( get_file_key(filename, &size, &mtime, &mtime_nsec) < 0 ) {
+	size = -1;				/* never matches */
+	mtime = 0;
+	mtime_nsec = 0;
+    }
+    this->append_frame(filename, offset_x, offset_y,
+		       size, mtime, mtime_nsec);
+    return;
+}
+
+void stack_checkpoint::append_frame( const char *filename,
+				     long offset_x, long offset_y,
+				     long long size, long long mtime,
+				     long mtime_nsec )
+{
+    const size_t i = this->n_frames;
+    get_frame_path(filename, &(this->frame_names[i]));
+    this->offset_x.resize_1d(i + 1);
+    this->offset_y.resize_1d(i + 1);
+    this->frame_size.resize_1d(i + 1);
+    this->frame_mtime.resize_1d(i + 1);
+    this->frame_mtime_nsec.resize_1d(i + 1);
+    this->offset_x[i] = offset_x;
+    this->offset_y[i] = offset_y;
+    this->frame_size[i] = size;
+    this->frame_mtime[i] = mtime;
+    this->frame_mtime_nsec[i] = mtime_nsec;
+    this->n_frames ++;
+    return;
+}
+
+bool stack_checkpoint::is_frame_modified( size_t i ) const
+{
+    long long size, mtime;
+    long mtime_nsec;
+    if ( this->n_frames <= i ) return true;
+    if ( get_file_key(this->frame_names[i].cstr(),
+		      &size, &mtime, &mtime_nsec) < 0 ) return true;
+    return ( size != this->frame_size[i] || mtime != this->frame_mtime[i] ||
+	     mtime_nsec != this->frame_mtime_nsec[i] );
+}
+
+
+/*
+ * file I/O
+ */
+
+static int write_bytes( stdstreamio *f_out, const void *ptr, size_t len )
+{
+    if ( len == 0 ) return 0;
+    if ( f_out->write(ptr, len) != (ssize_t)len ) return -1;
+    return 0;
+}
+
+static int read_bytes( stdstreamio *f_in, void *ptr, size_t len )
+{
+    if ( len == 0 ) return 0;
+    if ( f_in->read(ptr, len) != (ssize_t)len ) return -1;
+    return 0;
+}
+
+static int write_int64( stdstreamio *f_out, int64_t v )
+{
+    return write_bytes(f_out, &v, sizeof(v));
+}
+
+static int read_int64( stdstreamio *f_in, int64_t *ret_v )
+{
+    return read_bytes(f_in, ret_v, sizeof(*ret_v));
+}
+
+static int write_string( stdstreamio *f_out, const tstring &str )
+{
+    if ( write_int64(f_out, str.length()) < 0 ) return -1;
+    return write_bytes(f_out, str.cstr(), str.length());
+}
+
+static int read_string( stdstreamio *f_in, tstring *ret_str )
+{
+    char buf[Max_len_filename + 1];
+    int64_t len;
+    if ( read_int64(f_in, &len) < 0 ) return -1;
+    if ( len < 0 || Max_len_filename < len ) return -1;
+    if ( read_bytes(f_in, buf, len) < 0 ) return -1;
+    buf[len] = '\0';
+    *ret_str = buf;
+    return 0;
+}
+
+/*
+ * Layout:
+ *   magic[8]
+ *   int64: width, height, is_integer, ref_sztype, has_ref, n_iterations,
+ *          n_workers, worker_id, n_frames
+ *   string: ref_filename
+ *   int64: ref_size, ref_mtime, ref_mtime_nsec
+ *   n_frames x { int64: offset_x, offset_y, size, mtime, mtime_nsec;
+ *                string: filename }
+ *   sum[width*height*3], sum2[width*height*3]  (long long or double)
+ *   count[width*height*3]  (int)
+ * (string: int64 length + bytes without '\0'; filenames are absolute)
+ */
+int save_stack_checkpoint( const char *filename,
+			   const stack_checkpoint &ckpt,
+			   const stack_accum &accum )
+{
+    stdstreamio sio, f_out;
+    tstring tmp_filename;
+    const size_t len_data = accum.count.length();
+    size_t i;
+    int ret_status = -1;
+
+    if ( filename == NULL ) goto quit;
+    if ( accum.count.z_length() != 3 ) goto quit;
+
+    tmp_filename.printf("%s.tmp", filename);
+    if ( f_out.open("w", tmp_filename.cstr()) < 0 ) {
+	sio.eprintf("[ERROR] cannot open: %s\n", tmp_filename.cstr());
+	goto quit;
+    }
+
+    if ( write_bytes(&f_out, Checkpoint_magic, sizeof(Checkpoint_magic)) < 0 ||
+	 write_int64(&f_out, accum.x_length()) < 0 ||
+	 write_int64(&f_out, accum.y_length()) < 0 ||
+	 write_int64(&f_out, (accum.is_integer == true) ? 1 : 0) < 0 ||
+	 write_int64(&f_out, ckpt.ref_sztype) < 0 ||
+	 write_int64(&f_out, (ckpt.has_ref == true) ? 1 : 0) < 0 ||
+	 write_int64(&f_out, ckpt.n_iterations) < 0 ||
+	 write_int64(&f_out, ckpt.n_workers) < 0 ||
+	 write_int64(&f_out, ckpt.worker_id) < 0 ||
+	 write_int64(&f_out, ckpt.length()) < 0 ||
+	 write_string(&f_out, ckpt.ref_filename) < 0 ||
+	 write_int64(&f_out, ckpt.ref_size) < 0 ||
+	 write_int64(&f_out, ckpt.ref_mtime) < 0 ||
+	 write_int64(&f_out, ckpt.ref_mtime_nsec) < 0 ) goto write_error;
+
+    for ( i=0 ; i < ckpt.length() ; i++ ) {
+	if ( write_int64(&f_out, ckpt.offset_x[i]) < 0 ||
+	     write_int64(&f_out, ckpt.offset_y[i]) < 0 ||
+	     write_int64(&f_out, ckpt.frame_size[i]) < 0 ||
+	     write_int64(&f_out, ckpt.frame_mtime[i]) < 0 ||
+	     write_int64(&f_out, ckpt.frame_mtime_nsec[i]) < 0 ||
+	     write_string(&f_out, ckpt.frame_names[i]) < 0 ) goto write_error;
+    }
+
+    if ( accum.is_integer == true ) {
+	if ( write_bytes(&f_out, accum.sum_i.array_ptr_cs(0,0,0),
+			 sizeof(long long) * len_data) < 0 ||
+	     write_bytes(&f_out, accum.sum2_i.array_ptr_cs(0,0,0),
+			 sizeof(long long) * len_data) < 0 ) goto write_error;
+    }
+    else {
+	if ( write_bytes(&f_out, accum.sum_d.array_ptr_cs(0,0,0),
+			 sizeof(double) * len_data) < 0 ||
+	     write_bytes(&f_out, accum.sum2_d.array_ptr_cs(0,0,0),
+			 sizeof(double) * len_data) < 0 ) goto write_error;
+    }
+    if ( write_bytes(&f_out, accum.count.array_ptr_cs(0,0,0),
+		     sizeof(int) * len_data) < 0 ) goto write_error;
+
+    f_out.close();
+
+    if ( rename(tmp_filename.cstr(), filename) != 0 ) {
+	sio.eprintf("[ERROR] cannot rename %s to %s\n",
+		    tmp_filename.cstr(), filename);
+	unlink(tmp_filename.cstr());
+	goto quit;
+    }
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+
+ write_error:
+    sio.eprintf("[ERROR] cannot write: %s\n", tmp_filename.cstr());
+    f_out.close();
+    unlink(tmp_filename.cstr());
+    return ret_status;
+}
+
+int load_stack_checkpoint( const char *filename,
+			   stack_checkpoint *ret_ckpt,
+			   stack_accum *ret_accum )
+{
+    stdstreamio f_in;
+    char magic[sizeof(Checkpoint_magic)];
+    int64_t width, height, is_integer, ref_sztype, has_ref, n_iterations;
+    int64_t n_workers, worker_id, n_frames;
+    int64_t ref_size, ref_mtime, ref_mtime_nsec;
+    size_t len_data;
+    int64_t i;
+    int ret_status = -1;
+
+    if ( filename == NULL ) goto quit;
+    if ( ret_ckpt == NULL || ret_accum == NULL ) goto quit;
+
+    ret_ckpt->clear();
+    ret_accum->release();
+
+    if ( f_in.open("r", filename) < 0 ) goto quit;
+
+    if ( read_bytes(&f_in, magic, sizeof(magic)) < 0 ) goto quit;
+    if ( memcmp(magic, Checkpoint_magic, sizeof(magic)) != 0 ) goto quit;
+
+    if ( read_int64(&f_in, &width) < 0 ||
+	 read_int64(&f_in, &height) < 0 ||
+	 read_int64(&f_in, &is_integer) < 0 ||
+	 read_int64(&f_in, &ref_sztype) < 0 ||
+	 read_int64(&f_in, &has_ref) < 0 ||
+	 read_int64(&f_in, &n_iterations) < 0 ||
+	 read_int64(&f_in, &n_workers) < 0 ||
+	 read_int64(&f_in, &worker_id) < 0 ||
+	 read_int64(&f_in, &n_frames) < 0 ||
+	 read_string(&f_in, &(ret_ckpt->ref_filename)) < 0 ||
+	 read_int64(&f_in, &ref_size) < 0 ||
+	 read_int64(&f_in, &ref_mtime) < 0 ||
+	 read_int64(&f_in, &ref_mtime_nsec) < 0 ) goto quit;
+    if ( width <= 0 || height <= 0 || n_frames < 0 ) goto quit;
+    if ( n_iterations < 0 ) goto quit;
+    if ( n_workers < 0 || worker_id < 0 ) goto quit;
+    if ( n_workers == 0 && worker_id != 0 ) goto quit;
+    if ( 0 < n_workers && n_workers <= worker_id ) goto quit;
+    ret_ckpt->ref_size = ref_size;
+    ret_ckpt->ref_mtime = ref_mtime;
+    ret_ckpt->ref_mtime_nsec = ref_mtime_nsec;
+    ret_ckpt->ref_sztype = ref_sztype;
+    ret_ckpt->has_ref = ( has_ref != 0 );
+    ret_ckpt->n_iterations = n_iterations;
+    ret_ckpt->n_workers = n_workers;
+    ret_ckpt->worker_id = worker_id;
+
+    for ( i=0 ; i < n_frames ; i++ ) {
+	int64_t offset_x, offset_y, size, mtime, mtime_nsec;
+	tstring name;
+	if ( read_int64(&f_in, &offset_x) < 0 ||
+	     read_int64(&f_in, &offset_y) < 0 ||
+	     read_int64(&f_in, &size) < 0 ||
+	     read_int64(&f_in, &mtime) < 0 ||
+	     read_int64(&f_in, &mtime_nsec) < 0 ||
+	     read_string(&f_in, &name) < 0 ) goto quit;
+	ret_ckpt->append_frame(name.cstr(), offset_x, offset_y,
+			       size, mtime, mtime_nsec);
+    }
+
+    ret_accum->init(width, height, (is_integer != 0));
+    len_data = ret_accum->count.length();
+
+    if ( ret_accum->is_integer == true ) {
+	if ( read_bytes(&f_in, ret_accum->sum_i.array_ptr(0,0,0),
+			sizeof(long long) * len_data) < 0 ||
+	     read_bytes(&f_in, ret_accum->sum2_i.array_ptr(0,0,0),
+			sizeof(long long) * len_data) < 0 ) goto quit;
+    }
+    else {
+	if ( read_bytes(&f_in, ret_accum->sum_d.array_ptr(0,0,0),
+			sizeof(double) * len_data) < 0 ||
+	     read_bytes(&f_in, ret_accum->sum2_d.array_ptr(0,0,0),
+			sizeof(double) * len_data) < 0 ) goto quit;
+    }
+    if ( read_bytes(&f_in, ret_accum->count.array_ptr(0,0,0),
+		    sizeof(int) * len_data) < 0 ) goto quit;
+
+    ret_status = 0;
+ quit:
+    f_in.close();
+    if ( ret_status < 0 && ret_accum != NULL ) ret_accum->release();
+    return ret_status;
+}
+
+int merge_stack_checkpoint( stack_checkpoint *ckpt, stack_accum *accum,
+			    const stack_checkpoint &src_ckpt,
+			    const stack_accum &src_accum )
+{
+    stdstreamio sio;
+    size_t i, len_data;
+    int ret_status = -1;
+
+    if ( ckpt->ref_filename != src_ckpt.ref_filename.cstr() ||
+	 ckpt->ref_size != src_ckpt.ref_size ||
+	 ckpt->ref_mtime != src_ckpt.ref_mtime ||
+	 ckpt->ref_mtime_nsec != src_ckpt.ref_mtime_nsec ||
+	 ckpt->ref_sztype != src_ckpt.ref_sztype ||
+	 ckpt->n_iterations != src_ckpt.n_iterations ||
+	 ckpt->n_workers != src_ckpt.n_workers ||
+	 accum->is_integer != src_accum.is_integer ||
+	 accum->x_length() != src_accum.x_length() ||
+	 accum->y_length() != src_accum.y_length() ) {
+	sio.eprintf("[ERROR] reference, size, pass or number of workers "
+		    "does not match\n");
+	goto quit;
+    }
+    if ( ckpt->has_ref == true && src_ckpt.has_ref == true ) {
+	sio.eprintf("[ERROR] reference frame is stacked twice\n");
+	goto quit;
+    }
+    for ( i=0 ; i < src_ckpt.length() ; i++ ) {
+	if ( 0 <= ckpt->find_frame(src_ckpt.frame_names[i].cstr()) ) {
+	    sio.eprintf("[ERROR] frame is stacked twice: %s\n",
+			src_ckpt.frame_names[i].cstr());
+	    goto quit;
+	}
+    }
+
+    len_data = accum->count.length();
+    if ( accum->is_integer == true ) {
+	long long *sum = accum->sum_i.array_ptr();
+	long long *sum2 = accum->sum2_i.array_ptr();
+	const long long *src_sum = src_accum.sum_i.array_ptr_cs();
+	const long long *src_sum2 = src_accum.sum2_i.array_ptr_cs();
+	for ( i=0 ; i < len_data ; i++ ) {
+	    sum[i] += src_sum[i];
+	    sum2[i] += src_sum2[i];
+	}
+    }
+    else {
+	double *sum = accum->sum_d.array_ptr();
+	double *sum2 = accum->sum2_d.array_ptr();
+	const double *src_sum = src_accum.sum_d.array_ptr_cs();
+	const double *src_sum2 = src_accum.sum2_d.array_ptr_cs();
+	for ( i=0 ; i < len_data ; i++ ) {
+	    sum[i] += src_sum[i];
+	    sum2[i] += src_sum2[i];
+	}
+    }
+    {
+	int *count = accum->count.array_ptr();
+	const int *src_count = src_accum.count.array_ptr_cs();
+	for ( i=0 ; i < len_data ; i++ ) count[i] += src_count[i];
+    }
+
+    for ( i=0 ; i < src_ckpt.length() ; i++ ) {
+	ckpt->append_frame(src_ckpt.frame_names[i].cstr(),
+			   src_ckpt.offset_x[i], src_ckpt.offset_y[i],
+			   src_ckpt.frame_size[i], src_ckpt.frame_mtime[i],
+			   src_ckpt.frame_mtime_nsec[i]);
+    }
+    if ( src_ckpt.has_ref == true ) ckpt->has_ref = true;
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
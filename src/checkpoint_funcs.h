@@ -0,0 +1,84 @@
+#ifndef _CHECKPOINT_FUNCS_H
+#define _CHECKPOINT_FUNCS_H 1
+
+#include <unistd.h>
+#include <sli/tstring.h>
+#include <sli/tarray_tstring.h>
+#include <sli/mdarray.h>
+
+#include "stack_funcs.h"
+
+/*
+ * Checkpoint of a pass of stacking (sum, sum^2 and count), with the list
+ * of stacked frames and their offsets.  It is also used as a partial
+ * result of a worker stacking a subset of frames (see merge_stacks).
+ *
+ * Frames are identified by absolute paths, with size and mtime (in
+ * nanoseconds) of the files when they were stacked, so that a modified
+ * frame is detected; the reference frame is stored separately and is
+ * always stacked at offset (0,0).  A partial result
+ * records its worker (worker_id of n_workers), so that merge_stacks can
+ * check that every worker is merged exactly once.  Data are written in
+ * native byte order, so a checkpoint is not portable across machines of
+ * different architectures.
+ */
+class stack_checkpoint {
+
+  public:
+    stack_checkpoint();
+
+    void clear();
+    /* size and mtime of filename are recorded */
+    void set_reference( const char *filename, int sztype );
+    /* same path, size and mtime as the reference */
+    bool is_reference( const char *filename ) const;
+    /* returns index in frame list (-1: not found) */
+    long find_frame( const char *filename ) const;
+    /* size and mtime of filename are recorded */
+    void append_frame( const char *filename, long offset_x, long offset_y );
+    /* size and mtime are given (e.g. of another checkpoint) */
+    void append_frame( const char *filename, long offset_x, long offset_y,
+		       long long size, long long mtime, long mtime_nsec );
+    /* file of frame i is removed or has been modified */
+    bool is_frame_modified( size_t i ) const;
+    size_t length() const { return this->n_frames; }
+
+    sli::tstring ref_filename;		/* absolute path */
+    long long ref_size;
+    long long ref_mtime;
+    long ref_mtime_nsec;
+    int ref_sztype;
+    bool has_ref;			/* reference frame is in the sums */
+    int n_iterations;			/* 0: 1st pass, N: sigma-clip pass N */
+    int n_workers;			/* 0: not a partial result */
+    int worker_id;			/* 0 .. n_workers-1 */
+    sli::tarray_tstring frame_names;	/* except reference (absolute) */
+    sli::mdarray_long offset_x;
+    sli::mdarray_long offset_y;
+    sli::mdarray_llong frame_size;
+    sli::mdarray_llong frame_mtime;
+    sli::mdarray_long frame_mtime_nsec;
+
+  private:
+    size_t n_frames;
+
+};
+
+/* write checkpoint atomically (via "<filename>.tmp") */
+int save_stack_checkpoint( const char *filename,
+			   const stack_checkpoint &ckpt,
+			   const stack_accum &accum );
+
+/* returns 0 on success; ret_accum is reallocated */
+int load_stack_checkpoint( const char *filename,
+			   stack_checkpoint *ret_ckpt,
+			   stack_accum *ret_accum );
+
+/* accum += src, and frames of src_ckpt are appended to ckpt */
+/* (they must be of the same reference file, the same pass  */
+/*  and the same number of workers)                          */
+int merge_stack_checkpoint( stack_checkpoint *ckpt, stack_accum *accum,
+			    const stack_checkpoint &src_ckpt,
+			    const stack_accum &src_accum );
+
+#endif	/* _CHECKPOINT_FUNCS_H */
@@ -0,0 +1,330 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+#include "combine_funcs.h"
+
+using namespace sli;
+
+/* winsorized sigma-clipping */
+static const int Max_winsor_iterations = 10;
+static const double Winsor_clip_factor = 1.5;	/* for winsorization */
+static const double Winsor_sigma_correction = 1.134;
+static const double Winsor_tolerance = 0.0005;
+
+int parse_combine_mode( const char *str, combine_params *ret_params )
+{
+    combine_params params;
+    int j;
+
+    if ( str == NULL || ret_params == NULL ) return -1;
+
+    params.mode = COMBINE_MEAN;
+    params.percentile = 50.0;
+    for ( j=0 ; j < 3 ; j++ ) params.winsor_sigma[j] = 0.0;
+
+    if ( strcmp(str, "mean") == 0 ) {
+	params.mode = COMBINE_MEAN;
+    }
+    else if ( strcmp(str, "median") == 0 ) {
+	params.mode = COMBINE_MEDIAN;
+    }
+    else if ( strcmp(str, "winsor") == 0 ) {
+	params.mode = COMBINE_WINSORIZED;
+    }
+    else if ( str[0] == 'p' && str[1] != '\0' ) {
+	char *endptr = NULL;
+	params.mode = COMBINE_PERCENTILE;
+	params.percentile = strtod(str + 1, &endptr);
+	if ( endptr == NULL || *endptr != '\0' ) return -1;
+	if ( params.percentile < 0.0 || 100.0 < params.percentile ) return -1;
+    }
+    else {
+	return -1;
+    }
+
+    *ret_params = params;
+    return 0;
+}
+
+const char *get_combine_mode_name( const combine_params &params,
+				   char *ret_buf, size_t len_buf )
+{
+    if ( ret_buf == NULL || len_buf == 0 ) return NULL;
+    if ( params.mode == COMBINE_MEDIAN ) {
+	snprintf(ret_buf, len_buf, "median");
+    }
+    else if ( params.mode == COMBINE_PERCENTILE ) {
+	snprintf(ret_buf, len_buf, "p%g", params.percentile);
+    }
+    else if ( params.mode == COMBINE_WINSORIZED ) {
+	snprintf(ret_buf, len_buf, "winsor");
+    }
+    else {
+	snprintf(ret_buf, len_buf, "mean");
+    }
+    return ret_buf;
+}
+
+
+/*
+ * class frame_band_store
+ */
+
+frame_band_store::frame_band_store()
+  : width(0), height(0), n_frames(0), samples(false)
+{
+}
+
+int frame_band_store::init( size_t width, size_t height, size_t n_frames )
+{
+    this->release();
+    if ( width == 0 || height == 0 || n_frames == 0 ) return -1;
+    this->width = width;
+    this->height = height;
+    this->n_frames = n_frames;
+    this->samples.resize_3d(n_frames, width * height, 3);
+    this->clean();
+    return 0;
+}
+
+void frame_band_store::clean()
+{
+    this->samples = (float)NAN;
+    return;
+}
+
+void frame_band_store::release()
+{
+    this->samples.init(false);
+    this->width = 0;
+    this->height = 0;
+    this->n_frames = 0;
+    return;
+}
+
+size_t frame_band_store::pixel_bytes( size_t n_frames )
+{
+    return 3 * sizeof(float) * n_frames;
+}
+
+int frame_band_store::put( size_t frame_id, const mdarray_float &band_buf,
+			   long offset_x, long row_begin, long row_end )
+{
+    const size_t n = this->n_frames;
+    long x_begin, x_end, y;
+    size_t ch;
+
+    if ( this->n_frames <= frame_id ) return -1;
+    if ( band_buf.z_length() != 3 ) return -1;
+
+    if ( row_begin < 0 ) row_begin = 0;
+    if ( (long)(band_buf.y_length()) < row_end ) row_end = band_buf.y_length();
+    if ( (long)(this->height) < row_end ) row_end = this->height;
+
+    x_begin = offset_x;
+    x_end = offset_x + (long)(band_buf.x_length());
+    if ( x_begin < 0 ) x_begin = 0;
+    if ( (long)(this->width) < x_end ) x_end = this->width;
+    if ( x_end <= x_begin ) return 0;
+
+    /* transpose */
+    for ( ch=0 ; ch < 3 ; ch++ ) {
+	for ( y=row_begin ; y < row_end ; y++ ) {
+	    const float *src = band_buf.array_ptr_cs(0, y, ch) - offset_x;
+	    float *dst = this->samples.array_ptr(frame_id,
+						 this->width * y, ch);
+	    long x;
+	    for ( x=x_begin ; x < x_end ; x++ ) {
+		dst[n * x] = src[x];
+	    }
+	}
+    }
+
+    return 0;
+}
+
+/* median of v[0..n-1] (order of v is changed) */
+static double get_median( float *v, size_t n )
+{
+    const size_t h = n / 2;
+    double ret;
+    std::nth_element(v, v + h, v + n);
+    ret = v[h];
+    if ( (n % 2) == 0 ) {
+	/* mean of 2 values at center */
+	ret = 0.5 * (ret + *std::max_element(v, v + h));
+    }
+    return ret;
+}
+
+/* percentile with linear interpolation (order of v is changed) */
+static double get_percentile( float *v, size_t n, double percentile )
+{
+    const double pos = (percentile / 100.0) * (n - 1);
+    const size_t lo = (size_t)pos;
+    double ret;
+    std::nth_element(v, v + lo, v + n);
+    ret = v[lo];
+    if ( lo + 1 < n && lo < pos ) {
+	double v_hi = *std::min_element(v + lo + 1, v + n);
+	ret += (v_hi - ret) * (pos - lo);
+    }
+    return ret;
+}
+
+static double get_mean( const float *v, size_t n )
+{
+    double sum = 0.0;
+    size_t i;
+    for ( i=0 ; i < n ; i++ ) sum += v[i];
+    return sum / (double)n;
+}
+
+static double get_stddev( const float *v, size_t n )
+{
+    const double mean = get_mean(v, n);
+    double sum2 = 0.0;
+    size_t i;
+    for ( i=0 ; i < n ; i++ ) sum2 += (v[i] - mean) * (v[i] - mean);
+    return sqrt(sum2 / (double)(n - 1));
+}
+
+/* mean after winsorized sigma-clipping (v and w are work buffers) */
+static double get_winsorized_mean( float *v, size_t n, double sigma_factor,
+				   float *w )
+{
+    int iter;
+
+    if ( sigma_factor <= 0.0 ) return get_mean(v, n);
+
+    for ( iter=0 ; iter < Max_winsor_iterations ; iter++ ) {
+	double median, sigma, lo, hi;
+	size_t i, n_used;
+	int j;
+
+	if ( n < 3 ) break;
+
+	median = get_median(v, n);
+	sigma = get_stddev(v, n);
+
+	/* robust sigma using winsorized values */
+	for ( j=0 ; j < Max_winsor_iterations ; j++ ) {
+	    double sigma_new;
+	    lo = median - Winsor_clip_factor * sigma;
+	    hi = median + Winsor_clip_factor * sigma;
+	    for ( i=0 ; i < n ; i++ ) {
+		if ( v[i] < lo ) w[i] = lo;
+		else if ( hi < v[i] ) w[i] = hi;
+		else w[i] = v[i];
+	    }
+	    sigma_new = Winsor_sigma_correction * get_stddev(w, n);
+	    if ( fabs(sigma_new - sigma) <= sigma * Winsor_tolerance ) {
+		sigma = sigma_new;
+		break;
+	    }
+	    sigma = sigma_new;
+	}
+
+	/* reject */
+	lo = median - sigma_factor * sigma;
+	hi = median + sigma_factor * sigma;
+	n_used = 0;
+	for ( i=0 ; i < n ; i++ ) {
+	    if ( lo <= v[i] && v[i] <= hi ) {
+		v[n_used] = v[i];
+		n_used ++;
+	    }
+	}
+	if ( n_used == n || n_used == 0 ) break;
+	n = n_used;
+    }
+
+    return get_mean(v, n);
+}
+
+typedef struct _combine_args {
+    const mdarray_float *samples;
+    size_t width;
+    size_t n_frames;
+    const combine_params *params;
+    mdarray_float *ret_buf;
+} combine_args;
+
+static void combine_band( size_t y_begin, size_t y_end, void *user_ptr )
+{
+    const combine_args *a = (const combine_args *)user_ptr;
+    const size_t n_frames = a->n_frames;
+    mdarray_float work_buf(false);
+    float *v, *w;
+    size_t ch, x, y, i;
+
+    work_buf.resize_1d(2 * n_frames);
+    v = work_buf.array_ptr();
+    w = v + n_frames;
+
+    for ( ch=0 ; ch < 3 ; ch++ ) {
+	for ( y=y_begin ; y < y_end ; y++ ) {
+	    float *dst = a->ret_buf->array_ptr(0, y, ch);
+	    for ( x=0 ; x < a->width ; x++ ) {
+		const float *src =
+		    a->samples->array_ptr_cs(0, a->width * y + x, ch);
+		size_t n = 0;
+		/* gather valid samples */
+		for ( i=0 ; i < n_frames ; i++ ) {
+		    if ( isnan(src[i]) == 0 ) {
+			v[n] = src[i];
+			n ++;
+		    }
+		}
+		if ( n == 0 ) {
+		    dst[x] = NAN;
+		}
+		else if ( a->params->mode == COMBINE_MEDIAN ) {
+		    dst[x] = get_median(v, n);
+		}
+		else if ( a->params->mode == COMBINE_PERCENTILE ) {
+		    dst[x] = get_percentile(v, n, a->params->percentile);
+		}
+		else if ( a->params->mode == COMBINE_WINSORIZED ) {
+		    dst[x] = get_winsorized_mean(v, n,
+					a->params->winsor_sigma[ch], w);
+		}
+		else {
+		    dst[x] = get_mean(v, n);
+		}
+	    }
+	}
+    }
+
+    return;
+}
+
+int frame_band_store::combine( thread_pool *pool,
+			       const combine_params &params,
+			       size_t n_rows, mdarray_float *ret_buf ) const
+{
+    combine_args args;
+
+    if ( ret_buf == NULL ) return -1;
+    if ( this->height < n_rows ) return -1;
+
+    if ( ret_buf->x_length() != this->width ||
+	 ret_buf->y_length() != n_rows ||
+	 ret_buf->z_length() != 3 ) {
+	ret_buf->init(false);
+	ret_buf->resize_3d(this->width, n_rows, 3);
+    }
+
+    args.samples = &(this->samples);
+    args.width = this->width;
+    args.n_frames = this->n_frames;
+    args.params = &params;
+    args.ret_buf = ret_buf;
+
+    pool->run_row_bands(n_rows, &combine_band, (void *)&args);
+
+    return 0;
+}
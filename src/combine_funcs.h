@@ -0,0 +1,73 @@
+#ifndef _COMBINE_FUNCS_H
+#define _COMBINE_FUNCS_H 1
+
+#include <unistd.h>
+#include <sli/mdarray.h>
+
+#include "thread_funcs.h"
+
+/* combine modes of stacking */
+#define COMBINE_MEAN 0		/* mean with iterative sigma-clipping */
+#define COMBINE_MEDIAN 1
+#define COMBINE_PERCENTILE 2
+#define COMBINE_WINSORIZED 3	/* winsorized sigma-clipping */
+
+typedef struct _combine_params {
+    int mode;
+    double percentile;		/* 0 to 100 (COMBINE_PERCENTILE) */
+    double winsor_sigma[3];	/* factor of sigma for R,G,B          */
+				/* (<= 0: no rejection; COMBINE_WINSORIZED) */
+} combine_params;
+
+/* "mean", "median", "p<N>" (e.g. "p90") or "winsor" */
+int parse_combine_mode( const char *str, combine_params *ret_params );
+
+/* name used for filenames (e.g. "median", "p90") */
+const char *get_combine_mode_name( const combine_params &params,
+				   char *ret_buf, size_t len_buf );
+
+/*
+ * Transposed store of bands of frames for single-pass combine.
+ *
+ * Samples of a pixel (one for each frame) are contiguous, so that order
+ * statistics can be computed in cache.  Pixels not covered by a shifted
+ * frame are stored as NaN, and are excluded from combine.
+ */
+class frame_band_store {
+
+  public:
+    frame_band_store();
+
+    /* height: rows of a band */
+    int init( size_t width, size_t height, size_t n_frames );
+    void clean();		/* set all samples to missing */
+    void release();
+
+    /* store rows [row_begin, row_end) of a band (already shifted in y)  */
+    /* of a frame shifted by offset_x                                   */
+    int put( size_t frame_id, const sli::mdarray_float &band_buf,
+	     long offset_x, long row_begin, long row_end );
+
+    /* combine the first n_rows rows; ret_buf is width x n_rows x 3 */
+    int combine( thread_pool *pool, const combine_params &params,
+		 size_t n_rows, sli::mdarray_float *ret_buf ) const;
+
+    /* bytes per pixel (RGB) */
+    static size_t pixel_bytes( size_t n_frames );
+
+    size_t x_length() const { return this->width; }
+    size_t y_length() const { return this->height; }
+
+  private:
+    size_t width;
+    size_t height;
+    size_t n_frames;
+    sli::mdarray_float samples;		/* n_frames x (width*height) x 3 */
+
+    /* disable copy */
+    frame_band_store( const frame_band_store & );
+    frame_band_store &operator=( const frame_band_store & );
+
+};
+
+#endif	/* _COMBINE_FUNCS_H */
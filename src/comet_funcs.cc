@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "comet_funcs.h"
+
+int get_frame_number( const char *filename, long *ret_number )
+{
+    const char *p_end;
+    const char *p;
+    long num = 0;
+
+    if ( filename == NULL ) return -1;
+
+    /* rightmost run of digits */
+    p_end = filename + strlen(filename);
+    while ( filename < p_end && (p_end[-1] < '0' || '9' < p_end[-1]) ) {
+	p_end --;
+    }
+    if ( p_end == filename ) return -1;
+    p = p_end;
+    while ( filename < p && '0' <= p[-1] && p[-1] <= '9' ) p --;
+
+    for ( ; p < p_end ; p++ ) num = num * 10 + (*p - '0');
+
+    if ( ret_number != NULL ) *ret_number = num;
+    return 0;
+}
+
+int fit_comet_motion( const double t[], const double x[], const double y[],
+		      size_t n, comet_motion *ret_motion )
+{
+    double t_mean = 0.0, x_mean = 0.0, y_mean = 0.0;
+    double stt = 0.0, stx = 0.0, sty = 0.0;
+    size_t i;
+
+    if ( n < 2 ) return -1;
+
+    for ( i=0 ; i < n ; i++ ) {
+	t_mean += t[i];
+	x_mean += x[i];
+	y_mean += y[i];
+    }
+    t_mean /= n;
+    x_mean /= n;
+    y_mean /= n;
+
+    for ( i=0 ; i < n ; i++ ) {
+	const double dt = t[i] - t_mean;
+	stt += dt * dt;
+	stx += dt * (x[i] - x_mean);
+	sty += dt * (y[i] - y_mean);
+    }
+    if ( stt <= 0.0 ) return -1;		/* same time for all */
+
+    if ( ret_motion != NULL ) {
+	ret_motion->t0 = t_mean;
+	ret_motion->x0 = x_mean;
+	ret_motion->y0 = y_mean;
+	ret_motion->vx = stx / stt;
+	ret_motion->vy = sty / stt;
+    }
+
+    return 0;
+}
+
+void get_comet_position( const comet_motion &motion, double t,
+			 double *ret_x, double *ret_y )
+{
+    *ret_x = motion.x0 + motion.vx * (t - motion.t0);
+    *ret_y = motion.y0 + motion.vy * (t - motion.t0);
+    return;
+}
+
+void get_comet_transform( const frame_transform &star_tr,
+			  const comet_motion &motion, double t, double t_ref,
+			  frame_transform *ret_tr )
+{
+    double x, y, x_ref, y_ref;
+
+    get_comet_position(motion, t, &x, &y);
+    get_comet_position(motion, t_ref, &x_ref, &y_ref);
+
+    *ret_tr = star_tr;
+    ret_tr->m[2] += x_ref - x;
+    ret_tr->m[5] += y_ref - y;
+
+    return;
+}
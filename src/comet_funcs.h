@@ -0,0 +1,38 @@
+#ifndef _COMET_FUNCS_H
+#define _COMET_FUNCS_H 1
+
+#include <unistd.h>
+
+#include "transform_funcs.h"
+
+/* frame number (time) of a frame: rightmost digits of a filename */
+/* (e.g. 123 for "20240101-221234_FRAME_0123.tiff")                */
+int get_frame_number( const char *filename, long *ret_number );
+
+/*
+ * Motion of a comet nucleus in reference coordinates, linear in time
+ * (frame number):
+ *   X = x0 + vx * (t - t0),  Y = y0 + vy * (t - t0)
+ */
+typedef struct _comet_motion {
+    double t0;
+    double x0;
+    double y0;
+    double vx;
+    double vy;
+} comet_motion;
+
+/* least-squares fit of positions (x[i],y[i]) at t[i], i < n (n >= 2) */
+int fit_comet_motion( const double t[], const double x[], const double y[],
+		      size_t n, comet_motion *ret_motion );
+
+void get_comet_position( const comet_motion &motion, double t,
+			 double *ret_x, double *ret_y );
+
+/* transform of a frame at t aligning the nucleus with its position at */
+/* t_ref (star_tr: frame -> reference aligned by stars)                */
+void get_comet_transform( const frame_transform &star_tr,
+			  const comet_motion &motion, double t, double t_ref,
+			  frame_transform *ret_tr );
+
+#endif	/* _COMET_FUNCS_H */
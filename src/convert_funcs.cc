@@ -0,0 +1,621 @@
+#include <math.h>
+#include <string.h>
+
+#include "convert_funcs.h"
+
+#include "test_simd.h"
+
+#if defined(_SSSE3_IS_OK)
+#include <tmmintrin.h>
+#endif
+#if defined(_AVX2_DISPATCH_IS_OK)
+#include <immintrin.h>
+#endif
+
+/*
+ * Shuffle masks (in order of bytes in memory; -1 gives 0) taking every
+ * 3rd sample from 3 vectors: a pixel of a channel from 16 pixels of
+ * 8-bit RGB, 8 pixels of 16-bit RGB or 4 pixels of float RGB.
+ */
+static const signed char Sfl_u8[3][16] = {
+    { 0, 3, 6, 9,12,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1},
+    {-1,-1,-1,-1,-1,-1, 2, 5, 8,11,14,-1,-1,-1,-1,-1},
+    {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 1, 4, 7,10,13}
+};
+static const signed char Sfl_u16[3][16] = {
+    { 0, 1, 6, 7,12,13,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1},
+    {-1,-1,-1,-1,-1,-1, 2, 3, 8, 9,14,15,-1,-1,-1,-1},
+    {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 4, 5,10,11}
+};
+static const signed char Sfl_f32[3][16] = {
+    { 0, 1, 2, 3,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1},
+    {-1,-1,-1,-1,-1,-1,-1,-1, 8, 9,10,11,-1,-1,-1,-1},
+    {-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, 4, 5, 6, 7}
+};
+
+/* masks interleaving 8 pixels of 16-bit R,G,B: [output vector][ch] */
+static const signed char Sfl_rgb_u16[3][3][16] = {
+    { { 0, 1,-1,-1,-1,-1, 2, 3,-1,-1,-1,-1, 4, 5,-1,-1},
+      {-1,-1, 0, 1,-1,-1,-1,-1, 2, 3,-1,-1,-1,-1, 4, 5},
+      {-1,-1,-1,-1, 0, 1,-1,-1,-1,-1, 2, 3,-1,-1,-1,-1} },
+    { {-1,-1, 6, 7,-1,-1,-1,-1, 8, 9,-1,-1,-1,-1,10,11},
+      {-1,-1,-1,-1, 6, 7,-1,-1,-1,-1, 8, 9,-1,-1,-1,-1},
+      { 4, 5,-1,-1,-1,-1, 6, 7,-1,-1,-1,-1, 8, 9,-1,-1} },
+    { {-1,-1,-1,-1,12,13,-1,-1,-1,-1,14,15,-1,-1,-1,-1},
+      {10,11,-1,-1,-1,-1,12,13,-1,-1,-1,-1,14,15,-1,-1},
+      {-1,-1,10,11,-1,-1,-1,-1,12,13,-1,-1,-1,-1,14,15} }
+};
+
+static const double Max_u16_value = 65535.0;
+
+
+/*
+ * Scalar versions (also used for rest of rows)
+ */
+
+static void convert_u8_scalar( const unsigned char *src, size_t spp,
+			       size_t n, double scale, float *dst )
+{
+    size_t i, ii;
+    for ( i=0, ii=0 ; i < n ; i++, ii+=spp ) dst[i] = src[ii] * scale;
+    return;
+}
+
+static void convert_u16_scalar( const uint16_t *src, size_t spp,
+				size_t n, double scale, float *dst )
+{
+    size_t i, ii;
+    for ( i=0, ii=0 ; i < n ; i++, ii+=spp ) dst[i] = src[ii] * scale;
+    return;
+}
+
+static void convert_float_scalar( const float *src, size_t spp,
+				  size_t n, double scale, float *dst )
+{
+    size_t i, ii;
+    for ( i=0, ii=0 ; i < n ; i++, ii+=spp ) dst[i] = src[ii] * scale;
+    return;
+}
+
+static inline uint16_t quantize_value( double v )
+{
+    v += 0.5;
+    if ( !(0.0 <= v) ) v = 0.0;		/* including NaN */
+    if ( Max_u16_value < v ) v = Max_u16_value;
+    return (uint16_t)v;
+}
+
+/* finalizer of MurmurHash3 */
+static inline uint32_t mix_bits( uint32_t h )
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+/* uniform random number in [0,1) for a sample (key: from upper index) */
+static inline double dither_random( uint32_t key, uint32_t index_lo )
+{
+    return (mix_bits((index_lo * 0x9e3779b9U) ^ key) >> 1)
+	   * (1.0 / 2147483648.0);
+}
+
+static inline uint16_t dither_value( double v, double rnd )
+{
+    double fl;
+    if ( !(0.0 <= v) ) v = 0.0;		/* including NaN */
+    fl = floor(v);
+    if ( rnd < v - fl ) fl += 1.0;
+    if ( Max_u16_value < fl ) fl = Max_u16_value;
+    return (uint16_t)fl;
+}
+
+static void dither_rgb_scalar( const float *const src[], size_t n,
+			       double min_val, double range,
+			       uint32_t seed, uint64_t index0, uint16_t *dst )
+{
+    size_t i, ch;
+    for ( i=0 ; i < n ; i++ ) {
+	for ( ch=0 ; ch < 3 ; ch++ ) {
+	    const uint64_t idx = index0 + 3 * i + ch;
+	    const uint32_t key = mix_bits(seed ^ (uint32_t)(idx >> 32));
+	    const double v = ((src[ch][i] - min_val) / range) * 65535.0;
+	    dst[3 * i + ch] = dither_value(v, dither_random(key, (uint32_t)idx));
+	}
+    }
+    return;
+}
+
+static void quantize_rgb_scalar( const float *const src[], size_t n,
+				 bool normalize, double min_val, double range,
+				 uint16_t *dst )
+{
+    size_t i, ch;
+    for ( i=0 ; i < n ; i++ ) {
+	for ( ch=0 ; ch < 3 ; ch++ ) {
+	    double v = src[ch][i];
+	    if ( normalize == true ) v = ((v - min_val) / range) * 65535.0;
+	    dst[3 * i + ch] = quantize_value(v);
+	}
+    }
+    return;
+}
+
+
+/*
+ * SSSE3 versions
+ *
+ * With spp = 3, a block of pixels is used only when a pixel follows it,
+ * so that loads do not exceed the last sample of the channel.
+ */
+
+#if defined(_SSSE3_IS_OK)
+
+static inline __m128i load_mask( const signed char mask[] )
+{
+    return _mm_loadu_si128((const __m128i *)mask);
+}
+
+/* every 3rd sample from 48 bytes at p */
+static inline __m128i gather_rgb_ssse3( const void *p, const __m128i m[] )
+{
+    const __m128i *pp = (const __m128i *)p;
+    __m128i v = _mm_shuffle_epi8(_mm_loadu_si128(pp), m[0]);
+    v = _mm_or_si128(v, _mm_shuffle_epi8(_mm_loadu_si128(pp + 1), m[1]));
+    v = _mm_or_si128(v, _mm_shuffle_epi8(_mm_loadu_si128(pp + 2), m[2]));
+    return v;
+}
+
+static void convert_u8_ssse3( const unsigned char *src, size_t spp,
+			      size_t n, double scale, float *dst )
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 v_scale = _mm_set1_ps((float)scale);
+    const __m128i m[3] = {load_mask(Sfl_u8[0]), load_mask(Sfl_u8[1]),
+			  load_mask(Sfl_u8[2])};
+    size_t i = 0;
+
+    while ( (spp == 3 && i + 16 < n) || (spp == 1 && i + 16 <= n) ) {
+	__m128i v, v16;
+	if ( spp == 3 ) v = gather_rgb_ssse3(src + 3 * i, m);
+	else v = _mm_loadu_si128((const __m128i *)(src + i));
+	v16 = _mm_unpacklo_epi8(v, zero);
+	_mm_storeu_ps(dst + i, _mm_mul_ps(v_scale,
+		      _mm_cvtepi32_ps(_mm_unpacklo_epi16(v16, zero))));
+	_mm_storeu_ps(dst + i + 4, _mm_mul_ps(v_scale,
+		      _mm_cvtepi32_ps(_mm_unpackhi_epi16(v16, zero))));
+	v16 = _mm_unpackhi_epi8(v, zero);
+	_mm_storeu_ps(dst + i + 8, _mm_mul_ps(v_scale,
+		      _mm_cvtepi32_ps(_mm_unpacklo_epi16(v16, zero))));
+	_mm_storeu_ps(dst + i + 12, _mm_mul_ps(v_scale,
+		      _mm_cvtepi32_ps(_mm_unpackhi_epi16(v16, zero))));
+	i += 16;
+    }
+
+    convert_u8_scalar(src + spp * i, spp, n - i, scale, dst + i);
+    return;
+}
+
+static void convert_u16_ssse3( const uint16_t *src, size_t spp,
+			       size_t n, double scale, float *dst )
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 v_scale = _mm_set1_ps((float)scale);
+    const __m128i m[3] = {load_mask(Sfl_u16[0]), load_mask(Sfl_u16[1]),
+			  load_mask(Sfl_u16[2])};
+    size_t i = 0;
+
+    while ( (spp == 3 && i + 8 < n) || (spp == 1 && i + 8 <= n) ) {
+	__m128i v;
+	if ( spp == 3 ) v = gather_rgb_ssse3(src + 3 * i, m);
+	else v = _mm_loadu_si128((const __m128i *)(src + i));
+	_mm_storeu_ps(dst + i, _mm_mul_ps(v_scale,
+		      _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero))));
+	_mm_storeu_ps(dst + i + 4, _mm_mul_ps(v_scale,
+		      _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero))));
+	i += 8;
+    }
+
+    convert_u16_scalar(src + spp * i, spp, n - i, scale, dst + i);
+    return;
+}
+
+static void convert_float_ssse3( const float *src, size_t spp,
+				 size_t n, double scale, float *dst )
+{
+    const __m128 v_scale = _mm_set1_ps((float)scale);
+    const __m128i m[3] = {load_mask(Sfl_f32[0]), load_mask(Sfl_f32[1]),
+			  load_mask(Sfl_f32[2])};
+    size_t i = 0;
+
+    while ( (spp == 3 && i + 4 < n) || (spp == 1 && i + 4 <= n) ) {
+	__m128 v;
+	if ( spp == 3 ) v = _mm_castsi128_ps(gather_rgb_ssse3(src + 3 * i, m));
+	else v = _mm_loadu_ps(src + i);
+	_mm_storeu_ps(dst + i, _mm_mul_ps(v_scale, v));
+	i += 4;
+    }
+
+    convert_float_scalar(src + spp * i, spp, n - i, scale, dst + i);
+    return;
+}
+
+#endif	/* _SSSE3_IS_OK */
+
+
+/*
+ * AVX2 versions
+ */
+
+#if defined(_AVX2_DISPATCH_IS_OK)
+
+__attribute__((target("avx2")))
+static inline __m128i gather_rgb_avx2( const void *p, const __m128i m[] )
+{
+    const __m128i *pp = (const __m128i *)p;
+    __m128i v = _mm_shuffle_epi8(_mm_loadu_si128(pp), m[0]);
+    v = _mm_or_si128(v, _mm_shuffle_epi8(_mm_loadu_si128(pp + 1), m[1]));
+    v = _mm_or_si128(v, _mm_shuffle_epi8(_mm_loadu_si128(pp + 2), m[2]));
+    return v;
+}
+
+__attribute__((target("avx2")))
+static void convert_u8_avx2( const unsigned char *src, size_t spp,
+			     size_t n, double scale, float *dst )
+{
+    const __m256 v_scale = _mm256_set1_ps((float)scale);
+    const __m128i m[3] = {_mm_loadu_si128((const __m128i *)Sfl_u8[0]),
+			  _mm_loadu_si128((const __m128i *)Sfl_u8[1]),
+			  _mm_loadu_si128((const __m128i *)Sfl_u8[2])};
+    size_t i = 0;
+
+    while ( (spp == 3 && i + 16 < n) || (spp == 1 && i + 16 <= n) ) {
+	__m128i v;
+	if ( spp == 3 ) v = gather_rgb_avx2(src + 3 * i, m);
+	else v = _mm_loadu_si128((const __m128i *)(src + i));
+	_mm256_storeu_ps(dst + i, _mm256_mul_ps(v_scale,
+			 _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v))));
+	_mm256_storeu_ps(dst + i + 8, _mm256_mul_ps(v_scale,
+			 _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(
+						_mm_srli_si128(v, 8)))));
+	i += 16;
+    }
+
+    convert_u8_scalar(src + spp * i, spp, n - i, scale, dst + i);
+    return;
+}
+
+__attribute__((target("avx2")))
+static void convert_u16_avx2( const uint16_t *src, size_t spp,
+			      size_t n, double scale, float *dst )
+{
+    const __m256 v_scale = _mm256_set1_ps((float)scale);
+    const __m128i m[3] = {_mm_loadu_si128((const __m128i *)Sfl_u16[0]),
+			  _mm_loadu_si128((const __m128i *)Sfl_u16[1]),
+			  _mm_loadu_si128((const __m128i *)Sfl_u16[2])};
+    size_t i = 0;
+
+    while ( (spp == 3 && i + 8 < n) || (spp == 1 && i + 8 <= n) ) {
+	__m128i v;
+	if ( spp == 3 ) v = gather_rgb_avx2(src + 3 * i, m);
+	else v = _mm_loadu_si128((const __m128i *)(src + i));
+	_mm256_storeu_ps(dst + i, _mm256_mul_ps(v_scale,
+			 _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(v))));
+	i += 8;
+    }
+
+    convert_u16_scalar(src + spp * i, spp, n - i, scale, dst + i);
+    return;
+}
+
+__attribute__((target("avx2")))
+static void convert_float_avx2( const float *src, size_t spp,
+				size_t n, double scale, float *dst )
+{
+    const __m256 v_scale = _mm256_set1_ps((float)scale);
+    const __m128i m[3] = {_mm_loadu_si128((const __m128i *)Sfl_f32[0]),
+			  _mm_loadu_si128((const __m128i *)Sfl_f32[1]),
+			  _mm_loadu_si128((const __m128i *)Sfl_f32[2])};
+    size_t i = 0;
+
+    while ( (spp == 3 && i + 8 < n) || (spp == 1 && i + 8 <= n) ) {
+	__m256 v;
+	if ( spp == 3 ) {
+	    v = _mm256_castps128_ps256(
+			_mm_castsi128_ps(gather_rgb_avx2(src + 3 * i, m)));
+	    v = _mm256_insertf128_ps(v,
+		    _mm_castsi128_ps(gather_rgb_avx2(src + 3 * i + 12, m)), 1);
+	}
+	else v = _mm256_loadu_ps(src + i);
+	_mm256_storeu_ps(dst + i, _mm256_mul_ps(v_scale, v));
+	i += 8;
+    }
+
+    convert_float_scalar(src + spp * i, spp, n - i, scale, dst + i);
+    return;
+}
+
+/* 8 values of a channel -> 16-bit (same double arithmetic as scalar) */
+__attribute__((target("avx2")))
+static inline __m128i quantize_8_avx2( const float *src, bool normalize,
+				       __m256d v_min, __m256d v_range )
+{
+    const __m256d v_65535 = _mm256_set1_pd(65535.0);
+    const __m256d v_half = _mm256_set1_pd(0.5);
+    const __m256d v_zero = _mm256_setzero_pd();
+    const __m256 f = _mm256_loadu_ps(src);
+    __m256d d0 = _mm256_cvtps_pd(_mm256_castps256_ps128(f));
+    __m256d d1 = _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1));
+    if ( normalize == true ) {
+	d0 = _mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(d0, v_min), v_range),
+			   v_65535);
+	d1 = _mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(d1, v_min), v_range),
+			   v_65535);
+    }
+    /* NaN -> 0: max_pd() returns 2nd operand if either is NaN */
+    d0 = _mm256_min_pd(_mm256_max_pd(_mm256_add_pd(d0, v_half), v_zero),
+		       v_65535);
+    d1 = _mm256_min_pd(_mm256_max_pd(_mm256_add_pd(d1, v_half), v_zero),
+		       v_65535);
+    return _mm_packus_epi32(_mm256_cvttpd_epi32(d0), _mm256_cvttpd_epi32(d1));
+}
+
+__attribute__((target("avx2")))
+static void quantize_rgb_avx2( const float *const src[], size_t n,
+			       bool normalize, double min_val, double range,
+			       uint16_t *dst )
+{
+    const __m256d v_min = _mm256_set1_pd(min_val);
+    const __m256d v_range = _mm256_set1_pd(range);
+    __m128i m[3][3];
+    size_t i = 0, j, ch;
+
+    for ( j=0 ; j < 3 ; j++ ) {
+	for ( ch=0 ; ch < 3 ; ch++ ) {
+	    m[j][ch] = _mm_loadu_si128((const __m128i *)Sfl_rgb_u16[j][ch]);
+	}
+    }
+
+    for ( ; i + 8 <= n ; i += 8 ) {
+	__m128i q[3];
+	for ( ch=0 ; ch < 3 ; ch++ ) {
+	    q[ch] = quantize_8_avx2(src[ch] + i, normalize, v_min, v_range);
+	}
+	for ( j=0 ; j < 3 ; j++ ) {
+	    __m128i v = _mm_shuffle_epi8(q[0], m[j][0]);
+	    v = _mm_or_si128(v, _mm_shuffle_epi8(q[1], m[j][1]));
+	    v = _mm_or_si128(v, _mm_shuffle_epi8(q[2], m[j][2]));
+	    _mm_storeu_si128((__m128i *)(dst + 3 * i + 8 * j), v);
+	}
+    }
+
+    if ( i < n ) {
+	const float *src_rest[3] = {src[0] + i, src[1] + i, src[2] + i};
+	quantize_rgb_scalar(src_rest, n - i, normalize, min_val, range,
+			    dst + 3 * i);
+    }
+    return;
+}
+
+/* 8 values of a channel -> 16-bit with dithering (v_lo: lower 32 bits */
+/* of indices of the samples)                                          */
+__attribute__((target("avx2")))
+static inline __m128i dither_8_avx2( const float *src,
+				     __m256d v_min, __m256d v_range,
+				     __m256i v_key, __m256i v_lo )
+{
+    const __m256d v_65535 = _mm256_set1_pd(65535.0);
+    const __m256d v_zero = _mm256_setzero_pd();
+    const __m256d v_one = _mm256_set1_pd(1.0);
+    const __m256d v_rnd_scale = _mm256_set1_pd(1.0 / 2147483648.0);
+    const __m256 f = _mm256_loadu_ps(src);
+    __m256d d[2], r[2];
+    __m256i h;
+    __m128i q[2];
+    int k;
+
+    /* random numbers: same as dither_random() */
+    h = _mm256_mullo_epi32(v_lo, _mm256_set1_epi32((int)0x9e3779b9U));
+    h = _mm256_xor_si256(h, v_key);
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int)0x85ebca6bU));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+    h = _mm256_mullo_epi32(h, _mm256_set1_epi32((int)0xc2b2ae35U));
+    h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+    h = _mm256_srli_epi32(h, 1);
+    r[0] = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(h)),
+			 v_rnd_scale);
+    r[1] = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(h, 1)),
+			 v_rnd_scale);
+
+    d[0] = _mm256_cvtps_pd(_mm256_castps256_ps128(f));
+    d[1] = _mm256_cvtps_pd(_mm256_extractf128_ps(f, 1));
+    for ( k=0 ; k < 2 ; k++ ) {
+	__m256d v, fl, inc;
+	v = _mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(d[k], v_min), v_range),
+			  v_65535);
+	v = _mm256_max_pd(v, v_zero);		/* NaN -> 0 */
+	fl = _mm256_floor_pd(v);
+	inc = _mm256_and_pd(_mm256_cmp_pd(r[k], _mm256_sub_pd(v, fl),
+					  _CMP_LT_OQ), v_one);
+	fl = _mm256_min_pd(_mm256_add_pd(fl, inc), v_65535);
+	q[k] = _mm256_cvttpd_epi32(fl);
+    }
+    return _mm_packus_epi32(q[0], q[1]);
+}
+
+__attribute__((target("avx2")))
+static void dither_rgb_avx2( const float *const src[], size_t n,
+			     double min_val, double range,
+			     uint32_t seed, uint64_t index0, uint16_t *dst )
+{
+    const __m256d v_min = _mm256_set1_pd(min_val);
+    const __m256d v_range = _mm256_set1_pd(range);
+    const __m256i v_step = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    __m256i v_key;
+    __m128i m[3][3];
+    size_t i = 0, j, ch;
+
+    /* upper 32 bits of indices have to be the same in the row */
+    if ( (index0 >> 32) != ((index0 + 3 * n) >> 32) ) {
+	dither_rgb_scalar(src, n, min_val, range, seed, index0, dst);
+	return;
+    }
+    v_key = _mm256_set1_epi32((int)mix_bits(seed ^ (uint32_t)(index0 >> 32)));
+
+    for ( j=0 ; j < 3 ; j++ ) {
+	for ( ch=0 ; ch < 3 ; ch++ ) {
+	    m[j][ch] = _mm_loadu_si128((const __m128i *)Sfl_rgb_u16[j][ch]);
+	}
+    }
+
+    for ( ; i + 8 <= n ; i += 8 ) {
+	__m128i q[3];
+	for ( ch=0 ; ch < 3 ; ch++ ) {
+	    const uint32_t lo = (uint32_t)(index0 + 3 * i + ch);
+	    q[ch] = dither_8_avx2(src[ch] + i, v_min, v_range, v_key,
+			_mm256_add_epi32(_mm256_set1_epi32((int)lo), v_step));
+	}
+	for ( j=0 ; j < 3 ; j++ ) {
+	    __m128i v = _mm_shuffle_epi8(q[0], m[j][0]);
+	    v = _mm_or_si128(v, _mm_shuffle_epi8(q[1], m[j][1]));
+	    v = _mm_or_si128(v, _mm_shuffle_epi8(q[2], m[j][2]));
+	    _mm_storeu_si128((__m128i *)(dst + 3 * i + 8 * j), v);
+	}
+    }
+
+    if ( i < n ) {
+	const float *src_rest[3] = {src[0] + i, src[1] + i, src[2] + i};
+	dither_rgb_scalar(src_rest, n - i, min_val, range, seed,
+			  index0 + 3 * i, dst + 3 * i);
+    }
+    return;
+}
+
+#endif	/* _AVX2_DISPATCH_IS_OK */
+
+
+/*
+ * Selection of kernels
+ */
+
+typedef void (*convert_u8_func_t)( const unsigned char *src, size_t spp,
+				   size_t n, double scale, float *dst );
+typedef void (*convert_u16_func_t)( const uint16_t *src, size_t spp,
+				    size_t n, double scale, float *dst );
+typedef void (*convert_float_func_t)( const float *src, size_t spp,
+				      size_t n, double scale, float *dst );
+typedef void (*quantize_rgb_func_t)( const float *const src[], size_t n,
+				     bool normalize, double min_val,
+				     double range, uint16_t *dst );
+typedef void (*dither_rgb_func_t)( const float *const src[], size_t n,
+				   double min_val, double range,
+				   uint32_t seed, uint64_t index0,
+				   uint16_t *dst );
+
+static convert_u8_func_t Convert_u8 = &convert_u8_scalar;
+static convert_u16_func_t Convert_u16 = &convert_u16_scalar;
+static convert_float_func_t Convert_float = &convert_float_scalar;
+static quantize_rgb_func_t Quantize_rgb = &quantize_rgb_scalar;
+static dither_rgb_func_t Dither_rgb = &dither_rgb_scalar;
+
+/* select kernels by cpuid */
+static const char *select_convert_kernels()
+{
+    const char *name = "scalar";
+
+#if defined(_SSSE3_IS_OK)
+    Convert_u8 = &convert_u8_ssse3;
+    Convert_u16 = &convert_u16_ssse3;
+    Convert_float = &convert_float_ssse3;
+    name = "ssse3";
+#endif
+
+#if defined(_AVX2_DISPATCH_IS_OK)
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") ) {
+	Convert_u8 = &convert_u8_avx2;
+	Convert_u16 = &convert_u16_avx2;
+	Convert_float = &convert_float_avx2;
+	Quantize_rgb = &quantize_rgb_avx2;
+	Dither_rgb = &dither_rgb_avx2;
+	name = "avx2";
+    }
+#endif
+
+    return name;
+}
+
+/* selected before main(), since loaders are called from threads */
+static const char *Convert_kernel_name = select_convert_kernels();
+
+const char *convert_simd_kernel_name()
+{
+    return Convert_kernel_name;
+}
+
+/* results of float arithmetic are exact with a power of 2 */
+static bool is_exact_scale( double scale )
+{
+    int e;
+    if ( !(0.0 < scale) ) return false;
+    if ( frexp(scale, &e) != 0.5 ) return false;
+    return ((double)((float)scale) == scale);
+}
+
+void convert_u8_to_float( const unsigned char *src, size_t spp, size_t n,
+			  double scale, float *dst )
+{
+    if ( (spp == 1 || spp == 3) && is_exact_scale(scale) == true ) {
+	(*Convert_u8)(src, spp, n, scale, dst);
+    }
+    else convert_u8_scalar(src, spp, n, scale, dst);
+    return;
+}
+
+void convert_u16_to_float( const uint16_t *src, size_t spp, size_t n,
+			   double scale, float *dst )
+{
+    if ( (spp == 1 || spp == 3) && is_exact_scale(scale) == true ) {
+	(*Convert_u16)(src, spp, n, scale, dst);
+    }
+    else convert_u16_scalar(src, spp, n, scale, dst);
+    return;
+}
+
+void convert_float_to_float( const float *src, size_t spp, size_t n,
+			     double scale, float *dst )
+{
+    if ( (spp == 1 || spp == 3) && is_exact_scale(scale) == true ) {
+	(*Convert_float)(src, spp, n, scale, dst);
+    }
+    else convert_float_scalar(src, spp, n, scale, dst);
+    return;
+}
+
+void quantize_float_to_u16_rgb( const float *src_r, const float *src_g,
+				const float *src_b, size_t n,
+				double min_val, double max_val,
+				uint16_t *dst )
+{
+    const float *const src[3] = {src_r, src_g, src_b};
+    const bool normalize = (min_val != 0.0 || max_val != Max_u16_value);
+
+    (*Quantize_rgb)(src, n, normalize, min_val, max_val - min_val, dst);
+    return;
+}
+
+void dither_float_to_u16_rgb( const float *src_r, const float *src_g,
+			      const float *src_b, size_t n,
+			      double min_val, double max_val,
+			      uint32_t seed, uint64_t index0,
+			      uint16_t *dst )
+{
+    const float *const src[3] = {src_r, src_g, src_b};
+
+    (*Dither_rgb)(src, n, min_val, max_val - min_val, seed, index0, dst);
+    return;
+}
@@ -0,0 +1,49 @@
+#ifndef _CONVERT_FUNCS_H
+#define _CONVERT_FUNCS_H 1
+
+#include <unistd.h>
+#include <stdint.h>
+
+/*
+ * Conversion of samples between interleaved strips of TIFF and planar
+ * float buffers.  SSSE3 (when compiled) or AVX2 (selected at runtime)
+ * versions give results identical to the scalar loops.
+ */
+
+/* "scalar", "ssse3" or "avx2" */
+const char *convert_simd_kernel_name();
+
+/* n samples src[0], src[spp], src[2*spp], ... multiplied by scale are  */
+/* stored to dst[0..n-1] (spp is 1 or 3; for a channel of an RGB strip, */
+/* src points to the first sample of the channel).  SIMD is used when   */
+/* scale is a power of 2 (e.g. 1.0, 256.0), with which the results of  */
+/* float arithmetic are exact.                                          */
+void convert_u8_to_float( const unsigned char *src, size_t spp, size_t n,
+			  double scale, float *dst );
+void convert_u16_to_float( const uint16_t *src, size_t spp, size_t n,
+			   double scale, float *dst );
+void convert_float_to_float( const float *src, size_t spp, size_t n,
+			     double scale, float *dst );
+
+/* n pixels of R,G,B planes into interleaved 16-bit RGB samples:      */
+/*   (uint16_t)(((v - min_val) / (max_val - min_val)) * 65535.0 + 0.5) */
+/* or (uint16_t)(v + 0.5) when min_val = 0 and max_val = 65535.       */
+/* Results are clipped to 0..65535.                                   */
+void quantize_float_to_u16_rgb( const float *src_r, const float *src_g,
+				const float *src_b, size_t n,
+				double min_val, double max_val,
+				uint16_t *dst );
+
+/* n pixels of R,G,B planes into interleaved 16-bit RGB samples with  */
+/* dithering: v = ((v - min_val) / (max_val - min_val)) * 65535.0 is   */
+/* rounded up with probability of its fraction.  Random numbers are    */
+/* given by a counter-based generator from seed and the index of each  */
+/* sample in the image (index0 + 3 * i + ch), so that results do not   */
+/* depend on how an image is split into rows or bands.                 */
+void dither_float_to_u16_rgb( const float *src_r, const float *src_g,
+			      const float *src_b, size_t n,
+			      double min_val, double max_val,
+			      uint32_t seed, uint64_t index0,
+			      uint16_t *dst );
+
+#endif	/* _CONVERT_FUNCS_H */
@@ -0,0 +1,294 @@
+#include <math.h>
+#include <string.h>
+
+#include "drizzle_funcs.h"
+
+using namespace sli;
+
+
+/*
+ * class drizzle_accum
+ */
+
+drizzle_accum::drizzle_accum()
+  : scale(1), pixfrac(1.0), sum(false), weight(false)
+{
+}
+
+int drizzle_accum::init( size_t width, size_t height, int scale,
+			 double pixfrac )
+{
+    this->release();
+    if ( width == 0 || height == 0 ) return -1;
+    if ( scale < 1 ) return -1;
+    if ( pixfrac <= 0.0 || 1.0 < pixfrac ) return -1;
+    this->scale = scale;
+    this->pixfrac = pixfrac;
+    this->sum.resize_3d(width, height, 3);
+    this->weight.resize_2d(width, height);
+    this->clean();
+    return 0;
+}
+
+void drizzle_accum::clean()
+{
+    this->sum.clean();
+    this->weight.clean();
+    return;
+}
+
+void drizzle_accum::release()
+{
+    this->sum.init(false);
+    this->weight.init(false);
+    return;
+}
+
+size_t drizzle_accum::pixel_bytes()
+{
+    return sizeof(double) * (3 + 1);
+}
+
+
+/* half size of a drop in reference pixels */
+static double get_drop_half_size( const frame_transform &tr, double pixfrac )
+{
+    const double det = tr.m[0] * tr.m[4] - tr.m[1] * tr.m[3];
+    return 0.5 * pixfrac * sqrt(fabs(det));
+}
+
+/* rows of frame whose drops can overlap output rows [r_begin, r_end) */
+/* (the result is not clipped)                                        */
+static void get_source_range( const frame_transform &inv, double drop_h,
+			      size_t src_width, int scale,
+			      long r_begin, long r_end,
+			      long *ret_y_begin, long *ret_y_end )
+{
+    const double x0 = -0.5 - drop_h;
+    const double x1 = (double)src_width - 0.5 + drop_h;
+    const double y0 = (double)r_begin / scale - 0.5 - drop_h;
+    const double y1 = (double)r_end / scale - 0.5 + drop_h;
+    double y_min = 0.0, y_max = 0.0;
+    int i;
+
+    for ( i=0 ; i < 4 ; i++ ) {
+	double x, y;
+	apply_transform(inv, ((i & 1) == 0) ? x0 : x1,
+			((i & 2) == 0) ? y0 : y1, &x, &y);
+	if ( i == 0 || y < y_min ) y_min = y;
+	if ( i == 0 || y_max < y ) y_max = y;
+    }
+
+    *ret_y_begin = (long)floor(y_min);
+    *ret_y_end = (long)ceil(y_max) + 1;
+
+    return;
+}
+
+void drizzle_get_source_rows( const frame_transform &tr,
+			      size_t src_width, size_t src_height,
+			      int scale, double pixfrac,
+			      long band_y, size_t n_rows,
+			      long *ret_y_begin, long *ret_n_rows )
+{
+    frame_transform inv;
+    long y_begin = 0, y_end = 0;
+
+    if ( invert_transform(tr, &inv) == 0 ) {
+	get_source_range(inv, get_drop_half_size(tr, pixfrac),
+			 src_width, scale,
+			 band_y, band_y + (long)n_rows, &y_begin, &y_end);
+	if ( y_begin < 0 ) y_begin = 0;
+	if ( (long)src_height < y_end ) y_end = src_height;
+	if ( y_end < y_begin ) y_end = y_begin;
+    }
+
+    if ( ret_y_begin != NULL ) *ret_y_begin = y_begin;
+    if ( ret_n_rows != NULL ) *ret_n_rows = y_end - y_begin;
+
+    return;
+}
+
+
+/*
+ * drizzle_add_frame()
+ */
+
+typedef struct _drizzle_add_args {
+    const mdarray_float *img_buf;
+    long src_y;
+    size_t src_height;
+    const frame_transform *tr;
+    const frame_transform *inv;
+    double drop_h;			/* half size of drop (reference) */
+    long band_y;
+    drizzle_accum *accum;
+} drizzle_add_args;
+
+/* drop pixels of frame onto output rows [band_y + r_begin, band_y + r_end) */
+static void drizzle_add_band( size_t r_begin, size_t r_end, void *user_ptr )
+{
+    const drizzle_add_args *a = (const drizzle_add_args *)user_ptr;
+    const double *m = a->tr->m;
+    const double s = a->accum->scale;
+    const double hd = a->drop_h * s;	/* half size in output pixels */
+    const long out_width = a->accum->x_length();
+    const long src_width = a->img_buf->x_length();
+    const long r0 = a->band_y + (long)r_begin;	/* rows of output */
+    const long r1 = a->band_y + (long)r_end;
+    long y_begin, y_end, x, y;
+
+    get_source_range(*(a->inv), a->drop_h, src_width, a->accum->scale,
+		     r0, r1, &y_begin, &y_end);
+    /* rows held in img_buf and inside of frame */
+    if ( y_begin < a->src_y ) y_begin = a->src_y;
+    if ( a->src_y + (long)(a->img_buf->y_length()) < y_end ) {
+	y_end = a->src_y + a->img_buf->y_length();
+    }
+    if ( y_begin < 0 ) y_begin = 0;
+    if ( (long)(a->src_height) < y_end ) y_end = a->src_height;
+
+    for ( y=y_begin ; y < y_end ; y++ ) {
+	const float *src_r = a->img_buf->array_ptr_cs(0, y - a->src_y, 0);
+	const float *src_g = a->img_buf->array_ptr_cs(0, y - a->src_y, 1);
+	const float *src_b = a->img_buf->array_ptr_cs(0, y - a->src_y, 2);
+	for ( x=0 ; x < src_width ; x++ ) {
+	    /* center of drop on output grid */
+	    const double u = (m[0] * x + m[1] * y + m[2] + 0.5) * s;
+	    const double v = (m[3] * x + m[4] * y + m[5] + 0.5) * s;
+	    const double u0 = u - hd, u1 = u + hd;
+	    const double v0 = v - hd, v1 = v + hd;
+	    long jx_begin, jx_end, jy_begin, jy_end, jx, jy;
+
+	    if ( v1 <= r0 || r1 <= v0 ) continue;
+	    if ( u1 <= 0 || out_width <= u0 ) continue;
+
+	    jy_begin = (long)floor(v0);
+	    jy_end = (long)ceil(v1);
+	    if ( jy_begin < r0 ) jy_begin = r0;
+	    if ( r1 < jy_end ) jy_end = r1;
+	    jx_begin = (long)floor(u0);
+	    jx_end = (long)ceil(u1);
+	    if ( jx_begin < 0 ) jx_begin = 0;
+	    if ( out_width < jx_end ) jx_end = out_width;
+
+	    for ( jy=jy_begin ; jy < jy_end ; jy++ ) {
+		const size_t row = jy - a->band_y;
+		const double ay = ((jy + 1 < v1) ? jy + 1 : v1) -
+				  ((jy < v0) ? v0 : jy);
+		double *sum_r, *sum_g, *sum_b, *wgt;
+		if ( ay <= 0.0 ) continue;
+		sum_r = a->accum->sum.array_ptr(0, row, 0);
+		sum_g = a->accum->sum.array_ptr(0, row, 1);
+		sum_b = a->accum->sum.array_ptr(0, row, 2);
+		wgt = a->accum->weight.array_ptr(0, row, 0);
+		for ( jx=jx_begin ; jx < jx_end ; jx++ ) {
+		    const double ax = ((jx + 1 < u1) ? jx + 1 : u1) -
+				      ((jx < u0) ? u0 : jx);
+		    const double w = ax * ay;
+		    if ( ax <= 0.0 ) continue;
+		    sum_r[jx] += src_r[x] * w;
+		    sum_g[jx] += src_g[x] * w;
+		    sum_b[jx] += src_b[x] * w;
+		    wgt[jx] += w;
+		}
+	    }
+	}
+    }
+
+    return;
+}
+
+int drizzle_add_frame( thread_pool *pool,
+		       const mdarray_float &img_buf,
+		       long src_y, size_t src_height,
+		       const frame_transform &tr,
+		       long band_y, drizzle_accum *accum )
+{
+    frame_transform inv;
+    drizzle_add_args args;
+
+    if ( accum == NULL ) return -1;
+    if ( img_buf.z_length() != 3 ) return -1;
+    if ( invert_transform(tr, &inv) < 0 ) return -1;
+
+    args.img_buf = &img_buf;
+    args.src_y = src_y;
+    args.src_height = src_height;
+    args.tr = &tr;
+    args.inv = &inv;
+    args.drop_h = get_drop_half_size(tr, accum->pixfrac);
+    args.band_y = band_y;
+    args.accum = accum;
+
+    pool->run_row_bands(accum->y_length(), &drizzle_add_band, (void *)&args);
+
+    return 0;
+}
+
+
+/*
+ * drizzle_get_result()
+ */
+
+typedef struct _drizzle_result_args {
+    const drizzle_accum *accum;
+    mdarray_float *img_buf;
+    mdarray_float *weight_buf;
+} drizzle_result_args;
+
+static void drizzle_result_band( size_t y_begin, size_t y_end,
+				 void *user_ptr )
+{
+    const drizzle_result_args *a = (const drizzle_result_args *)user_ptr;
+    const size_t len = a->accum->x_length() * (y_end - y_begin);
+    const double *p_wgt = a->accum->weight.array_ptr_cs(0, y_begin, 0);
+    size_t ch, k;
+
+    for ( ch=0 ; ch < 3 ; ch++ ) {
+	const double *p_sum = a->accum->sum.array_ptr_cs(0, y_begin, ch);
+	float *p_dst = a->img_buf->array_ptr(0, y_begin, ch);
+	for ( k=0 ; k < len ; k++ ) {
+	    if ( 0.0 < p_wgt[k] ) p_dst[k] = p_sum[k] / p_wgt[k];
+	    else p_dst[k] = 0.0;
+	}
+    }
+    if ( a->weight_buf != NULL ) {
+	float *p_dst = a->weight_buf->array_ptr(0, y_begin, 0);
+	for ( k=0 ; k < len ; k++ ) p_dst[k] = p_wgt[k];
+    }
+
+    return;
+}
+
+int drizzle_get_result( thread_pool *pool, const drizzle_accum &accum,
+			mdarray_float *ret_img_buf,
+			mdarray_float *ret_weight_buf )
+{
+    drizzle_result_args args;
+
+    if ( ret_img_buf == NULL ) return -1;
+
+    if ( ret_img_buf->x_length() != accum.x_length() ||
+	 ret_img_buf->y_length() != accum.y_length() ||
+	 ret_img_buf->z_length() != 3 ) {
+	ret_img_buf->init(false);
+	ret_img_buf->resize_3d(accum.x_length(), accum.y_length(), 3);
+    }
+    if ( ret_weight_buf != NULL &&
+	 (ret_weight_buf->x_length() != accum.x_length() ||
+	  ret_weight_buf->y_length() != accum.y_length() ||
+	  ret_weight_buf->z_length() != 1) ) {
+	ret_weight_buf->init(false);
+	ret_weight_buf->resize_2d(accum.x_length(), accum.y_length());
+    }
+
+    args.accum = &accum;
+    args.img_buf = ret_img_buf;
+    args.weight_buf = ret_weight_buf;
+
+    pool->run_row_bands(accum.y_length(), &drizzle_result_band,
+			(void *)&args);
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+#ifndef _DRIZZLE_FUNCS_H
+#define _DRIZZLE_FUNCS_H 1
+
+#include <unistd.h>
+#include <sli/mdarray.h>
+
+#include "thread_funcs.h"
+#include "transform_funcs.h"
+
+/*
+ * Accumulator of drizzle integration (variable-pixel linear
+ * reconstruction).
+ *
+ * Each input pixel is shrunk to a square "drop" of pixfrac x pixfrac
+ * input pixels, mapped onto an output grid finer by scale, and added to
+ * output pixels weighted by the overlapped area.  Drops of rotated
+ * frames are approximated by axis-aligned squares of the same area.
+ *
+ * Only a band of output rows is held, so that large output canvases
+ * are processed with bounded memory.  Output pixel (u,v) covers
+ * [u/scale - 0.5, (u+1)/scale - 0.5) of the reference frame.
+ */
+class drizzle_accum {
+
+  public:
+    drizzle_accum();
+
+    /* width: output width; height: rows of a band */
+    int init( size_t width, size_t height, int scale, double pixfrac );
+    void clean();		/* set all to 0 */
+    void release();
+
+    size_t x_length() const { return this->weight.x_length(); }
+    size_t y_length() const { return this->weight.y_length(); }
+    /* bytes per output pixel */
+    static size_t pixel_bytes();
+
+    int scale;
+    double pixfrac;
+    sli::mdarray_double sum;		/* width x height x 3 */
+    sli::mdarray_double weight;		/* width x height (area) */
+
+};
+
+/* rows [*ret_y_begin, *ret_y_begin + *ret_n_rows) of a frame are */
+/* dropped onto output rows [band_y, band_y + n_rows)             */
+/* (tr: frame -> reference)                                       */
+void drizzle_get_source_rows( const frame_transform &tr,
+			      size_t src_width, size_t src_height,
+			      int scale, double pixfrac,
+			      long band_y, size_t n_rows,
+			      long *ret_y_begin, long *ret_n_rows );
+
+/* img_buf holds rows [src_y, src_y + img_buf.y_length()) of a frame  */
+/* of src_height rows (rows outside of the frame are ignored), and   */
+/* accum holds output rows [band_y, band_y + accum->y_length()).     */
+/* Every output pixel is computed in the same order, so the results  */
+/* do not depend on the number of threads.                           */
+int drizzle_add_frame( thread_pool *pool,
+		       const sli::mdarray_float &img_buf,
+		       long src_y, size_t src_height,
+		       const frame_transform &tr,
+		       long band_y, drizzle_accum *accum );
+
+/* ret_img_buf = sum / weight (0 where no drop is added)            */
+/* ret_weight_buf = weight (1 channel; NULL can be set)             */
+int drizzle_get_result( thread_pool *pool, const drizzle_accum &accum,
+			sli::mdarray_float *ret_img_buf,
+			sli::mdarray_float *ret_weight_buf );
+
+#endif	/* _DRIZZLE_FUNCS_H */
@@ -0,0 +1,238 @@
+#include "frame_cache.h"
+
+#include <sli/stdstreamio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+using namespace sli;
+
+frame_cache::frame_cache()
+  : width(0), height(0), n_ram_slots(0), n_file_slots(0),
+    n_ram_used(0), n_file_used(0),
+    slot_table(false), ram_buf(false),
+    scratch_fd(-1), scratch_map(NULL), scratch_bytes(0)
+{
+}
+
+frame_cache::~frame_cache()
+{
+    this->close();
+}
+
+int frame_cache::init( size_t width, size_t height,
+		       size_t n_index, size_t n_frames,
+		       uint64_t max_ram_bytes, const char *scratch_dir )
+{
+    stdstreamio sio;
+    const uint64_t frame_bytes = (uint64_t)sizeof(float) * width * height * 3;
+    int ret_status = -1;
+
+    this->close();
+
+    if ( frame_bytes == 0 || n_frames == 0 ) goto quit;
+
+    this->width = width;
+    this->height = height;
+
+    this->slot_table.resize_1d(n_index);
+    this->slot_table = -1L;
+
+    this->n_ram_slots = max_ram_bytes / frame_bytes;
+    if ( n_frames < this->n_ram_slots ) this->n_ram_slots = n_frames;
+    this->n_file_slots = n_frames - this->n_ram_slots;
+
+    if ( 0 < this->n_ram_slots ) {
+	this->ram_buf.resize_3d(width, height, 3 * this->n_ram_slots);
+    }
+
+    /* frames that do not fit into scratch file are decoded again */
+    if ( 0 < this->n_file_slots &&
+	 this->open_scratch(scratch_dir, frame_bytes) < 0 ) {
+	sio.eprintf("[WARNING] scratch file is disabled; frames beyond "
+		    "RAM will be decoded again\n");
+	this->close_scratch();
+	this->n_file_slots = 0;
+    }
+
+    ret_status = 0;
+ quit:
+    if ( ret_status != 0 ) this->close();
+    return ret_status;
+}
+
+/*
+ * Create the scratch file for this->n_file_slots frames.  The slots are
+ * capped to the free space of the filesystem, and the blocks are reserved
+ * by posix_fallocate(); a sparse file would raise SIGBUS on writes to the
+ * mapping when the disk becomes full.
+ */
+int frame_cache::open_scratch( const char *scratch_dir, uint64_t frame_bytes )
+{
+    stdstreamio sio;
+    char scratch_file[4096];
+    struct statvfs st;
+    uint64_t n_fit;
+    int err;
+
+    if ( scratch_dir == NULL ) scratch_dir = getenv("TMPDIR");
+    if ( scratch_dir == NULL ) scratch_dir = ".";
+    snprintf(scratch_file, sizeof(scratch_file),
+	     "%s/frame_cache.XXXXXX", scratch_dir);
+    this->scratch_fd = mkstemp(scratch_file);
+    if ( this->scratch_fd < 0 ) {
+	sio.eprintf("[WARNING] cannot create scratch file in %s\n",
+		    scratch_dir);
+	return -1;
+    }
+    unlink(scratch_file);
+
+    if ( fstatvfs(this->scratch_fd, &st) < 0 ) {
+	sio.eprintf("[WARNING] fstatvfs() failed for scratch file\n");
+	return -1;
+    }
+    n_fit = (uint64_t)st.f_bavail * st.f_frsize / frame_bytes;
+    if ( n_fit < this->n_file_slots ) {
+	sio.eprintf("[WARNING] free space in %s is for %zd of %zd frames\n",
+		    scratch_dir, (size_t)n_fit, this->n_file_slots);
+	this->n_file_slots = n_fit;
+    }
+    if ( this->n_file_slots == 0 ) return -1;
+
+    this->scratch_bytes = frame_bytes * this->n_file_slots;
+    err = posix_fallocate(this->scratch_fd, 0, this->scratch_bytes);
+    if ( err != 0 ) {
+	sio.eprintf("[WARNING] posix_fallocate() failed for scratch file: "
+		    "%s\n", strerror(err));
+	return -1;
+    }
+    this->scratch_map = mmap(NULL, this->scratch_bytes,
+			     PROT_READ | PROT_WRITE, MAP_SHARED,
+			     this->scratch_fd, 0);
+    if ( this->scratch_map == MAP_FAILED ) {
+	this->scratch_map = NULL;
+	sio.eprintf("[WARNING] mmap() failed for scratch file\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+void frame_cache::close_scratch()
+{
+    if ( this->scratch_map != NULL ) {
+	munmap(this->scratch_map, this->scratch_bytes);
+	this->scratch_map = NULL;
+    }
+    if ( 0 <= this->scratch_fd ) {
+	::close(this->scratch_fd);
+	this->scratch_fd = -1;
+    }
+    this->scratch_bytes = 0;
+    return;
+}
+
+void frame_cache::close()
+{
+    this->close_scratch();
+    this->ram_buf.init(false);
+    this->slot_table.init(false);
+    this->n_ram_slots = 0;
+    this->n_file_slots = 0;
+    this->n_ram_used = 0;
+    this->n_file_used = 0;
+    return;
+}
+
+const float *frame_cache::frame_ptr( long slot ) const
+{
+    const size_t len_frame = this->width * this->height * 3;
+    if ( slot < 0 ) return NULL;
+    if ( (size_t)slot < this->n_ram_slots ) {
+	return this->ram_buf.array_ptr_cs(0, 0, 3 * slot);
+    }
+    slot -= this->n_ram_slots;
+    return (const float *)(this->scratch_map) + len_frame * slot;
+}
+
+float *frame_cache::frame_ptr( long slot )
+{
+    const size_t len_frame = this->width * this->height * 3;
+    if ( slot < 0 ) return NULL;
+    if ( (size_t)slot < this->n_ram_slots ) {
+	return this->ram_buf.array_ptr(0, 0, 3 * slot);
+    }
+    slot -= this->n_ram_slots;
+    return (float *)(this->scratch_map) + len_frame * slot;
+}
+
+int frame_cache::put( size_t idx, const mdarray_float &img_buf )
+{
+    const size_t len_xy = this->width * this->height;
+    long slot;
+    float *dst;
+    size_t ch;
+
+    if ( this->slot_table.length() <= idx ) return -1;
+    if ( img_buf.x_length() != this->width ||
+	 img_buf.y_length() != this->height ||
+	 img_buf.z_length() != 3 ) return -1;
+
+    slot = this->slot_table[idx];
+    if ( slot < 0 ) {
+	if ( this->n_ram_used < this->n_ram_slots ) {
+	    slot = this->n_ram_used;
+	    this->n_ram_used ++;
+	}
+	else if ( this->n_file_used < this->n_file_slots ) {
+	    slot = this->n_ram_slots + this->n_file_used;
+	    this->n_file_used ++;
+	}
+	else {
+	    return -1;		/* full */
+	}
+	this->slot_table[idx] = slot;
+    }
+
+    dst = this->frame_ptr(slot);
+    for ( ch=0 ; ch < 3 ; ch++ ) {
+	memcpy(dst + len_xy * ch, img_buf.array_ptr_cs(0,0,ch),
+	       sizeof(float) * len_xy);
+    }
+
+    return 0;
+}
+
+bool frame_cache::get( size_t idx, mdarray_float *ret_img_buf ) const
+{
+    const size_t len_xy = this->width * this->height;
+    const float *src;
+    size_t ch;
+
+    if ( this->is_cached(idx) == false ) return false;
+    if ( ret_img_buf == NULL ) return false;
+
+    src = this->frame_ptr(this->slot_table[idx]);
+
+    if ( ret_img_buf->x_length() != this->width ||
+	 ret_img_buf->y_length() != this->height ||
+	 ret_img_buf->z_length() != 3 ) {
+	ret_img_buf->init(false);
+	ret_img_buf->resize_3d(this->width, this->height, 3);
+    }
+    for ( ch=0 ; ch < 3 ; ch++ ) {
+	memcpy(ret_img_buf->array_ptr(0,0,ch), src + len_xy * ch,
+	       sizeof(float) * len_xy);
+    }
+
+    return true;
+}
+
+bool frame_cache::is_cached( size_t idx ) const
+{
+    if ( this->slot_table.length() <= idx ) return false;
+    if ( this->slot_table[idx] < 0 ) return false;
+    return true;
+}
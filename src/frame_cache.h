@@ -0,0 +1,64 @@
+#ifndef _FRAME_CACHE_H
+#define _FRAME_CACHE_H 1
+
+#include <unistd.h>
+#include <stdint.h>
+#include <sli/mdarray.h>
+
+/*
+ * Cache of decoded RGB float frames (width x height x 3).
+ *
+ * Frames are kept in RAM while they fit into max_ram_bytes; the rest is
+ * stored in a planar scratch file that is memory-mapped.  The scratch file
+ * is unlinked just after creation, so it disappears when the cache is
+ * closed (or the process exits).  Frames that fit neither into RAM nor
+ * into free space of disk are not cached (put() returns -1), and the
+ * caller decodes them again.
+ */
+class frame_cache {
+
+  public:
+    frame_cache();
+    ~frame_cache();
+
+    /* n_index:  range of index (e.g. number of files)                 */
+    /* n_frames: maximum number of frames to be stored                 */
+    /* scratch_dir: directory for scratch file (NULL: TMPDIR or ".")   */
+    int init( size_t width, size_t height, size_t n_index, size_t n_frames,
+	      uint64_t max_ram_bytes, const char *scratch_dir );
+    void close();
+
+    /* store a frame; returns 0 on success */
+    int put( size_t idx, const sli::mdarray_float &img_buf );
+    /* restore a frame; returns true when cached */
+    bool get( size_t idx, sli::mdarray_float *ret_img_buf ) const;
+    bool is_cached( size_t idx ) const;
+
+    size_t n_in_ram() const { return this->n_ram_used; }
+    size_t n_in_file() const { return this->n_file_used; }
+
+  private:
+    int open_scratch( const char *scratch_dir, uint64_t frame_bytes );
+    void close_scratch();
+    const float *frame_ptr( long slot ) const;
+    float *frame_ptr( long slot );
+
+    size_t width;
+    size_t height;
+    size_t n_ram_slots;
+    size_t n_file_slots;
+    size_t n_ram_used;
+    size_t n_file_used;
+    sli::mdarray_long slot_table;	/* -1: not cached */
+    sli::mdarray_float ram_buf;		/* width x height x (3*n_ram_slots) */
+    int scratch_fd;
+    void *scratch_map;
+    size_t scratch_bytes;
+
+    /* disable copy */
+    frame_cache( const frame_cache & );
+    frame_cache &operator=( const frame_cache & );
+
+};
+
+#endif	/* _FRAME_CACHE_H */
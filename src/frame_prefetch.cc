@@ -0,0 +1,183 @@
+#include "frame_prefetch.h"
+
+#include <sli/stdstreamio.h>
+using namespace sli;
+
+static void *frame_prefetch_worker( void *obj_ptr )
+{
+    ((frame_prefetch *)obj_ptr)->worker_main();
+    return NULL;
+}
+
+frame_prefetch::frame_prefetch()
+  : idx_list(false), slots(NULL), queue_depth(0),
+    threads(NULL), n_threads(0), next_load(0), next_deliver(0),
+    flag_stop(false), loader(NULL), user_ptr(NULL)
+{
+    pthread_mutex_init(&(this->mutex), NULL);
+    pthread_cond_init(&(this->cond_ready), NULL);
+    pthread_cond_init(&(this->cond_space), NULL);
+}
+
+frame_prefetch::~frame_prefetch()
+{
+    this->stop();
+    pthread_cond_destroy(&(this->cond_space));
+    pthread_cond_destroy(&(this->cond_ready));
+    pthread_mutex_destroy(&(this->mutex));
+}
+
+int frame_prefetch::start( const long idx_list[], size_t n_idx,
+			   size_t n_threads, size_t queue_depth,
+			   frame_loader_t loader, void *user_ptr )
+{
+    stdstreamio sio;
+    size_t i;
+    int ret_status = -1;
+
+    this->stop();
+
+    if ( loader == NULL ) goto quit;
+    if ( n_threads < 1 ) n_threads = 1;
+    if ( queue_depth < 1 ) queue_depth = 1;
+
+    this->idx_list.resize_1d(n_idx);
+    for ( i=0 ; i < n_idx ; i++ ) this->idx_list[i] = idx_list[i];
+
+    this->loader = loader;
+    this->user_ptr = user_ptr;
+    this->next_load = 0;
+    this->next_deliver = 0;
+    this->flag_stop = false;
+
+    this->queue_depth = queue_depth;
+    this->slots = new frame_slot[queue_depth];
+    for ( i=0 ; i < queue_depth ; i++ ) {
+	this->slots[i].seq = -1;
+	this->slots[i].ready = false;
+	this->slots[i].ok = false;
+    }
+
+    this->threads = new pthread_t[n_threads];
+    for ( i=0 ; i < n_threads ; i++ ) {
+	if ( pthread_create(&(this->threads[i]), NULL,
+			    &frame_prefetch_worker, (void *)this) != 0 ) {
+	    sio.eprintf("[ERROR] pthread_create() failed\n");
+	    break;
+	}
+	this->n_threads ++;
+    }
+    if ( this->n_threads == 0 ) {
+	this->stop();
+	goto quit;
+    }
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
+
+void frame_prefetch::worker_main()
+{
+    const long n_idx = this->idx_list.length();
+
+    while ( 1 ) {
+	frame_slot *slot_p;
+	long seq;
+	int status;
+
+	pthread_mutex_lock(&(this->mutex));
+	while ( this->flag_stop == false && this->next_load < n_idx &&
+		this->next_deliver + (long)(this->queue_depth)
+		<= this->next_load ) {
+	    pthread_cond_wait(&(this->cond_space), &(this->mutex));
+	}
+	if ( this->flag_stop == true || n_idx <= this->next_load ) {
+	    pthread_mutex_unlock(&(this->mutex));
+	    break;
+	}
+	seq = this->next_load;
+	this->next_load ++;
+	slot_p = this->slots + (seq % this->queue_depth);
+	pthread_mutex_unlock(&(this->mutex));
+
+	/* load a frame without lock */
+	slot_p->offset_x = 0;
+	slot_p->offset_y = 0;
+	status = (*(this->loader))(this->idx_list[seq], &(slot_p->img_buf),
+				   &(slot_p->offset_x), &(slot_p->offset_y),
+				   this->user_ptr);
+
+	pthread_mutex_lock(&(this->mutex));
+	slot_p->seq = seq;
+	slot_p->ok = (status < 0) ? false : true;
+	slot_p->ready = true;
+	pthread_cond_broadcast(&(this->cond_ready));
+	pthread_mutex_unlock(&(this->mutex));
+    }
+
+    return;
+}
+
+bool frame_prefetch::next( long *ret_idx, bool *ret_ok,
+			   mdarray_float *ret_img_buf,
+			   long *ret_offset_x, long *ret_offset_y )
+{
+    frame_slot *slot_p;
+    long seq;
+
+    if ( this->slots == NULL ) return false;
+
+    pthread_mutex_lock(&(this->mutex));
+    seq = this->next_deliver;
+    if ( (long)(this->idx_list.length()) <= seq ) {
+	pthread_mutex_unlock(&(this->mutex));
+	return false;
+    }
+    slot_p = this->slots + (seq % this->queue_depth);
+    while ( slot_p->ready == false || slot_p->seq != seq ) {
+	pthread_cond_wait(&(this->cond_ready), &(this->mutex));
+    }
+    pthread_mutex_unlock(&(this->mutex));
+
+    if ( ret_idx != NULL ) *ret_idx = this->idx_list[seq];
+    if ( ret_ok != NULL ) *ret_ok = slot_p->ok;
+    if ( ret_offset_x != NULL ) *ret_offset_x = slot_p->offset_x;
+    if ( ret_offset_y != NULL ) *ret_offset_y = slot_p->offset_y;
+    if ( ret_img_buf != NULL ) ret_img_buf->swap(slot_p->img_buf);
+
+    pthread_mutex_lock(&(this->mutex));
+    slot_p->ready = false;
+    this->next_deliver ++;
+    pthread_cond_broadcast(&(this->cond_space));
+    pthread_mutex_unlock(&(this->mutex));
+
+    return true;
+}
+
+void frame_prefetch::stop()
+{
+    size_t i;
+
+    if ( this->threads != NULL ) {
+	pthread_mutex_lock(&(this->mutex));
+	this->flag_stop = true;
+	pthread_cond_broadcast(&(this->cond_space));
+	pthread_mutex_unlock(&(this->mutex));
+	for ( i=0 ; i < this->n_threads ; i++ ) {
+	    pthread_join(this->threads[i], NULL);
+	}
+	delete [] this->threads;
+	this->threads = NULL;
+    }
+    this->n_threads = 0;
+
+    if ( this->slots != NULL ) {
+	delete [] this->slots;
+	this->slots = NULL;
+    }
+    this->queue_depth = 0;
+    this->idx_list.init(false);
+
+    return;
+}
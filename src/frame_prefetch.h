@@ -0,0 +1,75 @@
+#ifndef _FRAME_PREFETCH_H
+#define _FRAME_PREFETCH_H 1
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sli/mdarray.h>
+
+/*
+ * Loader called in worker threads.
+ * It should load a frame of idx into ret_img_buf and set offsets.
+ * Returns 0 on success, negative value on error.
+ */
+typedef int (*frame_loader_t)( long idx, sli::mdarray_float *ret_img_buf,
+			       long *ret_offset_x, long *ret_offset_y,
+			       void *user_ptr );
+
+typedef struct _frame_slot {
+    sli::mdarray_float img_buf;
+    long seq;				/* sequence number in idx_list */
+    long offset_x;
+    long offset_y;
+    bool ready;
+    bool ok;
+} frame_slot;
+
+/*
+ * Bounded producer/consumer pipeline of frame loading.
+ *
+ * One or more worker threads call the loader ahead of the consumer, and
+ * next() returns frames in the order of idx_list.  At most queue_depth
+ * frames are held in the pipeline.
+ */
+class frame_prefetch {
+
+  public:
+    frame_prefetch();
+    ~frame_prefetch();
+
+    int start( const long idx_list[], size_t n_idx,
+	       size_t n_threads, size_t queue_depth,
+	       frame_loader_t loader, void *user_ptr );
+
+    /* returns false when all frames are delivered */
+    /* (ret_img_buf is swapped with internal buffer) */
+    bool next( long *ret_idx, bool *ret_ok,
+	       sli::mdarray_float *ret_img_buf,
+	       long *ret_offset_x, long *ret_offset_y );
+
+    void stop();
+
+    /* used by worker threads */
+    void worker_main();
+
+  private:
+    sli::mdarray_long idx_list;
+    frame_slot *slots;
+    size_t queue_depth;
+    pthread_t *threads;
+    size_t n_threads;
+    long next_load;			/* next seq to be loaded */
+    long next_deliver;			/* next seq to be delivered */
+    bool flag_stop;
+    frame_loader_t loader;
+    void *user_ptr;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_ready;
+    pthread_cond_t cond_space;
+
+    /* disable copy */
+    frame_prefetch( const frame_prefetch & );
+    frame_prefetch &operator=( const frame_prefetch & );
+
+};
+
+#endif	/* _FRAME_PREFETCH_H */
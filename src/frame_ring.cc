@@ -0,0 +1,120 @@
+#include "frame_ring.h"
+
+using namespace sli;
+
+frame_ring::frame_ring()
+  : slots(NULL), n_slots(0), use_count(0)
+{
+    pthread_mutex_init(&(this->mutex), NULL);
+}
+
+frame_ring::~frame_ring()
+{
+    this->close();
+    pthread_mutex_destroy(&(this->mutex));
+}
+
+int frame_ring::init( size_t n_slots )
+{
+    size_t i;
+
+    this->close();
+    if ( n_slots == 0 ) return -1;
+
+    this->slots = new frame_ring_entry[n_slots];
+    for ( i=0 ; i < n_slots ; i++ ) {
+	this->slots[i].idx = -1;
+	this->slots[i].last_use = 0;
+	this->slots[i].has_median = false;
+    }
+    this->n_slots = n_slots;
+    this->use_count = 0;
+
+    return 0;
+}
+
+void frame_ring::close()
+{
+    if ( this->slots != NULL ) {
+	delete [] this->slots;
+	this->slots = NULL;
+    }
+    this->n_slots = 0;
+    return;
+}
+
+bool frame_ring::get( long idx, mdarray_float *ret_img_buf, int *ret_sztype,
+		      long *ret_offset_x, long *ret_offset_y,
+		      double ret_median[], bool *ret_has_median )
+{
+    bool ret = false;
+    size_t i, j;
+
+    pthread_mutex_lock(&(this->mutex));
+    for ( i=0 ; i < this->n_slots ; i++ ) {
+	frame_ring_entry *e = &(this->slots[i]);
+	if ( e->idx != idx ) continue;
+	this->use_count ++;
+	e->last_use = this->use_count;
+	if ( ret_img_buf != NULL ) {
+	    ret_img_buf->init(false);
+	    ret_img_buf->resize(e->img_buf);
+	    ret_img_buf->paste(e->img_buf);
+	}
+	if ( ret_sztype != NULL ) *ret_sztype = e->sztype;
+	if ( ret_offset_x != NULL ) *ret_offset_x = e->offset_x;
+	if ( ret_offset_y != NULL ) *ret_offset_y = e->offset_y;
+	if ( ret_median != NULL ) {
+	    for ( j=0 ; j < 3 ; j++ ) ret_median[j] = e->median[j];
+	}
+	if ( ret_has_median != NULL ) *ret_has_median = e->has_median;
+	ret = true;
+	break;
+    }
+    pthread_mutex_unlock(&(this->mutex));
+
+    return ret;
+}
+
+void frame_ring::put( long idx, const mdarray_float &img_buf, int sztype,
+		      long offset_x, long offset_y, const double median[] )
+{
+    frame_ring_entry *e = NULL;
+    size_t i, j;
+
+    pthread_mutex_lock(&(this->mutex));
+    if ( this->n_slots == 0 ) goto quit;
+
+    /* same idx (loaded by another thread) or least recently used */
+    for ( i=0 ; i < this->n_slots ; i++ ) {
+	if ( this->slots[i].idx == idx ) {
+	    e = &(this->slots[i]);
+	    break;
+	}
+	if ( e == NULL || this->slots[i].last_use < e->last_use ) {
+	    e = &(this->slots[i]);
+	}
+    }
+
+    this->use_count ++;
+    e->idx = idx;
+    e->last_use = this->use_count;
+    if ( e->img_buf.x_length() != img_buf.x_length() ||
+	 e->img_buf.y_length() != img_buf.y_length() ||
+	 e->img_buf.z_length() != img_buf.z_length() ) {
+	e->img_buf.init(false);
+	e->img_buf.resize(img_buf);
+    }
+    e->img_buf.paste(img_buf);
+    e->sztype = sztype;
+    e->offset_x = offset_x;
+    e->offset_y = offset_y;
+    e->has_median = ( median != NULL );
+    for ( j=0 ; j < 3 ; j++ ) {
+	e->median[j] = (median != NULL) ? median[j] : 0.0;
+    }
+
+ quit:
+    pthread_mutex_unlock(&(this->mutex));
+    return;
+}
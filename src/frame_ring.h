@@ -0,0 +1,59 @@
+#ifndef _FRAME_RING_H
+#define _FRAME_RING_H 1
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sli/mdarray.h>
+
+/* a decoded frame and its per-frame measurements */
+typedef struct _frame_ring_entry {
+    sli::mdarray_float img_buf;
+    long idx;				/* -1: empty */
+    unsigned long last_use;
+    int sztype;
+    long offset_x;
+    long offset_y;
+    double median[3];			/* median of R,G,B */
+    bool has_median;
+} frame_ring_entry;
+
+/*
+ * Small ring of decoded frames keyed by index, for dark synthesis that
+ * compares frame i with frame i+n: each frame is decoded (and measured)
+ * once per pass, and reused when it is needed again as a target or as a
+ * compared frame.  The least recently used slot is reused when full.
+ * All methods are thread-safe (called from prefetch threads).
+ */
+class frame_ring {
+
+  public:
+    frame_ring();
+    ~frame_ring();
+
+    int init( size_t n_slots );
+    void close();
+
+    /* returns true when idx is in ring (ret_* can be NULL) */
+    bool get( long idx, sli::mdarray_float *ret_img_buf, int *ret_sztype,
+	      long *ret_offset_x, long *ret_offset_y,
+	      double ret_median[], bool *ret_has_median );
+
+    /* median can be NULL */
+    void put( long idx, const sli::mdarray_float &img_buf, int sztype,
+	      long offset_x, long offset_y, const double median[] );
+
+    size_t length() const { return this->n_slots; }
+
+  private:
+    frame_ring_entry *slots;
+    size_t n_slots;
+    unsigned long use_count;
+    pthread_mutex_t mutex;
+
+    /* disable copy */
+    frame_ring( const frame_ring & );
+    frame_ring &operator=( const frame_ring & );
+
+};
+
+#endif	/* _FRAME_RING_H */
@@ -0,0 +1,224 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sli/stdstreamio.h>
+#include <sli/tstring.h>
+#include <sli/tarray_tstring.h>
+#include <sli/mdarray_statistics.h>
+
+#include "frame_stats.h"
+#include "sys_funcs.h"
+
+using namespace sli;
+
+static const char *Names_stats_ch[] = {"median", "mad", "min", "max"};
+
+int get_frame_stats_filename( const char *filename, tstring *ret_filename )
+{
+    size_t i, ix = 0;
+    for ( i=0 ; filename[i] != '\0' ; i++ ) {
+	if ( filename[i] == '.' ) ix = i;
+    }
+    if ( ix != 0 ) {
+	ret_filename->assign(filename,ix);
+	ret_filename->append(".stats.txt");
+    }
+    else {
+	ret_filename->printf("%s.stats.txt",filename);
+    }
+    return 0;
+}
+
+/* split a line into elements; returns false at EOF */
+static bool read_elements( stdstreamio *f_in, tarray_tstring *ret_elms )
+{
+    const char *line = f_in->getline();
+    if ( line == NULL ) return false;
+    ret_elms->split(line, " \n", false);
+    return true;
+}
+
+static double *get_stats_ch_ptr( frame_stats *stats, size_t i )
+{
+    if ( i == 0 ) return stats->median;
+    else if ( i == 1 ) return stats->mad;
+    else if ( i == 2 ) return stats->min;
+    else return stats->max;
+}
+
+/*
+ * Format:
+ *   size <bytes>
+ *   mtime <seconds> <nanoseconds>
+ *   median <R> <G> <B>
+ *   mad <R> <G> <B>
+ *   min <R> <G> <B>
+ *   max <R> <G> <B>
+ *   hist <n_bins>
+ *   <n_bins counts of R>
+ *   <n_bins counts of G>
+ *   <n_bins counts of B>
+ */
+int load_frame_stats( const char *filename, frame_stats *ret_stats )
+{
+    stdstreamio f_in;
+    tstring stats_file;
+    tarray_tstring elms;
+    frame_stats stats;
+    long long size, mtime;
+    long mtime_nsec;
+    size_t i, j;
+    int ret_status = -1;
+
+    if ( get_file_key(filename, &size, &mtime, &mtime_nsec) < 0 ) goto quit;
+
+    get_frame_stats_filename(filename, &stats_file);
+    if ( f_in.open("r", stats_file.cstr()) < 0 ) goto quit;
+
+    if ( read_elements(&f_in, &elms) == false ) goto quit;
+    if ( elms.length() != 2 || elms[0] != "size" ||
+	 elms[1].atoll() != size ) goto quit;
+    if ( read_elements(&f_in, &elms) == false ) goto quit;
+    if ( elms.length() != 3 || elms[0] != "mtime" ||
+	 elms[1].atoll() != mtime || elms[2].atol() != mtime_nsec ) goto quit;
+
+    for ( i=0 ; i < 4 ; i++ ) {
+	double *v = get_stats_ch_ptr(&stats, i);
+	if ( read_elements(&f_in, &elms) == false ) goto quit;
+	if ( elms.length() != 4 || elms[0] != Names_stats_ch[i] ) goto quit;
+	for ( j=0 ; j < 3 ; j++ ) v[j] = elms[1 + j].atof();
+    }
+
+    if ( read_elements(&f_in, &elms) == false ) goto quit;
+    if ( elms.length() != 2 || elms[0] != "hist" ||
+	 elms[1].atoi() != FRAME_STATS_HIST_BINS ) goto quit;
+    for ( j=0 ; j < 3 ; j++ ) {
+	if ( read_elements(&f_in, &elms) == false ) goto quit;
+	if ( elms.length() != FRAME_STATS_HIST_BINS ) goto quit;
+	for ( i=0 ; i < FRAME_STATS_HIST_BINS ; i++ ) {
+	    stats.hist[j][i] = elms[i].atoll();
+	}
+    }
+
+    *ret_stats = stats;
+
+    ret_status = 0;
+ quit:
+    f_in.close();
+    return ret_status;
+}
+
+/*
+ * The sidecar is written to a temporary file and renamed, so that readers
+ * never see a partial file.  Several processes or loader threads can write
+ * the same sidecar, so the temporary file is unique (mkstemp()).
+ */
+int save_frame_stats( const char *filename, const frame_stats &stats )
+{
+    stdstreamio f_out;
+    tstring stats_file;
+    char tmp_file[4096];
+    long long size, mtime;
+    long mtime_nsec;
+    size_t i, j;
+    int fd;
+    int ret_status = -1;
+
+    if ( get_file_key(filename, &size, &mtime, &mtime_nsec) < 0 ) goto quit;
+
+    get_frame_stats_filename(filename, &stats_file);
+    snprintf(tmp_file, sizeof(tmp_file), "%s.tmp.XXXXXX", stats_file.cstr());
+    fd = mkstemp(tmp_file);
+    if ( fd < 0 ) goto quit;
+    fchmod(fd, 0644);			/* (mkstemp() creates with 0600) */
+    close(fd);
+    if ( f_out.open("w", tmp_file) < 0 ) {
+	unlink(tmp_file);
+	goto quit;
+    }
+
+    f_out.printf("size %lld\n", size);
+    f_out.printf("mtime %lld %ld\n", mtime, mtime_nsec);
+    for ( i=0 ; i < 4 ; i++ ) {
+	const double *v = get_stats_ch_ptr((frame_stats *)&stats, i);
+	/* %.17g: loaded values are the same as computed ones */
+	f_out.printf("%s %.17g %.17g %.17g\n",
+		     Names_stats_ch[i], v[0], v[1], v[2]);
+    }
+    f_out.printf("hist %d\n", FRAME_STATS_HIST_BINS);
+    for ( j=0 ; j < 3 ; j++ ) {
+	for ( i=0 ; i < FRAME_STATS_HIST_BINS ; i++ ) {
+	    f_out.printf((i == 0) ? "%lu" : " %lu", stats.hist[j][i]);
+	}
+	f_out.printf("\n");
+    }
+    f_out.close();
+
+    if ( rename(tmp_file, stats_file.cstr()) != 0 ) {
+	unlink(tmp_file);
+	goto quit;
+    }
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
+
+int compute_frame_stats( const mdarray_float &img_buf,
+			 frame_stats *ret_stats )
+{
+    const double bin_width = 65536.0 / FRAME_STATS_HIST_BINS;
+    mdarray_float ch_buf(false);
+    size_t ch, k, len;
+
+    if ( img_buf.z_length() != 3 ) return -1;
+
+    ch_buf.resize_2d(img_buf.x_length(), img_buf.y_length());
+    len = ch_buf.length();
+
+    for ( ch=0 ; ch < 3 ; ch++ ) {
+	float *p;
+	double min_v = NAN, max_v = NAN;
+	img_buf.copy(&ch_buf,
+		     0, img_buf.x_length(), 0, img_buf.y_length(), ch, 1);
+	ret_stats->median[ch] = md_median(ch_buf);
+
+	p = ch_buf.array_ptr();
+	for ( k=0 ; k < FRAME_STATS_HIST_BINS ; k++ ) {
+	    ret_stats->hist[ch][k] = 0;
+	}
+	for ( k=0 ; k < len ; k++ ) {
+	    long bin;
+	    if ( isnan(p[k]) != 0 ) continue;
+	    if ( !(min_v <= p[k]) ) min_v = p[k];
+	    if ( !(p[k] <= max_v) ) max_v = p[k];
+	    bin = (long)floor(p[k] / bin_width);
+	    if ( bin < 0 ) bin = 0;
+	    if ( FRAME_STATS_HIST_BINS <= bin ) bin = FRAME_STATS_HIST_BINS - 1;
+	    ret_stats->hist[ch][bin] ++;
+	}
+	ret_stats->min[ch] = min_v;
+	ret_stats->max[ch] = max_v;
+
+	/* MAD */
+	for ( k=0 ; k < len ; k++ ) {
+	    p[k] = fabs(p[k] - ret_stats->median[ch]);
+	}
+	ret_stats->mad[ch] = md_median(ch_buf);
+    }
+
+    return 0;
+}
+
+int get_frame_stats( const char *filename, const mdarray_float *img_buf,
+		     frame_stats *ret_stats )
+{
+    if ( load_frame_stats(filename, ret_stats) == 0 ) return 0;
+    if ( img_buf == NULL ) return -1;
+    if ( compute_frame_stats(*img_buf, ret_stats) < 0 ) return -1;
+    /* (a read-only directory is not an error) */
+    save_frame_stats(filename, *ret_stats);
+    return 0;
+}
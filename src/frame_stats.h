@@ -0,0 +1,45 @@
+#ifndef _FRAME_STATS_H
+#define _FRAME_STATS_H 1
+
+#include <unistd.h>
+#include <sli/tstring.h>
+#include <sli/mdarray.h>
+
+/* number of bins of histogram for [0,65536) */
+#define FRAME_STATS_HIST_BINS 256
+
+/*
+ * Statistics of R,G,B of a frame.  Values are for the frame loaded by
+ * load_tiff_into_float(filename, 65536.0, ...), i.e. 0..65535 for 8/16-bit.
+ */
+typedef struct _frame_stats {
+    double median[3];
+    double mad[3];			/* median absolute deviation */
+    double min[3];
+    double max[3];
+    unsigned long hist[3][FRAME_STATS_HIST_BINS];
+} frame_stats;
+
+/*
+ * Statistics are cached in a sidecar text file ("<base>.stats.txt") with
+ * size and mtime of the frame, and the cache is ignored when the frame
+ * is modified.
+ */
+
+/* name of sidecar file */
+int get_frame_stats_filename( const char *filename, sli::tstring *ret_filename );
+
+/* returns 0 when a valid sidecar is found */
+int load_frame_stats( const char *filename, frame_stats *ret_stats );
+
+int save_frame_stats( const char *filename, const frame_stats &stats );
+
+/* img_buf should be loaded with scale = 65536.0 */
+int compute_frame_stats( const sli::mdarray_float &img_buf,
+			 frame_stats *ret_stats );
+
+/* load from sidecar, or compute from img_buf (can be NULL) and save */
+int get_frame_stats( const char *filename, const sli::mdarray_float *img_buf,
+		     frame_stats *ret_stats );
+
+#endif	/* _FRAME_STATS_H */
@@ -24,6 +24,7 @@ int main( int argc, char *argv[] )
     mdarray_uchar icc_buf(false);
     mdarray result_buf(UCHAR_ZT,false);		/* RGB */
     mdarray img_stat_buf(UCHAR_ZT,false);	/* Single-band */
+    mdarray_float img_band_buf(false);		/* a section of a band */
     tarray_tstring filenames_in;
     const char *filename_in;
     const char *filename_out = "dark.tiff";
@@ -32,6 +33,7 @@ int main( int argc, char *argv[] )
     size_t i, j, k, k_step, width, height;
     int sz_type, tiff_szt;
     uint64_t nbytes_img_stat_full;
+    double load_scale;
     
     int return_status = -1;
     
@@ -64,12 +66,18 @@ int main( int argc, char *argv[] )
     result_buf.init(sz_type, false);
     result_buf.resize_3d(width, height, 3);
 
+    /* scale for load_tiff_region_into_float(): raw values of pixels */
+    if ( tiff_szt == 1 ) load_scale = 256.0;
+    else if ( tiff_szt == 2 ) load_scale = 65536.0;
+    else load_scale = 1.0;
+
     /* Calculate k_step */
     //sio.printf("bytes = %zd\n",img_load_buf.bytes());
     nbytes_img_stat_full = img_load_buf.bytes();
     nbytes_img_stat_full *= width;
     nbytes_img_stat_full *= height;
     nbytes_img_stat_full *= filenames_in.length();
+    img_load_buf.init(sz_type, false);	/* sections are loaded below */
     if ( Max_stat_buf_bytes < nbytes_img_stat_full ) {
 	size_t n_k = (nbytes_img_stat_full - 1) / Max_stat_buf_bytes;
 	k_step = height / (n_k + 1);
@@ -86,15 +94,19 @@ int main( int argc, char *argv[] )
     for ( j=0 ; j < 3 ; j++ ) {					/* R,G,B */
 	sio.printf("Starting channel [%s]\n",rgb_str[j]);
 	for ( k=0 ; k < height ; k+=k_step ) {			/* block[y] */
+	    const size_t n_rows = (height - k < k_step) ? height - k : k_step;
 	    sio.printf(" y of section = %zd\n",k);
 	    for ( i=0 ; i < filenames_in.length() ; i++ ) {	/* files */
 		int tiff_szt0;
+		size_t width0, height0;
 		filename_in = filenames_in[i].cstr();
 		sio.printf("  Reading %s\n",filename_in);
-		img_load_buf.init(sz_type, false);
-		if ( load_tiff(filename_in, &img_load_buf, &tiff_szt0,
-			       NULL, NULL) < 0 ) {
-		    sio.eprintf("[ERROR] load_tiff() failed\n");
+		/* decode only rows of this section of channel j */
+		if ( load_tiff_region_into_float(filename_in, load_scale,
+				0, width, k, n_rows, 1 << j /* R,G or B */,
+				&img_band_buf, &tiff_szt0, NULL, NULL,
+				&width0, &height0) < 0 ) {
+		    sio.eprintf("[ERROR] load_tiff_region_into_float() failed\n");
 		    goto quit;
 		}
 		if ( tiff_szt0 != tiff_szt ) {
@@ -102,9 +114,13 @@ int main( int argc, char *argv[] )
 				filename_in);
 		    goto quit;
 		}
-		img_load_buf.crop(2 /* dim */, j /* R,G or B */, 1);	/* z */
-		img_load_buf.crop(1, k, k_step);			/* y */
-		img_stat_buf.paste(img_load_buf, 0, 0, i /* layer = file No. */);
+		if ( width0 != width || height0 != height ) {
+		    sio.eprintf("[ERROR] invalid size of image: %s\n",
+				filename_in);
+		    goto quit;
+		}
+		/* values are integers for 8/16-bit: converted exactly */
+		img_stat_buf.paste(img_band_buf, 0, 0, i /* layer = file No. */);
 	    }
 	    //img_stat_buf.dprint();
 	    /* Get median and paste it to result_buf */
@@ -115,6 +131,7 @@ int main( int argc, char *argv[] )
 
     /* freeing buffer */
     img_load_buf.init(sz_type, false);
+    img_band_buf.init(false);
     img_stat_buf.init(sz_type, false);
 
     sio.printf("Writing %s ...\n", filename_out);
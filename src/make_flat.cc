@@ -15,7 +15,8 @@ int main( int argc, char *argv[] )
     stdstreamio sio, f_in;
 
     mdarray_float img_dark_buf(false);		/* RGB: load a master dark */
-    mdarray_float img_load_buf(false);		/* RGB: load a image */
+    mdarray_float img_load_buf(false);		/* a section of a band */
+    mdarray_float img_dark_band_buf(false);	/* a section of a dark */
     mdarray_uchar icc_buf(false);
     mdarray_float result_buf(false);		/* RGB: result */
     mdarray_float img_stat_buf(false);		/* Single-band */
@@ -168,14 +169,26 @@ int main( int argc, char *argv[] )
       if ( 3 <= target_channel || (int)j == target_channel ) {
 	sio.printf("Starting channel [%s]\n",rgb_str[j]);
 	for ( k=0 ; k < height ; k+=k_step ) {			/* block[y] */
+	    /* full height is needed for median of the 1st section */
+	    const size_t ny = (k == 0) ? height :
+			      ((height - k < k_step) ? height - k : k_step);
 	    sio.printf(" y of section = %zd\n",k);
 	    for ( i=0 ; i < filenames_in.length() ; i++ ) {	/* files */
 		const char *filename_in = filenames_in[i].cstr();
+		size_t width0, height0;
 		//size_t l;
 		sio.printf("  Reading %s\n",filename_in);
-		if ( load_tiff_into_float(filename_in, 65536.0,
-				   &img_load_buf, NULL, &icc_buf, NULL) < 0 ) {
-		    sio.eprintf("[ERROR] load_tiff_into_float() failed\n");
+		/* decode only rows of this section of channel j */
+		if ( load_tiff_region_into_float(filename_in, 65536.0,
+				0, width, k, ny, 1 << j /* R,G or B */,
+				&img_load_buf, NULL, &icc_buf, NULL,
+				&width0, &height0) < 0 ) {
+		    sio.eprintf("[ERROR] load_tiff_region_into_float() failed\n");
+		    goto quit;
+		}
+		if ( width0 != width || height0 != height ) {
+		    sio.eprintf("[ERROR] invalid size of image: %s\n",
+				filename_in);
 		    goto quit;
 		}
 		/* Subtract dark */
@@ -183,30 +196,34 @@ int main( int argc, char *argv[] )
 		    filename_dark =
 		       darkfile_list[cnt_dark % darkfile_list.length()].cstr();
 		    sio.printf("  Reading %s\n", filename_dark);
-		    if ( load_tiff_into_float(filename_dark, 65536.0,
-				   &img_dark_buf, NULL, &icc_buf, NULL) < 0 ) {
+		    if ( load_tiff_region_into_float(filename_dark, 65536.0,
+				0, width, k, ny, 1 << j,
+				&img_dark_band_buf, NULL, &icc_buf, NULL,
+				NULL, NULL) < 0 ) {
 			sio.eprintf("[ERROR] cannot load dark\n");
-			sio.eprintf("[ERROR] load_tiff_into_float() failed\n");
+			sio.eprintf("[ERROR] load_tiff_region_into_float() failed\n");
 			goto quit;
 		    }
 		    cnt_dark ++;
 		}
-		img_load_buf -= img_dark_buf;
+		else {
+		    img_dark_buf.copy(&img_dark_band_buf,
+				      0, width, k, ny, j, 1);
+		}
+		img_load_buf -= img_dark_band_buf;
 		/* */
 		//ptr = img_load_buf.array_ptr();
 		//for ( l=0 ; l < img_load_buf.length() ; l++ ) {
 		//    if ( ptr[l] < 0 ) ptr[l] = 0.0;
 		//}
-		/* Crop z */
-		img_load_buf.crop(2 /* dim */, j /* R,G or B */, 1);	/* z */
 		/* Median for standardization */
 		if ( k == 0 ) {
 		    median_each[i] = md_median(img_load_buf);
 		    sio.printf("  Updated median_each[%zd] = %g\n",
 			       i, median_each[i]);
+		    /* Crop y */
+		    img_load_buf.crop(1, 0, k_step);			/* y */
 		}
-		/* Crop y */
-		img_load_buf.crop(1, k, k_step);			/* y */
 		/* standardization */
 		img_load_buf *= (1.0 / median_each[i]);
 		/* Copy to img_stat_buf */
@@ -222,6 +239,7 @@ int main( int argc, char *argv[] )
 
     /* freeing buffer */
     img_load_buf.init(false);
+    img_dark_band_buf.init(false);
     img_stat_buf.init(false);
 
     if ( icc_buf.length() == 0 ) {
@@ -34,10 +34,11 @@ int main( int argc, char *argv[] )
     
     filename_in = argv[1];
     sio.printf("Loading %s\n", filename_in);
-    if ( load_tiff_into_float(filename_in, 1.0,
-			  &img_flat_r_buf, &sztype_r, &icc_buf, NULL) < 0 ) {
+    if ( load_tiff_region_into_float(filename_in, 1.0, 0, -1, 0, -1,
+				     TIFF_CH_R, &img_flat_r_buf, &sztype_r,
+				     &icc_buf, NULL, NULL, NULL) < 0 ) {
 	sio.eprintf("[ERROR] cannot load '%s'\n", filename_in);
-	sio.eprintf("[ERROR] load_tiff_into_float() failed\n");
+	sio.eprintf("[ERROR] load_tiff_region_into_float() failed\n");
 	goto quit;
     }
     
@@ -52,16 +53,17 @@ int main( int argc, char *argv[] )
 
     filename_in = argv[3];
     sio.printf("Loading %s\n", filename_in);
-    if ( load_tiff_into_float(filename_in, 1.0,
-			  &img_flat_b_buf, &sztype_r, &icc_buf, NULL) < 0 ) {
+    if ( load_tiff_region_into_float(filename_in, 1.0, 0, -1, 0, -1,
+				     TIFF_CH_B, &img_flat_b_buf, &sztype_b,
+				     &icc_buf, NULL, NULL, NULL) < 0 ) {
 	sio.eprintf("[ERROR] cannot load '%s'\n", filename_in);
-	sio.eprintf("[ERROR] load_tiff_into_float() failed\n");
+	sio.eprintf("[ERROR] load_tiff_region_into_float() failed\n");
 	goto quit;
     }
 
-    /* merge */
-    img_flat_g_buf.paste(img_flat_r_buf.sectionf("*,*,0"),0,0,0);
-    img_flat_g_buf.paste(img_flat_b_buf.sectionf("*,*,2"),0,0,2);
+    /* merge (only R of 1st and B of 3rd file are loaded) */
+    img_flat_g_buf.paste(img_flat_r_buf,0,0,0);
+    img_flat_g_buf.paste(img_flat_b_buf,0,0,2);
 
     if ( icc_buf.length() == 0 ) {
 	icc_buf.resize_1d(sizeof(Icc_srgb_profile));
@@ -0,0 +1,196 @@
+#include <sli/stdstreamio.h>
+#include <sli/tstring.h>
+#include <sli/mdarray.h>
+
+#include "tiff_funcs.h"
+#include "thread_funcs.h"
+#include "stack_funcs.h"
+#include "checkpoint_funcs.h"
+#include "sys_funcs.h"
+
+using namespace sli;
+
+/*
+ * Merge partial stacks written by workers (stack_images -w i/n -o file)
+ *
+ * Example of 2 workers with 1 sigma-clipping pass:
+ *   $ stack_images -w 0/2 -o pass0_0.stk &
+ *   $ stack_images -w 1/2 -o pass0_1.stk &
+ *   $ wait
+ *   $ merge_stacks -o pass0.stk pass0_0.stk pass0_1.stk
+ *   $ stack_images -w 0/2 -a pass0.stk -o pass1_0.stk &
+ *   $ stack_images -w 1/2 -a pass0.stk -o pass1_1.stk &
+ *   $ wait
+ *   $ merge_stacks -s pass1_0.stk pass1_1.stk
+ *
+ * Partial stacks of all workers (0 .. n-1 of -w i/n) are required.
+ */
+
+/* check worker of a partial stack; flg_merged[] is updated */
+static int check_worker( const char *filename, const stack_checkpoint &ckpt,
+			 mdarray_bool *flg_merged )
+{
+    stdstreamio sio;
+
+    if ( ckpt.n_workers < 1 ) {
+	sio.eprintf("[ERROR] '%s' is not a partial stack of a worker\n",
+		    filename);
+	return -1;
+    }
+    if ( flg_merged->length() == 0 ) {
+	flg_merged->resize_1d(ckpt.n_workers);
+	(*flg_merged) = false;
+    }
+    if ( flg_merged->length() != (size_t)ckpt.n_workers ) {
+	sio.eprintf("[ERROR] number of workers of '%s' is %d, not %zd\n",
+		    filename, ckpt.n_workers, flg_merged->length());
+	return -1;
+    }
+    if ( (*flg_merged)[ckpt.worker_id] == true ) {
+	sio.eprintf("[ERROR] worker %d/%d is given twice: %s\n",
+		    ckpt.worker_id, ckpt.n_workers, filename);
+	return -1;
+    }
+    (*flg_merged)[ckpt.worker_id] = true;
+
+    return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+    stdstreamio sio;
+
+    stack_checkpoint ckpt;
+    stack_accum accum;
+    thread_pool tpool;
+    mdarray_float img_buf(false);
+    mdarray_uchar icc_buf(false);
+    mdarray_bool flg_merged(false);	/* workers merged */
+    const char *filename_out = NULL;
+    bool flag_save_image = false;
+    bool flag_dither = true;
+    size_t i, n_frames;
+    tstring appended_str;
+    int arg_cnt, n_in;
+
+    int return_status = -1;
+
+    for ( arg_cnt=1 ; arg_cnt < argc ; arg_cnt++ ) {
+	tstring argstr;
+	argstr = argv[arg_cnt];
+	if ( argstr == "-o" && arg_cnt + 1 < argc ) {
+	    arg_cnt ++;
+	    filename_out = argv[arg_cnt];
+	}
+	else if ( argstr == "-s" ) {
+	    flag_save_image = true;
+	}
+	else if ( argstr == "-t" ) {
+	    flag_dither = false;
+	}
+	else break;
+    }
+
+    if ( argc <= arg_cnt ||
+	 (filename_out == NULL && flag_save_image == false) ) {
+	sio.eprintf("Merge partial stacks of all workers of stack_images -w\n");
+	sio.eprintf("\n");
+        sio.eprintf("[USAGE]\n");
+	sio.eprintf("$ %s [-o merged.stk] [-s] [-t] partial_0.stk partial_1.stk ...\n",
+		    argv[0]);
+	sio.eprintf("-o file ... write merged sums (input of stack_images -a)\n");
+	sio.eprintf("-s ... write averaged image as TIFF\n");
+	sio.eprintf("-t ... do not use dither for 16-bit TIFF\n");
+	goto quit;
+    }
+
+    /* merge */
+    for ( n_in=0 ; arg_cnt < argc ; arg_cnt++, n_in++ ) {
+	const char *filename_in = argv[arg_cnt];
+	sio.printf("Loading %s\n", filename_in);
+	if ( n_in == 0 ) {
+	    if ( load_stack_checkpoint(filename_in, &ckpt, &accum) < 0 ) {
+		sio.eprintf("[ERROR] cannot load '%s'\n", filename_in);
+		goto quit;
+	    }
+	    if ( check_worker(filename_in, ckpt, &flg_merged) < 0 ) {
+		goto quit;
+	    }
+	}
+	else {
+	    stack_checkpoint src_ckpt;
+	    stack_accum src_accum;
+	    if ( load_stack_checkpoint(filename_in, &src_ckpt,
+				       &src_accum) < 0 ) {
+		sio.eprintf("[ERROR] cannot load '%s'\n", filename_in);
+		goto quit;
+	    }
+	    if ( check_worker(filename_in, src_ckpt, &flg_merged) < 0 ) {
+		goto quit;
+	    }
+	    if ( merge_stack_checkpoint(&ckpt, &accum,
+					src_ckpt, src_accum) < 0 ) {
+		sio.eprintf("[ERROR] cannot merge '%s'\n", filename_in);
+		goto quit;
+	    }
+	}
+    }
+
+    for ( i=0 ; i < flg_merged.length() ; i++ ) {
+	if ( flg_merged[i] == false ) {
+	    sio.eprintf("[ERROR] partial stack of worker %zd/%zd is missing\n",
+			i, flg_merged.length());
+	    goto quit;
+	}
+    }
+    /* merged sums are not partial */
+    ckpt.n_workers = 0;
+    ckpt.worker_id = 0;
+
+    n_frames = ckpt.length() + ((ckpt.has_ref == true) ? 1 : 0);
+    sio.printf("Merged %d files: %zd frames, pass %d (reference: %s)\n",
+	       n_in, n_frames, ckpt.n_iterations, ckpt.ref_filename.cstr());
+    if ( ckpt.has_ref == false ) {
+	sio.eprintf("[WARNING] reference frame is not included\n");
+    }
+
+    if ( filename_out != NULL ) {
+	sio.printf("Writing '%s' ...\n", filename_out);
+	if ( save_stack_checkpoint(filename_out, ckpt, accum) < 0 ) {
+	    sio.eprintf("[ERROR] save_stack_checkpoint() failed\n");
+	    goto quit;
+	}
+    }
+
+    if ( flag_save_image == true ) {
+
+	/* ICC of reference */
+	if ( load_tiff_rows_into_float(ckpt.ref_filename.cstr(), 65536.0,
+			0, 0, &img_buf, NULL, &icc_buf, NULL, NULL, NULL) < 0 ) {
+	    sio.eprintf("[WARNING] cannot load header of '%s'\n",
+			ckpt.ref_filename.cstr());
+	}
+	if ( icc_buf.length() == 0 ) {
+	    icc_buf.resize_1d(sizeof(Icc_srgb_profile));
+	    icc_buf.put_elements(Icc_srgb_profile,sizeof(Icc_srgb_profile));
+	}
+
+	if ( tpool.start(get_number_of_cpus()) < 0 ) {
+	    sio.eprintf("[ERROR] tpool.start() failed\n");
+	    goto quit;
+	}
+	stack_get_average(&tpool, accum, n_frames, &img_buf);
+	tpool.stop();
+
+	/* same names as stack_images */
+	appended_str.printf("+%zdframes_stacked", ckpt.length());
+	if ( save_stacked_image(ckpt.ref_filename.cstr(), appended_str.cstr(),
+				img_buf, icc_buf, flag_dither) < 0 ) {
+	    goto quit;
+	}
+    }
+
+    return_status = 0;
+ quit:
+    return return_status;
+}
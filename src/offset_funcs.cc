@@ -0,0 +1,155 @@
+#include <sli/stdstreamio.h>
+#include <sli/tarray_tstring.h>
+#include <math.h>
+
+#include "offset_funcs.h"
+
+using namespace sli;
+
+int get_offset_filename( const char *target_filename,
+			 tstring *ret_filename )
+{
+    size_t i, ix = 0;
+    for ( i=0 ; target_filename[i] != '\0' ; i++ ) {
+	if ( target_filename[i] == '.' ) ix = i;
+    }
+    if ( ix != 0 ) {
+	ret_filename->assign(target_filename,ix);
+	ret_filename->append(".offset.txt");
+    }
+    else {
+	ret_filename->printf("%s.offset.txt",target_filename);
+    }
+    return 0;
+}
+
+int load_offset_file( const char *target_filename,
+		      long *ret_offset_x, long *ret_offset_y,
+		      double *ret_subpixel_x, double *ret_subpixel_y )
+{
+    stdstreamio f_in;
+    tstring offset_file;
+    tarray_tstring offs;
+    const char *line;
+    int ret_status = -1;
+
+    get_offset_filename(target_filename, &offset_file);
+    if ( f_in.open("r", offset_file.cstr()) < 0 ) goto quit;
+
+    line = f_in.getline();
+    if ( line == NULL ) goto quit;
+    offs.split(line," \n",false);
+    if ( offs.length() < 2 ) goto quit;
+
+    if ( ret_offset_x != NULL ) *ret_offset_x = offs[0].atol();
+    if ( ret_offset_y != NULL ) *ret_offset_y = offs[1].atol();
+    if ( ret_subpixel_x != NULL ) {
+	if ( 4 <= offs.length() ) *ret_subpixel_x = offs[2].atof();
+	else *ret_subpixel_x = offs[0].atol();
+    }
+    if ( ret_subpixel_y != NULL ) {
+	if ( 4 <= offs.length() ) *ret_subpixel_y = offs[3].atof();
+	else *ret_subpixel_y = offs[1].atol();
+    }
+
+    ret_status = 0;
+ quit:
+    f_in.close();
+    return ret_status;
+}
+
+int save_offset_file( const char *target_filename,
+		      long offset_x, long offset_y,
+		      const double subpixel_xy[] )
+{
+    stdstreamio sio, f_out;
+    tstring offset_file;
+    int ret_status = -1;
+
+    get_offset_filename(target_filename, &offset_file);
+    if ( f_out.open("w", offset_file.cstr()) < 0 ) {
+	sio.eprintf("[ERROR] cannot write: %s\n", offset_file.cstr());
+	goto quit;
+    }
+    if ( subpixel_xy != NULL ) {
+	f_out.printf("%ld %ld %.3f %.3f\n", offset_x, offset_y,
+		     subpixel_xy[0], subpixel_xy[1]);
+    }
+    else {
+	f_out.printf("%ld %ld\n", offset_x, offset_y);
+    }
+    f_out.close();
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
+
+int load_frame_transform( const char *target_filename,
+			  frame_transform *ret_tr )
+{
+    stdstreamio f_in;
+    tstring offset_file;
+    tarray_tstring elms;
+    frame_transform tr;
+    const char *line;
+    int i, ret_status = -1;
+
+    get_offset_filename(target_filename, &offset_file);
+    if ( f_in.open("r", offset_file.cstr()) < 0 ) goto quit;
+
+    line = f_in.getline();
+    if ( line == NULL ) goto quit;
+    elms.split(line," \n",false);
+    if ( elms.length() < 2 ) goto quit;
+    if ( 4 <= elms.length() ) {
+	set_translation_transform(elms[2].atof(), elms[3].atof(), &tr);
+    }
+    else {
+	set_translation_transform(elms[0].atol(), elms[1].atol(), &tr);
+    }
+
+    line = f_in.getline();
+    if ( line != NULL ) {
+	elms.split(line," \n",false);
+	if ( 7 <= elms.length() && elms[0] == "affine" ) {
+	    for ( i=0 ; i < 6 ; i++ ) tr.m[i] = elms[i + 1].atof();
+	}
+    }
+
+    if ( ret_tr != NULL ) *ret_tr = tr;
+
+    ret_status = 0;
+ quit:
+    f_in.close();
+    return ret_status;
+}
+
+int save_frame_transform( const char *target_filename,
+			  const frame_transform &tr,
+			  size_t width, size_t height )
+{
+    stdstreamio sio, f_out;
+    tstring offset_file;
+    double offset_xy[2];
+    int ret_status = -1;
+
+    get_transform_center_offset(tr, width, height,
+				&offset_xy[0], &offset_xy[1]);
+
+    get_offset_filename(target_filename, &offset_file);
+    if ( f_out.open("w", offset_file.cstr()) < 0 ) {
+	sio.eprintf("[ERROR] cannot write: %s\n", offset_file.cstr());
+	goto quit;
+    }
+    f_out.printf("%ld %ld %.3f %.3f\n",
+		 lround(offset_xy[0]), lround(offset_xy[1]),
+		 offset_xy[0], offset_xy[1]);
+    f_out.printf("affine %.8f %.8f %.4f %.8f %.8f %.4f\n",
+		 tr.m[0], tr.m[1], tr.m[2], tr.m[3], tr.m[4], tr.m[5]);
+    f_out.close();
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
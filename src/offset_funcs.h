@@ -0,0 +1,44 @@
+#ifndef _OFFSET_FUNCS_H
+#define _OFFSET_FUNCS_H 1
+
+#include <sli/tstring.h>
+
+#include "transform_funcs.h"
+
+/*
+ * Offset files of frames for stacking ("<base>.offset.txt").
+ *
+ * The 1st and 2nd values are integer offsets (x, y) of a frame against
+ * the reference.  Registration tools may append sub-pixel offsets as the
+ * 3rd and 4th values, which are ignored by readers of integer offsets:
+ *   "12 -3 12.274 -2.861"
+ * A transform with rotation is written in the 2nd line (see
+ * transform_funcs.h), and offsets in the 1st line are those of the
+ * center of the frame:
+ *   "affine 0.99863 -0.05234 31.82 0.05234 0.99863 -24.17"
+ */
+
+int get_offset_filename( const char *target_filename,
+			 sli::tstring *ret_filename );
+
+/* ret_subpixel_x/y can be NULL; they are set to integer offsets when */
+/* sub-pixel offsets are not found                                   */
+int load_offset_file( const char *target_filename,
+		      long *ret_offset_x, long *ret_offset_y,
+		      double *ret_subpixel_x, double *ret_subpixel_y );
+
+/* subpixel_xy can be NULL (only integer offsets are written) */
+int save_offset_file( const char *target_filename,
+		      long offset_x, long offset_y,
+		      const double subpixel_xy[] );
+
+/* translation (sub-pixel offsets) when no transform is written */
+int load_frame_transform( const char *target_filename,
+			  frame_transform *ret_tr );
+
+/* width, height: size of the frame */
+int save_frame_transform( const char *target_filename,
+			  const frame_transform &tr,
+			  size_t width, size_t height );
+
+#endif	/* _OFFSET_FUNCS_H */
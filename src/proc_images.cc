@@ -6,6 +6,7 @@
 
 #include "tiff_funcs.h"
 #include "image_funcs.h"
+#include "frame_stats.h"
 
 using namespace sli;
 
@@ -55,7 +56,7 @@ int main( int argc, char *argv[] )
 	sio.eprintf("Process target frames\n");
 	sio.eprintf("\n");
         sio.eprintf("[USAGE]\n");
-	sio.eprintf("$ %s [-8] [-16] [-t] [-s scale] [-b param] [-d param] [-f param] [-fi param] img_0.tiff img_1.tiff ...\n", argv[0]);
+	sio.eprintf("$ %s [-8] [-16] [-t] [-s scale] [-b param] [-d param] [-f param] [-fi param] [-z method] [-T size] img_0.tiff img_1.tiff ...\n", argv[0]);
 	sio.eprintf("\n");
 	sio.eprintf("-8 ... If set, output 8-bit processed images for 8-bit original images\n");
 	sio.eprintf("-16 .. If set, output 16-bit processed images.\n");
@@ -67,6 +68,8 @@ int main( int argc, char *argv[] )
 	sio.eprintf("-d param ... Set dark factor to param. Default is 1.0.\n");
 	sio.eprintf("-f param ... Set flat factor to param. Default is 1.0.\n");
 	sio.eprintf("-fi param ... Set flat index factor (flat ^ x) to param. Default is 1.0.\n");
+	sio.eprintf("-z method ... Compression of output: none, deflate or zstd. Default is none.\n");
+	sio.eprintf("-T size ... Write tiles of size x size (multiple of 16). Default is 0 (strips).\n");
 	sio.eprintf("NOTE: %s is used when it exists\n",filename_dark);
 	sio.eprintf("NOTE: %s or %s is used when it exists\n",
 		    filename_flat[0],filename_flat[1]);
@@ -133,6 +136,27 @@ int main( int argc, char *argv[] )
 	    sio.printf("Using flat index (flat^idx) factor: %g\n", flat_idx_factor);
 	    arg_cnt ++;
 	}
+	else if ( argstr == "-z" && arg_cnt + 1 < argc ) {
+	    int method;
+	    arg_cnt ++;
+	    if ( parse_tiff_compression(argv[arg_cnt], &method) < 0 ||
+		 set_tiff_compression(method) < 0 ) {
+		sio.eprintf("[ERROR] Unsupported compression: %s\n", argv[arg_cnt]);
+		goto quit;
+	    }
+	    arg_cnt ++;
+	}
+	else if ( argstr == "-T" && arg_cnt + 1 < argc ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    if ( argstr.length() == 0 ||
+		 argstr.strspn("0123456789") != argstr.length() ||
+		 set_tiff_tiling(argstr.atoi()) < 0 ) {
+		sio.eprintf("[ERROR] Invalid tile size: %s\n", argv[arg_cnt]);
+		goto quit;
+	    }
+	    arg_cnt ++;
+	}
 	else if ( argstr == "-s" ) {
 	    arg_cnt ++;
 	    filename_sky = argv[arg_cnt];
@@ -173,6 +197,7 @@ int main( int argc, char *argv[] )
     else {
 	int sztype;
 	mdarray_double dark_rgb(false);
+	frame_stats stats;
 	f_in.close();
 	dark_rgb.resize_1d(3);
 	sio.printf("Loading '%s'\n", filename_dark);
@@ -186,10 +211,19 @@ int main( int argc, char *argv[] )
 	else if ( sztype == 2 ) sio.printf("Found a 16-bit dark image\n");
 	else sio.printf("Found a float(32-bit) dark image\n");
 	//img_dark_buf.dprint();
-	img_dark_buf *= dark_factor;
-	dark_rgb[0] = md_median(img_dark_buf.sectionf("*,*,0"));
-	dark_rgb[1] = md_median(img_dark_buf.sectionf("*,*,1"));
-	dark_rgb[2] = md_median(img_dark_buf.sectionf("*,*,2"));
+	/* median of dark (cached in sidecar) */
+	if ( get_frame_stats(filename_dark, &img_dark_buf, &stats) == 0 ) {
+	    dark_rgb[0] = stats.median[0] * dark_factor;
+	    dark_rgb[1] = stats.median[1] * dark_factor;
+	    dark_rgb[2] = stats.median[2] * dark_factor;
+	    img_dark_buf *= dark_factor;
+	}
+	else {
+	    img_dark_buf *= dark_factor;
+	    dark_rgb[0] = md_median(img_dark_buf.sectionf("*,*,0"));
+	    dark_rgb[1] = md_median(img_dark_buf.sectionf("*,*,1"));
+	    dark_rgb[2] = md_median(img_dark_buf.sectionf("*,*,2"));
+	}
 	sio.printf("median dark value of r, g, b = %g, %g, %g\n",
 		   dark_rgb[0],dark_rgb[1],dark_rgb[2]);
 	softdark = md_median(dark_rgb);
@@ -246,6 +280,7 @@ int main( int argc, char *argv[] )
 	else {
 	    int sztype;
 	    mdarray_double sky_rgb(false);
+	    frame_stats stats;
 	    f_in.close();
 	    sky_rgb.resize_1d(3);
 	    sio.printf("Loading '%s'\n", filename_sky.cstr());
@@ -258,10 +293,18 @@ int main( int argc, char *argv[] )
 	    if ( sztype == 1 ) sio.printf("Found an 8-bit sky image\n");
 	    else if ( sztype == 2 ) sio.printf("Found a 16-bit sky image\n");
 	    else sio.printf("Found a float(32-bit) sky image\n");
-	    //
-	    sky_rgb[0] = md_median(img_sky_buf.sectionf("*,*,0"));
-	    sky_rgb[1] = md_median(img_sky_buf.sectionf("*,*,1"));
-	    sky_rgb[2] = md_median(img_sky_buf.sectionf("*,*,2"));
+	    /* median of sky (cached in sidecar) */
+	    if ( get_frame_stats(filename_sky.cstr(), &img_sky_buf,
+				 &stats) == 0 ) {
+		sky_rgb[0] = stats.median[0];
+		sky_rgb[1] = stats.median[1];
+		sky_rgb[2] = stats.median[2];
+	    }
+	    else {
+		sky_rgb[0] = md_median(img_sky_buf.sectionf("*,*,0"));
+		sky_rgb[1] = md_median(img_sky_buf.sectionf("*,*,1"));
+		sky_rgb[2] = md_median(img_sky_buf.sectionf("*,*,2"));
+	    }
 	    sio.printf("median sky value of r, g, b = %g, %g, %g\n",
 		       sky_rgb[0],sky_rgb[1],sky_rgb[2]);
 	    softsky = md_median(sky_rgb);
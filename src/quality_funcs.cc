@@ -0,0 +1,273 @@
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <sli/stdstreamio.h>
+
+#include "quality_funcs.h"
+#include "stack_funcs.h"
+#include "star_funcs.h"
+#include "sys_funcs.h"
+
+using namespace sli;
+
+/* stars used for HFR, and threshold of detection (sigma) */
+static const size_t Max_quality_stars = 100;
+static const double Quality_star_threshold_sigma = 5.0;
+/* radius of aperture for HFR */
+static const long Hfr_radius = 8;
+/* HFR is used for score when all frames have this number of stars */
+static const long Min_quality_stars = 5;
+/* lower limit of noise (quantized 8/16-bit images) */
+static const double Min_quality_noise = 1.0;
+
+/* median of v[0..n-1] (order of v is changed) */
+static double get_median( float *v, size_t n )
+{
+    const size_t h = n / 2;
+    std::nth_element(v, v + h, v + n);
+    return v[h];
+}
+
+/* half flux radius of a star at (cx,cy) above background bg */
+static double get_half_flux_radius( const float *p, size_t width,
+				    size_t height, double cx, double cy,
+				    double bg )
+{
+    const long ix = lround(cx), iy = lround(cy);
+    double sum_f = 0.0, sum_fr = 0.0;
+    long x, y;
+
+    if ( ix < Hfr_radius || (long)width <= ix + Hfr_radius ) return -1.0;
+    if ( iy < Hfr_radius || (long)height <= iy + Hfr_radius ) return -1.0;
+
+    for ( y=iy - Hfr_radius ; y <= iy + Hfr_radius ; y++ ) {
+	for ( x=ix - Hfr_radius ; x <= ix + Hfr_radius ; x++ ) {
+	    const double r = sqrt((x - cx) * (x - cx) + (y - cy) * (y - cy));
+	    const double f = p[width * y + x] - bg;
+	    if ( Hfr_radius < r || f <= 0.0 ) continue;
+	    sum_f += f;
+	    sum_fr += f * r;
+	}
+    }
+
+    if ( sum_f <= 0.0 ) return -1.0;
+    return sum_fr / sum_f;
+}
+
+int measure_frame_quality( const mdarray_float &img_buf,
+			   frame_quality *ret_quality )
+{
+    const size_t width = img_buf.x_length();
+    const size_t height = img_buf.y_length();
+    const float *p;
+    mdarray_float work_buf(false);
+    frame_quality q;
+    star_list stars;
+    double sum, sum2;
+    size_t len, n, i, x, y;
+
+    if ( ret_quality == NULL ) return -1;
+    if ( img_buf.z_length() != 3 ) return -1;
+    if ( width < 3 || height < 3 ) return -1;
+
+    len = width * height;
+    p = img_buf.array_ptr_cs(0, 0, 1);	/* green */
+
+    /* background and noise */
+    work_buf.resize_1d(len);
+    for ( i=0 ; i < len ; i++ ) work_buf[i] = p[i];
+    q.background = get_median(work_buf.array_ptr(), len);
+    for ( i=0 ; i < len ; i++ ) work_buf[i] = fabs(p[i] - q.background);
+    q.noise = 1.4826 * get_median(work_buf.array_ptr(), len);
+    if ( q.noise < Min_quality_noise ) q.noise = Min_quality_noise;
+
+    /* variance of Laplacian (4-neighbors) */
+    sum = 0.0;
+    sum2 = 0.0;
+    for ( y=1 ; y + 1 < height ; y++ ) {
+	const float *pp = p + width * y;
+	for ( x=1 ; x + 1 < width ; x++ ) {
+	    const double v = 4.0 * pp[x] - pp[x - 1] - pp[x + 1]
+			     - pp[x - width] - pp[x + width];
+	    sum += v;
+	    sum2 += v * v;
+	}
+    }
+    n = (width - 2) * (height - 2);
+    /* (normalized by noise^2 in rank_frame_quality()) */
+    q.sharpness = sum2 / n - (sum / n) * (sum / n);
+
+    /* stars and HFR */
+    q.n_stars = 0;
+    q.hfr = 0.0;
+    if ( detect_stars(NULL, img_buf, Quality_star_threshold_sigma,
+		      Max_quality_stars, &stars) == 0 ) {
+	q.n_stars = stars.length();
+	n = 0;
+	for ( i=0 ; i < stars.length() ; i++ ) {
+	    const double r = get_half_flux_radius(p, width, height,
+					stars.x[i], stars.y[i], q.background);
+	    if ( 0.0 < r ) {
+		work_buf[n] = r;
+		n ++;
+	    }
+	}
+	if ( 0 < n ) q.hfr = get_median(work_buf.array_ptr(), n);
+    }
+
+    q.score = 0.0;
+    q.weight = 1;
+
+    *ret_quality = q;
+
+    return 0;
+}
+
+/* for std::sort() of indices (larger score first) */
+class quality_score_greater {
+  public:
+    quality_score_greater( const frame_quality *q ) : q(q) { }
+    bool operator()( long a, long b ) const {
+	if ( this->q[a].score != this->q[b].score ) {
+	    return this->q[b].score < this->q[a].score;
+	}
+	return a < b;
+    }
+  private:
+    const frame_quality *q;
+};
+
+int rank_frame_quality( frame_quality quality[], size_t n,
+			double best_percent, int max_weight )
+{
+    mdarray_long idx(false);
+    bool use_hfr = true;
+    double max_score;
+    size_t n_selected, i;
+
+    if ( quality == NULL || n == 0 ) return -1;
+    if ( best_percent <= 0.0 || 100.0 < best_percent ) return -1;
+    if ( max_weight < 1 || STACK_MAX_WEIGHT < max_weight ) return -1;
+
+    for ( i=0 ; i < n ; i++ ) {
+	if ( quality[i].n_stars < Min_quality_stars ||
+	     quality[i].hfr <= 0.0 ) use_hfr = false;
+    }
+
+    for ( i=0 ; i < n ; i++ ) {
+	frame_quality *q = &quality[i];
+	if ( use_hfr == true ) {
+	    q->score = 1.0 / (q->hfr * q->hfr * q->noise * q->noise);
+	}
+	else {
+	    q->score = q->sharpness / (q->noise * q->noise);
+	}
+    }
+
+    idx.resize_1d(n);
+    for ( i=0 ; i < n ; i++ ) idx[i] = i;
+    std::sort(idx.array_ptr(), idx.array_ptr() + n,
+	      quality_score_greater(quality));
+
+    n_selected = (size_t)ceil(n * best_percent / 100.0);
+    if ( n_selected < 1 ) n_selected = 1;
+    if ( n < n_selected ) n_selected = n;
+
+    max_score = quality[idx[0]].score;
+    for ( i=0 ; i < n ; i++ ) {
+	frame_quality *q = &quality[idx[i]];
+	if ( n_selected <= i ) {
+	    q->weight = 0;
+	}
+	else if ( 0.0 < max_score ) {
+	    q->weight = lround(max_weight * q->score / max_score);
+	    if ( q->weight < 1 ) q->weight = 1;
+	}
+	else {
+	    q->weight = 1;
+	}
+    }
+
+    return 0;
+}
+
+/* absolute path (filename as is when current directory is unknown) */
+static void get_frame_path( const char *filename, tstring *ret_path )
+{
+    if ( get_absolute_path(filename, ret_path) < 0 ) *ret_path = filename;
+    return;
+}
+
+int save_quality_table( const char *filename,
+			const tarray_tstring &frame_names,
+			const frame_quality quality[] )
+{
+    stdstreamio f_out;
+    tstring path;
+    size_t i;
+    int ret_status = -1;
+
+    if ( filename == NULL || quality == NULL ) goto quit;
+
+    if ( f_out.open("w", filename) < 0 ) goto quit;
+
+    f_out.printf("# filename sharpness hfr n_stars background noise "
+		 "score weight\n");
+    for ( i=0 ; i < frame_names.length() ; i++ ) {
+	const frame_quality *q = &quality[i];
+	get_frame_path(frame_names[i].cstr(), &path);
+	f_out.printf("%s %.6g %.4f %ld %.6g %.6g %.6g %d\n",
+		     path.cstr(), q->sharpness, q->hfr,
+		     q->n_stars, q->background, q->noise, q->score,
+		     q->weight);
+    }
+    f_out.close();
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
+
+int load_quality_table( const char *filename,
+			const tarray_tstring &frame_names,
+			mdarray_int *ret_weights )
+{
+    stdstreamio f_in;
+    tarray_tstring elms;
+    tarray_tstring frame_paths;
+    tstring path;
+    const char *line;
+    size_t i;
+    int ret_status = -1;
+
+    if ( filename == NULL || ret_weights == NULL ) goto quit;
+
+    if ( f_in.open("r", filename) < 0 ) goto quit;
+
+    ret_weights->resize_1d(frame_names.length());
+    for ( i=0 ; i < frame_names.length() ; i++ ) {
+	(*ret_weights)[i] = -1;
+	get_frame_path(frame_names[i].cstr(), &frame_paths[i]);
+    }
+
+    while ( (line=f_in.getline()) != NULL ) {
+	if ( line[0] == '#' ) continue;
+	elms.split(line, " \n", false);
+	if ( elms.length() != 8 ) continue;
+	/* (relative paths of old tables are for current directory) */
+	get_frame_path(elms[0].cstr(), &path);
+	for ( i=0 ; i < frame_names.length() ; i++ ) {
+	    if ( frame_paths[i] == path.cstr() ) {
+		const int w = elms[7].atoi();
+		if ( STACK_MAX_WEIGHT < w ) goto quit;	/* see stack_funcs.h */
+		(*ret_weights)[i] = (w < 0) ? 0 : w;
+		break;
+	    }
+	}
+    }
+    f_in.close();
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
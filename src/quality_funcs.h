@@ -0,0 +1,58 @@
+#ifndef _QUALITY_FUNCS_H
+#define _QUALITY_FUNCS_H 1
+
+#include <unistd.h>
+#include <sli/tstring.h>
+#include <sli/tarray_tstring.h>
+#include <sli/mdarray.h>
+
+/*
+ * Quality of a frame measured on the green channel.  Values are for
+ * frames loaded with scale = 65536.0 (0..65535 for 8/16-bit).
+ */
+typedef struct _frame_quality {
+    double sharpness;		/* variance of Laplacian */
+    double hfr;			/* median half flux radius of stars (0: none) */
+    long n_stars;
+    double background;		/* median */
+    double noise;		/* 1.4826 * MAD */
+    double score;		/* set by rank_frame_quality() (larger: better) */
+    int weight;			/* weight in stacking (0: not selected) */
+} frame_quality;
+
+/*
+ * Measure quality of a frame (or of a band of rows of it).  Stars are
+ * detected without threads, so that frames are processed in parallel.
+ */
+int measure_frame_quality( const sli::mdarray_float &img_buf,
+			   frame_quality *ret_quality );
+
+/*
+ * Set score and weight of n frames.  The score is 1 / (hfr^2 * noise^2)
+ * when all frames have enough stars, otherwise sharpness / noise^2.
+ * Best best_percent % of frames are selected, and integer weights
+ * 1..max_weight proportional to the score are given to them
+ * (max_weight <= STACK_MAX_WEIGHT, see stack_funcs.h).
+ */
+int rank_frame_quality( frame_quality quality[], size_t n,
+			double best_percent, int max_weight );
+
+/*
+ * Quality table ("filename sharpness hfr n_stars background noise score
+ * weight" in each line; lines beginning with '#' are comments).  Absolute
+ * paths of frames are written, and rows are matched with frames by their
+ * absolute paths.
+ */
+int save_quality_table( const char *filename,
+			const sli::tarray_tstring &frame_names,
+			const frame_quality quality[] );
+
+/*
+ * Frames not found in the table have weight of -1.  Tables with a weight
+ * larger than STACK_MAX_WEIGHT (stack_funcs.h) are rejected.
+ */
+int load_quality_table( const char *filename,
+			const sli::tarray_tstring &frame_names,
+			sli::mdarray_int *ret_weights );
+
+#endif	/* _QUALITY_FUNCS_H */
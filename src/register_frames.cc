@@ -0,0 +1,343 @@
+#include <sli/stdstreamio.h>
+#include <sli/tstring.h>
+#include <sli/tarray_tstring.h>
+#include <sli/mdarray.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "tiff_funcs.h"
+#include "thread_funcs.h"
+#include "star_funcs.h"
+#include "register_funcs.h"
+#include "offset_funcs.h"
+#include "sys_funcs.h"
+
+using namespace sli;
+
+/*
+ * Headless registration of frames for stack_images
+ *
+ * Offsets against the reference are determined by FFT phase correlation
+ * and written to .offset.txt files with sub-pixel offsets:
+ *   $ register_frames -r ref.tiff -j 8 *.tiff
+ *
+ * With -m stars, stars are detected and matched by triangles, and a
+ * transform with rotation (e.g. alt-az mounts, meridian flips) is
+ * written in addition to offsets of the center of a frame:
+ *   $ register_frames -m stars -r ref.tiff -j 8 *.tiff
+ */
+
+/* methods of registration */
+#define REGISTER_FFT 0		/* phase correlation (translation) */
+#define REGISTER_STARS 1	/* triangles of stars (with rotation) */
+
+static const size_t Default_crop_size = 1024;
+/* results with lower peak of phase correlation are not written */
+static const double Min_correlation_peak = 0.02;
+/* stars used for matching, and threshold of detection (sigma) */
+static const size_t Max_registered_stars = 200;
+static const double Star_threshold_sigma = 5.0;
+/* results with less matched stars are not written */
+static const size_t Min_matched_stars = 6;
+
+typedef struct _register_args {
+    const tarray_tstring *filenames;
+    int method;
+    const phase_correlator *correlator;	/* REGISTER_FFT */
+    const star_matcher *matcher;		/* REGISTER_STARS */
+    bool affine;
+    bool overwrite;
+    bool verbose;
+    long crop_y;			/* rows used for correlation */
+    pthread_mutex_t *mutex;		/* for messages */
+    size_t n_registered;
+    size_t n_failed;
+} register_args;
+
+/* load only rows used by phase_correlator */
+static int load_crop_rows( const char *filename, long crop_y, size_t size,
+			   mdarray_float *ret_img,
+			   size_t *ret_width, size_t *ret_height )
+{
+    mdarray_uchar icc_buf(false);
+    float camera_calibration1[12];
+    int sztype;
+    return load_tiff_rows_into_float(filename, 65536.0, crop_y, size,
+				     ret_img, &sztype, &icc_buf,
+				     camera_calibration1,
+				     ret_width, ret_height);
+}
+
+/* returns 0 (registered), 1 (low correlation) or -1 (error) */
+static int register_frame_fft( const register_args *a,
+			       const char *filename, mdarray_float *img_buf,
+			       tstring *ret_msg )
+{
+    double subpixel[2], peak;
+
+    if ( load_crop_rows(filename, a->crop_y, a->correlator->crop_size(),
+			img_buf, NULL, NULL) < 0 ) {
+	ret_msg->printf("[ERROR] cannot load '%s'\n", filename);
+	return -1;
+    }
+    if ( a->correlator->get_offset(*img_buf, &subpixel[0], &subpixel[1],
+				   &peak) < 0 ) {
+	ret_msg->printf("[ERROR] size of '%s' differs from reference\n",
+			filename);
+	return -1;
+    }
+    if ( peak < Min_correlation_peak ) {
+	ret_msg->printf("[WARNING] low correlation (%.3f) for '%s': skipped\n",
+			peak, filename);
+	return 1;
+    }
+    if ( save_offset_file(filename, lround(subpixel[0]), lround(subpixel[1]),
+			  subpixel) < 0 ) return -1;
+
+    ret_msg->printf("%s: %.3f %.3f (peak=%.3f)\n",
+		    filename, subpixel[0], subpixel[1], peak);
+    return 0;
+}
+
+static int register_frame_stars( const register_args *a,
+				 const char *filename, mdarray_float *img_buf,
+				 tstring *ret_msg )
+{
+    star_list stars;
+    frame_transform tr;
+    double offset_x, offset_y, rms = 0.0;
+    size_t n_matched = 0;
+
+    if ( load_tiff_into_float(filename, 65536.0, img_buf,
+			      NULL, NULL, NULL) < 0 ) {
+	ret_msg->printf("[ERROR] cannot load '%s'\n", filename);
+	return -1;
+    }
+    /* frames are processed in parallel: no threads for a frame */
+    if ( detect_stars(NULL, *img_buf, Star_threshold_sigma,
+		      Max_registered_stars, &stars) < 0 ) {
+	ret_msg->printf("[ERROR] detect_stars() failed for '%s'\n", filename);
+	return -1;
+    }
+    if ( a->matcher->match(stars, a->affine, &tr, &n_matched, &rms) < 0 ||
+	 n_matched < Min_matched_stars ) {
+	ret_msg->printf("[WARNING] stars are not matched (%zd of %zd) "
+			"for '%s': skipped\n",
+			n_matched, stars.length(), filename);
+	return 1;
+    }
+    if ( save_frame_transform(filename, tr, img_buf->x_length(),
+			      img_buf->y_length()) < 0 ) return -1;
+
+    get_transform_center_offset(tr, img_buf->x_length(), img_buf->y_length(),
+				&offset_x, &offset_y);
+    ret_msg->printf("%s: %.3f %.3f rotation=%.4f deg (%zd stars, rms=%.3f)\n",
+		    filename, offset_x, offset_y,
+		    atan2(tr.m[3], tr.m[0]) * 180.0 / M_PI, n_matched, rms);
+    return 0;
+}
+
+static void register_band( size_t i_begin, size_t i_end, void *user_ptr )
+{
+    register_args *a = (register_args *)user_ptr;
+    stdstreamio sio;
+    mdarray_float img_buf(false);
+    size_t i;
+
+    for ( i=i_begin ; i < i_end ; i++ ) {
+	const char *filename = (*(a->filenames))[i].cstr();
+	tstring msg;
+	int status;
+
+	if ( a->overwrite == false &&
+	     load_offset_file(filename, NULL, NULL, NULL, NULL) == 0 ) {
+	    continue;
+	}
+
+	if ( a->method == REGISTER_STARS ) {
+	    status = register_frame_stars(a, filename, &img_buf, &msg);
+	}
+	else {
+	    status = register_frame_fft(a, filename, &img_buf, &msg);
+	}
+
+	pthread_mutex_lock(a->mutex);
+	if ( status == 0 ) {
+	    if ( a->verbose == true ) sio.printf("%s", msg.cstr());
+	    a->n_registered ++;
+	}
+	else {
+	    if ( 0 < msg.length() ) sio.eprintf("%s", msg.cstr());
+	    a->n_failed ++;
+	}
+	pthread_mutex_unlock(a->mutex);
+    }
+
+    return;
+}
+
+int main( int argc, char *argv[] )
+{
+    stdstreamio sio;
+
+    tarray_tstring filenames;
+    phase_correlator correlator;
+    star_matcher matcher;
+    star_list ref_stars;
+    thread_pool tpool;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    register_args args;
+    mdarray_float img_buf(false);
+    const char *filename_ref = NULL;
+    size_t max_crop_size = Default_crop_size;
+    size_t n_threads = get_number_of_cpus();
+    size_t width = 0, height = 0, crop_size;
+    long crop_y;
+    int method = REGISTER_FFT;
+    bool flag_affine = false;
+    bool flag_overwrite = false;
+    bool flag_verbose = false;
+    int arg_cnt, n_files;
+
+    int return_status = -1;
+
+    for ( arg_cnt=1 ; arg_cnt < argc ; arg_cnt++ ) {
+	tstring argstr;
+	argstr = argv[arg_cnt];
+	if ( argstr == "-r" && arg_cnt + 1 < argc ) {
+	    arg_cnt ++;
+	    filename_ref = argv[arg_cnt];
+	}
+	else if ( argstr == "-j" && arg_cnt + 1 < argc ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    if ( 0 < argstr.atoi() ) n_threads = argstr.atoi();
+	}
+	else if ( argstr == "-s" && arg_cnt + 1 < argc ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    if ( 0 < argstr.atol() ) max_crop_size = argstr.atol();
+	}
+	else if ( argstr == "-m" && arg_cnt + 1 < argc ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    if ( argstr == "fft" ) method = REGISTER_FFT;
+	    else if ( argstr == "stars" ) method = REGISTER_STARS;
+	    else {
+		sio.eprintf("[ERROR] unknown method: '%s'\n", argstr.cstr());
+		goto quit;
+	    }
+	}
+	else if ( argstr == "-a" ) {
+	    flag_affine = true;
+	}
+	else if ( argstr == "-f" ) {
+	    flag_overwrite = true;
+	}
+	else if ( argstr == "-v" ) {
+	    flag_verbose = true;
+	}
+	else break;
+    }
+
+    if ( argc <= arg_cnt || filename_ref == NULL ) {
+	sio.eprintf("Determine offsets of frames by FFT phase correlation\n");
+	sio.eprintf("or by matching stars\n");
+	sio.eprintf("\n");
+        sio.eprintf("[USAGE]\n");
+	sio.eprintf("$ %s -r ref.tiff [-m method] [-a] [-j threads] [-s size] [-f] [-v] frame_1.tiff ...\n",
+		    argv[0]);
+	sio.eprintf("-r file ... reference frame\n");
+	sio.eprintf("-m fft ... phase correlation (translation; default)\n");
+	sio.eprintf("-m stars ... triangles of stars (with rotation)\n");
+	sio.eprintf("-a ... affine transform instead of similarity (-m stars)\n");
+	sio.eprintf("-j n ... number of threads\n");
+	sio.eprintf("-s n ... max size of area used for correlation (default: %zd)\n",
+		    Default_crop_size);
+	sio.eprintf("-f ... overwrite existing .offset.txt files\n");
+	sio.eprintf("-v ... print offsets\n");
+	goto quit;
+    }
+
+    n_files = 0;
+    for ( ; arg_cnt < argc ; arg_cnt++ ) {
+	tstring argstr;
+	argstr = argv[arg_cnt];
+	if ( argstr == filename_ref ) continue;
+	filenames[n_files] = argstr;
+	n_files ++;
+    }
+
+    if ( tpool.start(n_threads) < 0 ) {
+	sio.eprintf("[ERROR] cannot start threads\n");
+	goto quit;
+    }
+
+    if ( method == REGISTER_STARS ) {
+	if ( load_tiff_into_float(filename_ref, 65536.0, &img_buf,
+				  NULL, NULL, NULL) < 0 ) {
+	    sio.eprintf("[ERROR] cannot load '%s'\n", filename_ref);
+	    goto quit;
+	}
+	if ( detect_stars(&tpool, img_buf, Star_threshold_sigma,
+			  Max_registered_stars, &ref_stars) < 0 ||
+	     matcher.init(ref_stars) < 0 ) {
+	    sio.eprintf("[ERROR] too few stars in '%s'\n", filename_ref);
+	    goto quit;
+	}
+	sio.printf("Reference: %s (%zd stars)\n",
+		   filename_ref, ref_stars.length());
+	crop_y = 0;
+    }
+    else {
+	/* size of reference */
+	if ( load_tiff_rows_into_float(filename_ref, 65536.0, 0, 0, &img_buf,
+				       NULL, NULL, NULL, &width, &height) < 0 ) {
+	    sio.eprintf("[ERROR] cannot load '%s'\n", filename_ref);
+	    goto quit;
+	}
+	crop_size = phase_correlator::get_crop_size(width, height,
+						    max_crop_size);
+	if ( crop_size < 2 ) {
+	    sio.eprintf("[ERROR] too small image: '%s'\n", filename_ref);
+	    goto quit;
+	}
+	crop_y = (height - crop_size) / 2;
+
+	if ( load_crop_rows(filename_ref, crop_y, crop_size,
+			    &img_buf, NULL, NULL) < 0 ||
+	     correlator.init(img_buf, crop_size) < 0 ) {
+	    sio.eprintf("[ERROR] cannot load '%s'\n", filename_ref);
+	    goto quit;
+	}
+	sio.printf("Reference: %s (area: %zdx%zd)\n",
+		   filename_ref, crop_size, crop_size);
+    }
+    img_buf.init(false);
+
+    if ( save_offset_file(filename_ref, 0, 0, NULL) < 0 ) goto quit;
+
+    args.filenames = &filenames;
+    args.method = method;
+    args.correlator = &correlator;
+    args.matcher = &matcher;
+    args.affine = flag_affine;
+    args.overwrite = flag_overwrite;
+    args.verbose = flag_verbose;
+    args.crop_y = crop_y;
+    args.mutex = &mutex;
+    args.n_registered = 0;
+    args.n_failed = 0;
+
+    /* a band is a range of frames */
+    tpool.run_row_bands(filenames.length(), &register_band, (void *)&args);
+    tpool.stop();
+
+    sio.printf("Registered %zd frames (%zd failed, %zd skipped)\n",
+	       args.n_registered, args.n_failed,
+	       filenames.length() - args.n_registered - args.n_failed);
+
+    if ( args.n_failed == 0 ) return_status = 0;
+ quit:
+    return return_status;
+}
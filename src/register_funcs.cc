@@ -0,0 +1,529 @@
+#include <math.h>
+#include <algorithm>
+
+#include "register_funcs.h"
+
+using namespace sli;
+
+/* against division by 0 in normalized cross-power spectrum */
+static const double Min_cross_power = 1.0e-20;
+
+/* brightest stars used for triangles (C(n,3) triangles) */
+static const size_t Max_triangle_stars = 20;
+/* shorter triangles are sensitive to errors of centroids */
+static const double Min_triangle_side = 10.0;
+/* difference of sides to distinguish vertices (pixels) */
+static const double Min_side_difference = 1.0;
+/* tolerance of ratios of sides */
+static const double Triangle_ratio_tolerance = 0.003;
+static const int Min_votes = 2;
+/* residual of outliers in initial fit, and radius of pairing (pixels) */
+static const double Max_pair_residual = 3.0;
+static const double Pair_radius = 2.0;
+
+/* in-place radix-2 FFT of n (power of 2) complex values; inverse: sign=+1 */
+static void fft_1d( double *re, double *im, size_t n, size_t step, int sign )
+{
+    size_t i, j, len;
+
+    /* bit reversal */
+    for ( i=1, j=0 ; i < n ; i++ ) {
+	size_t bit = n >> 1;
+	for ( ; (j & bit) != 0 ; bit >>= 1 ) j ^= bit;
+	j ^= bit;
+	if ( i < j ) {
+	    double t;
+	    t = re[step * i]; re[step * i] = re[step * j]; re[step * j] = t;
+	    t = im[step * i]; im[step * i] = im[step * j]; im[step * j] = t;
+	}
+    }
+
+    /* butterflies */
+    for ( len=2 ; len <= n ; len <<= 1 ) {
+	const double ang = sign * 2.0 * M_PI / (double)len;
+	const double w_re = cos(ang);
+	const double w_im = sin(ang);
+	for ( i=0 ; i < n ; i += len ) {
+	    double c_re = 1.0, c_im = 0.0;
+	    for ( j=0 ; j < len / 2 ; j++ ) {
+		const size_t a = step * (i + j);
+		const size_t b = step * (i + j + len / 2);
+		const double u_re = re[a], u_im = im[a];
+		const double v_re = re[b] * c_re - im[b] * c_im;
+		const double v_im = re[b] * c_im + im[b] * c_re;
+		double t;
+		re[a] = u_re + v_re;  im[a] = u_im + v_im;
+		re[b] = u_re - v_re;  im[b] = u_im - v_im;
+		t = c_re * w_re - c_im * w_im;
+		c_im = c_re * w_im + c_im * w_re;
+		c_re = t;
+	    }
+	}
+    }
+
+    return;
+}
+
+/* n x n; inverse is not normalized */
+static void fft_2d( double *re, double *im, size_t n, int sign )
+{
+    size_t i;
+    for ( i=0 ; i < n ; i++ ) fft_1d(re + n * i, im + n * i, n, 1, sign);
+    for ( i=0 ; i < n ; i++ ) fft_1d(re + i, im + i, n, n, sign);
+    return;
+}
+
+/* sub-pixel position of peak by parabola fitting */
+static double get_parabola_peak( double v_m, double v_0, double v_p )
+{
+    const double d = v_m - 2.0 * v_0 + v_p;
+    if ( d >= 0.0 ) return 0.0;
+    return 0.5 * (v_m - v_p) / d;
+}
+
+phase_correlator::phase_correlator()
+  : size(0), window(false), ref_re(false), ref_im(false)
+{
+}
+
+void phase_correlator::release()
+{
+    this->size = 0;
+    this->window.init(false);
+    this->ref_re.init(false);
+    this->ref_im.init(false);
+    return;
+}
+
+size_t phase_correlator::get_crop_size( size_t width, size_t height,
+					size_t max_size )
+{
+    size_t n_max = width, n = 1;
+    if ( height < n_max ) n_max = height;
+    if ( max_size < n_max ) n_max = max_size;
+    if ( n_max < 2 ) return 0;
+    while ( n * 2 <= n_max ) n *= 2;
+    return n;
+}
+
+int phase_correlator::init( const mdarray_float &ref_img, size_t size )
+{
+    size_t i;
+
+    this->release();
+
+    if ( size < 2 || (size & (size - 1)) != 0 ) return -1;
+    if ( ref_img.x_length() < size || ref_img.y_length() < size ) return -1;
+
+    this->size = size;
+    this->window.resize_1d(size);
+    for ( i=0 ; i < size ; i++ ) {
+	this->window[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / (double)size);
+    }
+
+    if ( this->get_spectrum(ref_img, &(this->ref_re), &(this->ref_im)) < 0 ) {
+	this->release();
+	return -1;
+    }
+
+    return 0;
+}
+
+/* windowed spectrum of green channel at the center */
+int phase_correlator::get_spectrum( const mdarray_float &img,
+				    mdarray_double *ret_re,
+				    mdarray_double *ret_im ) const
+{
+    const size_t n = this->size;
+    const double *win = this->window.array_ptr_cs();
+    size_t x0, y0, x, y;
+    double sum = 0.0, mean;
+    double *re, *im;
+
+    if ( n == 0 ) return -1;
+    if ( img.x_length() < n || img.y_length() < n ) return -1;
+    if ( img.z_length() < 2 ) return -1;
+
+    x0 = (img.x_length() - n) / 2;
+    y0 = (img.y_length() - n) / 2;
+
+    ret_re->resize_2d(n, n);
+    ret_im->resize_2d(n, n);
+    re = ret_re->array_ptr();
+    im = ret_im->array_ptr();
+
+    for ( y=0 ; y < n ; y++ ) {
+	const float *src = img.array_ptr_cs(x0, y0 + y, 1);
+	for ( x=0 ; x < n ; x++ ) sum += src[x];
+    }
+    mean = sum / (double)(n * n);
+
+    for ( y=0 ; y < n ; y++ ) {
+	const float *src = img.array_ptr_cs(x0, y0 + y, 1);
+	for ( x=0 ; x < n ; x++ ) {
+	    re[n * y + x] = (src[x] - mean) * win[x] * win[y];
+	    im[n * y + x] = 0.0;
+	}
+    }
+
+    fft_2d(re, im, n, -1);
+
+    return 0;
+}
+
+int phase_correlator::get_offset( const mdarray_float &img,
+				  double *ret_offset_x, double *ret_offset_y,
+				  double *ret_peak ) const
+{
+    const size_t n = this->size;
+    mdarray_double buf_re(false), buf_im(false);
+    const double *r_re, *r_im;
+    double *re, *im;
+    size_t i, x, y, ix_peak = 0;
+    size_t xm, xp, ym, yp;
+    double v_peak;
+    long px, py;
+
+    if ( this->get_spectrum(img, &buf_re, &buf_im) < 0 ) return -1;
+
+    r_re = this->ref_re.array_ptr_cs();
+    r_im = this->ref_im.array_ptr_cs();
+    re = buf_re.array_ptr();
+    im = buf_im.array_ptr();
+
+    /* normalized cross-power spectrum: R * conj(F) / |R * conj(F)| */
+    for ( i=0 ; i < n * n ; i++ ) {
+	const double c_re = r_re[i] * re[i] + r_im[i] * im[i];
+	const double c_im = r_im[i] * re[i] - r_re[i] * im[i];
+	double a = sqrt(c_re * c_re + c_im * c_im);
+	if ( a < Min_cross_power ) {
+	    re[i] = 0.0;
+	    im[i] = 0.0;
+	}
+	else {
+	    re[i] = c_re / a;
+	    im[i] = c_im / a;
+	}
+    }
+
+    fft_2d(re, im, n, 1);
+
+    v_peak = re[0];
+    for ( i=1 ; i < n * n ; i++ ) {
+	if ( v_peak < re[i] ) {
+	    v_peak = re[i];
+	    ix_peak = i;
+	}
+    }
+    x = ix_peak % n;
+    y = ix_peak / n;
+    xm = (x + n - 1) % n;  xp = (x + 1) % n;
+    ym = (y + n - 1) % n;  yp = (y + 1) % n;
+
+    /* wrap around to signed offsets */
+    px = (long)x;
+    py = (long)y;
+    if ( (long)(n / 2) < px ) px -= (long)n;
+    if ( (long)(n / 2) < py ) py -= (long)n;
+
+    if ( ret_offset_x != NULL ) {
+	*ret_offset_x = px + get_parabola_peak(re[n * y + xm], v_peak,
+					       re[n * y + xp]);
+    }
+    if ( ret_offset_y != NULL ) {
+	*ret_offset_y = py + get_parabola_peak(re[n * ym + x], v_peak,
+					       re[n * yp + x]);
+    }
+    if ( ret_peak != NULL ) *ret_peak = v_peak / (double)(n * n);
+
+    return 0;
+}
+
+
+/*
+ * class star_matcher
+ */
+
+/* a triangle with vertices ordered by the opposite side (longest first) */
+typedef struct _star_triangle {
+    double ratio[2];			/* b/a, c/a */
+    long vertex[3];
+    long orientation;			/* sign of cross product */
+} star_triangle;
+
+static bool get_triangle( const star_list &stars, long i0, long i1, long i2,
+			  star_triangle *ret_tri )
+{
+    const long v[3] = {i0, i1, i2};
+    double side[3];			/* side[k] is opposite to v[k] */
+    long order[3] = {0, 1, 2};
+    double cross;
+    int k;
+
+    for ( k=0 ; k < 3 ; k++ ) {
+	const long p = v[(k + 1) % 3];
+	const long q = v[(k + 2) % 3];
+	const double dx = stars.x[p] - stars.x[q];
+	const double dy = stars.y[p] - stars.y[q];
+	side[k] = sqrt(dx * dx + dy * dy);
+    }
+    /* sort by length of sides */
+    for ( k=0 ; k < 2 ; k++ ) {
+	int j;
+	for ( j=0 ; j < 2 - k ; j++ ) {
+	    if ( side[order[j]] < side[order[j + 1]] ) {
+		long t = order[j];  order[j] = order[j + 1];  order[j + 1] = t;
+	    }
+	}
+    }
+    if ( side[order[2]] < Min_triangle_side ) return false;
+    if ( side[order[0]] - side[order[1]] < Min_side_difference ||
+	 side[order[1]] - side[order[2]] < Min_side_difference ) return false;
+
+    for ( k=0 ; k < 3 ; k++ ) ret_tri->vertex[k] = v[order[k]];
+    ret_tri->ratio[0] = side[order[1]] / side[order[0]];
+    ret_tri->ratio[1] = side[order[2]] / side[order[0]];
+
+    cross = (stars.x[ret_tri->vertex[1]] - stars.x[ret_tri->vertex[0]])
+	  * (stars.y[ret_tri->vertex[2]] - stars.y[ret_tri->vertex[0]])
+	  - (stars.y[ret_tri->vertex[1]] - stars.y[ret_tri->vertex[0]])
+	  * (stars.x[ret_tri->vertex[2]] - stars.x[ret_tri->vertex[0]]);
+    ret_tri->orientation = (cross < 0.0) ? -1 : 1;
+
+    return true;
+}
+
+/* for std::sort() of triangles */
+static bool compare_triangle( const star_triangle &a, const star_triangle &b )
+{
+    return a.ratio[0] < b.ratio[0];
+}
+
+star_matcher::star_matcher()
+  : tri_ratio(false), tri_vertex(false), n_triangles(0)
+{
+}
+
+void star_matcher::release()
+{
+    this->ref_stars.clear();
+    this->tri_ratio.init(false);
+    this->tri_vertex.init(false);
+    this->n_triangles = 0;
+    return;
+}
+
+int star_matcher::init( const star_list &ref_stars )
+{
+    size_t n = ref_stars.length();
+    star_triangle *tris = NULL;
+    size_t n_tris = 0;
+    long i0, i1, i2;
+    size_t i;
+
+    this->release();
+
+    if ( n < 3 ) return -1;
+    if ( Max_triangle_stars < n ) n = Max_triangle_stars;
+
+    this->ref_stars.append(ref_stars);
+
+    tris = new star_triangle[n * (n - 1) * (n - 2) / 6];
+    for ( i0=0 ; i0 < (long)n ; i0++ ) {
+	for ( i1=i0+1 ; i1 < (long)n ; i1++ ) {
+	    for ( i2=i1+1 ; i2 < (long)n ; i2++ ) {
+		if ( get_triangle(ref_stars, i0, i1, i2,
+				  &tris[n_tris]) == true ) n_tris ++;
+	    }
+	}
+    }
+    std::sort(tris, tris + n_tris, compare_triangle);
+
+    this->tri_ratio.resize_2d(2, n_tris + 1);
+    this->tri_vertex.resize_2d(4, n_tris + 1);
+    for ( i=0 ; i < n_tris ; i++ ) {
+	this->tri_ratio(0, i) = tris[i].ratio[0];
+	this->tri_ratio(1, i) = tris[i].ratio[1];
+	this->tri_vertex(0, i) = tris[i].vertex[0];
+	this->tri_vertex(1, i) = tris[i].vertex[1];
+	this->tri_vertex(2, i) = tris[i].vertex[2];
+	this->tri_vertex(3, i) = tris[i].orientation;
+    }
+    this->n_triangles = n_tris;
+
+    delete [] tris;
+
+    if ( n_tris == 0 ) {
+	this->release();
+	return -1;
+    }
+    return 0;
+}
+
+/* fit to pairs (ref_id[i], frm_id[i]); rejected pairs are removed */
+static int fit_star_pairs( const star_list &ref, const star_list &stars,
+			   long ref_id[], long frm_id[], size_t *io_n_pairs,
+			   bool affine, double max_residual,
+			   frame_transform *ret_tr )
+{
+    mdarray_double buf(false);
+    double *x, *y, *rx, *ry;
+    size_t n = *io_n_pairs;
+    size_t i;
+
+    buf.resize_1d(4 * n + 4);
+    x = buf.array_ptr();
+    y = x + n;
+    rx = y + n;
+    ry = rx + n;
+
+    /* remove the worst pair until all residuals are small */
+    while ( 1 ) {
+	double worst = 0.0;
+	size_t i_worst = 0;
+	if ( n < ((affine == true) ? 3 : 2) ) return -1;
+	for ( i=0 ; i < n ; i++ ) {
+	    x[i] = stars.x[frm_id[i]];
+	    y[i] = stars.y[frm_id[i]];
+	    rx[i] = ref.x[ref_id[i]];
+	    ry[i] = ref.y[ref_id[i]];
+	}
+	if ( fit_transform(x, y, rx, ry, n, affine, ret_tr) < 0 ) return -1;
+	for ( i=0 ; i < n ; i++ ) {
+	    double tx, ty, d;
+	    apply_transform(*ret_tr, x[i], y[i], &tx, &ty);
+	    d = (tx - rx[i]) * (tx - rx[i]) + (ty - ry[i]) * (ty - ry[i]);
+	    if ( worst < d ) {
+		worst = d;
+		i_worst = i;
+	    }
+	}
+	if ( worst <= max_residual * max_residual ) break;
+	n --;
+	ref_id[i_worst] = ref_id[n];
+	frm_id[i_worst] = frm_id[n];
+    }
+
+    *io_n_pairs = n;
+    return 0;
+}
+
+int star_matcher::match( const star_list &stars, bool affine,
+			 frame_transform *ret_tr, size_t *ret_n_matched,
+			 double *ret_rms ) const
+{
+    const star_list &ref = this->ref_stars;
+    const size_t n_ref = (ref.length() < Max_triangle_stars)
+			 ? ref.length() : Max_triangle_stars;
+    size_t n_frm = stars.length();
+    const double *ratio0 = this->tri_ratio.array_ptr_cs(0, 0);
+    mdarray_int votes(false);
+    mdarray_long pairs(false);
+    long *ref_id, *frm_id;
+    frame_transform tr;
+    size_t n_pairs, i, j;
+    long i0, i1, i2;
+    double sum2;
+
+    if ( this->n_triangles == 0 ) return -1;
+    if ( n_frm < 3 ) return -1;
+    if ( Max_triangle_stars < n_frm ) n_frm = Max_triangle_stars;
+
+    /* vote for pairs of stars (ref x frame) */
+    votes.resize_2d(n_frm, n_ref);
+    votes.clean();
+    for ( i0=0 ; i0 < (long)n_frm ; i0++ ) {
+	for ( i1=i0+1 ; i1 < (long)n_frm ; i1++ ) {
+	    for ( i2=i1+1 ; i2 < (long)n_frm ; i2++ ) {
+		star_triangle tri;
+		size_t k;
+		if ( get_triangle(stars, i0, i1, i2, &tri) == false ) continue;
+		/* binary search of b/a (stride of tri_ratio is 2) */
+		{
+		    size_t lo = 0, hi = this->n_triangles;
+		    while ( lo < hi ) {
+			size_t mid = (lo + hi) / 2;
+			if ( ratio0[2 * mid] <
+			     tri.ratio[0] - Triangle_ratio_tolerance ) lo = mid + 1;
+			else hi = mid;
+		    }
+		    k = lo;
+		}
+		for ( ; k < this->n_triangles ; k++ ) {
+		    int m;
+		    if ( tri.ratio[0] + Triangle_ratio_tolerance < ratio0[2 * k] ) {
+			break;
+		    }
+		    if ( Triangle_ratio_tolerance <
+			 fabs(tri.ratio[1] - this->tri_ratio(1, k)) ) continue;
+		    if ( tri.orientation != this->tri_vertex(3, k) ) continue;
+		    for ( m=0 ; m < 3 ; m++ ) {
+			votes(tri.vertex[m], this->tri_vertex(m, k)) ++;
+		    }
+		}
+	    }
+	}
+    }
+
+    /* pairs of mutual best votes */
+    pairs.resize_1d(2 * (n_ref + stars.length()));
+    ref_id = pairs.array_ptr();
+    frm_id = ref_id + n_ref + stars.length();
+    n_pairs = 0;
+    for ( j=0 ; j < n_frm ; j++ ) {
+	size_t best = 0;
+	bool mutual = true;
+	for ( i=1 ; i < n_ref ; i++ ) {
+	    if ( votes(j, best) < votes(j, i) ) best = i;
+	}
+	if ( votes(j, best) < Min_votes ) continue;
+	for ( i=0 ; i < n_frm ; i++ ) {
+	    if ( i != j && votes(j, best) <= votes(i, best) ) mutual = false;
+	}
+	if ( mutual == false ) continue;
+	ref_id[n_pairs] = best;
+	frm_id[n_pairs] = j;
+	n_pairs ++;
+    }
+    if ( n_pairs < 3 ) return -1;
+
+    /* similarity from voted pairs */
+    if ( fit_star_pairs(ref, stars, ref_id, frm_id, &n_pairs, false,
+			Max_pair_residual, &tr) < 0 || n_pairs < 3 ) return -1;
+
+    /* refine with all stars: nearest reference star of each star */
+    n_pairs = 0;
+    for ( j=0 ; j < stars.length() ; j++ ) {
+	double tx, ty, d_min = Pair_radius * Pair_radius;
+	long best = -1;
+	apply_transform(tr, stars.x[j], stars.y[j], &tx, &ty);
+	for ( i=0 ; i < ref.length() ; i++ ) {
+	    const double d = (ref.x[i] - tx) * (ref.x[i] - tx)
+			   + (ref.y[i] - ty) * (ref.y[i] - ty);
+	    if ( d < d_min ) {
+		d_min = d;
+		best = i;
+	    }
+	}
+	if ( best < 0 ) continue;
+	ref_id[n_pairs] = best;
+	frm_id[n_pairs] = j;
+	n_pairs ++;
+    }
+    if ( fit_star_pairs(ref, stars, ref_id, frm_id, &n_pairs, affine,
+			Pair_radius, &tr) < 0 ) return -1;
+
+    sum2 = 0.0;
+    for ( i=0 ; i < n_pairs ; i++ ) {
+	double tx, ty;
+	apply_transform(tr, stars.x[frm_id[i]], stars.y[frm_id[i]], &tx, &ty);
+	sum2 += (tx - ref.x[ref_id[i]]) * (tx - ref.x[ref_id[i]])
+	      + (ty - ref.y[ref_id[i]]) * (ty - ref.y[ref_id[i]]);
+    }
+
+    if ( ret_tr != NULL ) *ret_tr = tr;
+    if ( ret_n_matched != NULL ) *ret_n_matched = n_pairs;
+    if ( ret_rms != NULL ) *ret_rms = sqrt(sum2 / (double)n_pairs);
+
+    return 0;
+}
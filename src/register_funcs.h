@@ -0,0 +1,87 @@
+#ifndef _REGISTER_FUNCS_H
+#define _REGISTER_FUNCS_H 1
+
+#include <unistd.h>
+#include <sli/mdarray.h>
+
+#include "star_funcs.h"
+#include "transform_funcs.h"
+
+/*
+ * Translation between frames by FFT phase correlation.
+ *
+ * A square area (size x size, size is a power of 2) at the center of the
+ * green channel is used.  Offsets follow the convention of .offset.txt:
+ * a frame is added to the reference at (x + offset_x, y + offset_y).
+ */
+class phase_correlator {
+
+  public:
+    phase_correlator();
+
+    /* img: width x height x 3 (or size x size x 3 already cropped) */
+    int init( const sli::mdarray_float &ref_img, size_t size );
+    void release();
+
+    /* thread safe; ret_peak is the height of the correlation peak (0-1) */
+    int get_offset( const sli::mdarray_float &img,
+		    double *ret_offset_x, double *ret_offset_y,
+		    double *ret_peak ) const;
+
+    size_t crop_size() const { return this->size; }
+
+    /* largest power of 2 <= min(width, height, max_size) */
+    static size_t get_crop_size( size_t width, size_t height,
+				 size_t max_size );
+
+  private:
+    size_t size;
+    sli::mdarray_double window;		/* Hann window (size) */
+    sli::mdarray_double ref_re;		/* spectrum of reference */
+    sli::mdarray_double ref_im;
+
+    int get_spectrum( const sli::mdarray_float &img,
+		      sli::mdarray_double *ret_re,
+		      sli::mdarray_double *ret_im ) const;
+
+    /* disable copy */
+    phase_correlator( const phase_correlator & );
+    phase_correlator &operator=( const phase_correlator & );
+
+};
+
+/*
+ * Transform between frames by matching triangles of stars.
+ *
+ * Triangles of the brightest stars are compared by ratios of sides,
+ * which do not depend on rotation, scale and translation.  Matched
+ * triangles vote for pairs of stars, and a transform of a frame to the
+ * reference is fitted to pairs of the most votes, then refined with all
+ * stars of the lists.
+ */
+class star_matcher {
+
+  public:
+    star_matcher();
+
+    int init( const star_list &ref_stars );
+    void release();
+
+    /* thread safe; affine = false: similarity (rotation, scale, shift) */
+    int match( const star_list &stars, bool affine,
+	       frame_transform *ret_tr, size_t *ret_n_matched,
+	       double *ret_rms ) const;
+
+  private:
+    star_list ref_stars;
+    sli::mdarray_double tri_ratio;	/* 2 x n: b/a, c/a (sorted by b/a) */
+    sli::mdarray_long tri_vertex;	/* 4 x n: vertices and orientation */
+    size_t n_triangles;
+
+    /* disable copy */
+    star_matcher( const star_matcher & );
+    star_matcher &operator=( const star_matcher & );
+
+};
+
+#endif	/* _REGISTER_FUNCS_H */
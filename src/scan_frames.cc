@@ -0,0 +1,231 @@
+#include <sli/stdstreamio.h>
+#include <sli/tstring.h>
+#include <sli/tarray_tstring.h>
+#include <sli/mdarray.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "tiff_funcs.h"
+#include "thread_funcs.h"
+#include "quality_funcs.h"
+#include "stack_funcs.h"
+#include "sys_funcs.h"
+
+using namespace sli;
+
+/*
+ * Headless quality pre-scan of frames for stack_images
+ *
+ * Sharpness (variance of Laplacian), HFR and number of stars, background
+ * and noise of each frame are measured from a band of rows at the center
+ * of the frame (only strips of the band are decoded), and a table with
+ * weights for stacking is written:
+ *   $ scan_frames -b 80 -o quality.txt -j 8 *.tiff
+ *   $ stack_images -q quality.txt
+ * Frames out of best 80 % have weight of 0 and are not stacked.
+ */
+
+static const double Default_scan_fraction = 0.25;
+static const double Default_best_percent = 100.0;
+static const int Default_max_weight = 8;
+/* min rows of a band (HFR needs rows around stars) */
+static const long Min_scan_rows = 64;
+
+typedef struct _scan_args {
+    const tarray_tstring *filenames;
+    double fraction;			/* fraction of rows to be read */
+    bool verbose;
+    frame_quality *quality;
+    pthread_mutex_t *mutex;		/* for messages */
+    size_t n_failed;
+} scan_args;
+
+/* load a band of rows at the center of a frame */
+static int load_scan_rows( const char *filename, double fraction,
+			   mdarray_float *ret_img )
+{
+    size_t width = 0, height = 0;
+    long n_rows;
+
+    /* size only */
+    if ( load_tiff_rows_into_float(filename, 65536.0, 0, 0, ret_img,
+				   NULL, NULL, NULL, &width, &height) < 0 ) {
+	return -1;
+    }
+    n_rows = lround(height * fraction);
+    if ( n_rows < Min_scan_rows ) n_rows = Min_scan_rows;
+    if ( (long)height < n_rows ) n_rows = height;
+
+    return load_tiff_rows_into_float(filename, 65536.0,
+				     ((long)height - n_rows) / 2, n_rows,
+				     ret_img, NULL, NULL, NULL, NULL, NULL);
+}
+
+static void scan_band( size_t i_begin, size_t i_end, void *user_ptr )
+{
+    scan_args *a = (scan_args *)user_ptr;
+    stdstreamio sio;
+    mdarray_float img_buf(false);
+    size_t i;
+
+    for ( i=i_begin ; i < i_end ; i++ ) {
+	const char *filename = (*(a->filenames))[i].cstr();
+	frame_quality *q = &(a->quality[i]);
+	int status = -1;
+
+	if ( load_scan_rows(filename, a->fraction, &img_buf) == 0 &&
+	     measure_frame_quality(img_buf, q) == 0 ) status = 0;
+
+	pthread_mutex_lock(a->mutex);
+	if ( status == 0 ) {
+	    if ( a->verbose == true ) {
+		sio.printf("%s: sharpness=%.4g hfr=%.3f stars=%ld "
+			   "background=%.1f noise=%.2f\n",
+			   filename, q->sharpness, q->hfr, q->n_stars,
+			   q->background, q->noise);
+	    }
+	}
+	else {
+	    sio.eprintf("[ERROR] cannot measure '%s'\n", filename);
+	    a->n_failed ++;
+	}
+	pthread_mutex_unlock(a->mutex);
+    }
+
+    return;
+}
+
+int main( int argc, char *argv[] )
+{
+    stdstreamio sio;
+
+    tarray_tstring filenames;
+    frame_quality *quality = NULL;
+    thread_pool tpool;
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    scan_args args;
+    const char *filename_out = "quality.txt";
+    size_t n_threads = get_number_of_cpus();
+    double fraction = Default_scan_fraction;
+    double best_percent = Default_best_percent;
+    int max_weight = Default_max_weight;
+    bool flag_verbose = false;
+    size_t i, n_selected;
+    int arg_cnt, n_files;
+
+    int return_status = -1;
+
+    for ( arg_cnt=1 ; arg_cnt < argc ; arg_cnt++ ) {
+	tstring argstr;
+	argstr = argv[arg_cnt];
+	if ( argstr == "-o" && arg_cnt + 1 < argc ) {
+	    arg_cnt ++;
+	    filename_out = argv[arg_cnt];
+	}
+	else if ( argstr == "-j" && arg_cnt + 1 < argc ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    if ( 0 < argstr.atoi() ) n_threads = argstr.atoi();
+	}
+	else if ( argstr == "-s" && arg_cnt + 1 < argc ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    fraction = argstr.atof();
+	    if ( fraction <= 0.0 || 1.0 < fraction ) {
+		sio.eprintf("[ERROR] invalid fraction: %s\n", argstr.cstr());
+		goto quit;
+	    }
+	}
+	else if ( argstr == "-b" && arg_cnt + 1 < argc ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    best_percent = argstr.atof();
+	    if ( best_percent <= 0.0 || 100.0 < best_percent ) {
+		sio.eprintf("[ERROR] invalid percent: %s\n", argstr.cstr());
+		goto quit;
+	    }
+	}
+	else if ( argstr == "-w" && arg_cnt + 1 < argc ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    max_weight = argstr.atoi();
+	    if ( max_weight < 1 || STACK_MAX_WEIGHT < max_weight ) {
+		sio.eprintf("[ERROR] invalid weight: %s (1..%d)\n",
+			    argstr.cstr(), STACK_MAX_WEIGHT);
+		goto quit;
+	    }
+	}
+	else if ( argstr == "-v" ) {
+	    flag_verbose = true;
+	}
+	else break;
+    }
+
+    if ( argc <= arg_cnt ) {
+	sio.eprintf("Measure quality of frames, and write a table of\n");
+	sio.eprintf("selection and weights for stack_images (-q)\n");
+	sio.eprintf("\n");
+        sio.eprintf("[USAGE]\n");
+	sio.eprintf("$ %s [-o file] [-b percent] [-w weight] [-s fraction] [-j threads] [-v] frame_1.tiff ...\n",
+		    argv[0]);
+	sio.eprintf("-o file ... output table (default: quality.txt)\n");
+	sio.eprintf("-b percent ... select best frames (default: %g)\n",
+		    Default_best_percent);
+	sio.eprintf("-w n ... max weight of frames (default: %d; 1: not weighted; max: %d)\n",
+		    Default_max_weight, STACK_MAX_WEIGHT);
+	sio.eprintf("-s fraction ... fraction of rows to be read (default: %g)\n",
+		    Default_scan_fraction);
+	sio.eprintf("-j n ... number of threads\n");
+	sio.eprintf("-v ... print quality of frames\n");
+	goto quit;
+    }
+
+    n_files = 0;
+    for ( ; arg_cnt < argc ; arg_cnt++ ) {
+	filenames[n_files] = argv[arg_cnt];
+	n_files ++;
+    }
+
+    quality = new frame_quality[filenames.length()];
+
+    if ( tpool.start(n_threads) < 0 ) {
+	sio.eprintf("[ERROR] cannot start threads\n");
+	goto quit;
+    }
+
+    args.filenames = &filenames;
+    args.fraction = fraction;
+    args.verbose = flag_verbose;
+    args.quality = quality;
+    args.mutex = &mutex;
+    args.n_failed = 0;
+
+    /* a band is a range of frames */
+    tpool.run_row_bands(filenames.length(), &scan_band, (void *)&args);
+    tpool.stop();
+
+    if ( 0 < args.n_failed ) goto quit;
+
+    if ( rank_frame_quality(quality, filenames.length(),
+			    best_percent, max_weight) < 0 ) {
+	sio.eprintf("[ERROR] rank_frame_quality() failed\n");
+	goto quit;
+    }
+
+    if ( save_quality_table(filename_out, filenames, quality) < 0 ) {
+	sio.eprintf("[ERROR] cannot write '%s'\n", filename_out);
+	goto quit;
+    }
+
+    n_selected = 0;
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+	if ( 0 < quality[i].weight ) n_selected ++;
+    }
+    sio.printf("Selected %zd of %zd frames: written to '%s'\n",
+	       n_selected, filenames.length(), filename_out);
+
+    return_status = 0;
+ quit:
+    if ( quality != NULL ) delete [] quality;
+    return return_status;
+}
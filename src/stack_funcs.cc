@@ -0,0 +1,1060 @@
+#include <math.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "stack_funcs.h"
+
+#include "test_simd.h"
+
+#if defined(_AVX2_DISPATCH_IS_OK) || defined(_AVX512F_DISPATCH_IS_OK)
+#include <immintrin.h>
+#endif
+
+using namespace sli;
+
+
+/*
+ * class stack_accum
+ */
+
+stack_accum::stack_accum()
+  : is_integer(false), weight(1), sum_i(false), sum2_i(false),
+    sum_d(false), sum2_d(false), count(false)
+{
+}
+
+int stack_accum::init( size_t width, size_t height, bool is_integer )
+{
+    this->release();
+    this->is_integer = is_integer;
+    this->weight = 1;
+    if ( is_integer == true ) {
+	this->sum_i.resize_3d(width, height, 3);
+	this->sum2_i.resize_3d(width, height, 3);
+    }
+    else {
+	this->sum_d.resize_3d(width, height, 3);
+	this->sum2_d.resize_3d(width, height, 3);
+    }
+    this->count.resize_3d(width, height, 3);
+    this->clean();
+    return 0;
+}
+
+void stack_accum::clean()
+{
+    if ( this->is_integer == true ) {
+	this->sum_i.clean();
+	this->sum2_i.clean();
+    }
+    else {
+	this->sum_d.clean();
+	this->sum2_d.clean();
+    }
+    this->count.clean();
+    return;
+}
+
+void stack_accum::release()
+{
+    this->sum_i.init(false);
+    this->sum2_i.init(false);
+    this->sum_d.init(false);
+    this->sum2_d.init(false);
+    this->count.init(false);
+    return;
+}
+
+size_t stack_accum::pixel_bytes( bool is_integer )
+{
+    if ( is_integer == true ) {
+	return 3 * (sizeof(long long) * 2 + sizeof(int));
+    }
+    else {
+	return 3 * (sizeof(double) * 2 + sizeof(int));
+    }
+}
+
+
+/*
+ * Row kernels of stacking.
+ *
+ * mark_rejected: test of sigma-clipping for a channel.
+ * accumulate:    sum += w*v, sum2 += w*v*v, count += w for used pixels
+ *                in a single sweep (no temporary frame; w: weight of
+ *                frame, see stack_accum::weight).
+ *                _i: 64-bit integer sums  _d: double sums
+ *
+ * SIMD versions compute mean/sigma in double precision with the same
+ * expressions and the same order of operations as the scalar version,
+ * so that all versions produce identical results.
+ * (Do not enable FP contraction: see -ffp-contract=off in Makefile.)
+ *
+ * NULL for p3 means pixel values of 0 (out of shifted frame).
+ */
+
+/* p5[k]++ where sigma_factor_limit * sigma < |mean - (p3[k] + sky_diff)| */
+typedef void (*mark_rejected_func_t)( const double *p0, const double *p1,
+				      const int *p2, const float *p3,
+				      size_t n, double sigma_factor_limit,
+				      double sky_diff, unsigned char *p5 );
+
+/* for pixels of p5[k] == 0 (all pixels if p5 is NULL):          */
+/*   sum[k] += w*p3[k], sum2[k] += w*p3[k]*p3[k], count[k] += w    */
+/* (w: weight of frame).  count can be NULL.                     */
+/* NOTE: skipping rejected pixels gives the same result as adding */
+/*       0, since sums start from +0 and never become -0.0.       */
+typedef void (*accumulate_i_func_t)( const unsigned char *p5,
+				     const float *p3, size_t n, int weight,
+				     long long *sum, long long *sum2,
+				     int *count );
+typedef void (*accumulate_d_func_t)( const unsigned char *p5,
+				     const float *p3, size_t n, int weight,
+				     double *sum, double *sum2, int *count );
+
+static void mark_rejected_scalar( const double *p0, const double *p1,
+				  const int *p2, const float *p3,
+				  size_t n, double sigma_factor_limit,
+				  double sky_diff, unsigned char *p5 )
+{
+    size_t k;
+    for ( k=0 ; k < n ; k++ ) {
+	double sum  = p0[k];
+	double mean = sum / (double)(p2[k]);
+	double sum2 = p1[k];
+	double sigma = sqrt( (sum2 - 2 * mean * sum + mean * mean * p2[k])
+			     / (double)(p2[k] - 1) );
+	/* apply *standardized* pixel value */
+	//double pix_val = p3[k] * (av_median[j] / target_median[j]);
+	/* apply *sky-level-adjusted* pixel value */
+	double pix_val = ((p3 != NULL) ? p3[k] : (float)0.0) + sky_diff;
+	if ( sigma_factor_limit * sigma < fabs(mean - pix_val) ) {
+	    p5[k] ++;		/* mark unused pixels */
+	}
+    }
+    return;
+}
+
+/* only count (p3 is NULL) */
+static void accumulate_count( const unsigned char *p5, size_t n, int weight,
+			      int *count )
+{
+    size_t k;
+    if ( count == NULL ) return;
+    for ( k=0 ; k < n ; k++ ) {
+	if ( p5 == NULL || p5[k] == 0 ) count[k] += weight;
+    }
+    return;
+}
+
+static void accumulate_i_scalar( const unsigned char *p5,
+				 const float *p3, size_t n, int weight,
+				 long long *sum, long long *sum2, int *count )
+{
+    size_t k;
+    if ( p3 == NULL ) {
+	accumulate_count(p5, n, weight, count);
+	return;
+    }
+    for ( k=0 ; k < n ; k++ ) {
+	if ( p5 == NULL || p5[k] == 0 ) {
+	    const long long v = (int)(p3[k]);	/* 0..65535 */
+	    const long long wv = weight * v;
+	    sum[k] += wv;
+	    sum2[k] += wv * v;
+	    if ( count != NULL ) count[k] += weight;
+	}
+    }
+    return;
+}
+
+static void accumulate_d_scalar( const unsigned char *p5,
+				 const float *p3, size_t n, int weight,
+				 double *sum, double *sum2, int *count )
+{
+    size_t k;
+    if ( p3 == NULL ) {
+	accumulate_count(p5, n, weight, count);
+	return;
+    }
+    for ( k=0 ; k < n ; k++ ) {
+	if ( p5 == NULL || p5[k] == 0 ) {
+	    const double v = p3[k];
+	    const double wv = weight * v;
+	    sum[k] += wv;
+	    sum2[k] += wv * v;
+	    if ( count != NULL ) count[k] += weight;
+	}
+    }
+    return;
+}
+
+#if defined(_AVX2_DISPATCH_IS_OK)
+
+/* 4-bit mask => 4 bytes of 0 or 1 (little endian) */
+static const uint32_t Mask4_to_bytes[16] = {
+    0x00000000, 0x00000001, 0x00000100, 0x00000101,
+    0x00010000, 0x00010001, 0x00010100, 0x00010101,
+    0x01000000, 0x01000001, 0x01000100, 0x01000101,
+    0x01010000, 0x01010001, 0x01010100, 0x01010101
+};
+
+__attribute__((target("avx2")))
+static void mark_rejected_avx2( const double *p0, const double *p1,
+				const int *p2, const float *p3,
+				size_t n, double sigma_factor_limit,
+				double sky_diff, unsigned char *p5 )
+{
+    const __m256d v_two = _mm256_set1_pd(2.0);
+    const __m256d v_limit = _mm256_set1_pd(sigma_factor_limit);
+    const __m256d v_sky = _mm256_set1_pd(sky_diff);
+    const __m256d v_abs = _mm256_castsi256_pd(
+				_mm256_set1_epi64x(0x7fffffffffffffffLL));
+    const __m128i v_one = _mm_set1_epi32(1);
+    size_t k = 0;
+
+    for ( ; k + 4 <= n ; k += 4 ) {
+	__m128i cnt_i = _mm_loadu_si128((const __m128i *)(p2 + k));
+	__m256d cnt = _mm256_cvtepi32_pd(cnt_i);
+	__m256d cnt_1 = _mm256_cvtepi32_pd(_mm_sub_epi32(cnt_i, v_one));
+	__m256d sum = _mm256_loadu_pd(p0 + k);
+	__m256d sum2 = _mm256_loadu_pd(p1 + k);
+	__m256d mean = _mm256_div_pd(sum, cnt);
+	__m256d var, sigma, pix_val, diff;
+	int m;
+	var = _mm256_sub_pd(sum2, _mm256_mul_pd(_mm256_mul_pd(v_two, mean), sum));
+	var = _mm256_add_pd(var, _mm256_mul_pd(_mm256_mul_pd(mean, mean), cnt));
+	sigma = _mm256_sqrt_pd(_mm256_div_pd(var, cnt_1));
+	if ( p3 != NULL ) {
+	    pix_val = _mm256_add_pd(_mm256_cvtps_pd(_mm_loadu_ps(p3 + k)),
+				    v_sky);
+	}
+	else {
+	    pix_val = _mm256_add_pd(_mm256_setzero_pd(), v_sky);
+	}
+	diff = _mm256_and_pd(_mm256_sub_pd(mean, pix_val), v_abs);
+	m = _mm256_movemask_pd(
+		_mm256_cmp_pd(_mm256_mul_pd(v_limit, sigma), diff, _CMP_LT_OQ));
+	if ( m != 0 ) {
+	    uint32_t f;
+	    memcpy(&f, p5 + k, 4);
+	    f += Mask4_to_bytes[m];		/* mark unused pixels */
+	    memcpy(p5 + k, &f, 4);
+	}
+    }
+
+    mark_rejected_scalar(p0 + k, p1 + k, p2 + k,
+			 (p3 != NULL) ? p3 + k : NULL, n - k,
+			 sigma_factor_limit, sky_diff, p5 + k);
+    return;
+}
+
+/* returns -1 (used) or 0 for 8 pixels */
+__attribute__((target("avx2")))
+static inline __m256i get_used_mask_avx2( const unsigned char *p5 )
+{
+    __m256i f = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)p5));
+    return _mm256_cmpeq_epi32(f, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static void accumulate_i_avx2( const unsigned char *p5,
+			       const float *p3, size_t n, int weight,
+			       long long *sum, long long *sum2, int *count )
+{
+    const __m256i v_w = _mm256_set1_epi32(weight);
+    __m256i used = _mm256_set1_epi32(-1);
+    size_t k = 0;
+
+    if ( p3 == NULL ) {
+	accumulate_count(p5, n, weight, count);
+	return;
+    }
+
+    for ( ; k + 8 <= n ; k += 8 ) {
+	__m256i v, wv, v_lo, v_hi, wv_lo, wv_hi;
+	__m256i *p_sum = (__m256i *)(sum + k);
+	__m256i *p_sum2 = (__m256i *)(sum2 + k);
+	if ( p5 != NULL ) used = get_used_mask_avx2(p5 + k);
+	/* rejected pixels are added as 0 */
+	v = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_loadu_ps(p3 + k)),
+			     used);
+	wv = _mm256_mullo_epi32(v, v_w);	/* weight <= STACK_MAX_WEIGHT */
+	v_lo = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(v));
+	v_hi = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(v, 1));
+	wv_lo = _mm256_cvtepi32_epi64(_mm256_castsi256_si128(wv));
+	wv_hi = _mm256_cvtepi32_epi64(_mm256_extracti128_si256(wv, 1));
+	_mm256_storeu_si256(p_sum,
+		_mm256_add_epi64(_mm256_loadu_si256(p_sum), wv_lo));
+	_mm256_storeu_si256(p_sum + 1,
+		_mm256_add_epi64(_mm256_loadu_si256(p_sum + 1), wv_hi));
+	_mm256_storeu_si256(p_sum2,
+		_mm256_add_epi64(_mm256_loadu_si256(p_sum2),
+				 _mm256_mul_epi32(wv_lo, v_lo)));
+	_mm256_storeu_si256(p_sum2 + 1,
+		_mm256_add_epi64(_mm256_loadu_si256(p_sum2 + 1),
+				 _mm256_mul_epi32(wv_hi, v_hi)));
+	if ( count != NULL ) {
+	    __m256i *p_cnt = (__m256i *)(count + k);
+	    _mm256_storeu_si256(p_cnt,
+		    _mm256_add_epi32(_mm256_loadu_si256(p_cnt),
+				     _mm256_and_si256(used, v_w)));
+	}
+    }
+
+    accumulate_i_scalar((p5 != NULL) ? p5 + k : NULL, p3 + k, n - k, weight,
+			sum + k, sum2 + k, (count != NULL) ? count + k : NULL);
+    return;
+}
+
+__attribute__((target("avx2")))
+static void accumulate_d_avx2( const unsigned char *p5,
+			       const float *p3, size_t n, int weight,
+			       double *sum, double *sum2, int *count )
+{
+    const __m256i v_w = _mm256_set1_epi32(weight);
+    const __m256d v_wd = _mm256_set1_pd(weight);
+    __m256i used = _mm256_set1_epi32(-1);
+    size_t k = 0;
+
+    if ( p3 == NULL ) {
+	accumulate_count(p5, n, weight, count);
+	return;
+    }
+
+    for ( ; k + 8 <= n ; k += 8 ) {
+	__m256 v;
+	__m256d v_lo, v_hi, wv_lo, wv_hi;
+	if ( p5 != NULL ) used = get_used_mask_avx2(p5 + k);
+	/* rejected pixels are added as 0.0 */
+	v = _mm256_and_ps(_mm256_loadu_ps(p3 + k), _mm256_castsi256_ps(used));
+	v_lo = _mm256_cvtps_pd(_mm256_castps256_ps128(v));
+	v_hi = _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1));
+	wv_lo = _mm256_mul_pd(v_wd, v_lo);
+	wv_hi = _mm256_mul_pd(v_wd, v_hi);
+	_mm256_storeu_pd(sum + k, _mm256_add_pd(_mm256_loadu_pd(sum + k), wv_lo));
+	_mm256_storeu_pd(sum + k + 4,
+			 _mm256_add_pd(_mm256_loadu_pd(sum + k + 4), wv_hi));
+	_mm256_storeu_pd(sum2 + k, _mm256_add_pd(_mm256_loadu_pd(sum2 + k),
+						 _mm256_mul_pd(wv_lo, v_lo)));
+	_mm256_storeu_pd(sum2 + k + 4,
+			 _mm256_add_pd(_mm256_loadu_pd(sum2 + k + 4),
+				       _mm256_mul_pd(wv_hi, v_hi)));
+	if ( count != NULL ) {
+	    __m256i *p_cnt = (__m256i *)(count + k);
+	    _mm256_storeu_si256(p_cnt,
+		    _mm256_add_epi32(_mm256_loadu_si256(p_cnt),
+				     _mm256_and_si256(used, v_w)));
+	}
+    }
+
+    accumulate_d_scalar((p5 != NULL) ? p5 + k : NULL, p3 + k, n - k, weight,
+			sum + k, sum2 + k, (count != NULL) ? count + k : NULL);
+    return;
+}
+
+#endif	/* _AVX2_DISPATCH_IS_OK */
+
+#if defined(_AVX512F_DISPATCH_IS_OK)
+
+__attribute__((target("avx512f")))
+static void mark_rejected_avx512( const double *p0, const double *p1,
+				  const int *p2, const float *p3,
+				  size_t n, double sigma_factor_limit,
+				  double sky_diff, unsigned char *p5 )
+{
+    const __m512d v_two = _mm512_set1_pd(2.0);
+    const __m512d v_limit = _mm512_set1_pd(sigma_factor_limit);
+    const __m512d v_sky = _mm512_set1_pd(sky_diff);
+    const __m512i v_abs = _mm512_set1_epi64(0x7fffffffffffffffLL);
+    const __m256i v_one = _mm256_set1_epi32(1);
+    size_t k = 0;
+
+    for ( ; k + 8 <= n ; k += 8 ) {
+	__m256i cnt_i = _mm256_loadu_si256((const __m256i *)(p2 + k));
+	__m512d cnt = _mm512_cvtepi32_pd(cnt_i);
+	__m512d cnt_1 = _mm512_cvtepi32_pd(_mm256_sub_epi32(cnt_i, v_one));
+	__m512d sum = _mm512_loadu_pd(p0 + k);
+	__m512d sum2 = _mm512_loadu_pd(p1 + k);
+	__m512d mean = _mm512_div_pd(sum, cnt);
+	__m512d var, sigma, pix_val, diff;
+	__mmask8 m;
+	var = _mm512_sub_pd(sum2, _mm512_mul_pd(_mm512_mul_pd(v_two, mean), sum));
+	var = _mm512_add_pd(var, _mm512_mul_pd(_mm512_mul_pd(mean, mean), cnt));
+	sigma = _mm512_sqrt_pd(_mm512_div_pd(var, cnt_1));
+	if ( p3 != NULL ) {
+	    pix_val = _mm512_add_pd(_mm512_cvtps_pd(_mm256_loadu_ps(p3 + k)),
+				    v_sky);
+	}
+	else {
+	    pix_val = _mm512_add_pd(_mm512_setzero_pd(), v_sky);
+	}
+	diff = _mm512_castsi512_pd(_mm512_and_epi64(
+		    _mm512_castpd_si512(_mm512_sub_pd(mean, pix_val)), v_abs));
+	m = _mm512_cmp_pd_mask(_mm512_mul_pd(v_limit, sigma), diff,
+			       _CMP_LT_OQ);
+	if ( m != 0 ) {
+	    __m128i inc = _mm512_cvtepi64_epi8(
+				_mm512_maskz_set1_epi64(m, 1));
+	    __m128i f = _mm_loadl_epi64((const __m128i *)(p5 + k));
+	    /* mark unused pixels */
+	    _mm_storel_epi64((__m128i *)(p5 + k), _mm_add_epi8(f, inc));
+	}
+    }
+
+    mark_rejected_scalar(p0 + k, p1 + k, p2 + k,
+			 (p3 != NULL) ? p3 + k : NULL, n - k,
+			 sigma_factor_limit, sky_diff, p5 + k);
+    return;
+}
+
+/* returns mask of used pixels for 16 pixels */
+__attribute__((target("avx512f")))
+static inline __mmask16 get_used_mask_avx512( const unsigned char *p5 )
+{
+    __m512i f = _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)p5));
+    return _mm512_cmpeq_epi32_mask(f, _mm512_setzero_si512());
+}
+
+__attribute__((target("avx512f")))
+static void accumulate_i_avx512( const unsigned char *p5,
+				 const float *p3, size_t n, int weight,
+				 long long *sum, long long *sum2, int *count )
+{
+    const __m512i v_w = _mm512_set1_epi32(weight);
+    __mmask16 used = 0xffff;
+    size_t k = 0;
+
+    if ( p3 == NULL ) {
+	accumulate_count(p5, n, weight, count);
+	return;
+    }
+
+    for ( ; k + 16 <= n ; k += 16 ) {
+	__m512i v, wv, v_lo, v_hi, wv_lo, wv_hi;
+	if ( p5 != NULL ) used = get_used_mask_avx512(p5 + k);
+	/* rejected pixels are added as 0 */
+	v = _mm512_maskz_mov_epi32(used,
+			_mm512_cvttps_epi32(_mm512_loadu_ps(p3 + k)));
+	wv = _mm512_mullo_epi32(v, v_w);	/* weight <= STACK_MAX_WEIGHT */
+	v_lo = _mm512_cvtepi32_epi64(_mm512_castsi512_si256(v));
+	v_hi = _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(v, 1));
+	wv_lo = _mm512_cvtepi32_epi64(_mm512_castsi512_si256(wv));
+	wv_hi = _mm512_cvtepi32_epi64(_mm512_extracti64x4_epi64(wv, 1));
+	_mm512_storeu_si512(sum + k,
+		_mm512_add_epi64(_mm512_loadu_si512(sum + k), wv_lo));
+	_mm512_storeu_si512(sum + k + 8,
+		_mm512_add_epi64(_mm512_loadu_si512(sum + k + 8), wv_hi));
+	_mm512_storeu_si512(sum2 + k,
+		_mm512_add_epi64(_mm512_loadu_si512(sum2 + k),
+				 _mm512_mul_epi32(wv_lo, v_lo)));
+	_mm512_storeu_si512(sum2 + k + 8,
+		_mm512_add_epi64(_mm512_loadu_si512(sum2 + k + 8),
+				 _mm512_mul_epi32(wv_hi, v_hi)));
+	if ( count != NULL ) {
+	    __m512i cnt = _mm512_loadu_si512(count + k);
+	    _mm512_storeu_si512(count + k,
+				_mm512_mask_add_epi32(cnt, used, cnt, v_w));
+	}
+    }
+
+    accumulate_i_scalar((p5 != NULL) ? p5 + k : NULL, p3 + k, n - k, weight,
+			sum + k, sum2 + k, (count != NULL) ? count + k : NULL);
+    return;
+}
+
+__attribute__((target("avx512f")))
+static void accumulate_d_avx512( const unsigned char *p5,
+				 const float *p3, size_t n, int weight,
+				 double *sum, double *sum2, int *count )
+{
+    const __m512i v_w = _mm512_set1_epi32(weight);
+    const __m512d v_wd = _mm512_set1_pd(weight);
+    __mmask16 used = 0xffff;
+    size_t k = 0;
+
+    if ( p3 == NULL ) {
+	accumulate_count(p5, n, weight, count);
+	return;
+    }
+
+    for ( ; k + 16 <= n ; k += 16 ) {
+	__m512 v;
+	__m512d v_lo, v_hi, wv_lo, wv_hi;
+	if ( p5 != NULL ) used = get_used_mask_avx512(p5 + k);
+	/* rejected pixels are added as 0.0 */
+	v = _mm512_maskz_loadu_ps(used, p3 + k);
+	v_lo = _mm512_cvtps_pd(_mm512_castps512_ps256(v));
+	v_hi = _mm512_cvtps_pd(_mm256_castpd_ps(
+			_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1)));
+	wv_lo = _mm512_mul_pd(v_wd, v_lo);
+	wv_hi = _mm512_mul_pd(v_wd, v_hi);
+	_mm512_storeu_pd(sum + k, _mm512_add_pd(_mm512_loadu_pd(sum + k), wv_lo));
+	_mm512_storeu_pd(sum + k + 8,
+			 _mm512_add_pd(_mm512_loadu_pd(sum + k + 8), wv_hi));
+	_mm512_storeu_pd(sum2 + k, _mm512_add_pd(_mm512_loadu_pd(sum2 + k),
+						 _mm512_mul_pd(wv_lo, v_lo)));
+	_mm512_storeu_pd(sum2 + k + 8,
+			 _mm512_add_pd(_mm512_loadu_pd(sum2 + k + 8),
+				       _mm512_mul_pd(wv_hi, v_hi)));
+	if ( count != NULL ) {
+	    __m512i cnt = _mm512_loadu_si512(count + k);
+	    _mm512_storeu_si512(count + k,
+				_mm512_mask_add_epi32(cnt, used, cnt, v_w));
+	}
+    }
+
+    accumulate_d_scalar((p5 != NULL) ? p5 + k : NULL, p3 + k, n - k, weight,
+			sum + k, sum2 + k, (count != NULL) ? count + k : NULL);
+    return;
+}
+
+#endif	/* _AVX512F_DISPATCH_IS_OK */
+
+static mark_rejected_func_t Mark_rejected = NULL;
+static accumulate_i_func_t Accumulate_i = NULL;
+static accumulate_d_func_t Accumulate_d = NULL;
+static const char *Kernel_name = NULL;
+
+/* select kernels by cpuid (called from main thread) */
+static void select_stack_kernels()
+{
+    if ( Kernel_name != NULL ) return;
+
+    Mark_rejected = &mark_rejected_scalar;
+    Accumulate_i = &accumulate_i_scalar;
+    Accumulate_d = &accumulate_d_scalar;
+    Kernel_name = "scalar";
+
+#if defined(_AVX2_DISPATCH_IS_OK) || defined(_AVX512F_DISPATCH_IS_OK)
+    __builtin_cpu_init();
+#endif
+#if defined(_AVX2_DISPATCH_IS_OK)
+    if ( __builtin_cpu_supports("avx2") ) {
+	Mark_rejected = &mark_rejected_avx2;
+	Accumulate_i = &accumulate_i_avx2;
+	Accumulate_d = &accumulate_d_avx2;
+	Kernel_name = "avx2";
+    }
+#endif
+#if defined(_AVX512F_DISPATCH_IS_OK)
+    if ( __builtin_cpu_supports("avx512f") ) {
+	Mark_rejected = &mark_rejected_avx512;
+	Accumulate_i = &accumulate_i_avx512;
+	Accumulate_d = &accumulate_d_avx512;
+	Kernel_name = "avx512f";
+    }
+#endif
+
+    return;
+}
+
+const char *stack_sigma_clip_kernel_name()
+{
+    select_stack_kernels();
+    return Kernel_name;
+}
+
+/* accumulate a part of row of channel ch */
+static void accumulate_row( const unsigned char *p5, const float *p3,
+			    size_t n, stack_accum *accum,
+			    size_t x, size_t y, size_t ch, bool with_count )
+{
+    int *count = (with_count == true) ? accum->count.array_ptr(x, y, ch)
+				       : NULL;
+    if ( accum->is_integer == true ) {
+	(*Accumulate_i)(p5, p3, n, accum->weight,
+			accum->sum_i.array_ptr(x, y, ch),
+			accum->sum2_i.array_ptr(x, y, ch), count);
+    }
+    else {
+	(*Accumulate_d)(p5, p3, n, accum->weight,
+			accum->sum_d.array_ptr(x, y, ch),
+			accum->sum2_d.array_ptr(x, y, ch), count);
+    }
+    return;
+}
+
+/*
+ * Get range of x in dest for a row shifted by offset_x.
+ * Returns false when no pixel is overlapped.
+ */
+static bool get_shifted_range( size_t dest_width, size_t src_width,
+			       long offset_x,
+			       size_t *ret_x_begin, size_t *ret_x_end )
+{
+    long x_begin = offset_x;
+    long x_end = offset_x + (long)src_width;
+    if ( x_begin < 0 ) x_begin = 0;
+    if ( (long)dest_width < x_end ) x_end = (long)dest_width;
+    if ( x_end <= x_begin ) return false;
+    *ret_x_begin = x_begin;
+    *ret_x_end = x_end;
+    return true;
+}
+
+/* returns source row for dest row y (NULL if out of range) */
+static const float *get_shifted_src_row( const mdarray_float &img_buf,
+					 long offset_x, long offset_y,
+					 size_t y, size_t ch )
+{
+    long src_y = (long)y - offset_y;
+    if ( src_y < 0 || (long)(img_buf.y_length()) <= src_y ) return NULL;
+    /* pointer aligned with dest x */
+    return img_buf.array_ptr_cs(0, src_y, ch) - offset_x;
+}
+
+/*
+ * Source frame of stacking, shifted by integer offsets or resampled by
+ * frame_warper.
+ */
+typedef struct _stack_source {
+    const mdarray_float *img_buf;
+    long offset_x;
+    long offset_y;
+    bool warped;
+    frame_warper warper;
+} stack_source;
+
+static void set_shifted_source( const mdarray_float &img_buf,
+				long offset_x, long offset_y,
+				stack_source *ret_src )
+{
+    ret_src->img_buf = &img_buf;
+    ret_src->offset_x = offset_x;
+    ret_src->offset_y = offset_y;
+    ret_src->warped = false;
+    return;
+}
+
+static int set_warped_source( const mdarray_float &img_buf,
+			      const frame_transform &tr, int kernel,
+			      bool rounded, stack_source *ret_src )
+{
+    if ( ret_src->warper.init(img_buf, tr, kernel, rounded) < 0 ) return -1;
+    ret_src->img_buf = &img_buf;
+    ret_src->offset_x = 0;
+    ret_src->offset_y = 0;
+    ret_src->warped = true;
+    return 0;
+}
+
+/*
+ * Get RGB rows of source for dest row y: ret_src[ch] are aligned with
+ * dest x, and valid in [*ret_x_begin, *ret_x_end).  Warped rows are
+ * written into row_buf.  Returns false when no pixel is overlapped.
+ */
+static bool get_source_rows( const stack_source *s, size_t width, size_t y,
+			     mdarray_float *row_buf, const float *ret_src[],
+			     size_t *ret_x_begin, size_t *ret_x_end )
+{
+    int ch;
+
+    if ( s->warped == false ) {
+	if ( get_shifted_range(width, s->img_buf->x_length(), s->offset_x,
+			       ret_x_begin, ret_x_end) == false ) return false;
+	for ( ch=0 ; ch < 3 ; ch++ ) {
+	    ret_src[ch] = get_shifted_src_row(*(s->img_buf),
+				s->offset_x, s->offset_y, y, ch);
+	    if ( ret_src[ch] == NULL ) return false;
+	}
+    }
+    else {
+	const size_t len = 3 * width + s->warper.work_length(width);
+	float *rows;
+	if ( row_buf->length() < len ) row_buf->resize_1d(len);
+	rows = row_buf->array_ptr();
+	if ( s->warper.get_rows(width, y, rows + 3 * width, rows,
+				ret_x_begin, ret_x_end) == false ) {
+	    return false;
+	}
+	for ( ch=0 ; ch < 3 ; ch++ ) ret_src[ch] = rows + width * ch;
+    }
+
+    return true;
+}
+
+
+/* inverse of accumulate_row() for all pixels (count is not changed) */
+static void subtract_row( const float *p3, size_t n, stack_accum *accum,
+			  size_t x, size_t y, size_t ch )
+{
+    size_t k;
+    if ( accum->is_integer == true ) {
+	long long *sum = accum->sum_i.array_ptr(x, y, ch);
+	long long *sum2 = accum->sum2_i.array_ptr(x, y, ch);
+	for ( k=0 ; k < n ; k++ ) {
+	    const long long v = (int)(p3[k]);	/* 0..65535 */
+	    const long long wv = accum->weight * v;
+	    sum[k] -= wv;
+	    sum2[k] -= wv * v;
+	}
+    }
+    else {
+	double *sum = accum->sum_d.array_ptr(x, y, ch);
+	double *sum2 = accum->sum2_d.array_ptr(x, y, ch);
+	for ( k=0 ; k < n ; k++ ) {
+	    const double v = p3[k];
+	    const double wv = accum->weight * v;
+	    sum[k] -= wv;
+	    sum2[k] -= wv * v;
+	}
+    }
+    return;
+}
+
+
+/*
+ * stack_add_frame() and stack_subtract_frame()
+ */
+
+typedef struct _stack_add_args {
+    stack_source src;
+    bool subtract;
+    stack_accum *accum;
+} stack_add_args;
+
+static void stack_add_band( size_t y_begin, size_t y_end, void *user_ptr )
+{
+    const stack_add_args *a = (const stack_add_args *)user_ptr;
+    const size_t width = a->accum->x_length();
+    mdarray_float row_buf(false);
+    size_t x_begin, x_end, y, ch;
+
+    for ( y=y_begin ; y < y_end ; y++ ) {
+	const float *src[3];
+	if ( get_source_rows(&(a->src), width, y, &row_buf, src,
+			     &x_begin, &x_end) == false ) continue;
+	for ( ch=0 ; ch < 3 ; ch++ ) {
+	    if ( a->subtract == true ) {
+		subtract_row(src[ch] + x_begin, x_end - x_begin,
+			     a->accum, x_begin, y, ch);
+	    }
+	    else {
+		accumulate_row(NULL, src[ch] + x_begin, x_end - x_begin,
+			       a->accum, x_begin, y, ch, false);
+	    }
+	}
+    }
+
+    return;
+}
+
+static int stack_add_source( thread_pool *pool, const stack_source &src,
+			     bool subtract, stack_accum *accum )
+{
+    stack_add_args args;
+
+    if ( src.img_buf->z_length() != 3 || accum->count.z_length() != 3 ) {
+	return -1;
+    }
+    if ( accum->weight < 1 || STACK_MAX_WEIGHT < accum->weight ) return -1;
+
+    args.src = src;
+    args.subtract = subtract;
+    args.accum = accum;
+
+    select_stack_kernels();
+
+    pool->run_row_bands(accum->y_length(), &stack_add_band, (void *)&args);
+
+    return 0;
+}
+
+int stack_add_frame( thread_pool *pool,
+		     const mdarray_float &img_buf,
+		     long offset_x, long offset_y,
+		     stack_accum *accum )
+{
+    stack_source src;
+    set_shifted_source(img_buf, offset_x, offset_y, &src);
+    return stack_add_source(pool, src, false, accum);
+}
+
+int stack_subtract_frame( thread_pool *pool,
+			  const mdarray_float &img_buf,
+			  long offset_x, long offset_y,
+			  stack_accum *accum )
+{
+    stack_source src;
+    set_shifted_source(img_buf, offset_x, offset_y, &src);
+    return stack_add_source(pool, src, true, accum);
+}
+
+int stack_add_frame_warped( thread_pool *pool,
+			    const mdarray_float &img_buf,
+			    const frame_transform &tr, int kernel,
+			    stack_accum *accum )
+{
+    stack_source src;
+    if ( set_warped_source(img_buf, tr, kernel, accum->is_integer,
+			   &src) < 0 ) {
+	return -1;
+    }
+    return stack_add_source(pool, src, false, accum);
+}
+
+int stack_subtract_frame_warped( thread_pool *pool,
+				 const mdarray_float &img_buf,
+				 const frame_transform &tr, int kernel,
+				 stack_accum *accum )
+{
+    stack_source src;
+    if ( set_warped_source(img_buf, tr, kernel, accum->is_integer,
+			   &src) < 0 ) {
+	return -1;
+    }
+    return stack_add_source(pool, src, true, accum);
+}
+
+
+/*
+ * stack_sigma_clip_frame()
+ */
+
+typedef struct _stack_sigma_clip_args {
+    stack_source src;
+    const stack_accum *accum1;
+    const int *sigma_rgb;
+    const double *av_median;
+    const double *target_median;
+    bool no_clip;
+    stack_accum *accum0;
+} stack_sigma_clip_args;
+
+/* length of a part of row processed at once (buffers are on stack) */
+static const size_t Len_chunk = 1024;
+
+/* process [x0,x1) of row y; src[] are aligned with dest x (or NULL) */
+static void stack_sigma_clip_segment( const stack_sigma_clip_args *a,
+				      const float *const src[],
+				      size_t y, size_t x0, size_t x1 )
+{
+    const stack_accum *accum1 = a->accum1;
+    unsigned char flags[Len_chunk];
+    double sum_chunk[Len_chunk];
+    double sum2_chunk[Len_chunk];
+    size_t x, n, i, j;
+
+    for ( x=x0 ; x < x1 ; x += n ) {
+	n = x1 - x;
+	if ( Len_chunk < n ) n = Len_chunk;
+
+	if ( a->no_clip == false ) {
+	    memset(flags, 0, n);
+	    for ( j=0 ; j < 3 ; j++ ) {
+		const double *p0, *p1;
+		if ( a->sigma_rgb[j] <= 0 ) continue;
+		if ( accum1->is_integer == true ) {
+		    const long long *s = accum1->sum_i.array_ptr_cs(x, y, j);
+		    const long long *s2 = accum1->sum2_i.array_ptr_cs(x, y, j);
+		    for ( i=0 ; i < n ; i++ ) {
+			sum_chunk[i] = (double)(s[i]);
+			sum2_chunk[i] = (double)(s2[i]);
+		    }
+		    p0 = sum_chunk;
+		    p1 = sum2_chunk;
+		}
+		else {
+		    p0 = accum1->sum_d.array_ptr_cs(x, y, j);
+		    p1 = accum1->sum2_d.array_ptr_cs(x, y, j);
+		}
+		(*Mark_rejected)(p0, p1, accum1->count.array_ptr_cs(x, y, j),
+				 (src[j] != NULL) ? src[j] + x : NULL,
+				 n, a->sigma_rgb[j] / 10.0,
+				 a->av_median[j] - a->target_median[j],
+				 flags);
+	    }
+	}
+
+	/* STACK! */
+	for ( j=0 ; j < 3 ; j++ ) {
+	    accumulate_row((a->no_clip == false) ? flags : NULL,
+			   (src[j] != NULL) ? src[j] + x : NULL, n,
+			   a->accum0, x, y, j, true);
+	}
+    }
+
+    return;
+}
+
+static void stack_sigma_clip_band( size_t y_begin, size_t y_end,
+				   void *user_ptr )
+{
+    const stack_sigma_clip_args *a = (const stack_sigma_clip_args *)user_ptr;
+    const size_t width = a->accum0->x_length();
+    const float *const no_src[3] = {NULL, NULL, NULL};
+    mdarray_float row_buf(false);
+    size_t x_begin = 0, x_end = 0;
+    size_t y;
+
+    for ( y=y_begin ; y < y_end ; y++ ) {
+	const float *src[3] = {NULL, NULL, NULL};
+	if ( get_source_rows(&(a->src), width, y, &row_buf, src,
+			     &x_begin, &x_end) == false ) {
+	    /* outside of shifted frame */
+	    stack_sigma_clip_segment(a, no_src, y, 0, width);
+	}
+	else {
+	    stack_sigma_clip_segment(a, no_src, y, 0, x_begin);
+	    stack_sigma_clip_segment(a, src, y, x_begin, x_end);
+	    stack_sigma_clip_segment(a, no_src, y, x_end, width);
+	}
+    }
+
+    return;
+}
+
+static int stack_sigma_clip_source( thread_pool *pool,
+				    const stack_source &src,
+				    const stack_accum &accum1,
+				    const int sigma_rgb[],
+				    const double av_median[],
+				    const double target_median[],
+				    bool no_clip,
+				    stack_accum *accum0 )
+{
+    stack_sigma_clip_args args;
+
+    if ( src.img_buf->z_length() != 3 || accum0->count.z_length() != 3 ) {
+	return -1;
+    }
+    if ( accum0->weight < 1 || STACK_MAX_WEIGHT < accum0->weight ) {
+	return -1;
+    }
+    if ( accum1.x_length() != accum0->x_length() ||
+	 accum1.y_length() != accum0->y_length() ) return -1;
+
+    args.src = src;
+    args.accum1 = &accum1;
+    args.sigma_rgb = sigma_rgb;
+    args.av_median = av_median;
+    args.target_median = target_median;
+    args.no_clip = no_clip;
+    args.accum0 = accum0;
+
+    select_stack_kernels();
+
+    pool->run_row_bands(accum0->y_length(), &stack_sigma_clip_band,
+			(void *)&args);
+
+    return 0;
+}
+
+int stack_sigma_clip_frame( thread_pool *pool,
+			    const mdarray_float &img_buf,
+			    long offset_x, long offset_y,
+			    const stack_accum &accum1,
+			    const int sigma_rgb[],
+			    const double av_median[],
+			    const double target_median[],
+			    bool no_clip,
+			    stack_accum *accum0 )
+{
+    stack_source src;
+    set_shifted_source(img_buf, offset_x, offset_y, &src);
+    return stack_sigma_clip_source(pool, src, accum1, sigma_rgb, av_median,
+				   target_median, no_clip, accum0);
+}
+
+int stack_sigma_clip_frame_warped( thread_pool *pool,
+				   const mdarray_float &img_buf,
+				   const frame_transform &tr, int kernel,
+				   const stack_accum &accum1,
+				   const int sigma_rgb[],
+				   const double av_median[],
+				   const double target_median[],
+				   bool no_clip,
+				   stack_accum *accum0 )
+{
+    stack_source src;
+    if ( set_warped_source(img_buf, tr, kernel, accum0->is_integer,
+			   &src) < 0 ) {
+	return -1;
+    }
+    return stack_sigma_clip_source(pool, src, accum1, sigma_rgb, av_median,
+				   target_median, no_clip, accum0);
+}
+
+
+/*
+ * stack_get_average()
+ */
+
+typedef struct _stack_average_args {
+    const stack_accum *accum;
+    const double *recip;		/* recip[c] = 1/c */
+    size_t len_recip;
+    mdarray_float *img_buf;
+} stack_average_args;
+
+static void stack_average_band( size_t y_begin, size_t y_end,
+				void *user_ptr )
+{
+    const stack_average_args *a = (const stack_average_args *)user_ptr;
+    const size_t len = a->accum->x_length() * (y_end - y_begin);
+    size_t ch, k;
+
+    for ( ch=0 ; ch < 3 ; ch++ ) {
+	const int *p_cnt = a->accum->count.array_ptr_cs(0, y_begin, ch);
+	float *p_dst = a->img_buf->array_ptr(0, y_begin, ch);
+	if ( a->accum->is_integer == true ) {
+	    const long long *p_sum = a->accum->sum_i.array_ptr_cs(0, y_begin, ch);
+	    for ( k=0 ; k < len ; k++ ) {
+		const int c = p_cnt[k];
+		if ( 0 < c && (size_t)c < a->len_recip ) {
+		    p_dst[k] = (double)(p_sum[k]) * a->recip[c];
+		}
+		else {
+		    p_dst[k] = (double)(p_sum[k]) / (double)c;
+		}
+	    }
+	}
+	else {
+	    const double *p_sum = a->accum->sum_d.array_ptr_cs(0, y_begin, ch);
+	    for ( k=0 ; k < len ; k++ ) {
+		const int c = p_cnt[k];
+		if ( 0 < c && (size_t)c < a->len_recip ) {
+		    p_dst[k] = p_sum[k] * a->recip[c];
+		}
+		else {
+		    p_dst[k] = p_sum[k] / (double)c;
+		}
+	    }
+	}
+    }
+
+    return;
+}
+
+int stack_get_average( thread_pool *pool, const stack_accum &accum,
+		       size_t max_count, mdarray_float *ret_img_buf )
+{
+    mdarray_double recip(false);
+    stack_average_args args;
+    size_t i;
+
+    if ( ret_img_buf == NULL ) return -1;
+
+    /* table of reciprocals (multiplication is faster than division) */
+    recip.resize_1d(max_count + 1);
+    recip[0] = 0.0;
+    for ( i=1 ; i <= max_count ; i++ ) recip[i] = 1.0 / (double)i;
+
+    if ( ret_img_buf->x_length() != accum.x_length() ||
+	 ret_img_buf->y_length() != accum.y_length() ||
+	 ret_img_buf->z_length() != 3 ) {
+	ret_img_buf->init(false);
+	ret_img_buf->resize_3d(accum.x_length(), accum.y_length(), 3);
+    }
+
+    args.accum = &accum;
+    args.recip = recip.array_ptr_cs(0);
+    args.len_recip = recip.length();
+    args.img_buf = ret_img_buf;
+
+    pool->run_row_bands(accum.y_length(), &stack_average_band,
+			(void *)&args);
+
+    return 0;
+}
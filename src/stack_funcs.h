@@ -0,0 +1,129 @@
+#ifndef _STACK_FUNCS_H
+#define _STACK_FUNCS_H 1
+
+#include <unistd.h>
+#include <sli/mdarray.h>
+
+#include "thread_funcs.h"
+#include "transform_funcs.h"
+#include "warp_funcs.h"
+
+/*
+ * Accumulator of stacking (sum, sum^2 and count for each pixel of RGB).
+ *
+ * Integer mode is used for 8/16-bit sources (values are integers in
+ * 0..65535 after load_tiff_into_float(..., 65536.0, ...)), and sums are
+ * exact 64-bit integers.  Otherwise sums are double.  Counts are 32-bit.
+ *
+ * Frames are added with an integer weight (stack_accum::weight, 1 by
+ * default), i.e. a frame of weight w is accumulated as w copies of it,
+ * so that sums stay exact and sigma-clipping uses weighted mean/sigma.
+ * The weight is reset to 1 by init(), and is not changed by clean().
+ *
+ * The weight must be 1..STACK_MAX_WEIGHT: SIMD kernels multiply 16-bit
+ * samples by the weight in 32-bit lanes (65535 * 255 < 2^31), and the
+ * weights of all frames are summed into the 32-bit count.
+ */
+#define STACK_MAX_WEIGHT 255
+
+class stack_accum {
+
+  public:
+    stack_accum();
+
+    int init( size_t width, size_t height, bool is_integer );
+    void clean();		/* set all to 0 */
+    void release();
+
+    size_t x_length() const { return this->count.x_length(); }
+    size_t y_length() const { return this->count.y_length(); }
+    /* bytes per pixel (RGB) */
+    static size_t pixel_bytes( bool is_integer );
+
+    bool is_integer;
+    int weight;				/* weight of frames added next */
+    sli::mdarray_llong sum_i;		/* integer mode */
+    sli::mdarray_llong sum2_i;
+    sli::mdarray_double sum_d;		/* double mode */
+    sli::mdarray_double sum2_d;
+    sli::mdarray_int count;
+
+};
+
+/*
+ * Kernels of stacking, processed by row bands on thread_pool.
+ * Every pixel is computed in the same order, so the results do not
+ * depend on the number of threads or the selected SIMD kernel.
+ */
+
+/* sum(x+offset_x,y+offset_y) += w*img(x,y)                  */
+/* sum2(x+offset_x,y+offset_y) += w*img(x,y)*img(x,y)        */
+/* (count is not changed)                                    */
+int stack_add_frame( thread_pool *pool,
+		     const sli::mdarray_float &img_buf,
+		     long offset_x, long offset_y,
+		     stack_accum *accum );
+
+/* inverse of stack_add_frame(), to remove a frame from a stack   */
+/* (exact in integer mode)                                        */
+int stack_subtract_frame( thread_pool *pool,
+			  const sli::mdarray_float &img_buf,
+			  long offset_x, long offset_y,
+			  stack_accum *accum );
+
+/*
+ * One frame of a sigma-clipping pass.
+ *
+ * The shifted frame is compared with mean and sigma computed from
+ * accum1 (previous pass), and pixels not rejected are accumulated into
+ * accum0 in a single sweep.  Pixels outside of the shifted frame are
+ * treated as 0.  When no_clip is true all pixels are used (reference
+ * frame of comet mode).
+ */
+int stack_sigma_clip_frame( thread_pool *pool,
+			    const sli::mdarray_float &img_buf,
+			    long offset_x, long offset_y,
+			    const stack_accum &accum1,
+			    const int sigma_rgb[],
+			    const double av_median[],
+			    const double target_median[],
+			    bool no_clip,
+			    stack_accum *accum0 );
+
+/*
+ * Same as above, but a frame is warped by tr (frame -> reference: a
+ * sub-pixel translation or a transform with rotation) with kernel
+ * (WARP_BILINEAR, WARP_BICUBIC or WARP_LANCZOS3 of warp_funcs.h).  Rows
+ * are resampled on the fly (no warped copy of the frame is made).  In
+ * integer mode, resampled values are rounded, so that subtraction is
+ * still exact.
+ */
+int stack_add_frame_warped( thread_pool *pool,
+			    const sli::mdarray_float &img_buf,
+			    const frame_transform &tr, int kernel,
+			    stack_accum *accum );
+
+int stack_subtract_frame_warped( thread_pool *pool,
+				 const sli::mdarray_float &img_buf,
+				 const frame_transform &tr, int kernel,
+				 stack_accum *accum );
+
+int stack_sigma_clip_frame_warped( thread_pool *pool,
+				   const sli::mdarray_float &img_buf,
+				   const frame_transform &tr, int kernel,
+				   const stack_accum &accum1,
+				   const int sigma_rgb[],
+				   const double av_median[],
+				   const double target_median[],
+				   bool no_clip,
+				   stack_accum *accum0 );
+
+/* ret_img_buf = sum / count                                 */
+/* (max_count: size of table of reciprocals, e.g. n_frames)  */
+int stack_get_average( thread_pool *pool, const stack_accum &accum,
+		       size_t max_count, sli::mdarray_float *ret_img_buf );
+
+/* name of selected SIMD kernel ("scalar", "avx2" or "avx512f") */
+const char *stack_sigma_clip_kernel_name();
+
+#endif	/* _STACK_FUNCS_H */
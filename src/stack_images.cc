@@ -9,11 +9,27 @@
 #include <sli/mdarray_statistics.h>
 #include <eggx.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 #include "tiff_funcs.h"
 #include "display_image.h"
 #include "gui_base.h"
 #include "loupe_funcs.h"
+#include "frame_cache.h"
+#include "frame_prefetch.h"
+#include "frame_ring.h"
+#include "frame_stats.h"
+#include "offset_funcs.h"
+#include "thread_funcs.h"
+#include "stack_funcs.h"
+#include "checkpoint_funcs.h"
+#include "combine_funcs.h"
+#include "drizzle_funcs.h"
+#include "comet_funcs.h"
+#include "quality_funcs.h"
+#include "sys_funcs.h"
 
 using namespace sli;
 
@@ -26,6 +42,28 @@ using namespace sli;
 
 const char *Refframe_conffile = "refframe.txt";
 
+/* Fraction of physical memory used to keep decoded frames for sigma-clip */
+static const double Frame_cache_mem_ratio = 0.5;
+
+/* Minimum height of tiles for stacking with memory budget (-m) */
+static const size_t Min_tile_height = 16;
+
+/* Drizzle (-d): max scale and default pixfrac */
+static const int Max_drizzle_scale = 4;
+static const double Default_drizzle_pixfrac = 1.0;
+
+/* Max frames with marked comet nucleus (-C) */
+static const size_t Max_comet_marks = 16;
+
+/* Limits of sweep of sigma-clipping parameters (-s) */
+static const size_t Max_sigclip_settings = 16;
+static const int Max_sweep_iterations = 30;
+
+/* rotation (or scaling) in .offset.txt smaller than this at corners of */
+/* a frame is ignored, and the frame is stacked by integer offsets      */
+static const double Max_ignored_warp = 0.25;	/* pixels */
+static const double Max_ignored_shift = 0.01;	/* pixels (-i) */
+
 
 static int load_sigclip_params( const char *filename,
 			int *n_comp_dark_synth_p,
@@ -105,23 +143,6 @@ static int load_sigclip_params( const char *filename,
     return return_status;
 }
 
-static int get_offset_filename( const char *target_filename,
-				tstring *ret_filename )
-{
-    size_t i, ix = 0;
-    for ( i=0 ; target_filename[i] != '\0' ; i++ ) {
-	if ( target_filename[i] == '.' ) ix = i;
-    }
-    if ( ix != 0 ) {
-	ret_filename->assign(target_filename,ix);
-	ret_filename->append(".offset.txt");
-    }
-    else {
-	ret_filename->printf("%s.offset.txt",target_filename);
-    }
-    return 0;
-}
-
 static int save_sigclip_params( const char *filename,
 				int n_comp_dark_synth,
 				int count_sigma_clip, const int sigma_rgb[],
@@ -185,6 +206,138 @@ static int read_offset_file( const tarray_tstring &filenames, int sel_file_id,
     return ret_status;
 }
 
+/* transform of a frame parsed from its .offset.txt */
+typedef struct _frame_warp {
+    bool warped;		/* tr is used (else integer offsets) */
+    frame_transform tr;		/* identity for reference and unknown */
+} frame_warp;
+
+/*
+ * Parse .offset.txt of the reference and saved frames once before
+ * stacking, so that passes do not read them again.  A frame has to be
+ * warped when its transform has rotation (written by register_frames -m
+ * stars), or a sub-pixel offset when warp_kernel is not WARP_NONE.  The
+ * others are stacked by integer offsets.  ret_warps[] has
+ * filenames.length() elements.  Returns number of warped frames.
+ */
+static size_t load_frame_warps( const tarray_tstring &filenames,
+				long ref_file_id, int warp_kernel,
+				const mdarray_bool &flg_saved,
+				size_t width, size_t height,
+				frame_warp ret_warps[] )
+{
+    size_t i, n = 0;
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+	frame_warp *w = &ret_warps[i];
+	const frame_transform &tr = w->tr;
+	w->warped = false;
+	set_translation_transform(0.0, 0.0, &(w->tr));
+	if ( (long)i == ref_file_id || flg_saved[i] == false ) continue;
+	if ( load_frame_transform(filenames[i].cstr(), &(w->tr)) < 0 ) continue;
+	if ( get_transform_deviation(tr, width, height) < Max_ignored_warp ) {
+	    if ( warp_kernel == WARP_NONE ) continue;
+	    if ( fabs(tr.m[2] - floor(tr.m[2] + 0.5)) < Max_ignored_shift &&
+		 fabs(tr.m[5] - floor(tr.m[5] + 0.5)) < Max_ignored_shift ) {
+		continue;
+	    }
+	}
+	w->warped = true;
+	n ++;
+    }
+    return n;
+}
+
+/* number of warped frames (for modes that use integer offsets only) */
+static size_t count_warped_frames( const tarray_tstring &filenames,
+				   long ref_file_id, int warp_kernel,
+				   const mdarray_bool &flg_saved,
+				   size_t width, size_t height )
+{
+    frame_warp *warps = new frame_warp[filenames.length()];
+    const size_t n = load_frame_warps(filenames, ref_file_id, warp_kernel,
+				      flg_saved, width, height, warps);
+    delete [] warps;
+    return n;
+}
+
+/*
+ * Get median(R,G,B) of a target frame.  For a frame as loaded from file
+ * (is_raw), the sidecar statistics are used (and created if needed).
+ */
+static void get_target_median( const char *filename,
+			       const mdarray_float &img_buf, bool is_raw,
+			       double ret_median[] )
+{
+    frame_stats stats;
+    int j;
+
+    if ( is_raw == true &&
+	 get_frame_stats(filename, &img_buf, &stats) == 0 ) {
+	for ( j=0 ; j < 3 ; j++ ) ret_median[j] = stats.median[j];
+	return;
+    }
+
+    ret_median[0] = md_median(img_buf.sectionf("*,*,0"));
+    ret_median[1] = md_median(img_buf.sectionf("*,*,1"));
+    ret_median[2] = md_median(img_buf.sectionf("*,*,2"));
+
+    return;
+}
+
+/*
+ * Load a raw frame with its offsets (and medians of R,G,B when
+ * need_median is true) for dark synthesis.  Frames already in ring are
+ * not decoded again.
+ */
+static int load_frame_for_compare( const tarray_tstring &filenames,
+				   long idx_ref_img, long idx,
+				   bool need_median, frame_ring *ring,
+				   mdarray_float *ret_img_buf, int *ret_sztype,
+				   long *ret_offset_x, long *ret_offset_y,
+				   double ret_median[] )
+{
+    stdstreamio sio;
+    frame_stats stats;
+    long offset_x = 0, offset_y = 0;
+    bool has_median = false;
+    int sztype = 0;
+    int j;
+
+    if ( ring != NULL &&
+	 ring->get(idx, ret_img_buf, ret_sztype, ret_offset_x, ret_offset_y,
+		   ret_median, &has_median) == true &&
+	 (need_median == false || has_median == true) ) {
+	return 0;
+    }
+
+    if ( load_tiff_into_float(filenames[idx].cstr(), 65536.0,
+			      ret_img_buf, &sztype, NULL, NULL) < 0 ) {
+	sio.eprintf("[ERROR] load_tiff_into_float() failed\n");
+	return -1;
+    }
+    if ( idx != idx_ref_img &&
+	 read_offset_file(filenames, idx, &offset_x, &offset_y) < 0 ) {
+	sio.eprintf("[ERROR] read_offset_file() failed.\n");
+    }
+
+    for ( j=0 ; j < 3 ; j++ ) ret_median[j] = 0.0;
+    if ( need_median == true &&
+	 get_frame_stats(filenames[idx].cstr(), ret_img_buf, &stats) == 0 ) {
+	for ( j=0 ; j < 3 ; j++ ) ret_median[j] = stats.median[j];
+    }
+
+    if ( ring != NULL ) {
+	ring->put(idx, *ret_img_buf, sztype, offset_x, offset_y,
+		  (need_median == true) ? ret_median : NULL);
+    }
+
+    if ( ret_sztype != NULL ) *ret_sztype = sztype;
+    *ret_offset_x = offset_x;
+    *ret_offset_y = offset_y;
+
+    return 0;
+}
+
 /*
  * Experimental code:
  *
@@ -193,181 +346,457 @@ static int read_offset_file( const tarray_tstring &filenames, int sel_file_id,
  *
  * The green channel is used for brightness comparisons.
  *
+ * Decoded frames and their medians are kept in ring (can be NULL), so
+ * that each frame is decoded once although it is used twice.
  */
 static bool load_tiff_into_float_and_compare(
 		      const tarray_tstring &filenames,
 		      const mdarray_bool &flg_saved,
 		      long idx_ref_img, long idx_img,
 		      long offset_idx_compared, bool skylv_sigma_clip,
-		      mdarray_float *ret_img_buf )
+		      mdarray_float *ret_img_buf, int *ret_sztype,
+		      frame_ring *ring )
 {
     stdstreamio sio;
+    mdarray_float img_buf_1(false);
+    mdarray_float img_compared_buf(false);
+    long idx_compared;
+    long offset_x_0 = 0, offset_y_0 = 0;
+    long offset_x_1 = 0, offset_y_1 = 0;
+    double median_0[3] = {0.0, 0.0, 0.0};
+    double median_1[3] = {0.0, 0.0, 0.0};
     bool load_tiff_ok = false;
-    if ( load_tiff_into_float(filenames[idx_img].cstr(), 65536.0,
-			      ret_img_buf, NULL, NULL, NULL) < 0 ) {
-	sio.eprintf("[ERROR] load_tiff_into_float() failed\n");
-    }
-    else {
-	mdarray_float img_buf_1(false);
-	mdarray_float img_compared_buf(false);
-	long idx_compared;
-	if ( offset_idx_compared == 0 ) {
-	    load_tiff_ok = true;
-	    goto quit;
-	}
-	if ( idx_img + offset_idx_compared < 0 ) {
-	    goto quit;
-	}
-	if ( idx_img + offset_idx_compared < 0 ) {
+
+    if ( offset_idx_compared == 0 ) {
+	if ( load_tiff_into_float(filenames[idx_img].cstr(), 65536.0,
+				  ret_img_buf, ret_sztype, NULL, NULL) < 0 ) {
+	    sio.eprintf("[ERROR] load_tiff_into_float() failed\n");
 	    goto quit;
 	}
-	idx_compared = idx_img + offset_idx_compared;
-	/* */
-	if ( idx_compared < (long)filenames.length() &&
-	     flg_saved[idx_compared] == true ) {
-	    if ( load_tiff_into_float(
-			filenames[idx_compared].cstr(), 65536.0,
-			&img_buf_1, NULL, NULL, NULL) < 0 ) {
-		sio.eprintf("[ERROR] load_tiff_into_float() failed\n");
-	    }
-	    else {
-		long offset_x_0 = 0, offset_y_0 = 0;
-		long offset_x_1 = 0, offset_y_1 = 0;
-		if ( idx_img != idx_ref_img &&
-		     read_offset_file(filenames, idx_img,
-				      &offset_x_0, &offset_y_0) < 0 ) {
-		    sio.eprintf("[ERROR] read_offset_file() failed.\n");
-		}
-		if ( idx_compared != idx_ref_img &&
-		     read_offset_file(filenames, idx_compared,
-				      &offset_x_1, &offset_y_1) < 0 ) {
-		    sio.eprintf("[ERROR] read_offset_file() failed.\n");
-		}
-		img_compared_buf = (*ret_img_buf);		/* copy */
+	load_tiff_ok = true;
+	goto quit;
+    }
 
-		img_compared_buf.subtract(img_buf_1,	/* subtract */
-					  offset_x_1 - offset_x_0,
-					  offset_y_1 - offset_y_0,
-					  0);
-		{
-		    const float *p_cmp = img_compared_buf.array_ptr(0,0,1 /* green */);
-		    size_t j,k, xylen;
+    if ( load_frame_for_compare(filenames, idx_ref_img, idx_img,
+				skylv_sigma_clip, ring,
+				ret_img_buf, ret_sztype,
+				&offset_x_0, &offset_y_0, median_0) < 0 ) {
+	goto quit;
+    }
 
-		    double median_0[3] = {0.0, 0.0, 0.0};
-		    double median_1[3] = {0.0, 0.0, 0.0};
+    idx_compared = idx_img + offset_idx_compared;
+    if ( idx_compared < 0 ) goto quit;
+    if ( (long)filenames.length() <= idx_compared ||
+	 flg_saved[idx_compared] == false ) goto quit;
 
-		    if ( skylv_sigma_clip == true ) {
-			mdarray_float img_tmp_buf_1d(false);
-
-			ret_img_buf->copy(&img_tmp_buf_1d,
-				      0, ret_img_buf->x_length(),
-				      0, ret_img_buf->y_length(),
-				      0, 1);
-			median_0[0] = md_median(img_tmp_buf_1d);
-			ret_img_buf->copy(&img_tmp_buf_1d,
-				      0, ret_img_buf->x_length(),
-				      0, ret_img_buf->y_length(),
-				      1, 1);
-			median_0[1] = md_median(img_tmp_buf_1d);
-			ret_img_buf->copy(&img_tmp_buf_1d,
-				      0, ret_img_buf->x_length(),
-				      0, ret_img_buf->y_length(),
-				      2, 1);
-			median_0[2] = md_median(img_tmp_buf_1d);
-
-			img_buf_1.copy(&img_tmp_buf_1d,
-				   0, img_buf_1.x_length(),
-				   0, img_buf_1.y_length(),
-				   0, 1);
-			median_1[0] = md_median(img_tmp_buf_1d);
-			img_buf_1.copy(&img_tmp_buf_1d,
-				     0, img_buf_1.x_length(),
-				     0, img_buf_1.y_length(),
-				     1, 1);
-			median_1[1] = md_median(img_tmp_buf_1d);
-			img_buf_1.copy(&img_tmp_buf_1d,
-				     0, img_buf_1.x_length(),
-				     0, img_buf_1.y_length(),
-				     2, 1);
-			median_1[2] = md_median(img_tmp_buf_1d);
-		    }
+    if ( load_frame_for_compare(filenames, idx_ref_img, idx_compared,
+				skylv_sigma_clip, ring,
+				&img_buf_1, NULL,
+				&offset_x_1, &offset_y_1, median_1) < 0 ) {
+	goto quit;
+    }
 
-		    xylen = ret_img_buf->x_length() * ret_img_buf->y_length();
-
-		    /* compared GREEN ch */
-		    for ( j=0 ; j < 3 ; j++ ) {
-			float *p0 = ret_img_buf->array_ptr(0,0,j);
-			const float *p1 = img_compared_buf.array_ptr(0,0,j);
-			double diff = - median_0[j] + median_1[j];
-			double diff_cmp = - median_0[1] + median_1[1];	/* GREEN */
-			for ( k=0 ; k < xylen ; k++ ) {
-			    if ( 0 < (p_cmp[k] + diff_cmp) ) {
-				p0[k] = - (p1[k] - p0[k]);
-				p0[k] -= diff;
-			    }
-			}
-		    }
+    img_compared_buf = (*ret_img_buf);		/* copy */
+
+    img_compared_buf.subtract(img_buf_1,	/* subtract */
+			      offset_x_1 - offset_x_0,
+			      offset_y_1 - offset_y_0,
+			      0);
+    {
+	const float *p_cmp = img_compared_buf.array_ptr(0,0,1 /* green */);
+	size_t j,k, xylen;
+
+	xylen = ret_img_buf->x_length() * ret_img_buf->y_length();
+
+	/* compared GREEN ch */
+	for ( j=0 ; j < 3 ; j++ ) {
+	    float *p0 = ret_img_buf->array_ptr(0,0,j);
+	    const float *p1 = img_compared_buf.array_ptr(0,0,j);
+	    double diff = - median_0[j] + median_1[j];
+	    double diff_cmp = - median_0[1] + median_1[1];	/* GREEN */
+	    for ( k=0 ; k < xylen ; k++ ) {
+		if ( 0 < (p_cmp[k] + diff_cmp) ) {
+		    p0[k] = - (p1[k] - p0[k]);
+		    p0[k] -= diff;
 		}
-		load_tiff_ok = true;
 	    }
 	}
     }
+    load_tiff_ok = true;
 
  quit:
     return load_tiff_ok;
 }
 
-static int do_stack_and_save( const tarray_tstring &filenames,
+/*
+ * Sums are exact integers when the reference and all selected frames are
+ * 8/16-bit and dark synthesis (which makes fractions) is off.  Sample
+ * formats are read from TIFF headers (no rows are decoded), so that a
+ * float frame in the set selects the double accumulator before 1st pass.
+ */
+static bool is_integer_stack( const tarray_tstring &filenames,
 			      int ref_file_id, const mdarray_bool &flg_saved,
-			      int n_comp_dark_synth,
-			      int count_sigma_clip, const int sigma_rgb[], 
-			      bool skylv_sigma_clip, bool comet_sigma_clip, 
-			      bool flag_dither, bool flag_preview,
-			      int display_bin, int display_ch, 
-			      const int contrast_rgb[],
-			      int win_image, mdarray_uchar *tmp_buf )
+			      int n_comp_dark_synth )
+{
+    stdstreamio sio;
+    size_t i;
+
+    if ( n_comp_dark_synth != 0 ) return false;
+
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+	int sztype = 0;
+	if ( (int)i != ref_file_id && flg_saved[i] == false ) continue;
+	if ( load_tiff_rows_into_float(filenames[i].cstr(), 65536.0,
+				       0, 0, NULL, &sztype, NULL, NULL,
+				       NULL, NULL) < 0 ) {
+	    sio.eprintf("[WARNING] cannot read header of '%s'\n",
+			filenames[i].cstr());
+	    return false;
+	}
+	if ( sztype != 1 && sztype != 2 ) {
+	    sio.printf("Not an 8/16-bit frame: %s\n", filenames[i].cstr());
+	    return false;
+	}
+    }
+
+    return true;
+}
+
+/* arguments for frame loader in prefetch threads */
+typedef struct _stack_loader_args {
+    const tarray_tstring *filenames;
+    const mdarray_bool *flg_saved;
+    long ref_file_id;
+    int n_comp_dark_synth;
+    bool skylv_sigma_clip;
+    long band_y;			/* tile mode: top of band in ref frame */
+    long band_height;			/* tile mode: rows of band (0: off) */
+    const frame_cache *fcache;
+    frame_ring *ring;			/* for dark synthesis (can be NULL) */
+} stack_loader_args;
+
+/* called in prefetch threads */
+static int load_frame_for_stacking( long idx, mdarray_float *ret_img_buf,
+				    long *ret_offset_x, long *ret_offset_y,
+				    void *user_ptr )
+{
+    stdstreamio sio;
+    const stack_loader_args *args_p = (const stack_loader_args *)user_ptr;
+    int sztype = 0;
+    int ret_status = -1;
+
+    if ( idx != args_p->ref_file_id ) {
+	if ( read_offset_file(*(args_p->filenames), idx,
+			      ret_offset_x, ret_offset_y) < 0 ) {
+	    sio.eprintf("[ERROR] read_offset_file() failed.\n");
+	}
+    }
+
+    /* decoded frames are reused when cached */
+    if ( args_p->fcache == NULL ||
+	 args_p->fcache->get(idx, ret_img_buf) == false ) {
+	if ( 0 < args_p->band_height ) {
+	    /* tile mode: only rows overlapping the band are decoded */
+	    if ( load_tiff_rows_into_float(
+			(*(args_p->filenames))[idx].cstr(), 65536.0,
+			args_p->band_y - (*ret_offset_y), args_p->band_height,
+			ret_img_buf, &sztype, NULL, NULL, NULL, NULL) < 0 ) {
+		sio.eprintf("[ERROR] load_tiff_rows_into_float() failed\n");
+		goto quit;
+	    }
+	}
+	else if ( load_tiff_into_float_and_compare(
+			*(args_p->filenames), *(args_p->flg_saved),
+			args_p->ref_file_id, idx,
+			args_p->n_comp_dark_synth, args_p->skylv_sigma_clip,
+			ret_img_buf, &sztype, args_p->ring ) == false ) {
+	    goto quit;
+	}
+    }
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
+
+/* a setting of sweep of sigma-clipping parameters (-s) */
+typedef struct _sigclip_setting {
+    int sigma;			/* x10 (same as sigma_rgb) */
+    int n_iterations;		/* 0: count_sigma_clip */
+} sigclip_setting;
+
+/* "20,25x2,30" => {20,0},{25,2},{30,0} */
+static int parse_sigclip_settings( const char *str,
+				   sigclip_setting ret_settings[],
+				   size_t max_settings, size_t *ret_n )
+{
+    tarray_tstring items;
+    size_t i, n = 0;
+
+    items.split(str, ",", false);
+    for ( i=0 ; i < items.length() ; i++ ) {
+	tarray_tstring vals;
+	if ( max_settings <= n ) return -1;
+	vals.split(items[i].cstr(), "x", false);
+	if ( vals.length() < 1 || 2 < vals.length() ) return -1;
+	ret_settings[n].sigma = vals[0].atoi();
+	ret_settings[n].n_iterations = 0;
+	if ( vals.length() == 2 ) ret_settings[n].n_iterations = vals[1].atoi();
+	if ( ret_settings[n].sigma <= 0 ||
+	     ret_settings[n].n_iterations < 0 ||
+	     Max_sweep_iterations < ret_settings[n].n_iterations ) return -1;
+	n ++;
+    }
+    if ( n == 0 ) return -1;
+
+    *ret_n = n;
+    return 0;
+}
+
+/* a series of sigma-clipping iterations with a set of sigma values */
+typedef struct _sigclip_track {
+    int sigma_rgb[3];
+    int n_iterations;
+    unsigned long output_mask;	/* bit n: output after n iterations  */
+				/* (0: output after n_iterations only) */
+    stack_accum *accum_buf[2];
+    stack_accum *accum0_ptr;	/* new result */
+    stack_accum *accum1_ptr;	/* result of previous pass */
+    double av_median[3];
+} sigclip_track;
+
+static bool is_sigclip_output( const sigclip_track &trk, int n_iter )
+{
+    if ( trk.output_mask == 0 ) return ( n_iter == trk.n_iterations );
+    return ( ((trk.output_mask >> n_iter) & 1) != 0 );
+}
+
+/*
+ * Build tracks from settings.  Settings with the same sigma share a track
+ * (outputs are taken at intermediate iterations), except in comet mode
+ * where the final iteration is special.
+ * Without settings, a single track of sigma_rgb is returned.
+ */
+static size_t build_sigclip_tracks( const sigclip_setting settings[],
+				    size_t n_settings,
+				    int count_sigma_clip, const int sigma_rgb[],
+				    bool comet_sigma_clip,
+				    sigclip_track ret_tracks[] )
+{
+    size_t i, j, t, n_tracks = 0;
+
+    if ( n_settings == 0 ) {
+	for ( j=0 ; j < 3 ; j++ ) ret_tracks[0].sigma_rgb[j] = sigma_rgb[j];
+	ret_tracks[0].n_iterations = count_sigma_clip;
+	ret_tracks[0].output_mask = 0;
+	return 1;
+    }
+
+    for ( i=0 ; i < n_settings ; i++ ) {
+	int n_iter = settings[i].n_iterations;
+	if ( n_iter == 0 ) n_iter = count_sigma_clip;
+	if ( n_iter < 1 ) n_iter = 1;
+	if ( Max_sweep_iterations < n_iter ) n_iter = Max_sweep_iterations;
+	t = n_tracks;
+	if ( comet_sigma_clip == false ) {
+	    for ( t=0 ; t < n_tracks ; t++ ) {
+		if ( ret_tracks[t].sigma_rgb[0] == settings[i].sigma ) break;
+	    }
+	}
+	if ( t == n_tracks ) {
+	    for ( j=0 ; j < 3 ; j++ ) {
+		ret_tracks[t].sigma_rgb[j] = settings[i].sigma;
+	    }
+	    ret_tracks[t].n_iterations = 0;
+	    ret_tracks[t].output_mask = 0;
+	    n_tracks ++;
+	}
+	if ( ret_tracks[t].n_iterations < n_iter ) {
+	    ret_tracks[t].n_iterations = n_iter;
+	}
+	ret_tracks[t].output_mask |= (1UL << n_iter);
+    }
+
+    return n_tracks;
+}
+
+/*
+ * Resume the 1st pass of stacking from a checkpoint.
+ *
+ * Frames of the checkpoint that are no longer selected (or whose offsets
+ * have been changed) are subtracted from accum, and selected frames not
+ * in the checkpoint are returned in ret_idx_list to be added.  ret_ckpt
+ * is set to the list of frames kept in accum.  The contribution of a
+ * modified file (size or mtime) cannot be subtracted, so the checkpoint
+ * is not used when the reference, a kept frame or a removed frame has
+ * been modified.
+ * Returns 0 on success; on error, accum must be rebuilt from scratch.
+ */
+static int resume_stack_checkpoint( thread_pool *pool,
+				    const tarray_tstring &filenames,
+				    int ref_file_id,
+				    const mdarray_bool &flg_saved,
+				    int ref_sztype, size_t width, size_t height,
+				    const char *checkpoint_file,
+				    stack_checkpoint *ret_ckpt,
+				    stack_accum *accum,
+				    mdarray_long *ret_idx_list,
+				    size_t *ret_n_idx )
 {
     stdstreamio sio;
-    mdarray_float stacked_buf0_sum(false);
-    mdarray_float stacked_buf0_sum2(false);
-    mdarray_float stacked_buf1_sum(false);
-    mdarray_float stacked_buf1_sum2(false);
-    mdarray_float *stacked_buf_result_ptr = NULL;
-    mdarray_short count_buf0(false);
-    mdarray_short count_buf1(false);
-    mdarray_short *count_buf_result_ptr = NULL;
-    mdarray_uchar flag_buf(false);
+    stack_checkpoint old_ckpt;
+    mdarray_bool flg_kept(false);
     mdarray_float img_buf(false);
-    mdarray_float img_tmp_buf(false);
-    mdarray_float img_tmp_buf_1d(false);
-    mdarray_uchar icc_buf(false);
-    size_t i, ii, n_plus;
-    tstring appended_str;
-    tstring out_filename;
-    int cnt;
-    
+    size_t i, n_idx = 0, n_removed = 0;
     int ret_status = -1;
-    
-    if ( filenames.length() == 0 ) goto quit;
-    if ( flg_saved.length() == 0 ) goto quit;
-    if ( ref_file_id < 0 ) goto quit;
-    if ( filenames.length() <= (size_t)ref_file_id ) goto quit;
 
-    /* determine on/off of sigma-clip */
-    if ( sigma_rgb[0] <= 0 && sigma_rgb[1] <= 0 && sigma_rgb[2] <= 0 ) {
-	count_sigma_clip = 0;
+    if ( load_stack_checkpoint(checkpoint_file, &old_ckpt, accum) < 0 ) {
+	sio.printf("No valid checkpoint in '%s'\n", checkpoint_file);
+	goto quit;
+    }
+    if ( old_ckpt.is_reference(filenames[ref_file_id].cstr()) == false ||
+	 old_ckpt.ref_sztype != ref_sztype ||
+	 old_ckpt.has_ref == false || old_ckpt.n_iterations != 0 ||
+	 old_ckpt.n_workers != 0 || accum->is_integer == false ||
+	 accum->x_length() != width || accum->y_length() != height ) {
+	sio.printf("Checkpoint '%s' does not match reference frame "
+		   "(or it has been modified)\n", checkpoint_file);
+	goto quit;
     }
 
-    sio.printf("sigma-clipping: [N_iterations=%d,  value=(%d,%d,%d),  sky-level=%d,  comet=%d]  "
-	       "dither=%d\n",
-	       count_sigma_clip, sigma_rgb[0], sigma_rgb[1], sigma_rgb[2],
-	       (int)skylv_sigma_clip, (int)comet_sigma_clip, (int)flag_dither);
+    ret_ckpt->clear();
+    ret_ckpt->set_reference(filenames[ref_file_id].cstr(), ref_sztype);
+
+    flg_kept.resize_1d(old_ckpt.length() + 1);
+    flg_kept = false;
+
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+	long offset_x = 0, offset_y = 0;
+	long j;
+	if ( (int)i == ref_file_id || flg_saved[i] == false ) continue;
+	if ( read_offset_file(filenames, i, &offset_x, &offset_y) < 0 ) {
+	    sio.eprintf("[ERROR] read_offset_file() failed.\n");
+	}
+	j = old_ckpt.find_frame(filenames[i].cstr());
+	if ( 0 <= j && flg_kept[j] == false &&
+	     old_ckpt.offset_x[j] == offset_x &&
+	     old_ckpt.offset_y[j] == offset_y ) {
+	    if ( old_ckpt.is_frame_modified(j) == true ) {
+		sio.printf("Frame in checkpoint has been modified: %s\n",
+			   filenames[i].cstr());
+		goto quit;
+	    }
+	    flg_kept[j] = true;
+	    ret_ckpt->append_frame(filenames[i].cstr(), offset_x, offset_y);
+	}
+	else {
+	    (*ret_idx_list)[n_idx] = i;
+	    n_idx ++;
+	}
+    }
+
+    /* remove frames not selected any more */
+    for ( i=0 ; i < old_ckpt.length() ; i++ ) {
+	int sztype = 0;
+	if ( flg_kept[i] == true ) continue;
+	if ( old_ckpt.is_frame_modified(i) == true ) {
+	    sio.printf("Frame in checkpoint has been modified "
+		       "(or removed): %s\n", old_ckpt.frame_names[i].cstr());
+	    goto quit;
+	}
+	sio.printf("Removing [%s]\n", old_ckpt.frame_names[i].cstr());
+	if ( load_tiff_into_float(old_ckpt.frame_names[i].cstr(), 65536.0,
+				  &img_buf, &sztype, NULL, NULL) < 0 ) {
+	    sio.eprintf("[ERROR] load_tiff_into_float() failed\n");
+	    goto quit;
+	}
+	if ( sztype != ref_sztype ||
+	     stack_subtract_frame(pool, img_buf, old_ckpt.offset_x[i],
+				  old_ckpt.offset_y[i], accum) < 0 ) {
+	    sio.eprintf("[ERROR] cannot remove frame from checkpoint\n");
+	    goto quit;
+	}
+	n_removed ++;
+    }
+
+    sio.printf("Resuming from checkpoint: %zd frames kept, %zd removed, "
+	       "%zd to be added\n", ret_ckpt->length(), n_removed, n_idx);
+
+    *ret_n_idx = n_idx;
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
+
+/* weight of a frame in stacking (frame_weights of length 0: all 1) */
+static int get_frame_weight( const mdarray_int &frame_weights, size_t idx )
+{
+    if ( frame_weights.length() <= idx ) return 1;
+    if ( frame_weights[idx] < 1 ) return 1;
+    return frame_weights[idx];
+}
+
+/*
+ * Frames of weight 0 in quality table (-q) are removed from flg_stacked.
+ * Frames not found in the table (weight < 0) are stacked with weight 1,
+ * and a warning is shown for such frames to be stacked.
+ * Returns number of removed frames.
+ */
+static size_t select_frames_by_weight( const tarray_tstring &filenames,
+				       mdarray_int *frame_weights,
+				       int ref_file_id,
+				       mdarray_bool *flg_stacked )
+{
+    stdstreamio sio;
+    size_t i, n_removed = 0;
+
+    for ( i=0 ; i < frame_weights->length() ; i++ ) {
+	if ( (*frame_weights)[i] < 0 ) {
+	    if ( (int)i == ref_file_id ||
+		 (i < flg_stacked->length() && (*flg_stacked)[i] == true) ) {
+		sio.eprintf("[WARNING] not found in quality table (-q); "
+			    "stacked with weight 1: %s\n",
+			    filenames[i].cstr());
+	    }
+	}
+	else if ( (*frame_weights)[i] == 0 ) {
+	    if ( (int)i == ref_file_id ) {
+		sio.eprintf("[WARNING] reference frame is not selected "
+			    "in quality table; stacked with weight 1\n");
+		(*frame_weights)[i] = 1;
+	    }
+	    else if ( i < flg_stacked->length() &&
+		      (*flg_stacked)[i] == true ) {
+		(*flg_stacked)[i] = false;
+		n_removed ++;
+	    }
+	}
+    }
+
+    return n_removed;
+}
+
+/*
+ * Load the reference frame for stacking (with dark synthesis) and its
+ * ICC profile (sRGB when the frame has none).  Sums are exact integers
+ * (ret_is_integer) when is_integer_stack() is true.
+ */
+static int load_stack_reference( const tarray_tstring &filenames,
+				 int ref_file_id, const mdarray_bool &flg_saved,
+				 int n_comp_dark_synth, bool skylv_sigma_clip,
+				 mdarray_float *ret_img_buf, int *ret_sztype,
+				 mdarray_uchar *ret_icc_buf,
+				 bool *ret_is_integer )
+{
+    stdstreamio sio;
+    int ret_status = -1;
 
-    /* load reference ... needs for ICC data */
     sio.printf("Stacking [%s]\n", filenames[ref_file_id].cstr());
 
     if ( load_tiff_into_float(filenames[ref_file_id].cstr(), 65536.0,
-			      &img_buf, NULL, &icc_buf, NULL) < 0 ) {
+			      ret_img_buf, ret_sztype,
+			      ret_icc_buf, NULL) < 0 ) {
 	sio.eprintf("[ERROR] load_tiff_into_float() failed\n");
 	goto quit;
     }
@@ -375,335 +804,2238 @@ static int do_stack_and_save( const tarray_tstring &filenames,
     if ( load_tiff_into_float_and_compare(
 			filenames, flg_saved, ref_file_id, ref_file_id,
 			n_comp_dark_synth, skylv_sigma_clip,
-			&img_buf ) == false ) {
+			ret_img_buf, NULL, NULL ) == false ) {
 	sio.eprintf("[ERROR] load_tiff_into_float_and_compare() failed\n");
 	goto quit;
     }
 
+    if ( ret_icc_buf->length() == 0 ) {
+	ret_icc_buf->resize_1d(sizeof(Icc_srgb_profile));
+	ret_icc_buf->put_elements(Icc_srgb_profile,sizeof(Icc_srgb_profile));
+    }
+
+    *ret_is_integer = is_integer_stack(filenames, ref_file_id, flg_saved,
+				       n_comp_dark_synth);
+    sio.printf("Accumulator: %s\n", (*ret_is_integer == true) ?
+	       "64-bit integer (exact)" : "double");
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
+
+/*
+ * Alignment of frame idx in a stack: offset_x and offset_y (read from
+ * .offset.txt) are adjusted, or a transform is returned (NULL: the frame
+ * is stacked by integer offsets).
+ */
+typedef const frame_transform *(*stack_align_func)( long idx,
+				long *offset_x, long *offset_y,
+				const void *user_ptr );
+
+/* aligned by stars: user_ptr is frame_warp[] of load_frame_warps() */
+static const frame_transform *align_by_stars( long idx,
+				long *offset_x, long *offset_y,
+				const void *user_ptr )
+{
+    const frame_warp *warps = (const frame_warp *)user_ptr;
+    if ( warps[idx].warped == true ) return &(warps[idx].tr);
+    return NULL;
+}
+
+/*
+ * A stack made by stack_frames_and_save(): frames are aligned by
+ * align_func, and the result of the 1st pass (accum_1st) is refined by
+ * sigma-clipping tracks.  Track t uses tracks[t].accum_buf[0,1], where
+ * accum_buf[1] of track 0 can be accum_1st (reused after 1st iteration).
+ * name is used for output files ("+<N>frames_<name>.tiff").
+ */
+typedef struct _stack_target {
+    const char *name;
+    stack_align_func align_func;
+    const void *align_user;
+    stack_accum *accum_1st;
+    sigclip_track *tracks;
+    size_t n_tracks;
+} stack_target;
+
+/* add a frame aligned by integer offsets or transform (tr != NULL) */
+static void add_aligned_frame( thread_pool *pool,
+			       const mdarray_float &img_buf,
+			       long offset_x, long offset_y,
+			       const frame_transform *tr,
+			       int kernel, stack_accum *accum )
+{
+    if ( tr != NULL ) {
+	stack_add_frame_warped(pool, img_buf, *tr, kernel, accum);
+    }
+    else {
+	stack_add_frame(pool, img_buf, offset_x, offset_y, accum);
+    }
+    return;
+}
+
+static void sigma_clip_aligned_frame( thread_pool *pool,
+				      const mdarray_float &img_buf,
+				      long offset_x, long offset_y,
+				      const frame_transform *tr,
+				      int kernel, const stack_accum &accum1,
+				      const int sigma_rgb[],
+				      const double av_median[],
+				      const double target_median[],
+				      bool no_clip, stack_accum *accum0 )
+{
+    if ( tr != NULL ) {
+	stack_sigma_clip_frame_warped(pool, img_buf, *tr, kernel, accum1,
+			sigma_rgb, av_median, target_median, no_clip, accum0);
+    }
+    else {
+	stack_sigma_clip_frame(pool, img_buf, offset_x, offset_y, accum1,
+			sigma_rgb, av_median, target_median, no_clip, accum0);
+    }
+    return;
+}
+
+/* median(R,G,B) of averaged image (img_buf and img_buf_1d are work) */
+static void get_average_median( thread_pool *pool, const stack_accum &accum,
+				size_t n_frames, mdarray_float *img_buf,
+				mdarray_float *img_buf_1d,
+				double ret_median[] )
+{
+    int j;
+    stack_get_average(pool, accum, n_frames, img_buf);
+    for ( j=0 ; j < 3 ; j++ ) {
+	img_buf->copy(img_buf_1d, 0, img_buf->x_length(),
+		      0, img_buf->y_length(), j, 1);
+	ret_median[j] = md_median(*img_buf_1d);
+    }
+    return;
+}
+
+/*
+ * Driver of stacking shared by do_stack_and_save() and
+ * do_comet_stack_and_save().  img_buf has the reference frame loaded by
+ * load_stack_reference().  All stacks (targets) and their tracks are
+ * updated from a frame while it is in memory, so that each frame is
+ * decoded only once per pass.  Accumulators of targets are initialized
+ * here.  checkpoint_file (can be NULL) needs a single target.
+ * With sweep_names, outputs of tracks are named by sigma and iterations.
+ */
+static int stack_frames_and_save( const tarray_tstring &filenames,
+			      int ref_file_id, const mdarray_bool &flg_saved,
+			      const mdarray_int &frame_weights,
+			      int n_comp_dark_synth,
+			      stack_target targets[], size_t n_targets,
+			      bool sweep_names, const char *checkpoint_file,
+			      bool skylv_sigma_clip, bool comet_sigma_clip,
+			      bool flag_dither, bool flag_preview,
+			      int warp_kernel,
+			      int n_loader_threads, int prefetch_depth,
+			      int n_compute_threads,
+			      int display_bin, int display_ch,
+			      const int contrast_rgb[],
+			      int win_image, mdarray_uchar *tmp_buf,
+			      mdarray_float *img_buf,
+			      const mdarray_uchar &icc_buf,
+			      int ref_sztype, bool is_integer )
+{
+    stdstreamio sio;
+    const size_t width = img_buf->x_length();
+    const size_t height = img_buf->y_length();
+    /* preview shows the last target */
+    stack_target *tgt_view = &targets[n_targets - 1];
+    int max_iterations = 0;
+    size_t n_accum = 0;			/* initialized accumulators */
+    mdarray_float img_tmp_buf(false);
+    mdarray_float img_tmp_buf_1d(false);
+    frame_cache fcache;			/* decoded frames for sigma-clip */
+    frame_ring ring;			/* raw frames for dark synthesis */
+    frame_prefetch prefetch;		/* background frame loading */
+    thread_pool tpool;			/* threads for stacking kernels */
+    stack_loader_args loader_args;
+    stack_checkpoint ckpt;		/* frames in 1st pass (-k) */
+    bool resumed = false;
+    mdarray_long idx_list(false);	/* list of frames to be loaded */
+    size_t n_idx;
+    long idx;
+    size_t i, ii, k, t, n_plus;
+    size_t sum_weight;			/* sum of weights of stacked frames */
+    /* rotated frames are interpolated even without -i */
+    const int resample_kernel =
+	(warp_kernel == WARP_NONE) ? WARP_BILINEAR : warp_kernel;
+    tstring appended_str;
+    int cnt;
+
+    int ret_status = -1;
+
+    if ( n_targets == 0 ) goto quit;
+    if ( checkpoint_file != NULL && n_targets != 1 ) goto quit;
+
+    /* allocate memory */
+    for ( k=0 ; k < n_targets ; k++ ) {
+	stack_target *tgt = &targets[k];
+	tgt->accum_1st->init(width, height, is_integer);
+	n_accum ++;
+	for ( t=0 ; t < tgt->n_tracks ; t++ ) {
+	    sigclip_track *trk = &(tgt->tracks[t]);
+	    trk->accum0_ptr = NULL;
+	    trk->accum1_ptr = tgt->accum_1st;
+	    if ( max_iterations < trk->n_iterations ) {
+		max_iterations = trk->n_iterations;
+	    }
+	    if ( 0 < trk->n_iterations ) {
+		trk->accum_buf[0]->init(width, height, is_integer);
+		n_accum ++;
+	    }
+	    if ( 1 < trk->n_iterations &&
+		 trk->accum_buf[1] != tgt->accum_1st ) {
+		trk->accum_buf[1]->init(width, height, is_integer);
+		n_accum ++;
+	    }
+	}
+    }
+    if ( 0 < max_iterations && skylv_sigma_clip == true ) {
+	/* for median of averaged image */
+	img_tmp_buf.resize(*img_buf);
+	img_tmp_buf_1d.resize_2d(width, height);
+    }
+
+    n_plus = 0;
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+        if ( flg_saved[i] == true ) n_plus ++;
+    }
+
+    /* prepare cache of decoded frames for sigma-clipping passes */
+    if ( 0 < max_iterations ) {
+	uint64_t mem_bytes = get_physical_memory_bytes();
+	uint64_t max_ram_bytes = 0;
+	/* accumulators, tmp, img, etc. */
+	uint64_t work_bytes = (uint64_t)n_accum
+			      * stack_accum::pixel_bytes(is_integer)
+			      * width * height
+			      + (uint64_t)4 * img_buf->bytes()
+			      * img_buf->length();
+	if ( work_bytes < mem_bytes * Frame_cache_mem_ratio ) {
+	    max_ram_bytes = mem_bytes * Frame_cache_mem_ratio - work_bytes;
+	}
+	if ( fcache.init(width, height, filenames.length(), 1 + n_plus,
+			 max_ram_bytes, NULL) < 0 ) {
+	    sio.eprintf("[WARNING] frame cache is disabled\n");
+	}
+	else {
+	    fcache.put(ref_file_id, *img_buf);
+	}
+    }
+
+    if ( tpool.start(n_compute_threads) < 0 ) {
+	sio.eprintf("[ERROR] tpool.start() failed\n");
+	goto quit;
+    }
+    sio.printf("Using %zd threads for stacking (kernel: %s)\n",
+	       tpool.length(), stack_sigma_clip_kernel_name());
+
+    idx_list.resize_1d(1 + n_plus);
+
+    /* only added/removed frames are processed when resumed */
+    if ( checkpoint_file != NULL ) {
+	if ( resume_stack_checkpoint(&tpool, filenames, ref_file_id,
+			flg_saved, ref_sztype, width, height,
+			checkpoint_file, &ckpt, targets[0].accum_1st,
+			&idx_list, &n_idx) == 0 ) {
+	    resumed = true;
+	}
+	else {
+	    targets[0].accum_1st->init(width, height, is_integer);
+	}
+    }
+    if ( resumed == false ) {
+	ckpt.clear();
+	ckpt.set_reference(filenames[ref_file_id].cstr(), ref_sztype);
+
+	/* paste 1st image */
+	for ( k=0 ; k < n_targets ; k++ ) {
+	    stack_accum *accum = targets[k].accum_1st;
+	    accum->weight = get_frame_weight(frame_weights, ref_file_id);
+	    stack_add_frame(&tpool, *img_buf, 0, 0, accum);
+	}
+
+	n_idx = 0;
+	for ( i=0 ; i < filenames.length() ; i++ ) {
+	    if ( flg_saved[i] == true ) {
+		idx_list[n_idx] = i;
+		n_idx ++;
+	    }
+	}
+    }
+
+    winname(win_image, "Stacking ...");
+    if ( flag_preview == true ) {
+        display_image(win_image, 0, 0, *img_buf, 2,
+		      display_bin, display_ch, contrast_rgb, false, tmp_buf);
+    }
+
+    loader_args.filenames = &filenames;
+    loader_args.flg_saved = &flg_saved;
+    loader_args.ref_file_id = ref_file_id;
+    loader_args.n_comp_dark_synth = n_comp_dark_synth;
+    loader_args.skylv_sigma_clip = skylv_sigma_clip;
+    loader_args.band_y = 0;
+    loader_args.band_height = 0;
+    loader_args.fcache = NULL;
+    loader_args.ring = NULL;
+
+    /* raw frames shared by targets and compared frames */
+    if ( n_comp_dark_synth != 0 ) {
+	ring.init(abs(n_comp_dark_synth) + n_loader_threads + prefetch_depth + 1);
+	loader_args.ring = &ring;
+    }
+
+    /*
+     *  1st pass
+     */
+    if ( prefetch.start(idx_list.array_ptr(), n_idx,
+			n_loader_threads, prefetch_depth,
+			&load_frame_for_stacking, (void *)&loader_args) < 0 ) {
+	sio.eprintf("[ERROR] prefetch.start() failed\n");
+	goto quit;
+    }
+
+    ii = 1 + ckpt.length();
+    /* (weights are 1 when resumed from checkpoint) */
+    sum_weight = (resumed == true) ?
+		 ii : get_frame_weight(frame_weights, ref_file_id);
+    while ( 1 ) {
+	bool load_tiff_ok;
+	long offset_x = 0, offset_y = 0;
+	int weight;
+
+	if ( prefetch.next(&idx, &load_tiff_ok, img_buf,
+			   &offset_x, &offset_y) == false ) break;
+
+	if ( load_tiff_ok == false ) continue;
+	ii ++;
+	weight = get_frame_weight(frame_weights, idx);
+	sum_weight += weight;
+
+	sio.printf("Stacking [%s]\n", filenames[idx].cstr());
+
+	if ( 0 < max_iterations ) fcache.put(idx, *img_buf);
+
+	/* STACK! */
+	for ( k=0 ; k < n_targets ; k++ ) {
+	    const stack_target *tgt = &targets[k];
+	    long ox = offset_x, oy = offset_y;
+	    const frame_transform *tr =
+		(*(tgt->align_func))(idx, &ox, &oy, tgt->align_user);
+	    tgt->accum_1st->weight = weight;
+	    add_aligned_frame(&tpool, *img_buf, ox, oy, tr,
+			      resample_kernel, tgt->accum_1st);
+	}
+	ckpt.append_frame(filenames[idx].cstr(), offset_x, offset_y);
+
+	if ( flag_preview == true ) {
+	    tgt_view->accum_1st->count = (int)sum_weight;
+	    stack_get_average(&tpool, *(tgt_view->accum_1st), sum_weight,
+			      img_buf);
+	    /* display stacked image */
+	    display_image(win_image, 0, 0, *img_buf, 2,
+		    display_bin, display_ch, contrast_rgb, false, tmp_buf);
+	}
+
+	winname(win_image, "Stacking %zd/%zd", ii, (size_t)(1+n_plus));
+    }
+    prefetch.stop();
+
+    n_plus = ii - 1;
+
+    for ( k=0 ; k < n_targets ; k++ ) {
+	targets[k].accum_1st->count = (int)sum_weight;
+    }
+
+    if ( checkpoint_file != NULL ) {
+	sio.printf("Writing checkpoint '%s' ...\n", checkpoint_file);
+	if ( save_stack_checkpoint(checkpoint_file, ckpt,
+				   *(targets[0].accum_1st)) < 0 ) {
+	    sio.eprintf("[WARNING] save_stack_checkpoint() failed\n");
+	}
+    }
+
+    /* save targets without sigma-clipping */
+    for ( k=0 ; k < n_targets ; k++ ) {
+	const stack_target *tgt = &targets[k];
+	bool clipped = false;
+	for ( t=0 ; t < tgt->n_tracks ; t++ ) {
+	    if ( 0 < tgt->tracks[t].n_iterations ) clipped = true;
+	}
+	if ( clipped == true ) continue;
+	stack_get_average(&tpool, *(tgt->accum_1st), sum_weight, img_buf);
+	appended_str.printf("+%zdframes_%s", n_plus, tgt->name);
+	if ( save_stacked_image(filenames[ref_file_id].cstr(),
+				appended_str.cstr(), *img_buf, icc_buf,
+				flag_dither) < 0 ) {
+	    goto quit;
+	}
+    }
+
+    /* display stacked image */
+    stack_get_average(&tpool, *(tgt_view->accum_1st), sum_weight, img_buf);
+    display_image(win_image, 0, 0, *img_buf, 2,
+		  display_bin, display_ch, contrast_rgb, false, tmp_buf);
+
+
+    /*
+     *  Perform Sigma-Clipping ...
+     *
+     *  Tracks of a target use its own result of the previous pass, so
+     *  that the moving nucleus is rejected in the stack of stars and
+     *  stars are rejected in the stack of comet (comet mode).
+     */
+
+    /* reference and selected frames, with cached frames */
+    n_idx = 0;
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+	if ( (int)i == ref_file_id || flg_saved[i] == true ) {
+	    idx_list[n_idx] = i;
+	    n_idx ++;
+	}
+    }
+    loader_args.fcache = &fcache;
+
+    for ( cnt=0 ; cnt < max_iterations ; cnt++ ) {
+
+	sio.printf("*** Sigma-Clipping count of iterations = %d / %d ***\n",
+		   cnt + 1, max_iterations);
+
+	for ( k=0 ; k < n_targets ; k++ ) {
+	    stack_target *tgt = &targets[k];
+	    for ( t=0 ; t < tgt->n_tracks ; t++ ) {
+		sigclip_track *trk = &(tgt->tracks[t]);
+		int j;
+
+		if ( trk->n_iterations <= cnt ) continue;
+
+		/* swap buffer pointer (1st pass is used at 1st iteration) */
+		trk->accum0_ptr = trk->accum_buf[cnt % 2];
+		if ( cnt == 0 ) trk->accum1_ptr = tgt->accum_1st;
+		else trk->accum1_ptr = trk->accum_buf[(cnt + 1) % 2];
+
+		for ( j=0 ; j < 3 ; j++ ) trk->av_median[j] = 1.0;
+
+		if ( skylv_sigma_clip == true ) {
+		    if ( cnt == 0 && 0 < t ) {
+			/* same 1st pass as track 0 */
+			for ( j=0 ; j < 3 ; j++ ) {
+			    trk->av_median[j] = tgt->tracks[0].av_median[j];
+			}
+		    }
+		    else {
+			/* get median(R,G,B) of averaged image */
+			get_average_median(&tpool, *(trk->accum1_ptr),
+					   sum_weight, &img_tmp_buf,
+					   &img_tmp_buf_1d, trk->av_median);
+			sio.printf("Median of averaged image (%s) = "
+				   "(%g, %g, %g)\n", tgt->name,
+				   trk->av_median[0], trk->av_median[1],
+				   trk->av_median[2]);
+		    }
+		}
+
+		/* clear buffer for new result */
+		trk->accum0_ptr->clean();
+	    }
+	}
+
+	/*
+	 *  main of sigma-clipping
+	 */
+	if ( prefetch.start(idx_list.array_ptr(), n_idx,
+			    n_loader_threads, prefetch_depth,
+			    &load_frame_for_stacking, (void *)&loader_args) < 0 ) {
+	    sio.eprintf("[ERROR] prefetch.start() failed\n");
+	    goto quit;
+	}
+
+	ii = 0;
+	while ( 1 ) {
+	    bool load_tiff_ok = false;
+	    long offset_x = 0, offset_y = 0;
+	    double target_median[3] = {1.0, 1.0, 1.0};
+	    int weight;
+
+	    if ( prefetch.next(&idx, &load_tiff_ok, img_buf,
+			       &offset_x, &offset_y) == false ) break;
+
+	    if ( load_tiff_ok == false ) continue;
+	    ii ++;
+	    weight = get_frame_weight(frame_weights, idx);
+
+	    sio.printf("Stacking with Sigma-Clipping [%s]\n",
+		       filenames[idx].cstr());
+
+	    /* (frames kept by checkpoint are not cached in 1st pass) */
+	    if ( fcache.is_cached(idx) == false ) fcache.put(idx, *img_buf);
+
+	    if ( skylv_sigma_clip == true ) {
+		/* get median(R,G,B) of target image */
+		get_target_median(filenames[idx].cstr(), *img_buf,
+				  (n_comp_dark_synth == 0), target_median);
+		sio.printf("Median of target image = (%g, %g, %g)\n",
+			   target_median[0], target_median[1],
+			   target_median[2]);
+	    }
+
+	    /* STACK! */
+	    for ( k=0 ; k < n_targets ; k++ ) {
+		const stack_target *tgt = &targets[k];
+		long ox = offset_x, oy = offset_y;
+		const frame_transform *tr =
+		    (*(tgt->align_func))(idx, &ox, &oy, tgt->align_user);
+		for ( t=0 ; t < tgt->n_tracks ; t++ ) {
+		    const sigclip_track *trk = &(tgt->tracks[t]);
+		    bool final_loop, no_clip;
+
+		    if ( trk->n_iterations <= cnt ) continue;
+		    final_loop = ( cnt + 1 == trk->n_iterations );
+		    trk->accum0_ptr->weight = weight;
+
+		    /* (a reference image is stacked without sigma-clipping */
+		    /*  when last loop of comet mode)                       */
+		    no_clip = ( comet_sigma_clip == true &&
+				final_loop == true && idx == ref_file_id );
+		    sigma_clip_aligned_frame(&tpool, *img_buf, ox, oy, tr,
+			resample_kernel, *(trk->accum1_ptr), trk->sigma_rgb,
+			trk->av_median, target_median, no_clip,
+			trk->accum0_ptr);
+		}
+	    }
+
+	    if ( flag_preview == true || ii == 1 + n_plus ) {
+		/* (first track only) */
+		stack_get_average(&tpool, *(tgt_view->tracks[0].accum0_ptr),
+				  sum_weight, img_buf);
+		/* display stacked image */
+		display_image(win_image, 0, 0, *img_buf, 2,
+		     display_bin, display_ch, contrast_rgb, false, tmp_buf);
+	    }
+
+	    winname(win_image, "Stacking with sigma-clipping %zd/%zd",
+		    ii, (size_t)(1+n_plus));
+	}
+	prefetch.stop();
+
+	/* save results of tracks reaching requested iterations */
+	for ( k=0 ; k < n_targets ; k++ ) {
+	    const stack_target *tgt = &targets[k];
+	    for ( t=0 ; t < tgt->n_tracks ; t++ ) {
+		const sigclip_track *trk = &(tgt->tracks[t]);
+
+		if ( trk->n_iterations <= cnt ) continue;
+
+		if ( sweep_names == false ) {
+		    sio.printf("Median of pixel-count (%s) = %g frames\n",
+			       tgt->name, md_median(trk->accum0_ptr->count));
+		}
+		else {
+		    sio.printf("Median of pixel-count (%s) = %g frames "
+			       "(sigma=%d, iterations=%d)\n", tgt->name,
+			       md_median(trk->accum0_ptr->count),
+			       trk->sigma_rgb[0], cnt + 1);
+		}
+
+		if ( is_sigclip_output(*trk, cnt + 1) == false ) continue;
+
+		if ( sweep_names == false ) {
+		    appended_str.printf("+%zdframes_%s", n_plus, tgt->name);
+		}
+		else {
+		    appended_str.printf("+%zdframes_%s_s%di%d", n_plus,
+					tgt->name, trk->sigma_rgb[0], cnt + 1);
+		}
+		stack_get_average(&tpool, *(trk->accum0_ptr), sum_weight,
+				  img_buf);
+		if ( save_stacked_image(filenames[ref_file_id].cstr(),
+					appended_str.cstr(), *img_buf, icc_buf,
+					flag_dither) < 0 ) {
+		    goto quit;
+		}
+	    }
+	}
+    }
+
+    /* display */
+    winname(win_image, "Done stacking %zd frames", (size_t)(1+n_plus));
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
+
+static int do_stack_and_save( const tarray_tstring &filenames,
+			      int ref_file_id, const mdarray_bool &flg_saved,
+			      const mdarray_int &frame_weights,
+			      int n_comp_dark_synth,
+			      int count_sigma_clip, const int sigma_rgb[],
+			      const sigclip_setting sweep[], size_t n_sweep,
+			      const char *checkpoint_file,
+			      bool skylv_sigma_clip, bool comet_sigma_clip,
+			      bool flag_dither, bool flag_preview,
+			      int warp_kernel,
+			      int n_loader_threads, int prefetch_depth,
+			      int n_compute_threads,
+			      int display_bin, int display_ch,
+			      const int contrast_rgb[],
+			      int win_image, mdarray_uchar *tmp_buf )
+{
+    stdstreamio sio;
+    /* sum, sum^2 and count: [1] is result of 1st pass, and [2t,2t+1] */
+    /* are used by track t (track 0 reuses [1] after 1st iteration)   */
+    stack_accum accum[2 * Max_sigclip_settings];
+    sigclip_track tracks[Max_sigclip_settings];
+    stack_target target;
+    size_t n_tracks, t;
+    int max_iterations;
+    bool is_integer;
+    int ref_sztype = 0;
+    mdarray_float img_buf(false);
+    mdarray_uchar icc_buf(false);
+    frame_warp *warps = NULL;		/* transforms of frames */
+    size_t i, n_warped;
+    bool weighted = false;
+    /* rotated frames are interpolated even without -i */
+    const int resample_kernel =
+	(warp_kernel == WARP_NONE) ? WARP_BILINEAR : warp_kernel;
+
+    int ret_status = -1;
+
+    if ( filenames.length() == 0 ) goto quit;
+    if ( flg_saved.length() == 0 ) goto quit;
+    if ( ref_file_id < 0 ) goto quit;
+    if ( filenames.length() <= (size_t)ref_file_id ) goto quit;
+    if ( Max_sigclip_settings < n_sweep ) goto quit;
+
+    /* determine on/off of sigma-clip */
+    if ( sigma_rgb[0] <= 0 && sigma_rgb[1] <= 0 && sigma_rgb[2] <= 0 ) {
+	count_sigma_clip = 0;
+    }
+
+    n_tracks = build_sigclip_tracks(sweep, n_sweep, count_sigma_clip,
+				    sigma_rgb, comet_sigma_clip, tracks);
+    max_iterations = 0;
+    for ( t=0 ; t < n_tracks ; t++ ) {
+	if ( max_iterations < tracks[t].n_iterations ) {
+	    max_iterations = tracks[t].n_iterations;
+	}
+    }
+
+    if ( n_sweep == 0 ) {
+	sio.printf("sigma-clipping: [N_iterations=%d,  value=(%d,%d,%d),  sky-level=%d,  comet=%d]  "
+		   "dither=%d\n",
+		   count_sigma_clip, sigma_rgb[0], sigma_rgb[1], sigma_rgb[2],
+		   (int)skylv_sigma_clip, (int)comet_sigma_clip, (int)flag_dither);
+    }
+    else {
+	sio.printf("sigma-clipping sweep: [N_settings=%zd,  N_tracks=%zd,  "
+		   "max_iterations=%d,  sky-level=%d,  comet=%d]  dither=%d\n",
+		   n_sweep, n_tracks, max_iterations,
+		   (int)skylv_sigma_clip, (int)comet_sigma_clip, (int)flag_dither);
+    }
+
+    /* load reference ... needs for ICC data */
+    if ( load_stack_reference(filenames, ref_file_id, flg_saved,
+			      n_comp_dark_synth, skylv_sigma_clip,
+			      &img_buf, &ref_sztype, &icc_buf,
+			      &is_integer) < 0 ) {
+	goto quit;
+    }
+
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+	if ( ((int)i == ref_file_id || flg_saved[i] == true) &&
+	     get_frame_weight(frame_weights, i) != 1 ) weighted = true;
+    }
+    if ( weighted == true ) {
+	sio.printf("Frames are weighted by quality table\n");
+	if ( checkpoint_file != NULL ) {
+	    /* checkpoints do not record weights */
+	    sio.eprintf("[WARNING] checkpoint (-k) is ignored "
+			"with weighted frames\n");
+	    checkpoint_file = NULL;
+	}
+    }
+
+    if ( checkpoint_file != NULL && is_integer == false ) {
+	sio.eprintf("[WARNING] checkpoint (-k) requires 8/16-bit frames "
+		    "without dark synthesis; ignored\n");
+	checkpoint_file = NULL;
+    }
+
+    warps = new frame_warp[filenames.length()];
+    n_warped = load_frame_warps(filenames, ref_file_id, warp_kernel,
+				flg_saved,
+				img_buf.x_length(), img_buf.y_length(), warps);
+    if ( 0 < n_warped ) {
+	sio.printf("Warped frames: %zd (%s interpolation, %s)\n",
+		   n_warped, get_warp_kernel_name(resample_kernel),
+		   warp_simd_kernel_name());
+	if ( checkpoint_file != NULL ) {
+	    /* checkpoints record integer offsets only */
+	    sio.eprintf("[WARNING] checkpoint (-k) is ignored "
+			"with warped frames\n");
+	    checkpoint_file = NULL;
+	}
+    }
+
+    for ( t=0 ; t < n_tracks ; t++ ) {
+	tracks[t].accum_buf[0] = &accum[2 * t];
+	tracks[t].accum_buf[1] = &accum[2 * t + 1];
+    }
+    target.name = "stacked";
+    target.align_func = &align_by_stars;
+    target.align_user = (const void *)warps;
+    target.accum_1st = &accum[1];
+    target.tracks = tracks;
+    target.n_tracks = n_tracks;
+
+    if ( stack_frames_and_save(filenames, ref_file_id, flg_saved,
+			frame_weights, n_comp_dark_synth,
+			&target, 1, (0 < n_sweep), checkpoint_file,
+			skylv_sigma_clip, comet_sigma_clip,
+			flag_dither, flag_preview, warp_kernel,
+			n_loader_threads, prefetch_depth, n_compute_threads,
+			display_bin, display_ch, contrast_rgb,
+			win_image, tmp_buf,
+			&img_buf, icc_buf, ref_sztype, is_integer) < 0 ) {
+	goto quit;
+    }
+
+    ret_status = 0;
+ quit:
+    if ( warps != NULL ) delete [] warps;
+    return ret_status;
+}
+
+/*
+ * Get alignments of frames by comet nucleus.  comet_file has
+ * "filename x y" lines for 2 or more frames, where (x,y) is position of
+ * the nucleus in the frame.  Motion of the nucleus is interpolated
+ * linearly in time (frame numbers of filenames).  Transforms of stars
+ * are taken from warps[] (see load_frame_warps()), and ret_comet_warps[]
+ * has transforms aligning the nucleus (see align_by_comet()).
+ */
+static int get_comet_alignments( const char *comet_file,
+				 const tarray_tstring &filenames,
+				 int ref_file_id, const mdarray_bool &flg_saved,
+				 int warp_kernel, const frame_warp warps[],
+				 frame_warp ret_comet_warps[] )
+{
+    stdstreamio sio, f_in;
+    double mark_t[Max_comet_marks];
+    double mark_x[Max_comet_marks];
+    double mark_y[Max_comet_marks];
+    size_t n_marks = 0;
+    comet_motion motion;
+    long num, t_ref;
+    const char *line;
+    size_t i;
+    int ret_status = -1;
+
+    if ( f_in.open("r", comet_file) < 0 ) {
+	sio.eprintf("[ERROR] cannot open: %s\n", comet_file);
+	goto quit;
+    }
+    while ( (line = f_in.getline()) != NULL ) {
+	tarray_tstring elms;
+	frame_transform tr;
+	elms.split(line, " \t\n", false);
+	if ( elms.length() < 3 || elms[0].cstr()[0] == '#' ) continue;
+	if ( Max_comet_marks <= n_marks ) {
+	    sio.eprintf("[WARNING] too many marks of comet; ignored: %s\n",
+			elms[0].cstr());
+	    continue;
+	}
+	if ( get_frame_number(elms[0].cstr(), &num) < 0 ) {
+	    sio.eprintf("[ERROR] no frame number: %s\n", elms[0].cstr());
+	    goto quit;
+	}
+	/* position of nucleus in reference coordinates */
+	if ( elms[0] == filenames[ref_file_id] ) {
+	    set_translation_transform(0.0, 0.0, &tr);
+	}
+	else if ( load_frame_transform(elms[0].cstr(), &tr) < 0 ) {
+	    sio.eprintf("[ERROR] no offset of marked frame: %s\n",
+			elms[0].cstr());
+	    goto quit;
+	}
+	apply_transform(tr, elms[1].atof(), elms[2].atof(),
+			&mark_x[n_marks], &mark_y[n_marks]);
+	mark_t[n_marks] = num;
+	n_marks ++;
+    }
+    f_in.close();
+
+    if ( fit_comet_motion(mark_t, mark_x, mark_y, n_marks, &motion) < 0 ) {
+	sio.eprintf("[ERROR] marks of comet in 2 or more frames "
+		    "of different times are required\n");
+	goto quit;
+    }
+    if ( get_frame_number(filenames[ref_file_id].cstr(), &t_ref) < 0 ) {
+	sio.eprintf("[ERROR] no frame number: %s\n",
+		    filenames[ref_file_id].cstr());
+	goto quit;
+    }
+    sio.printf("Comet: %zd marks,  motion = (%g, %g) pixels/frame\n",
+	       n_marks, motion.vx, motion.vy);
+
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+	frame_warp *cw = &ret_comet_warps[i];
+	const frame_transform &tr = cw->tr;
+	cw->warped = false;
+	set_translation_transform(0.0, 0.0, &(cw->tr));
+	if ( (int)i != ref_file_id && flg_saved[i] == false ) continue;
+	if ( get_frame_number(filenames[i].cstr(), &num) < 0 ) {
+	    sio.eprintf("[ERROR] no frame number: %s\n", filenames[i].cstr());
+	    goto quit;
+	}
+	get_comet_transform(warps[i].tr, motion, num, t_ref, &(cw->tr));
+	/* sub-pixel offset of stars plus motion is rounded only once */
+	cw->warped = warps[i].warped;
+	if ( warp_kernel != WARP_NONE &&
+	     (Max_ignored_shift <= fabs(tr.m[2] - floor(tr.m[2] + 0.5)) ||
+	      Max_ignored_shift <= fabs(tr.m[5] - floor(tr.m[5] + 0.5))) ) {
+	    cw->warped = true;
+	}
+    }
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
+
+/*
+ * Aligned by comet nucleus: user_ptr is frame_warp[] of
+ * get_comet_alignments().  Integer offsets are rounded from the offset
+ * of stars plus motion of the nucleus (both sub-pixel).
+ */
+static const frame_transform *align_by_comet( long idx,
+				long *offset_x, long *offset_y,
+				const void *user_ptr )
+{
+    const frame_warp *comet_warps = (const frame_warp *)user_ptr;
+    const frame_transform &tr = comet_warps[idx].tr;
+    if ( comet_warps[idx].warped == true ) return &tr;
+    *offset_x = (long)floor(tr.m[2] + 0.5);
+    *offset_y = (long)floor(tr.m[5] + 0.5);
+    return NULL;
+}
+
+/*
+ * Comet mode: stacks aligned by stars and by comet nucleus are made in
+ * the same passes by stack_frames_and_save(), so that each frame is
+ * decoded only once per pass for both stacks.
+ */
+static int do_comet_stack_and_save( const tarray_tstring &filenames,
+			      int ref_file_id, const mdarray_bool &flg_saved,
+			      const char *comet_file,
+			      int n_comp_dark_synth,
+			      int count_sigma_clip, const int sigma_rgb[],
+			      bool skylv_sigma_clip,
+			      bool flag_dither, bool flag_preview,
+			      int warp_kernel,
+			      int n_loader_threads, int prefetch_depth,
+			      int n_compute_threads,
+			      int display_bin, int display_ch,
+			      const int contrast_rgb[],
+			      int win_image, mdarray_uchar *tmp_buf )
+{
+    stdstreamio sio;
+    /* sum, sum^2 and count: [0,1] for stars and [2,3] for comet */
+    /* ([1] and [3] are results of 1st pass)                     */
+    stack_accum accum[4];
+    sigclip_track tracks[2];
+    stack_target targets[2];
+    frame_warp *warps = NULL;		/* transforms of frames */
+    frame_warp *comet_warps = NULL;	/* aligned by comet nucleus */
+    mdarray_int frame_weights(false);	/* (no weights) */
+    bool is_integer;
+    int ref_sztype = 0;
+    mdarray_float img_buf(false);
+    mdarray_uchar icc_buf(false);
+    size_t k;
+    int j;
+
+    int ret_status = -1;
+
+    if ( filenames.length() == 0 ) goto quit;
+    if ( flg_saved.length() == 0 ) goto quit;
+    if ( ref_file_id < 0 ) goto quit;
+    if ( filenames.length() <= (size_t)ref_file_id ) goto quit;
+
+    /* determine on/off of sigma-clip */
+    if ( sigma_rgb[0] <= 0 && sigma_rgb[1] <= 0 && sigma_rgb[2] <= 0 ) {
+	count_sigma_clip = 0;
+    }
+
+    sio.printf("comet mode: sigma-clipping: [N_iterations=%d,  "
+	       "value=(%d,%d,%d),  sky-level=%d]  dither=%d\n",
+	       count_sigma_clip, sigma_rgb[0], sigma_rgb[1], sigma_rgb[2],
+	       (int)skylv_sigma_clip, (int)flag_dither);
+
+    /* load reference ... needs for ICC data */
+    if ( load_stack_reference(filenames, ref_file_id, flg_saved,
+			      n_comp_dark_synth, skylv_sigma_clip,
+			      &img_buf, &ref_sztype, &icc_buf,
+			      &is_integer) < 0 ) {
+	goto quit;
+    }
+
+    warps = new frame_warp[filenames.length()];
+    load_frame_warps(filenames, ref_file_id, warp_kernel, flg_saved,
+		     img_buf.x_length(), img_buf.y_length(), warps);
+    comet_warps = new frame_warp[filenames.length()];
+    if ( get_comet_alignments(comet_file, filenames, ref_file_id, flg_saved,
+			      warp_kernel, warps, comet_warps) < 0 ) {
+	goto quit;
+    }
+
+    /* a track of sigma-clipping for each stack */
+    for ( k=0 ; k < 2 ; k++ ) {
+	for ( j=0 ; j < 3 ; j++ ) tracks[k].sigma_rgb[j] = sigma_rgb[j];
+	tracks[k].n_iterations = count_sigma_clip;
+	tracks[k].output_mask = 0;
+	tracks[k].accum_buf[0] = &accum[2 * k];
+	tracks[k].accum_buf[1] = &accum[2 * k + 1];
+	targets[k].accum_1st = &accum[2 * k + 1];
+	targets[k].tracks = &tracks[k];
+	targets[k].n_tracks = 1;
+    }
+    targets[0].name = "stacked";
+    targets[0].align_func = &align_by_stars;
+    targets[0].align_user = (const void *)warps;
+    targets[1].name = "comet_stacked";
+    targets[1].align_func = &align_by_comet;
+    targets[1].align_user = (const void *)comet_warps;
+
+    if ( stack_frames_and_save(filenames, ref_file_id, flg_saved,
+			frame_weights, n_comp_dark_synth,
+			targets, 2, false, NULL,
+			skylv_sigma_clip, false,
+			flag_dither, flag_preview, warp_kernel,
+			n_loader_threads, prefetch_depth, n_compute_threads,
+			display_bin, display_ch, contrast_rgb,
+			win_image, tmp_buf,
+			&img_buf, icc_buf, ref_sztype, is_integer) < 0 ) {
+	goto quit;
+    }
+
+    ret_status = 0;
+ quit:
+    if ( comet_warps != NULL ) delete [] comet_warps;
+    if ( warps != NULL ) delete [] warps;
+    return ret_status;
+}
+
+/*
+ * A pass of stacking for a worker of distributed stacking (no display).
+ *
+ * The reference and selected frames are divided into n_workers subsets
+ * (every n_workers-th frame; the reference is in the subset of worker 0),
+ * and sums of the subset of worker_id are written to out_file.  Without
+ * prev_file, the 1st pass (no sigma-clip) is performed.  With prev_file
+ * (merged result of the previous pass by merge_stacks), a sigma-clipping
+ * pass against it is performed.
+ */
+static int do_stack_partial( const tarray_tstring &filenames,
+			     int ref_file_id, const mdarray_bool &flg_saved,
+			     int n_comp_dark_synth, const int sigma_rgb[],
+			     bool skylv_sigma_clip,
+			     int worker_id, int n_workers,
+			     const char *prev_file, const char *out_file,
+			     int warp_kernel,
+			     int n_loader_threads, int prefetch_depth,
+			     int n_compute_threads )
+{
+    stdstreamio sio;
+    stack_accum accum0;			/* result of this worker */
+    stack_accum accum1;			/* merged previous pass */
+    stack_checkpoint ckpt;
+    stack_checkpoint prev_ckpt;
+    size_t width = 0, height = 0;
+    int ref_sztype = 0;
+    bool is_integer;
+    double av_median[3] = {1.0, 1.0, 1.0};
+    mdarray_float img_buf(false);
+    mdarray_float img_tmp_buf_1d(false);
+    frame_ring ring;
+    frame_prefetch prefetch;
+    thread_pool tpool;
+    stack_loader_args loader_args;
+    mdarray_long idx_list(false);
+    frame_warp *warps = NULL;		/* transforms of frames */
+    size_t n_idx, n_all, n_prev, n_warped;
+    /* rotated frames are interpolated even without -i */
+    const int resample_kernel =
+	(warp_kernel == WARP_NONE) ? WARP_BILINEAR : warp_kernel;
+    long idx;
+    size_t i;
+    int j;
+
+    int ret_status = -1;
+
+    if ( filenames.length() == 0 ) goto quit;
+    if ( ref_file_id < 0 ) goto quit;
+    if ( filenames.length() <= (size_t)ref_file_id ) goto quit;
+    if ( worker_id < 0 || n_workers <= worker_id ) goto quit;
+    if ( out_file == NULL ) goto quit;
+
+    /* header of reference */
+    if ( load_tiff_rows_into_float(filenames[ref_file_id].cstr(), 65536.0,
+			0, 0, &img_buf, &ref_sztype, NULL, NULL,
+			&width, &height) < 0 ) {
+	sio.eprintf("[ERROR] load_tiff_rows_into_float() failed\n");
+	goto quit;
+    }
+    /* (same for all workers: all selected frames are examined) */
+    is_integer = is_integer_stack(filenames, ref_file_id, flg_saved,
+				  n_comp_dark_synth);
+
+    ckpt.set_reference(filenames[ref_file_id].cstr(), ref_sztype);
+    ckpt.has_ref = false;
+    ckpt.n_iterations = 0;
+    ckpt.n_workers = n_workers;
+    ckpt.worker_id = worker_id;
+
+    if ( prev_file != NULL ) {
+	if ( load_stack_checkpoint(prev_file, &prev_ckpt, &accum1) < 0 ) {
+	    sio.eprintf("[ERROR] cannot load '%s'\n", prev_file);
+	    goto quit;
+	}
+	if ( prev_ckpt.n_workers != 0 ) {
+	    sio.eprintf("[ERROR] '%s' is a partial stack; "
+			"merge all workers by merge_stacks -o\n", prev_file);
+	    goto quit;
+	}
+	if ( prev_ckpt.is_reference(filenames[ref_file_id].cstr()) == false ||
+	     prev_ckpt.ref_sztype != ref_sztype ||
+	     prev_ckpt.has_ref == false ||
+	     accum1.is_integer != is_integer ||
+	     accum1.x_length() != width || accum1.y_length() != height ) {
+	    sio.eprintf("[ERROR] '%s' does not match reference frame "
+			"(or it has been modified)\n", prev_file);
+	    goto quit;
+	}
+	ckpt.n_iterations = prev_ckpt.n_iterations + 1;
+    }
+
+    /* subset of this worker */
+    n_all = 0;
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+	if ( (int)i == ref_file_id || flg_saved[i] == true ) n_all ++;
+    }
+    idx_list.resize_1d(n_all);
+    idx_list[0] = ref_file_id;
+    n_all = 1;
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+	if ( (int)i != ref_file_id && flg_saved[i] == true ) {
+	    idx_list[n_all] = i;
+	    n_all ++;
+	}
+    }
+    n_idx = 0;
+    for ( i=0 ; i < n_all ; i++ ) {
+	if ( (int)(i % n_workers) == worker_id ) {
+	    idx_list[n_idx] = idx_list[i];
+	    n_idx ++;
+	}
+    }
+
+    warps = new frame_warp[filenames.length()];
+    n_warped = load_frame_warps(filenames, ref_file_id, warp_kernel,
+				flg_saved, width, height, warps);
+    if ( 0 < n_warped ) {
+	sio.printf("Warped frames: %zd (%s interpolation, %s)\n",
+		   n_warped, get_warp_kernel_name(resample_kernel),
+		   warp_simd_kernel_name());
+    }
+
+    sio.printf("Worker %d/%d: %s of %zd frames (of %zd)\n",
+	       worker_id, n_workers,
+	       (prev_file == NULL) ? "1st pass" : "sigma-clipping pass",
+	       n_idx, n_all);
+
+    accum0.init(width, height, is_integer);
+
+    if ( tpool.start(n_compute_threads) < 0 ) {
+	sio.eprintf("[ERROR] tpool.start() failed\n");
+	goto quit;
+    }
+
+    /* same median of averaged image for all workers */
+    n_prev = prev_ckpt.length() + 1;
+    if ( prev_file != NULL && skylv_sigma_clip == true ) {
+	stack_get_average(&tpool, accum1, n_prev, &img_buf);
+	img_tmp_buf_1d.resize_2d(width, height);
+	for ( j=0 ; j < 3 ; j++ ) {
+	    img_buf.copy(&img_tmp_buf_1d, 0, width, 0, height, j, 1);
+	    av_median[j] = md_median(img_tmp_buf_1d);
+	}
+	sio.printf("Median of averaged image = (%g, %g, %g)\n",
+		   av_median[0], av_median[1], av_median[2]);
+    }
+
+    loader_args.filenames = &filenames;
+    loader_args.flg_saved = &flg_saved;
+    loader_args.ref_file_id = ref_file_id;
+    loader_args.n_comp_dark_synth = n_comp_dark_synth;
+    loader_args.skylv_sigma_clip = skylv_sigma_clip;
+    loader_args.band_y = 0;
+    loader_args.band_height = 0;
+    loader_args.fcache = NULL;
+    loader_args.ring = NULL;
+
+    /* raw frames shared by targets and compared frames */
+    if ( n_comp_dark_synth != 0 ) {
+	ring.init(abs(n_comp_dark_synth) + n_loader_threads + prefetch_depth + 1);
+	loader_args.ring = &ring;
+    }
+
+    if ( prefetch.start(idx_list.array_ptr(), n_idx,
+			n_loader_threads, prefetch_depth,
+			&load_frame_for_stacking, (void *)&loader_args) < 0 ) {
+	sio.eprintf("[ERROR] prefetch.start() failed\n");
+	goto quit;
+    }
+
+    while ( 1 ) {
+	bool load_tiff_ok = false;
+	long offset_x = 0, offset_y = 0;
+
+	if ( prefetch.next(&idx, &load_tiff_ok, &img_buf,
+			   &offset_x, &offset_y) == false ) break;
+
+	i = idx;
+
+	if ( load_tiff_ok == true ) {
+	    const frame_transform &warp = warps[i].tr;
+	    const bool warped = warps[i].warped;
+
+	    if ( prev_file == NULL ) {
+		sio.printf("Stacking [%s]\n", filenames[i].cstr());
+		if ( warped == true ) {
+		    stack_add_frame_warped(&tpool, img_buf, warp,
+					   resample_kernel, &accum0);
+		}
+		else {
+		    stack_add_frame(&tpool, img_buf, offset_x, offset_y,
+				    &accum0);
+		}
+	    }
+	    else {
+		double target_median[3] = {1.0, 1.0, 1.0};
+		sio.printf("Stacking with Sigma-Clipping [%s]\n",
+			   filenames[i].cstr());
+		if ( skylv_sigma_clip == true ) {
+		    get_target_median(filenames[i].cstr(), img_buf,
+				      (n_comp_dark_synth == 0), target_median);
+		}
+		if ( warped == true ) {
+		    stack_sigma_clip_frame_warped(&tpool, img_buf, warp,
+				       resample_kernel, accum1, sigma_rgb,
+				       av_median, target_median, false,
+				       &accum0);
+		}
+		else {
+		    stack_sigma_clip_frame(&tpool, img_buf, offset_x, offset_y,
+				       accum1, sigma_rgb, av_median,
+				       target_median, false, &accum0);
+		}
+	    }
+
+	    if ( (int)i == ref_file_id ) ckpt.has_ref = true;
+	    else ckpt.append_frame(filenames[i].cstr(), offset_x, offset_y);
+	}
+    }
+    prefetch.stop();
+
+    /* count of 1st pass: number of frames */
+    if ( prev_file == NULL ) {
+	accum0.count = (int)(ckpt.length() + ((ckpt.has_ref == true) ? 1 : 0));
+    }
+
+    sio.printf("Writing '%s' ...\n", out_file);
+    if ( save_stack_checkpoint(out_file, ckpt, accum0) < 0 ) {
+	sio.eprintf("[ERROR] save_stack_checkpoint() failed\n");
+	goto quit;
+    }
+
+    ret_status = 0;
+ quit:
+    if ( warps != NULL ) delete [] warps;
+    return ret_status;
+}
+
+/* key of float whose order as unsigned is the same as the float */
+static uint32_t float_key( float v )
+{
+    uint32_t u;
+    memcpy(&u, &v, sizeof(u));
+    if ( (u & 0x80000000U) != 0 ) return ~u;
+    else return (u | 0x80000000U);
+}
+
+static float key_float( uint32_t key )
+{
+    uint32_t u;
+    float v;
+    if ( (key & 0x80000000U) != 0 ) u = (key & 0x7fffffffU);
+    else u = ~key;
+    memcpy(&v, &u, sizeof(v));
+    return v;
+}
+
+/*
+ * Exact median(R,G,B) of a TIFF file (scale = 65536.0) read by bands of
+ * band_height rows, so that the whole image is not held in memory.  Keys
+ * of floats are counted by their upper 16 bits in the 1st read, and by
+ * their lower 16 bits within the bins of the middle ranks in the 2nd
+ * read.  NaN is ignored, and the mean of the two middle values is the
+ * median of an even number of values.
+ */
+static int get_tiff_median( const char *filename, size_t band_height,
+			    double ret_median[] )
+{
+    stdstreamio sio;
+    const size_t n_bins = 65536;
+    mdarray_long hist_hi(false);	/* n_bins x 3 */
+    mdarray_long hist_lo(false);	/* n_bins x 3 x 2 (lower, upper rank) */
+    mdarray_float band_buf(false);
+    size_t width = 0, height = 0;
+    size_t n_valid[3] = {0, 0, 0};
+    size_t rank[3][2];			/* ranks in bins of bin_hi */
+    size_t bin_hi[3][2];
+    size_t y, read_id, ch, r, k;
+    int ret_status = -1;
+
+    if ( load_tiff_rows_into_float(filename, 65536.0, 0, 0, NULL, NULL,
+				   NULL, NULL, &width, &height) < 0 ) {
+	sio.eprintf("[ERROR] cannot read header of '%s'\n", filename);
+	goto quit;
+    }
+    if ( band_height == 0 ) band_height = height;
+
+    hist_hi.resize_2d(n_bins, 3);
+    hist_lo.resize_3d(n_bins, 3, 2);
+
+    for ( read_id=0 ; read_id < 2 ; read_id++ ) {
+	for ( y=0 ; y < height ; y += band_height ) {
+	    size_t band_h = band_height;
+	    if ( height < y + band_h ) band_h = height - y;
+	    if ( load_tiff_rows_into_float(filename, 65536.0, y, band_h,
+					   &band_buf, NULL, NULL, NULL,
+					   NULL, NULL) < 0 ) {
+		sio.eprintf("[ERROR] cannot read '%s'\n", filename);
+		goto quit;
+	    }
+	    for ( ch=0 ; ch < 3 ; ch++ ) {
+		const float *p = band_buf.array_ptr_cs(0, 0, ch);
+		const size_t len = width * band_h;
+		long *h_hi = hist_hi.array_ptr(0, ch);
+		long *h_lo[2];
+		h_lo[0] = hist_lo.array_ptr(0, ch, 0);
+		h_lo[1] = hist_lo.array_ptr(0, ch, 1);
+		for ( k=0 ; k < len ; k++ ) {
+		    uint32_t key;
+		    if ( isnan(p[k]) != 0 ) continue;
+		    key = float_key(p[k]);
+		    if ( read_id == 0 ) {
+			h_hi[key >> 16] ++;
+			continue;
+		    }
+		    for ( r=0 ; r < 2 ; r++ ) {
+			if ( (key >> 16) == bin_hi[ch][r] ) {
+			    h_lo[r][key & 0xffffU] ++;
+			}
+		    }
+		}
+	    }
+	}
+	if ( read_id != 0 ) break;
+
+	/* bins of upper 16 bits that have the middle ranks */
+	for ( ch=0 ; ch < 3 ; ch++ ) {
+	    const long *h_hi = hist_hi.array_ptr_cs(0, ch);
+	    for ( k=0 ; k < n_bins ; k++ ) n_valid[ch] += h_hi[k];
+	    if ( n_valid[ch] == 0 ) {
+		sio.eprintf("[ERROR] no valid pixels in '%s'\n", filename);
+		goto quit;
+	    }
+	    rank[ch][0] = (n_valid[ch] - 1) / 2;
+	    rank[ch][1] = n_valid[ch] / 2;
+	    for ( r=0 ; r < 2 ; r++ ) {
+		for ( k=0 ; (size_t)h_hi[k] <= rank[ch][r] ; k++ ) {
+		    rank[ch][r] -= h_hi[k];
+		}
+		bin_hi[ch][r] = k;
+	    }
+	}
+    }
+
+    for ( ch=0 ; ch < 3 ; ch++ ) {
+	double v[2];
+	for ( r=0 ; r < 2 ; r++ ) {
+	    const long *h_lo = hist_lo.array_ptr_cs(0, ch, r);
+	    size_t rk = rank[ch][r];
+	    for ( k=0 ; (size_t)h_lo[k] <= rk ; k++ ) rk -= h_lo[k];
+	    v[r] = key_float((uint32_t)((bin_hi[ch][r] << 16) | k));
+	}
+	ret_median[ch] = (v[0] + v[1]) / 2.0;
+    }
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
+
+/*
+ * Median(R,G,B) of a whole frame for sky-level sigma-clipping with
+ * memory budget.  The sidecar statistics are used when available, and
+ * otherwise the frame is read by bands.
+ */
+static int get_target_median_by_bands( const char *filename,
+				       size_t band_height,
+				       double ret_median[] )
+{
+    frame_stats stats;
+    int j;
+
+    if ( get_frame_stats(filename, NULL, &stats) == 0 ) {
+	for ( j=0 ; j < 3 ; j++ ) ret_median[j] = stats.median[j];
+	return 0;
+    }
+
+    return get_tiff_median(filename, band_height, ret_median);
+}
+
+/*
+ * Tile-based (out-of-core) version of do_stack_and_save().
+ *
+ * The image is processed in horizontal tiles whose height is determined
+ * by mem_budget_mb; for each tile, only rows of frames overlapping the
+ * tile are decoded and all passes of sigma-clipping are performed before
+ * moving to the next tile.  Frames are accumulated in the same order as
+ * do_stack_and_save(), so the results are the same.
+ *
+ * Dark synthesis needs whole frames, and is not supported in this mode.
+ * Finished tiles are written to the float TIFF and displayed, so that
+ * the whole image is not held in memory.  The 16-bit TIFF is written
+ * from the float TIFF at the end.
+ *
+ * Sky-level sigma-clipping needs the median of the whole averaged image
+ * of the previous pass.  Tiles are then stacked in stages: stage s
+ * performs s passes of sigma-clipping, writes the averaged image to the
+ * float TIFF and gets its median by reading it again, and the last stage
+ * performs all passes with the medians of preceding stages.  Medians of
+ * frames are taken from the sidecar statistics or read by bands.
+ */
+static int do_stack_tiled_and_save( const tarray_tstring &filenames,
+			      int ref_file_id, const mdarray_bool &flg_saved,
+			      const mdarray_int &frame_weights,
+			      int count_sigma_clip, const int sigma_rgb[], 
+			      bool skylv_sigma_clip, bool comet_sigma_clip,
+			      bool flag_dither,
+			      int n_loader_threads, int prefetch_depth,
+			      int n_compute_threads, size_t mem_budget_mb,
+			      int display_bin, int display_ch, 
+			      const int contrast_rgb[],
+			      int win_image, mdarray_uchar *tmp_buf )
+{
+    stdstreamio sio;
+    const uint64_t mem_budget_bytes = (uint64_t)mem_budget_mb * 1024 * 1024;
+    const double unit_median[3] = {1.0, 1.0, 1.0};
+    mdarray_double av_median_pass(false);	/* 3 x count_sigma_clip */
+    mdarray_double target_medians(false);	/* 3 x filenames.length() */
+    stack_accum accum[2];		/* sum, sum^2 and count of a tile */
+    stack_accum *accum_result_ptr = NULL;
+    bool is_integer;
+    int ref_sztype = 0;
+    size_t width = 0, height = 0;
+    size_t tile_height, n_tiles, n_in_flight, n_accum;
+    uint64_t row_bytes, cache_ram_bytes;
+    mdarray_float img_buf(false);	/* band of a frame */
+    mdarray_float tile_buf(false);	/* averaged tile */
+    mdarray_uchar icc_buf(false);
+    float_tiff_writer float_out;	/* result written by tiles */
+    tiff48_writer out_16bit;
+    double min_val = 0.0, max_val = 0.0;	/* of result */
+    frame_cache fcache;			/* bands of frames for sigma-clip */
+    frame_prefetch prefetch;		/* background frame loading */
+    thread_pool tpool;			/* threads for stacking kernels */
+    stack_loader_args loader_args;
+    mdarray_long idx_list_1st(false);	/* reference + selected frames */
+    mdarray_long idx_list(false);	/* frames in order of index */
+    size_t n_idx, n_plus, sum_weight, tile_y, i, ii;
+    long idx;
+    tstring appended_str, float_filename, out_filename;
+    int n_stages, stage, n_passes, cnt;
+
+    int ret_status = -1;
+
+    if ( filenames.length() == 0 ) goto quit;
+    if ( flg_saved.length() == 0 ) goto quit;
+    if ( ref_file_id < 0 ) goto quit;
+    if ( filenames.length() <= (size_t)ref_file_id ) goto quit;
+
+    /* determine on/off of sigma-clip */
+    if ( sigma_rgb[0] <= 0 && sigma_rgb[1] <= 0 && sigma_rgb[2] <= 0 ) {
+	count_sigma_clip = 0;
+    }
+
+    sio.printf("sigma-clipping: [N_iterations=%d,  value=(%d,%d,%d),  "
+	       "skylv=%d,  comet=%d]  dither=%d\n",
+	       count_sigma_clip, sigma_rgb[0], sigma_rgb[1], sigma_rgb[2],
+	       (int)skylv_sigma_clip, (int)comet_sigma_clip, (int)flag_dither);
+
+    /* get size, type and ICC data of reference (no rows are decoded) */
+    if ( load_tiff_rows_into_float(filenames[ref_file_id].cstr(), 65536.0,
+				   0, 0, NULL, &ref_sztype, &icc_buf, NULL,
+				   &width, &height) < 0 ) {
+	sio.eprintf("[ERROR] load_tiff_rows_into_float() failed\n");
+	goto quit;
+    }
+    if ( width == 0 || height == 0 ) goto quit;
+
+    if ( icc_buf.length() == 0 ) {
+	icc_buf.resize_1d(sizeof(Icc_srgb_profile));
+	icc_buf.put_elements(Icc_srgb_profile,sizeof(Icc_srgb_profile));
+    }
+
+    is_integer = is_integer_stack(filenames, ref_file_id, flg_saved, 0);
+    sio.printf("Accumulator: %s\n", (is_integer == true) ?
+	       "64-bit integer (exact)" : "double");
+
+    if ( 0 < count_warped_frames(filenames, ref_file_id, WARP_NONE,
+				 flg_saved, width, height) ) {
+	sio.eprintf("[WARNING] rotation of frames is not supported with "
+		    "memory budget (-m); integer offsets are used\n");
+    }
+
+    n_plus = 0;
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+        if ( flg_saved[i] == true ) n_plus ++;
+    }
+
+    /* same order as do_stack_and_save() */
+    idx_list_1st.resize_1d(1 + n_plus);
+    idx_list.resize_1d(1 + n_plus);
+    idx_list_1st[0] = ref_file_id;
+    n_idx = 1;
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+        if ( flg_saved[i] == true && (int)i != ref_file_id ) {
+	    idx_list_1st[n_idx] = i;
+	    n_idx ++;
+	}
+    }
+    n_plus = n_idx - 1;
+    n_idx = 0;
+    sum_weight = 0;
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+	if ( (int)i == ref_file_id || flg_saved[i] == true ) {
+	    idx_list[n_idx] = i;
+	    n_idx ++;
+	    sum_weight += get_frame_weight(frame_weights, i);
+	}
+    }
+    if ( sum_weight != 1 + n_plus ) {
+	sio.printf("Frames are weighted by quality table\n");
+    }
+
+    /*
+     * determine height of tile:
+     *   accumulators + bands in prefetch queue + band and averaged tile
+     *   should be within the budget (half of it when sigma-clipping, and
+     *   the rest is used for cache of bands).
+     */
+    n_accum = (0 < count_sigma_clip) ? 2 : 1;
+    n_in_flight = prefetch_depth + n_loader_threads + 2;
+    row_bytes = (uint64_t)width * (n_accum * stack_accum::pixel_bytes(is_integer)
+				   + n_in_flight * 3 * sizeof(float));
+    if ( 0 < count_sigma_clip ) tile_height = (mem_budget_bytes / 2) / row_bytes;
+    else tile_height = mem_budget_bytes / row_bytes;
+    if ( tile_height < Min_tile_height ) {
+	sio.eprintf("[WARNING] memory budget is too small; "
+		    "using tiles of %zd rows\n", Min_tile_height);
+	tile_height = Min_tile_height;
+    }
+    /* tiles are displayed at rows of binned window */
+    if ( 1 < display_bin && (size_t)display_bin <= tile_height ) {
+	tile_height -= tile_height % display_bin;
+    }
+    if ( height < tile_height ) tile_height = height;
+    n_tiles = (height + tile_height - 1) / tile_height;
+    cache_ram_bytes = 0;
+    if ( tile_height * row_bytes < mem_budget_bytes ) {
+	cache_ram_bytes = mem_budget_bytes - tile_height * row_bytes;
+    }
+
+    sio.printf("Tile mode: budget = %zd MB,  %zd tiles of %zd rows\n",
+	       mem_budget_mb, n_tiles, tile_height);
+
+    if ( tpool.start(n_compute_threads) < 0 ) {
+	sio.eprintf("[ERROR] tpool.start() failed\n");
+	goto quit;
+    }
+    sio.printf("Using %zd threads for stacking (kernel: %s)\n",
+	       tpool.length(), stack_sigma_clip_kernel_name());
+
+    n_stages = 1;
+    if ( 0 < count_sigma_clip && skylv_sigma_clip == true ) {
+	n_stages = 1 + count_sigma_clip;
+	av_median_pass.resize_2d(3, count_sigma_clip);
+	target_medians.resize_2d(3, filenames.length());
+	for ( i=0 ; i < n_idx ; i++ ) {
+	    double *tgt_median = target_medians.array_ptr(0, idx_list[i]);
+	    if ( get_target_median_by_bands(filenames[idx_list[i]].cstr(),
+					    tile_height, tgt_median) < 0 ) {
+		sio.eprintf("[ERROR] cannot get median of [%s]\n",
+			    filenames[idx_list[i]].cstr());
+		goto quit;
+	    }
+	    sio.printf("Median of target image [%s] = (%g, %g, %g)\n",
+		       filenames[idx_list[i]].cstr(),
+		       tgt_median[0], tgt_median[1], tgt_median[2]);
+	}
+    }
+
+    appended_str.printf("+%zdframes_stacked", n_plus);
+    make_tiff_filename(filenames[ref_file_id].cstr(), appended_str.cstr(),
+		       "float", &float_filename);
+
+    loader_args.filenames = &filenames;
+    loader_args.flg_saved = &flg_saved;
+    loader_args.ref_file_id = ref_file_id;
+    loader_args.n_comp_dark_synth = 0;
+    loader_args.skylv_sigma_clip = false;
+    loader_args.band_y = 0;
+    loader_args.band_height = tile_height;
+    loader_args.fcache = NULL;
+    loader_args.ring = NULL;
+
+    for ( stage=0 ; stage < n_stages ; stage++ ) {
+
+	/* passes of sigma-clipping in this stage */
+	n_passes = (stage + 1 == n_stages) ? count_sigma_clip : stage;
+
+	if ( 1 < n_stages ) {
+	    sio.printf("*** Stage %d / %d  [%d passes of sigma-clipping] ***\n",
+		       stage + 1, n_stages, n_passes);
+	}
+
+	/* save using float (by tiles) */
+	sio.printf("Writing '%s' by tiles\n", float_filename.cstr());
+	if ( float_out.open(float_filename.cstr(), width, height, 3, icc_buf,
+			    65536.0) < 0 ) {
+	    sio.eprintf("[ERROR] float_out.open() failed\n");
+	    goto quit;
+	}
+
+	winname(win_image, "Stacking ...");
+
+	for ( tile_y=0 ; tile_y < height ; tile_y += tile_height ) {
+
+	    const size_t tile_id = tile_y / tile_height;
+	    size_t tile_h = tile_height;
+	    if ( height < tile_y + tile_h ) tile_h = height - tile_y;
+
+	    sio.printf("*** Tile %zd / %zd  [y = %zd - %zd] ***\n",
+		       tile_id + 1, n_tiles, tile_y, tile_y + tile_h - 1);
+
+	    /* bands of frames always have tile_height rows */
+	    loader_args.band_y = tile_y;
+	    loader_args.fcache = NULL;
+
+	    accum[1].init(width, tile_h, is_integer);
+	    if ( 0 < n_passes ) {
+		accum[0].init(width, tile_h, is_integer);
+		if ( fcache.init(width, tile_height, filenames.length(),
+				 1 + n_plus, cache_ram_bytes, NULL) < 0 ) {
+		    sio.eprintf("[WARNING] frame cache is disabled\n");
+		}
+	    }
+
+	    /*
+	     *  1st pass
+	     */
+	    if ( prefetch.start(idx_list_1st.array_ptr(), 1 + n_plus,
+				n_loader_threads, prefetch_depth,
+				&load_frame_for_stacking, (void *)&loader_args) < 0 ) {
+		sio.eprintf("[ERROR] prefetch.start() failed\n");
+		goto quit;
+	    }
+	    ii = 0;
+	    while ( 1 ) {
+		bool load_tiff_ok = false;
+		long offset_x = 0, offset_y = 0;
+
+		if ( prefetch.next(&idx, &load_tiff_ok, &img_buf,
+				   &offset_x, &offset_y) == false ) break;
+
+		if ( load_tiff_ok == false ) {
+		    /* all tiles should be stacked with the same frames */
+		    sio.eprintf("[ERROR] cannot load [%s]\n",
+				filenames[idx].cstr());
+		    prefetch.stop();
+		    goto quit;
+		}
+		ii ++;
+
+		if ( 0 < n_passes ) fcache.put(idx, img_buf);
+
+		/* (bands are already shifted in y) */
+		accum[1].weight = get_frame_weight(frame_weights, idx);
+		stack_add_frame(&tpool, img_buf, offset_x, 0,
+				&accum[1]);                 /* STACK! */
+
+		winname(win_image, "Stacking tile %zd/%zd: %zd/%zd",
+			tile_id + 1, n_tiles, ii, (size_t)(1+n_plus));
+	    }
+	    prefetch.stop();
+
+	    accum[1].count = (int)sum_weight;
+	    accum_result_ptr = &accum[1];
+
+	    /*
+	     *  Perform Sigma-Clipping ...
+	     */
+	    loader_args.fcache = &fcache;
+
+	    for ( cnt=0 ; cnt < n_passes ; cnt++ ) {
+
+		stack_accum *accum0_ptr;            /* new result */
+		stack_accum *accum1_ptr;            /* result of previous pass */
+		const double *av_median = unit_median;
+
+		bool final_loop = false;
+
+		if ( cnt + 1 == count_sigma_clip ) final_loop = true;
+
+		/* swap buffer pointer */
+		if ( (cnt % 2) == 0 ) {
+		    accum0_ptr = &accum[0];
+		    accum1_ptr = &accum[1];
+		}
+		else {
+		    accum1_ptr = &accum[0];
+		    accum0_ptr = &accum[1];
+		}
+
+		/* median(R,G,B) of whole averaged image of previous pass */
+		if ( skylv_sigma_clip == true ) {
+		    av_median = av_median_pass.array_ptr_cs(0, cnt);
+		}
+
+		/* clear buffer for new result */
+		accum0_ptr->clean();
+
+		if ( prefetch.start(idx_list.array_ptr(), 1 + n_plus,
+				    n_loader_threads, prefetch_depth,
+				    &load_frame_for_stacking,
+				    (void *)&loader_args) < 0 ) {
+		    sio.eprintf("[ERROR] prefetch.start() failed\n");
+		    goto quit;
+		}
+
+		ii = 0;
+		while ( 1 ) {
+		    bool load_tiff_ok = false;
+		    long offset_x = 0, offset_y = 0;
+		    const double *target_median = unit_median;
+
+		    if ( prefetch.next(&idx, &load_tiff_ok, &img_buf,
+				       &offset_x, &offset_y) == false ) break;
+
+		    if ( load_tiff_ok == false ) {
+			sio.eprintf("[ERROR] cannot load [%s]\n",
+				    filenames[idx].cstr());
+			prefetch.stop();
+			goto quit;
+		    }
+		    ii ++;
+
+		    if ( skylv_sigma_clip == true ) {
+			target_median = target_medians.array_ptr_cs(0, idx);
+		    }
+
+		    /* STACK! */
+		    /* (a reference image is stacked without sigma-clipping */
+		    /*  when last loop of comet mode)                       */
+		    accum0_ptr->weight = get_frame_weight(frame_weights, idx);
+		    stack_sigma_clip_frame(&tpool, img_buf, offset_x, 0,
+			    *accum1_ptr, sigma_rgb, av_median, target_median,
+			    (comet_sigma_clip == true && final_loop == true &&
+			     idx == ref_file_id),
+			    accum0_ptr);
+
+		    winname(win_image,
+			    "Stacking tile %zd/%zd with sigma-clipping %d: "
+			    "%zd/%zd", tile_id + 1, n_tiles, cnt + 1, ii,
+			    (size_t)(1+n_plus));
+		}
+		prefetch.stop();
+
+		accum_result_ptr = accum0_ptr;
+	    }
+
+	    /* get averaged tile, write and display it */
+	    stack_get_average(&tpool, *accum_result_ptr, sum_weight, &tile_buf);
+	    if ( tile_id == 0 || md_min(tile_buf) < min_val ) {
+		min_val = md_min(tile_buf);
+	    }
+	    if ( tile_id == 0 || max_val < md_max(tile_buf) ) {
+		max_val = md_max(tile_buf);
+	    }
+	    if ( float_out.write_rows(tile_buf, tile_h) < 0 ) {
+		sio.eprintf("[ERROR] float_out.write_rows() failed\n");
+		goto quit;
+	    }
+	    display_image(win_image, 0, tile_y, tile_buf, 2,
+			  display_bin, display_ch, contrast_rgb, false, tmp_buf);
+
+	    fcache.close();
+	}
+
+	if ( float_out.close() < 0 ) {
+	    sio.eprintf("[ERROR] float_out.close() failed\n");
+	    goto quit;
+	}
+
+	if ( stage + 1 < n_stages ) {
+	    /* averaged image of this stage is the previous pass of next one */
+	    double *av_median = av_median_pass.array_ptr(0, stage);
+	    if ( get_tiff_median(float_filename.cstr(), tile_height,
+				 av_median) < 0 ) {
+		sio.eprintf("[ERROR] get_tiff_median() failed\n");
+		goto quit;
+	    }
+	    sio.printf("Median of averaged image = (%g, %g, %g)\n",
+		       av_median[0], av_median[1], av_median[2]);
+	}
+
+    }
+
+    /* free memory */
+    accum[0].release();
+    accum[1].release();
+    img_buf.init(false);
+
+    winname(win_image, "Done stacking %zd frames", (size_t)(1+n_plus));
+
+    /* save using 16-bit (same as save_stacked_image()) */
+    make_tiff_filename(filenames[ref_file_id].cstr(), appended_str.cstr(),
+		       "16bit", &out_filename);
+    sio.printf("Writing '%s' ", out_filename.cstr());
+    if ( flag_dither == true ) sio.printf("using dither ...\n");
+    else sio.printf("NOT using dither ...\n");
+    sio.printf("[INFO] scale will be changed\n");
+    if ( out_16bit.open(out_filename.cstr(), width, height, icc_buf,
+			min_val, max_val, flag_dither) < 0 ) {
+	sio.eprintf("[ERROR] out_16bit.open() failed\n");
+	goto quit;
+    }
+    for ( tile_y=0 ; tile_y < height ; tile_y += tile_height ) {
+	size_t tile_h = tile_height;
+	if ( height < tile_y + tile_h ) tile_h = height - tile_y;
+	if ( load_tiff_rows_into_float(float_filename.cstr(), 65536.0,
+				       tile_y, tile_h, &tile_buf, NULL,
+				       NULL, NULL, NULL, NULL) < 0 ||
+	     out_16bit.write_rows(tile_buf, tile_h) < 0 ) {
+	    sio.eprintf("[ERROR] cannot write '%s'\n", out_filename.cstr());
+	    goto quit;
+	}
+    }
+    if ( out_16bit.close() < 0 ) {
+	sio.eprintf("[ERROR] out_16bit.close() failed\n");
+	goto quit;
+    }
+    
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
+
+/*
+ * Single-pass combine (median, percentile or winsorized sigma-clipping).
+ *
+ * The image is processed in horizontal bands: rows of all frames
+ * overlapping a band are decoded (honoring .offset shifts) into a
+ * transposed store, and each pixel is combined from its samples.
+ * Each frame is read only once in total.  Pixels not covered by a
+ * shifted frame are excluded.
+ */
+static int do_combine_and_save( const tarray_tstring &filenames,
+			      int ref_file_id, const mdarray_bool &flg_saved,
+			      const combine_params &combine_prms,
+			      bool flag_dither,
+			      int n_loader_threads, int prefetch_depth,
+			      int n_compute_threads, size_t mem_budget_mb,
+			      int display_bin, int display_ch, 
+			      const int contrast_rgb[],
+			      int win_image, mdarray_uchar *tmp_buf )
+{
+    stdstreamio sio;
+    uint64_t mem_budget_bytes;
+    size_t width = 0, height = 0;
+    size_t band_height, n_bands, n_in_flight;
+    uint64_t row_bytes;
+    char mode_name[32];
+    frame_band_store store;		/* samples of a band */
+    mdarray_float img_buf(false);	/* band of a frame */
+    mdarray_float band_buf(false);	/* combined band */
+    mdarray_float result_buf(false);	/* whole combined image */
+    mdarray_uchar icc_buf(false);
+    frame_prefetch prefetch;		/* background frame loading */
+    thread_pool tpool;			/* threads for combine */
+    stack_loader_args loader_args;
+    mdarray_long idx_list(false);	/* frames in order of index */
+    size_t n_idx, n_plus, band_y, i, ii, ch;
+    long idx;
+    tstring appended_str;
+
+    int ret_status = -1;
+
+    if ( filenames.length() == 0 ) goto quit;
+    if ( flg_saved.length() == 0 ) goto quit;
+    if ( ref_file_id < 0 ) goto quit;
+    if ( filenames.length() <= (size_t)ref_file_id ) goto quit;
+
+    get_combine_mode_name(combine_prms, mode_name, sizeof(mode_name));
+    sio.printf("combine: [mode=%s", mode_name);
+    if ( combine_prms.mode == COMBINE_WINSORIZED ) {
+	sio.printf(",  sigma=(%g,%g,%g)", combine_prms.winsor_sigma[0],
+		   combine_prms.winsor_sigma[1], combine_prms.winsor_sigma[2]);
+    }
+    sio.printf("]  dither=%d\n", (int)flag_dither);
+
+    /* get size and ICC data of reference (no rows are decoded) */
+    if ( load_tiff_rows_into_float(filenames[ref_file_id].cstr(), 65536.0,
+				   0, 0, NULL, NULL, &icc_buf, NULL,
+				   &width, &height) < 0 ) {
+	sio.eprintf("[ERROR] load_tiff_rows_into_float() failed\n");
+	goto quit;
+    }
+    if ( width == 0 || height == 0 ) goto quit;
+
+    if ( 0 < count_warped_frames(filenames, ref_file_id, WARP_NONE,
+				 flg_saved, width, height) ) {
+	sio.eprintf("[WARNING] rotation of frames is not supported with "
+		    "combine mode (-c); integer offsets are used\n");
+    }
+
     if ( icc_buf.length() == 0 ) {
 	icc_buf.resize_1d(sizeof(Icc_srgb_profile));
 	icc_buf.put_elements(Icc_srgb_profile,sizeof(Icc_srgb_profile));
     }
 
-    /* allocate memory */
-    stacked_buf1_sum.resize(img_buf);
-    count_buf1.resize(img_buf);
-    stacked_buf1_sum2.resize(img_buf);
-
-    if ( 0 < count_sigma_clip ) {
-	stacked_buf0_sum.resize(img_buf);
-	count_buf0.resize(img_buf);
-	stacked_buf0_sum2.resize(img_buf);
-	flag_buf.resize_2d(img_buf.x_length(), img_buf.y_length());
-	img_tmp_buf.resize(img_buf);
-	img_tmp_buf_1d.resize_2d(img_buf.x_length(), img_buf.y_length());
-    }
-
-    /* paste 1st image */
-    stacked_buf1_sum = img_buf;
-    stacked_buf1_sum2 = img_buf;
-    stacked_buf1_sum2 *= img_buf;
-    
-    winname(win_image, "Stacking ...");
-    if ( flag_preview == true ) {
-        display_image(win_image, 0, 0, img_buf, 2,
-		      display_bin, display_ch, contrast_rgb, false, tmp_buf);
-    }
-
     n_plus = 0;
     for ( i=0 ; i < filenames.length() ; i++ ) {
-        if ( flg_saved[i] == true ) n_plus ++;
+        if ( flg_saved[i] == true && (int)i != ref_file_id ) n_plus ++;
     }
-    
-    ii = 1;
+    idx_list.resize_1d(1 + n_plus);
+    n_idx = 0;
     for ( i=0 ; i < filenames.length() ; i++ ) {
-        if ( flg_saved[i] == true ) {
-	    bool load_tiff_ok;
-
-	    load_tiff_ok = load_tiff_into_float_and_compare(
-			filenames, flg_saved, ref_file_id, i,
-			n_comp_dark_synth, skylv_sigma_clip,
-			&img_buf );
-
-	    if ( load_tiff_ok == true ) {
-		//double max_val;
-		long offset_x = 0, offset_y = 0;
-
-		ii ++;
-
-		sio.printf("Stacking [%s]\n", filenames[i].cstr());
-
-		if ( read_offset_file(filenames, i,
-				      &offset_x, &offset_y) < 0 ) {
-		    sio.eprintf("[ERROR] read_offset_file() failed.\n");
-		}
-
-		stacked_buf1_sum.add(img_buf, offset_x, offset_y, 0); /* STACK! */
-		stacked_buf1_sum2.add(img_buf * img_buf, offset_x, offset_y, 0); /* STACK pow() */
-
-		if ( flag_preview == true ) {
-		    //max_val = md_max(stacked_buf1_sum);
-		    //img_buf.paste(stacked_buf1_sum * (65535.0 / max_val));
-		    img_buf = stacked_buf1_sum;
-		    img_buf *= (1.0/(double)(ii));
-		    /* display stacked image */
-		    display_image(win_image, 0, 0, img_buf, 2,
-			display_bin, display_ch, contrast_rgb, false, tmp_buf);
-		}
-
-		winname(win_image, "Stacking %zd/%zd", ii, (size_t)(1+n_plus));
-
-	    }
+	if ( (int)i == ref_file_id || flg_saved[i] == true ) {
+	    idx_list[n_idx] = i;
+	    n_idx ++;
 	}
     }
 
-    n_plus = ii - 1;
+    /* determine height of band */
+    if ( 0 < mem_budget_mb ) {
+	mem_budget_bytes = (uint64_t)mem_budget_mb * 1024 * 1024;
+    }
+    else {
+	mem_budget_bytes = get_physical_memory_bytes() * Frame_cache_mem_ratio;
+    }
+    n_in_flight = prefetch_depth + n_loader_threads + 2;
+    row_bytes = (uint64_t)width * (frame_band_store::pixel_bytes(n_idx)
+				   + n_in_flight * 3 * sizeof(float));
+    band_height = mem_budget_bytes / row_bytes;
+    if ( band_height < Min_tile_height ) {
+	sio.eprintf("[WARNING] memory budget is too small; "
+		    "using bands of %zd rows\n", Min_tile_height);
+	band_height = Min_tile_height;
+    }
+    if ( height < band_height ) band_height = height;
+    n_bands = (height + band_height - 1) / band_height;
 
-    count_buf1 = (int)(1 + n_plus);
+    sio.printf("%zd bands of %zd rows\n", n_bands, band_height);
 
-    /* display stacked image */
-    img_buf = stacked_buf1_sum;
-    img_buf *= (1.0/(double)ii);
-    display_image(win_image, 0, 0, img_buf, 2,
-		  display_bin, display_ch, contrast_rgb, false, tmp_buf);
+    if ( store.init(width, band_height, n_idx) < 0 ) {
+	sio.eprintf("[ERROR] store.init() failed\n");
+	goto quit;
+    }
 
-    stacked_buf_result_ptr = &stacked_buf1_sum;
-    count_buf_result_ptr = &count_buf1;
+    if ( tpool.start(n_compute_threads) < 0 ) {
+	sio.eprintf("[ERROR] tpool.start() failed\n");
+	goto quit;
+    }
 
+    result_buf.resize_3d(width, height, 3);
 
-    /*
-     *  Perform Sigma-Clipping ...
-     */
+    loader_args.filenames = &filenames;
+    loader_args.flg_saved = &flg_saved;
+    loader_args.ref_file_id = ref_file_id;
+    loader_args.n_comp_dark_synth = 0;
+    loader_args.skylv_sigma_clip = false;
+    loader_args.band_y = 0;
+    loader_args.band_height = band_height;
+    loader_args.fcache = NULL;
+    loader_args.ring = NULL;
 
-    for ( cnt=0 ; cnt < count_sigma_clip ; cnt++ ) {
+    winname(win_image, "Combining ...");
 
-	mdarray_float *stacked_buf0_sum_ptr;
-	mdarray_float *stacked_buf0_sum2_ptr;
-	mdarray_short *count_buf0_ptr;
+    for ( band_y=0 ; band_y < height ; band_y += band_height ) {
 
-	mdarray_float *stacked_buf1_sum_ptr;
-	mdarray_float *stacked_buf1_sum2_ptr;
-	mdarray_short *count_buf1_ptr;
+	const size_t band_id = band_y / band_height;
+	size_t band_h = band_height;
+	if ( height < band_y + band_h ) band_h = height - band_y;
 
-	double av_median[3] = {1.0, 1.0, 1.0};
+	sio.printf("*** Band %zd / %zd  [y = %zd - %zd] ***\n",
+		   band_id + 1, n_bands, band_y, band_y + band_h - 1);
 
-	bool final_loop = false;
+	loader_args.band_y = band_y;
+	store.clean();
 
-	if ( cnt + 1 == count_sigma_clip ) final_loop = true;
+	if ( prefetch.start(idx_list.array_ptr(), n_idx,
+			    n_loader_threads, prefetch_depth,
+			    &load_frame_for_stacking, (void *)&loader_args) < 0 ) {
+	    sio.eprintf("[ERROR] prefetch.start() failed\n");
+	    goto quit;
+	}
+	ii = 0;
+	while ( 1 ) {
+	    bool load_tiff_ok = false;
+	    long offset_x = 0, offset_y = 0;
+	    long row_begin;
+
+	    if ( prefetch.next(&idx, &load_tiff_ok, &img_buf,
+			       &offset_x, &offset_y) == false ) break;
+
+	    if ( load_tiff_ok == false ) {
+		/* all bands should be combined with the same frames */
+		sio.eprintf("[ERROR] cannot load [%s]\n", filenames[idx].cstr());
+		prefetch.stop();
+		goto quit;
+	    }
 
-	sio.printf("*** Sigma-Clipping count of iterations = %d / %d ***\n", cnt + 1, count_sigma_clip);
+	    /* row r of band is row (band_y - offset_y + r) of frame */
+	    row_begin = offset_y - (long)band_y;
+	    store.put(ii, img_buf, offset_x,
+		      row_begin, row_begin + (long)height);
+	    ii ++;
 
-	/* swap buffer pointer */
-	if ( (cnt % 2) == 0 ) {
-	    stacked_buf0_sum_ptr = &stacked_buf0_sum;
-	    stacked_buf0_sum2_ptr = &stacked_buf0_sum2;
-	    count_buf0_ptr = &count_buf0;
-	    stacked_buf1_sum_ptr = &stacked_buf1_sum;
-	    stacked_buf1_sum2_ptr = &stacked_buf1_sum2;
-	    count_buf1_ptr = &count_buf1;
+	    winname(win_image, "Combining band %zd/%zd: %zd/%zd",
+		    band_id + 1, n_bands, ii, n_idx);
 	}
-	else {
-	    stacked_buf1_sum_ptr = &stacked_buf0_sum;
-	    stacked_buf1_sum2_ptr = &stacked_buf0_sum2;
-	    count_buf1_ptr = &count_buf0;
-	    stacked_buf0_sum_ptr = &stacked_buf1_sum;
-	    stacked_buf0_sum2_ptr = &stacked_buf1_sum2;
-	    count_buf0_ptr = &count_buf1;
-	}
-
-	if ( skylv_sigma_clip == true ) {
-	    /* get median(R,G,B) of averaged image */
-	    img_tmp_buf = (*stacked_buf1_sum_ptr);
-	    img_tmp_buf /= (*count_buf1_ptr);
-	    img_tmp_buf.copy(&img_tmp_buf_1d,
-		0, img_tmp_buf.x_length(), 0, img_tmp_buf.y_length(), 0, 1);
-	    av_median[0] = md_median(img_tmp_buf_1d);
-	    img_tmp_buf.copy(&img_tmp_buf_1d,
-		0, img_tmp_buf.x_length(), 0, img_tmp_buf.y_length(), 1, 1);
-	    av_median[1] = md_median(img_tmp_buf_1d);
-	    img_tmp_buf.copy(&img_tmp_buf_1d,
-		0, img_tmp_buf.x_length(), 0, img_tmp_buf.y_length(), 2, 1);
-	    av_median[2] = md_median(img_tmp_buf_1d);
-	    sio.printf("Median of averaged image = (%g, %g, %g)\n",
-		       av_median[0], av_median[1], av_median[2]);
+	prefetch.stop();
+
+	/* combine samples and store it into result */
+	store.combine(&tpool, combine_prms, band_h, &band_buf);
+	for ( ch=0 ; ch < 3 ; ch++ ) {
+	    memcpy(result_buf.array_ptr(0, band_y, ch),
+		   band_buf.array_ptr_cs(0, 0, ch),
+		   sizeof(float) * width * band_h);
 	}
+    }
 
-	/* clear buffer for new result */
-	stacked_buf0_sum_ptr->clean();
-	stacked_buf0_sum2_ptr->clean();
-	count_buf0_ptr->clean();
+    /* free memory */
+    store.release();
+    band_buf.init(false);
+    img_buf.init(false);
 
-	/*
-	 *  main of sigma-clipping
-	 */
-	ii = 0;
-	for ( i=0 ; i < filenames.length() ; i++ ) {
-	    if ( (int)i == ref_file_id || flg_saved[i] == true ) {
-		bool load_tiff_ok = false;
+    /* display */
+    display_image(win_image, 0, 0, result_buf, 2,
+		  display_bin, display_ch, contrast_rgb, false, tmp_buf);
+    winname(win_image, "Done combining %zd frames", n_idx);
 
-		load_tiff_ok = load_tiff_into_float_and_compare(
-			filenames, flg_saved, ref_file_id, i,
-			n_comp_dark_synth, skylv_sigma_clip,
-			&img_buf );
+    /* save */
+    appended_str.printf("+%zdframes_%s", n_plus, mode_name);
 
-		/*
-		if ( load_tiff_into_float(filenames[i].cstr(), 65536.0,
-					  &img_buf, NULL, NULL, NULL) < 0 ) {
-		    sio.eprintf("[ERROR] load_tiff_into_float() failed\n");
-		}
-		else {
-		    load_tiff_ok = true;
-		}
-		*/
-	        if ( load_tiff_ok == true ) {
-		    unsigned char *p5 = flag_buf.array_ptr();
-		    size_t j;
-		    double target_median[3] = {1.0, 1.0, 1.0};
-		    //double max_val;
-		    long offset_x = 0, offset_y = 0;
+    if ( save_stacked_image(filenames[ref_file_id].cstr(),
+			    appended_str.cstr(), result_buf, icc_buf,
+			    flag_dither) < 0 ) {
+	goto quit;
+    }
+    
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
 
-		    ii ++;
+/* arguments for frame loader of drizzle in prefetch threads */
+typedef struct _drizzle_loader_args {
+    const tarray_tstring *filenames;
+    const frame_transform *transforms;	/* [idx]: frame -> reference */
+    size_t width;			/* size of frames */
+    size_t height;
+    int scale;
+    double pixfrac;
+    long band_y;			/* top of band in output */
+    long band_height;			/* rows of band in output */
+} drizzle_loader_args;
+
+/* called in prefetch threads: rows of frame dropped onto the band are */
+/* loaded, and ret_offset_y is set to the row of frame of the 1st row  */
+static int load_frame_for_drizzle( long idx, mdarray_float *ret_img_buf,
+				   long *ret_offset_x, long *ret_offset_y,
+				   void *user_ptr )
+{
+    stdstreamio sio;
+    const drizzle_loader_args *args_p = (const drizzle_loader_args *)user_ptr;
+    long y_begin, n_rows;
+    int ret_status = -1;
 
-		    sio.printf("Stacking with Sigma-Clipping [%s]\n", filenames[i].cstr());
+    drizzle_get_source_rows(args_p->transforms[idx],
+			    args_p->width, args_p->height,
+			    args_p->scale, args_p->pixfrac,
+			    args_p->band_y, args_p->band_height,
+			    &y_begin, &n_rows);
+    *ret_offset_x = 0;
+    *ret_offset_y = y_begin;
+
+    if ( n_rows <= 0 ) {
+	/* no pixel is dropped onto the band */
+	ret_img_buf->init(false);
+    }
+    else if ( load_tiff_rows_into_float(
+			(*(args_p->filenames))[idx].cstr(), 65536.0,
+			y_begin, n_rows,
+			ret_img_buf, NULL, NULL, NULL, NULL, NULL) < 0 ) {
+	sio.eprintf("[ERROR] load_tiff_rows_into_float() failed\n");
+	goto quit;
+    }
 
-		    if ( (int)i != ref_file_id ) {
-			if ( read_offset_file(filenames, i,
-				              &offset_x, &offset_y) < 0 ) {
-			    sio.eprintf("[ERROR] read_offset_file() failed.\n");
-			}
-		    }
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
 
-		    if ( skylv_sigma_clip == true ) {
-			/* get median(R,G,B) of target image */
-			target_median[0] = md_median(img_buf.sectionf("*,*,0"));
-			target_median[1] = md_median(img_buf.sectionf("*,*,1"));
-			target_median[2] = md_median(img_buf.sectionf("*,*,2"));
-			sio.printf("Median of target image = (%g, %g, %g)\n",
-				   target_median[0], target_median[1], target_median[2]);
-		    }
+/*
+ * Drizzle integration onto an output grid finer by scale.
+ *
+ * The output is processed in horizontal bands whose height is
+ * determined by mem_budget_mb (or a fraction of physical memory): for
+ * each band, only rows of frames dropped onto the band are decoded,
+ * drops are accumulated by threads over rows of the band, and the band
+ * is written to TIFF files of the result and the weight map.  Neither
+ * the output canvas nor whole frames are held in memory.
+ *
+ * Offsets (and rotations) of .offset.txt are used with sub-pixel
+ * precision.  Sigma-clipping and dark synthesis are not supported.
+ */
+static int do_drizzle_and_save( const tarray_tstring &filenames,
+			      int ref_file_id, const mdarray_bool &flg_saved,
+			      int drizzle_scale, double drizzle_pixfrac,
+			      int n_loader_threads, int prefetch_depth,
+			      int n_compute_threads, size_t mem_budget_mb,
+			      int win_image )
+{
+    stdstreamio sio;
+    uint64_t mem_budget_bytes;
+    size_t width = 0, height = 0, out_width, out_height;
+    size_t band_height, n_bands, n_in_flight;
+    uint64_t row_bytes;
+    frame_transform *transforms = NULL;
+    drizzle_accum accum;		/* sum and weight of a band */
+    mdarray_float img_buf(false);	/* rows of a frame */
+    mdarray_float band_buf(false);	/* result of a band */
+    mdarray_float weight_buf(false);	/* weight map of a band */
+    mdarray_uchar icc_buf(false);
+    float_tiff_writer result_out, weight_out;
+    frame_prefetch prefetch;		/* background frame loading */
+    thread_pool tpool;			/* threads for drizzle */
+    drizzle_loader_args loader_args;
+    mdarray_long idx_list(false);	/* frames in order of index */
+    size_t n_idx, n_plus, band_y, i, ii;
+    long idx;
+    tstring appended_str, out_filename, weight_filename;
 
-		    img_tmp_buf.clean();
-		    img_tmp_buf.add(img_buf, offset_x, offset_y, 0);
-		    size_t len_xy = img_tmp_buf.x_length() * img_tmp_buf.y_length();
+    int ret_status = -1;
 
-		    flag_buf = 0;
+    if ( filenames.length() == 0 ) goto quit;
+    if ( flg_saved.length() == 0 ) goto quit;
+    if ( ref_file_id < 0 ) goto quit;
+    if ( filenames.length() <= (size_t)ref_file_id ) goto quit;
 
-		    if ( comet_sigma_clip == true && final_loop == true && (int)i == ref_file_id ) {
-			/* Stack a reference image without sigma-clipping (when last loop) */
-			(*count_buf0_ptr) += (int)1;
-		    }
-		    else {
-			for ( j=0 ; j < 3 ; j++ ) {
-			    size_t k;
-			    const float *p0 = stacked_buf1_sum_ptr->array_ptr_cs(0,0,j);
-			    const float *p1 = stacked_buf1_sum2_ptr->array_ptr_cs(0,0,j);
-			    const short *p2 = count_buf1_ptr->array_ptr_cs(0,0,j);
-			    const float *p3 = img_tmp_buf.array_ptr_cs(0,0,j);
-
-			    if ( 0 < sigma_rgb[j] ) {
-			        double sigma_factor_limit = sigma_rgb[j] / 10.0;
-			        for ( k=0 ; k < len_xy ; k++ ) {
-				    double sum  = p0[k];
-				    double mean = sum / (double)(p2[k]);
-				    double sum2 = p1[k];
-				    double sigma = sqrt( (sum2 - 2 * mean * sum + mean * mean * p2[k])
-					                 / (double)(p2[k] - 1) );
-				    /* apply *standardized* pixel value */
-				    //double pix_val = p3[k] * (av_median[j] / target_median[j]);
-				    /* apply *sky-level-adjusted* pixel value */
-				    double pix_val = p3[k] + (av_median[j] - target_median[j]);
-				    if ( sigma_factor_limit * sigma < fabs(mean - pix_val) ) {
-				        p5[k] ++;		/* mark unused pixels */
-				    }
-			        }
-			    }
-		        }
-		        for ( j=0 ; j < 3 ; j++ ) {
-			    float *p3 = img_tmp_buf.array_ptr(0,0,j);
-			    short *p4 = count_buf0_ptr->array_ptr(0,0,j);
-			    size_t k;
-			    for ( k=0 ; k < len_xy ; k++ ) {
-			        if ( 0 < p5[k] ) {
-				    p3[k] = 0.0;	/* unused pixels */
-			        }
-			        else {
-				    p4[k] ++;
-			        }
-			    }
-		        }
-		    }
+    sio.printf("drizzle: [scale=%d,  pixfrac=%g]\n",
+	       drizzle_scale, drizzle_pixfrac);
 
-		    (*stacked_buf0_sum_ptr) += img_tmp_buf;		/* STACK! */
-		    img_tmp_buf *= img_tmp_buf;
-		    (*stacked_buf0_sum2_ptr) += img_tmp_buf; /* img_tmp_buf^2 */
-
-		    if ( flag_preview == true || ii == 1 + n_plus ) {
-			//max_val = md_max(stacked_buf0_sum);
-			//img_buf.paste(stacked_buf0_sum * (65535.0 / max_val));
-			img_buf = (*stacked_buf0_sum_ptr);
-			img_buf /= (*count_buf0_ptr);
-			/* display stacked image */
-			display_image(win_image, 0, 0, img_buf, 2,
-		         display_bin, display_ch, contrast_rgb, false, tmp_buf);
-		    }
+    /* get size and ICC data of reference (no rows are decoded) */
+    if ( load_tiff_rows_into_float(filenames[ref_file_id].cstr(), 65536.0,
+				   0, 0, NULL, NULL, &icc_buf, NULL,
+				   &width, &height) < 0 ) {
+	sio.eprintf("[ERROR] load_tiff_rows_into_float() failed\n");
+	goto quit;
+    }
+    if ( width == 0 || height == 0 ) goto quit;
+    out_width = width * drizzle_scale;
+    out_height = height * drizzle_scale;
 
-		    winname(win_image, "Stacking with sigma-clipping %zd/%zd", ii, (size_t)(1+n_plus));
+    if ( icc_buf.length() == 0 ) {
+	icc_buf.resize_1d(sizeof(Icc_srgb_profile));
+	icc_buf.put_elements(Icc_srgb_profile,sizeof(Icc_srgb_profile));
+    }
 
-		}
+    /* frames and their transforms */
+    transforms = new frame_transform[filenames.length()];
+    n_plus = 0;
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+	set_translation_transform(0.0, 0.0, &transforms[i]);
+        if ( flg_saved[i] == true && (int)i != ref_file_id ) {
+	    if ( load_frame_transform(filenames[i].cstr(),
+				      &transforms[i]) < 0 ) {
+		sio.eprintf("[ERROR] cannot read offset of [%s]\n",
+			    filenames[i].cstr());
+		goto quit;
 	    }
+	    n_plus ++;
+	}
+    }
+    idx_list.resize_1d(1 + n_plus);
+    n_idx = 0;
+    for ( i=0 ; i < filenames.length() ; i++ ) {
+	if ( (int)i == ref_file_id || flg_saved[i] == true ) {
+	    idx_list[n_idx] = i;
+	    n_idx ++;
 	}
-	stacked_buf_result_ptr = stacked_buf0_sum_ptr;
-	count_buf_result_ptr = count_buf0_ptr;
-	sio.printf("Median of pixel-count = %g frames\n", md_median(*(count_buf0_ptr)));
     }
 
+    /* determine height of band (rows of output):          */
+    /*   accumulator, results and rows of frames in flight */
+    if ( 0 < mem_budget_mb ) {
+	mem_budget_bytes = (uint64_t)mem_budget_mb * 1024 * 1024;
+    }
+    else {
+	mem_budget_bytes = get_physical_memory_bytes() * Frame_cache_mem_ratio;
+    }
+    n_in_flight = prefetch_depth + n_loader_threads + 2;
+    row_bytes = (uint64_t)out_width * (drizzle_accum::pixel_bytes()
+				       + 4 * sizeof(float))
+		+ (uint64_t)width * n_in_flight * 3 * sizeof(float)
+		  / drizzle_scale;
+    band_height = mem_budget_bytes / row_bytes;
+    if ( band_height < Min_tile_height ) {
+	sio.eprintf("[WARNING] memory budget is too small; "
+		    "using bands of %zd rows\n", Min_tile_height);
+	band_height = Min_tile_height;
+    }
+    if ( out_height < band_height ) band_height = out_height;
+    n_bands = (out_height + band_height - 1) / band_height;
 
-    /* get final averaged image */
-    (*stacked_buf_result_ptr) /= (*count_buf_result_ptr);
-
-    /* free memory */
-    img_tmp_buf_1d.init(false);
-    img_tmp_buf.init(false);
-    flag_buf.init(false);
-    stacked_buf0_sum2.init(false);
-    count_buf0.init(false);
-    stacked_buf1_sum2.init(false);
-    count_buf1.init(false);
-    img_buf.init(false);
+    sio.printf("Output: %zd x %zd,  %zd bands of %zd rows\n",
+	       out_width, out_height, n_bands, band_height);
 
-    /* display */
-    winname(win_image, "Done stacking %zd frames", (size_t)(1+n_plus));
+    if ( accum.init(out_width, band_height,
+		    drizzle_scale, drizzle_pixfrac) < 0 ) {
+	sio.eprintf("[ERROR] accum.init() failed\n");
+	goto quit;
+    }
 
-    /* save */
-#if 1
-    appended_str.printf("+%zdframes_stacked", n_plus);
+    if ( tpool.start(n_compute_threads) < 0 ) {
+	sio.eprintf("[ERROR] tpool.start() failed\n");
+	goto quit;
+    }
+    sio.printf("Using %zd threads for drizzle\n", tpool.length());
 
-    /* save using float */
+    /* output files are written band by band */
+    appended_str.printf("+%zdframes_drizzle%dx", n_plus, drizzle_scale);
     make_tiff_filename(filenames[ref_file_id].cstr(), appended_str.cstr(),
 		       "float", &out_filename);
-    sio.printf("Writing '%s' ...\n", out_filename.cstr());
-    if ( save_float_to_tiff(*stacked_buf_result_ptr, icc_buf, NULL, 
-			    65536.0, out_filename.cstr()) < 0 ) {
-	sio.eprintf("[ERROR] save_float_to_tiff() failed.\n");
+    appended_str.printf("+%zdframes_drizzle%dx_weight",
+			n_plus, drizzle_scale);
+    make_tiff_filename(filenames[ref_file_id].cstr(), appended_str.cstr(),
+		       "float", &weight_filename);
+    sio.printf("Writing '%s' and '%s' ...\n",
+	       out_filename.cstr(), weight_filename.cstr());
+    if ( result_out.open(out_filename.cstr(), out_width, out_height, 3,
+			 icc_buf, 65536.0) < 0 ||
+	 weight_out.open(weight_filename.cstr(), out_width, out_height, 1,
+			 icc_buf, 1.0) < 0 ) {
+	sio.eprintf("[ERROR] float_tiff_writer::open() failed\n");
 	goto quit;
     }
-    
-    /* save using 16-bit */
-    make_tiff_filename(filenames[ref_file_id].cstr(), appended_str.cstr(),
-		       "16bit", &out_filename);
-    sio.printf("Writing '%s' ", out_filename.cstr());
-    if ( flag_dither == true ) sio.printf("using dither ...\n");
-    else sio.printf("NOT using dither ...\n");
-    sio.printf("[INFO] scale will be changed\n");
-    if ( save_float_to_tiff48(*stacked_buf_result_ptr, icc_buf, NULL,
-			    0.0, 0.0, flag_dither, out_filename.cstr()) < 0 ) {
-	sio.eprintf("[ERROR] save_float_to_tiff48() failed.\n");
+
+    loader_args.filenames = &filenames;
+    loader_args.transforms = transforms;
+    loader_args.width = width;
+    loader_args.height = height;
+    loader_args.scale = drizzle_scale;
+    loader_args.pixfrac = drizzle_pixfrac;
+    loader_args.band_y = 0;
+    loader_args.band_height = band_height;
+
+    winname(win_image, "Drizzle ...");
+
+    for ( band_y=0 ; band_y < out_height ; band_y += band_height ) {
+
+	const size_t band_id = band_y / band_height;
+	size_t band_h = band_height;
+	if ( out_height < band_y + band_h ) band_h = out_height - band_y;
+
+	sio.printf("*** Band %zd / %zd  [y = %zd - %zd] ***\n",
+		   band_id + 1, n_bands, band_y, band_y + band_h - 1);
+
+	loader_args.band_y = band_y;
+	accum.clean();
+
+	if ( prefetch.start(idx_list.array_ptr(), n_idx,
+			    n_loader_threads, prefetch_depth,
+			    &load_frame_for_drizzle, (void *)&loader_args) < 0 ) {
+	    sio.eprintf("[ERROR] prefetch.start() failed\n");
+	    goto quit;
+	}
+	ii = 0;
+	while ( 1 ) {
+	    bool load_tiff_ok = false;
+	    long offset_x = 0, src_y = 0;
+
+	    if ( prefetch.next(&idx, &load_tiff_ok, &img_buf,
+			       &offset_x, &src_y) == false ) break;
+
+	    if ( load_tiff_ok == false ) {
+		/* all bands should be integrated with the same frames */
+		sio.eprintf("[ERROR] cannot load [%s]\n", filenames[idx].cstr());
+		prefetch.stop();
+		goto quit;
+	    }
+	    ii ++;
+
+	    if ( 0 < img_buf.length() ) {
+		drizzle_add_frame(&tpool, img_buf, src_y, height,
+				  transforms[idx], band_y, &accum);
+	    }
+
+	    winname(win_image, "Drizzle band %zd/%zd: %zd/%zd",
+		    band_id + 1, n_bands, ii, n_idx);
+	}
+	prefetch.stop();
+
+	/* write result and weight map of band */
+	drizzle_get_result(&tpool, accum, &band_buf, &weight_buf);
+	if ( result_out.write_rows(band_buf, band_h) < 0 ||
+	     weight_out.write_rows(weight_buf, band_h) < 0 ) {
+	    sio.eprintf("[ERROR] float_tiff_writer::write_rows() failed\n");
+	    goto quit;
+	}
+    }
+
+    if ( result_out.close() < 0 || weight_out.close() < 0 ) {
+	sio.eprintf("[ERROR] float_tiff_writer::close() failed\n");
 	goto quit;
     }
-#endif
-    
+
+    winname(win_image, "Done drizzle of %zd frames", n_idx);
+
     ret_status = 0;
  quit:
+    if ( transforms != NULL ) delete [] transforms;
     return ret_status;
 }
 
@@ -816,6 +3148,26 @@ int main( int argc, char *argv[] )
 
     bool flag_dither = true;
 
+    int n_loader_threads = 1;		/* threads for loading frames */
+    int prefetch_depth = 2;		/* max frames in loading queue */
+    int n_compute_threads = get_number_of_cpus();	/* for stacking */
+    size_t mem_budget_mb = 0;		/* tile mode when non-zero */
+    combine_params combine_prms;	/* mean, median, etc. */
+    sigclip_setting sweep[Max_sigclip_settings];	/* -s */
+    size_t n_sweep = 0;
+    tstring checkpoint_file;		/* -k */
+    int worker_id = 0;			/* distributed stacking (-w) */
+    int n_workers = 0;
+    tstring partial_file;		/* output of worker (-o) */
+    tstring prev_stack_file;		/* -a */
+    int warp_kernel = WARP_NONE;	/* sub-pixel warping (-i) */
+    int drizzle_scale = 0;		/* drizzle (-d; 0: off) */
+    double drizzle_pixfrac = Default_drizzle_pixfrac;
+    tstring comet_file;			/* marks of comet nucleus (-C) */
+    tstring quality_file;		/* quality table of scan_frames (-q) */
+    mdarray_int frame_weights(false);	/* weights in quality table */
+    mdarray_bool flg_stacked(false);	/* flg_saved and selected */
+
     const char *names_ch[] = {"RGB", "Red", "Green", "Blue"};
     
     long offset_x = 0;
@@ -826,6 +3178,8 @@ int main( int argc, char *argv[] )
 
     int return_status = -1;
 
+    parse_combine_mode("mean", &combine_prms);
+
     load_display_params(conf_file_display, contrast_rgb);
     load_sigclip_params(conf_file_sigclip, &n_comp_dark_synth,
 			&count_sigma_clip, sigma_rgb, &skylv_sigma_clip, &comet_sigma_clip);
@@ -837,6 +3191,130 @@ int main( int argc, char *argv[] )
 	    arg_cnt ++;
 	    refframe = argv[arg_cnt];
 	}
+	else if ( argstr == "-l" ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    n_loader_threads = argstr.atoi();
+	    if ( n_loader_threads < 1 ) n_loader_threads = 1;
+	}
+	else if ( argstr == "-p" ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    prefetch_depth = argstr.atoi();
+	    if ( prefetch_depth < 1 ) prefetch_depth = 1;
+	}
+	else if ( argstr == "-j" ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    n_compute_threads = argstr.atoi();
+	    if ( n_compute_threads < 1 ) n_compute_threads = 1;
+	}
+	else if ( argstr == "-m" ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    if ( 0 < argstr.atol() ) mem_budget_mb = argstr.atol();
+	}
+	else if ( argstr == "-c" ) {
+	    arg_cnt ++;
+	    if ( parse_combine_mode(argv[arg_cnt], &combine_prms) < 0 ) {
+		sio.eprintf("[ERROR] invalid combine mode: %s\n", argv[arg_cnt]);
+		sio.eprintf("[ERROR] use mean, median, p<N> or winsor\n");
+		goto quit;
+	    }
+	}
+	else if ( argstr == "-k" ) {
+	    arg_cnt ++;
+	    checkpoint_file = argv[arg_cnt];
+	}
+	else if ( argstr == "-o" ) {
+	    arg_cnt ++;
+	    partial_file = argv[arg_cnt];
+	}
+	else if ( argstr == "-w" ) {
+	    tarray_tstring vals;
+	    arg_cnt ++;
+	    vals.split(argv[arg_cnt], "/", false);
+	    if ( vals.length() == 2 ) {
+		worker_id = vals[0].atoi();
+		n_workers = vals[1].atoi();
+	    }
+	    if ( n_workers < 1 || worker_id < 0 || n_workers <= worker_id ) {
+		sio.eprintf("[ERROR] invalid worker: %s (use i/n)\n",
+			    argv[arg_cnt]);
+		goto quit;
+	    }
+	}
+	else if ( argstr == "-a" ) {
+	    arg_cnt ++;
+	    prev_stack_file = argv[arg_cnt];
+	}
+	else if ( argstr == "-C" ) {
+	    arg_cnt ++;
+	    comet_file = argv[arg_cnt];
+	}
+	else if ( argstr == "-q" ) {
+	    arg_cnt ++;
+	    quality_file = argv[arg_cnt];
+	}
+	else if ( argstr == "-d" ) {
+	    tarray_tstring vals;
+	    arg_cnt ++;
+	    vals.split(argv[arg_cnt], ",", false);
+	    if ( 0 < vals.length() ) drizzle_scale = vals[0].atoi();
+	    if ( 1 < vals.length() ) drizzle_pixfrac = vals[1].atof();
+	    if ( vals.length() < 1 || 2 < vals.length() ||
+		 drizzle_scale < 1 || Max_drizzle_scale < drizzle_scale ||
+		 drizzle_pixfrac <= 0.0 || 1.0 < drizzle_pixfrac ) {
+		sio.eprintf("[ERROR] invalid drizzle: %s\n", argv[arg_cnt]);
+		sio.eprintf("[ERROR] use scale[,pixfrac] (e.g. 2 or 3,0.7; "
+			    "scale <= %d, 0 < pixfrac <= 1)\n",
+			    Max_drizzle_scale);
+		goto quit;
+	    }
+	}
+	else if ( argstr == "-i" ) {
+	    arg_cnt ++;
+	    if ( parse_warp_kernel(argv[arg_cnt], &warp_kernel) < 0 ) {
+		sio.eprintf("[ERROR] invalid interpolation: %s\n",
+			    argv[arg_cnt]);
+		sio.eprintf("[ERROR] use none, bilinear, bicubic or lanczos3\n");
+		goto quit;
+	    }
+	}
+	else if ( argstr == "-z" ) {
+	    int method;
+	    arg_cnt ++;
+	    if ( parse_tiff_compression(argv[arg_cnt], &method) < 0 ||
+		 set_tiff_compression(method) < 0 ) {
+		sio.eprintf("[ERROR] unsupported compression: %s\n",
+			    argv[arg_cnt]);
+		sio.eprintf("[ERROR] use none, deflate or zstd\n");
+		goto quit;
+	    }
+	}
+	else if ( argstr == "-T" ) {
+	    arg_cnt ++;
+	    argstr = argv[arg_cnt];
+	    if ( argstr.length() == 0 ||
+		 argstr.strspn("0123456789") != argstr.length() ||
+		 set_tiff_tiling(argstr.atoi()) < 0 ) {
+		sio.eprintf("[ERROR] invalid tile size: %s\n", argv[arg_cnt]);
+		sio.eprintf("[ERROR] use 0 (strips) or a multiple of 16\n");
+		goto quit;
+	    }
+	}
+	else if ( argstr == "-s" ) {
+	    arg_cnt ++;
+	    if ( parse_sigclip_settings(argv[arg_cnt], sweep,
+				Max_sigclip_settings, &n_sweep) < 0 ) {
+		sio.eprintf("[ERROR] invalid sigma-clip settings: %s\n",
+			    argv[arg_cnt]);
+		sio.eprintf("[ERROR] use sigma[xN],... (e.g. 20,25x2,30x3; "
+			    "sigma x10, N<=%d, up to %zd settings)\n",
+			    Max_sweep_iterations, Max_sigclip_settings);
+		goto quit;
+	    }
+	}
     }
 
     if ( refframe.length() < 1 ) {
@@ -926,6 +3404,67 @@ int main( int argc, char *argv[] )
 	goto quit;
     }
 
+    /* selection and weights of frames by quality (see scan_frames) */
+    flg_stacked = flg_saved;
+    if ( 0 < quality_file.length() ) {
+	if ( load_quality_table(quality_file.cstr(), filenames,
+				&frame_weights) < 0 ) {
+	    sio.eprintf("[ERROR] cannot load quality table "
+			"(or weight > %d): %s\n",
+			STACK_MAX_WEIGHT, quality_file.cstr());
+	    goto quit;
+	}
+	sio.printf("Quality table [%s]: %zd frames are not selected\n",
+		   quality_file.cstr(),
+		   select_frames_by_weight(filenames, &frame_weights,
+					   ref_file_id, &flg_stacked));
+    }
+
+    if ( (0 < partial_file.length() || 0 < prev_stack_file.length()) &&
+	 n_workers == 0 ) {
+	sio.eprintf("[ERROR] -o and -a are only for worker (-w)\n");
+	goto quit;
+    }
+
+    /*
+     * Worker of distributed stacking: a pass for a subset of frames is
+     * written to the file of -o, and results are merged by merge_stacks.
+     */
+    if ( 0 < n_workers ) {
+	if ( partial_file.length() < 1 ) {
+	    sio.eprintf("[ERROR] output file (-o) is required for worker\n");
+	    goto quit;
+	}
+	if ( 0 < checkpoint_file.length() ) {
+	    sio.eprintf("[ERROR] checkpoint (-k) is not supported with "
+			"worker (-w); use -o for output\n");
+	    goto quit;
+	}
+	/* partial sums are merged as unweighted (see merge_stacks) */
+	for ( i=0 ; i < frame_weights.length() ; i++ ) {
+	    if ( flg_stacked[i] == true &&
+		 get_frame_weight(frame_weights, i) != 1 ) {
+		sio.eprintf("[ERROR] weights of quality table (-q) are not "
+			    "supported with worker (-w); "
+			    "use 'scan_frames -w 1'\n");
+		goto quit;
+	    }
+	}
+	if ( do_stack_partial( filenames, ref_file_id, flg_stacked,
+			       n_comp_dark_synth, sigma_rgb,
+			       skylv_sigma_clip, worker_id, n_workers,
+			       (0 < prev_stack_file.length()) ?
+				   prev_stack_file.cstr() : NULL,
+			       partial_file.cstr(), warp_kernel,
+			       n_loader_threads, prefetch_depth,
+			       n_compute_threads ) < 0 ) {
+	    sio.eprintf("[ERROR] do_stack_partial() failed\n");
+	    goto quit;
+	}
+	return_status = 0;
+	goto quit;
+    }
+
     
     /*
      * GRAPHICS
@@ -1154,11 +3693,124 @@ int main( int argc, char *argv[] )
 	    /* save memory ... */
 	    img_display.init(false);
 	    img_buf.init(false);
-	    if ( do_stack_and_save( filenames, ref_file_id, flg_saved,
+	    /* frames with offsets, and selected by quality table (-q) */
+	    flg_stacked = flg_saved;
+	    select_frames_by_weight(filenames, &frame_weights, ref_file_id,
+				    &flg_stacked);
+	    if ( 0 < frame_weights.length() &&
+		 (0 < drizzle_scale || 0 < comet_file.length() ||
+		  combine_prms.mode != COMBINE_MEAN) ) {
+		sio.eprintf("[WARNING] weights of quality table (-q) are "
+			    "ignored with -d, -C or -c "
+			    "(only selection is applied)\n");
+	    }
+	    if ( 0 < n_sweep && combine_prms.mode != COMBINE_MEAN ) {
+		sio.eprintf("[WARNING] sigma-clip settings (-s) are ignored "
+			    "with combine mode (-c)\n");
+	    }
+	    if ( 0 < checkpoint_file.length() &&
+		 combine_prms.mode != COMBINE_MEAN ) {
+		sio.eprintf("[WARNING] checkpoint (-k) is ignored "
+			    "with combine mode (-c)\n");
+	    }
+	    if ( warp_kernel != WARP_NONE &&
+		 combine_prms.mode != COMBINE_MEAN ) {
+		sio.eprintf("[WARNING] interpolation (-i) is ignored "
+			    "with combine mode (-c)\n");
+	    }
+	    if ( 0 < drizzle_scale ) {
+		if ( n_comp_dark_synth != 0 ) {
+		    sio.eprintf("[ERROR] dark synthesis is not supported "
+				"with drizzle (-d)\n");
+		}
+		else {
+		    if ( 0 < count_sigma_clip ) {
+			sio.eprintf("[WARNING] sigma-clip is not "
+				    "supported with drizzle (-d)\n");
+		    }
+		    if ( do_drizzle_and_save( filenames, ref_file_id,
+				    flg_stacked, drizzle_scale, drizzle_pixfrac,
+				    n_loader_threads, prefetch_depth,
+				    n_compute_threads, mem_budget_mb,
+				    win_image ) < 0 ) {
+			sio.eprintf("[ERROR] do_drizzle_and_save() failed\n");
+		    }
+		}
+	    }
+	    else if ( 0 < comet_file.length() ) {
+		if ( 0 < n_sweep || 0 < checkpoint_file.length() ) {
+		    sio.eprintf("[WARNING] sigma-clip settings (-s) and "
+				"checkpoint (-k) are ignored in comet mode (-C)\n");
+		}
+		if ( do_comet_stack_and_save( filenames, ref_file_id,
+				    flg_stacked, comet_file.cstr(),
+				    n_comp_dark_synth,
+				    count_sigma_clip, sigma_rgb,
+				    skylv_sigma_clip,
+				    flag_dither, flag_preview, warp_kernel,
+				    n_loader_threads, prefetch_depth,
+				    n_compute_threads,
+				    display_bin, display_ch, contrast_rgb,
+				    win_image, &tmp_buf ) < 0 ) {
+		    sio.eprintf("[ERROR] do_comet_stack_and_save() failed\n");
+		}
+	    }
+	    else if ( combine_prms.mode != COMBINE_MEAN ) {
+		if ( n_comp_dark_synth != 0 ) {
+		    sio.eprintf("[ERROR] dark synthesis is not supported "
+				"with combine mode (-c)\n");
+		}
+		else {
+		    /* sigma of winsorized sigma-clipping */
+		    for ( i=0 ; i < 3 ; i++ ) {
+			combine_prms.winsor_sigma[i] = sigma_rgb[i] / 10.0;
+		    }
+		    if ( do_combine_and_save( filenames, ref_file_id,
+				    flg_stacked, combine_prms, flag_dither,
+				    n_loader_threads, prefetch_depth,
+				    n_compute_threads, mem_budget_mb,
+				    display_bin, display_ch, contrast_rgb,
+				    win_image, &tmp_buf ) < 0 ) {
+			sio.eprintf("[ERROR] do_combine_and_save() failed\n");
+		    }
+		}
+	    }
+	    else if ( 0 < mem_budget_mb ) {
+		if ( n_comp_dark_synth != 0 ) {
+		    sio.eprintf("[ERROR] dark synthesis is not supported "
+				"with memory budget (-m)\n");
+		}
+		else if ( 0 < n_sweep || 0 < checkpoint_file.length() ||
+			  warp_kernel != WARP_NONE ) {
+		    sio.eprintf("[ERROR] sigma-clip settings (-s), "
+				"checkpoint (-k) and interpolation (-i) are "
+				"not supported with memory budget (-m)\n");
+		}
+		else {
+		    if ( do_stack_tiled_and_save( filenames, ref_file_id,
+				    flg_stacked, frame_weights,
+				    count_sigma_clip, sigma_rgb,
+				    skylv_sigma_clip, comet_sigma_clip,
+				    flag_dither,
+				    n_loader_threads, prefetch_depth,
+				    n_compute_threads, mem_budget_mb,
+				    display_bin, display_ch, contrast_rgb,
+				    win_image, &tmp_buf ) < 0 ) {
+			sio.eprintf("[ERROR] do_stack_tiled_and_save() failed\n");
+		    }
+		}
+	    }
+	    else if ( do_stack_and_save( filenames, ref_file_id, flg_stacked,
+				    frame_weights,
 				    n_comp_dark_synth,
 				    count_sigma_clip, sigma_rgb, 
+				    sweep, n_sweep,
+				    (0 < checkpoint_file.length()) ?
+					checkpoint_file.cstr() : NULL,
 				    skylv_sigma_clip, comet_sigma_clip, 
-				    flag_dither, flag_preview,
+				    flag_dither, flag_preview, warp_kernel,
+				    n_loader_threads, prefetch_depth,
+				    n_compute_threads,
 				    display_bin, display_ch, contrast_rgb,
 				    win_image, &tmp_buf ) < 0 ) {
 	        sio.eprintf("[ERROR] do_stack_and_save() failed\n");
@@ -0,0 +1,326 @@
+#include <math.h>
+#include <algorithm>
+
+#include "star_funcs.h"
+
+using namespace sli;
+
+/* tile for background estimation (and rows of a band of detection) */
+static const size_t Star_tile_size = 64;
+/* rows above and below a band searched for pixels of a star */
+static const size_t Star_band_margin = 16;
+/* pixels of a star (smaller: hot pixels, larger: not a star) */
+static const size_t Min_star_area = 3;
+static const size_t Max_star_area = 1024;
+/* lower limit of noise (quantized 8/16-bit images) */
+static const double Min_background_sigma = 1.0;
+
+
+/*
+ * class star_list
+ */
+
+star_list::star_list()
+  : x(false), y(false), flux(false), n_stars(0)
+{
+}
+
+void star_list::clear()
+{
+    this->n_stars = 0;
+    return;
+}
+
+void star_list::append( double x, double y, double flux )
+{
+    if ( this->x.length() <= this->n_stars ) {
+	size_t len = (this->n_stars < 16) ? 32 : 2 * this->n_stars;
+	this->x.resize_1d(len);
+	this->y.resize_1d(len);
+	this->flux.resize_1d(len);
+    }
+    this->x[this->n_stars] = x;
+    this->y[this->n_stars] = y;
+    this->flux[this->n_stars] = flux;
+    this->n_stars ++;
+    return;
+}
+
+void star_list::append( const star_list &src )
+{
+    size_t i;
+    for ( i=0 ; i < src.length() ; i++ ) {
+	this->append(src.x[i], src.y[i], src.flux[i]);
+    }
+    return;
+}
+
+/* for std::sort() of indices */
+class star_flux_greater {
+  public:
+    star_flux_greater( const double *flux ) : flux(flux) { }
+    bool operator()( long a, long b ) const {
+	if ( this->flux[a] != this->flux[b] ) return this->flux[b] < this->flux[a];
+	return a < b;
+    }
+  private:
+    const double *flux;
+};
+
+void star_list::sort_by_flux()
+{
+    const size_t n = this->n_stars;
+    mdarray_long idx(false);
+    mdarray_double tmp(false);
+    size_t i;
+
+    if ( n < 2 ) return;
+
+    idx.resize_1d(n);
+    for ( i=0 ; i < n ; i++ ) idx[i] = i;
+    std::sort(idx.array_ptr(), idx.array_ptr() + n,
+	      star_flux_greater(this->flux.array_ptr_cs()));
+
+    tmp.resize_1d(n);
+    for ( i=0 ; i < n ; i++ ) tmp[i] = this->x[idx[i]];
+    for ( i=0 ; i < n ; i++ ) this->x[i] = tmp[i];
+    for ( i=0 ; i < n ; i++ ) tmp[i] = this->y[idx[i]];
+    for ( i=0 ; i < n ; i++ ) this->y[i] = tmp[i];
+    for ( i=0 ; i < n ; i++ ) tmp[i] = this->flux[idx[i]];
+    for ( i=0 ; i < n ; i++ ) this->flux[i] = tmp[i];
+
+    return;
+}
+
+void star_list::truncate( size_t n )
+{
+    if ( n < this->n_stars ) this->n_stars = n;
+    return;
+}
+
+
+/*
+ * detect_stars()
+ */
+
+typedef struct _detect_args {
+    const mdarray_float *img_buf;
+    size_t n_tiles_x;
+    size_t n_tiles_y;
+    double threshold_sigma;
+    mdarray_float *threshold;		/* n_tiles_x x n_tiles_y */
+    mdarray_float *background;
+    star_list *band_stars;		/* for each row of tiles */
+} detect_args;
+
+/* background and threshold of tiles of rows [ty_begin, ty_end) */
+static void estimate_background_band( size_t ty_begin, size_t ty_end,
+				      void *user_ptr )
+{
+    const detect_args *a = (const detect_args *)user_ptr;
+    const size_t width = a->img_buf->x_length();
+    const size_t height = a->img_buf->y_length();
+    mdarray_float work_buf(false);
+    size_t tx, ty;
+
+    work_buf.resize_1d(Star_tile_size * Star_tile_size);
+
+    for ( ty=ty_begin ; ty < ty_end ; ty++ ) {
+	const size_t y0 = Star_tile_size * ty;
+	size_t y1 = y0 + Star_tile_size;
+	if ( height < y1 ) y1 = height;
+	for ( tx=0 ; tx < a->n_tiles_x ; tx++ ) {
+	    const size_t x0 = Star_tile_size * tx;
+	    size_t x1 = x0 + Star_tile_size;
+	    float *v = work_buf.array_ptr();
+	    double median, sigma;
+	    size_t x, y, n = 0, h;
+	    if ( width < x1 ) x1 = width;
+	    for ( y=y0 ; y < y1 ; y++ ) {
+		const float *src = a->img_buf->array_ptr_cs(0, y, 1);
+		for ( x=x0 ; x < x1 ; x++ ) v[n++] = src[x];
+	    }
+	    /* median and MAD (robust against stars) */
+	    h = n / 2;
+	    std::nth_element(v, v + h, v + n);
+	    median = v[h];
+	    for ( x=0 ; x < n ; x++ ) v[x] = fabs(v[x] - median);
+	    std::nth_element(v, v + h, v + n);
+	    sigma = 1.4826 * v[h];
+	    if ( sigma < Min_background_sigma ) sigma = Min_background_sigma;
+	    (*(a->background))(tx, ty) = median;
+	    (*(a->threshold))(tx, ty) = median + a->threshold_sigma * sigma;
+	}
+    }
+
+    return;
+}
+
+/* connected pixels above threshold (8-connectivity) */
+typedef struct _star_blob {
+    size_t area;
+    double sum;
+    double sum_x;
+    double sum_y;
+    double peak;
+    long peak_y;
+    bool clipped;			/* reaches edge of searched area */
+} star_blob;
+
+/* stars whose peak is in rows of tiles [ty_begin, ty_end) */
+static void detect_stars_band( size_t ty_begin, size_t ty_end,
+			       void *user_ptr )
+{
+    const detect_args *a = (const detect_args *)user_ptr;
+    const mdarray_float &img = *(a->img_buf);
+    const long width = img.x_length();
+    const long height = img.y_length();
+    mdarray_uchar visited(false);
+    mdarray_long stack(false);
+    size_t ty;
+
+    for ( ty=ty_begin ; ty < ty_end ; ty++ ) {
+	const long band_y0 = Star_tile_size * ty;
+	long band_y1 = band_y0 + Star_tile_size;
+	long area_y0, area_y1, x, y;
+	if ( height < band_y1 ) band_y1 = height;
+	/* searched area includes margins */
+	area_y0 = band_y0 - (long)Star_band_margin;
+	area_y1 = band_y1 + (long)Star_band_margin;
+	if ( area_y0 < 0 ) area_y0 = 0;
+	if ( height < area_y1 ) area_y1 = height;
+
+	visited.resize_2d(width, area_y1 - area_y0);
+	visited.clean();
+	if ( stack.length() < (size_t)(Max_star_area + 1) * 8 ) {
+	    stack.resize_1d((Max_star_area + 1) * 8);
+	}
+	a->band_stars[ty].clear();
+
+	for ( y=band_y0 ; y < band_y1 ; y++ ) {
+	    const float *src = img.array_ptr_cs(0, y, 1);
+	    const float *thr = a->threshold->array_ptr_cs(0, y / Star_tile_size);
+	    for ( x=0 ; x < width ; x++ ) {
+		star_blob blob;
+		size_t n_stack = 0;
+		if ( src[x] <= thr[x / Star_tile_size] ) continue;
+		if ( visited(x, y - area_y0) != 0 ) continue;
+
+		/* flood fill */
+		blob.area = 0;
+		blob.sum = 0.0;  blob.sum_x = 0.0;  blob.sum_y = 0.0;
+		blob.peak = src[x];  blob.peak_y = y;
+		blob.clipped = false;
+		visited(x, y - area_y0) = 1;
+		stack[n_stack++] = width * y + x;
+		while ( 0 < n_stack ) {
+		    const long pos = stack[--n_stack];
+		    const long px = pos % width;
+		    const long py = pos / width;
+		    const size_t tx_p = px / Star_tile_size;
+		    const size_t ty_p = py / Star_tile_size;
+		    const double v = img(px, py, 1);
+		    const double w = v - (*(a->background))(tx_p, ty_p);
+		    long dx, dy;
+		    blob.area ++;
+		    blob.sum += w;
+		    blob.sum_x += w * px;
+		    blob.sum_y += w * py;
+		    if ( blob.peak < v ) {
+			blob.peak = v;
+			blob.peak_y = py;
+		    }
+		    if ( px == 0 || py == 0 || px + 1 == width ||
+			 py + 1 == height ||
+			 py == area_y0 || py + 1 == area_y1 ) {
+			blob.clipped = true;
+		    }
+		    for ( dy=-1 ; dy <= 1 ; dy++ ) {
+			const long qy = py + dy;
+			if ( qy < area_y0 || area_y1 <= qy ) continue;
+			for ( dx=-1 ; dx <= 1 ; dx++ ) {
+			    const long qx = px + dx;
+			    if ( qx < 0 || width <= qx ) continue;
+			    if ( visited(qx, qy - area_y0) != 0 ) continue;
+			    if ( img(qx, qy, 1) <=
+				 (*(a->threshold))(qx / Star_tile_size,
+						   qy / Star_tile_size) ) {
+				continue;
+			    }
+			    visited(qx, qy - area_y0) = 1;
+			    /* too large: marked, but not traced further */
+			    if ( blob.area + n_stack < Max_star_area ) {
+				stack[n_stack++] = width * qy + qx;
+			    }
+			    else {
+				blob.clipped = true;
+			    }
+			}
+		    }
+		}
+
+		/* the band containing the peak reports the star */
+		if ( blob.clipped == true ) continue;
+		if ( blob.area < Min_star_area ) continue;
+		if ( blob.peak_y < band_y0 || band_y1 <= blob.peak_y ) continue;
+		if ( blob.sum <= 0.0 ) continue;
+		a->band_stars[ty].append(blob.sum_x / blob.sum,
+					 blob.sum_y / blob.sum, blob.sum);
+	    }
+	}
+    }
+
+    return;
+}
+
+int detect_stars( thread_pool *pool, const mdarray_float &img_buf,
+		  double threshold_sigma, size_t max_stars,
+		  star_list *ret_stars )
+{
+    mdarray_float threshold(false);
+    mdarray_float background(false);
+    star_list *band_stars = NULL;
+    detect_args args;
+    size_t ty;
+    int ret_status = -1;
+
+    if ( ret_stars == NULL ) goto quit;
+    if ( img_buf.z_length() < 2 ) goto quit;
+    if ( img_buf.x_length() == 0 || img_buf.y_length() == 0 ) goto quit;
+
+    args.img_buf = &img_buf;
+    args.n_tiles_x = (img_buf.x_length() + Star_tile_size - 1) / Star_tile_size;
+    args.n_tiles_y = (img_buf.y_length() + Star_tile_size - 1) / Star_tile_size;
+    args.threshold_sigma = threshold_sigma;
+
+    threshold.resize_2d(args.n_tiles_x, args.n_tiles_y);
+    background.resize_2d(args.n_tiles_x, args.n_tiles_y);
+    band_stars = new star_list[args.n_tiles_y];
+    args.threshold = &threshold;
+    args.background = &background;
+    args.band_stars = band_stars;
+
+    if ( pool != NULL ) {
+	pool->run_row_bands(args.n_tiles_y, &estimate_background_band,
+			    (void *)&args);
+	pool->run_row_bands(args.n_tiles_y, &detect_stars_band,
+			    (void *)&args);
+    }
+    else {
+	estimate_background_band(0, args.n_tiles_y, (void *)&args);
+	detect_stars_band(0, args.n_tiles_y, (void *)&args);
+    }
+
+    /* merged in order of bands (does not depend on threads) */
+    ret_stars->clear();
+    for ( ty=0 ; ty < args.n_tiles_y ; ty++ ) {
+	ret_stars->append(band_stars[ty]);
+    }
+    ret_stars->sort_by_flux();
+    if ( 0 < max_stars ) ret_stars->truncate(max_stars);
+
+    ret_status = 0;
+ quit:
+    if ( band_stars != NULL ) delete [] band_stars;
+    return ret_status;
+}
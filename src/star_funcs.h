@@ -0,0 +1,42 @@
+#ifndef _STAR_FUNCS_H
+#define _STAR_FUNCS_H 1
+
+#include <unistd.h>
+#include <sli/mdarray.h>
+
+#include "thread_funcs.h"
+
+/* list of stars sorted by flux (brightest first) */
+class star_list {
+
+  public:
+    star_list();
+
+    void clear();
+    void append( double x, double y, double flux );
+    void append( const star_list &src );
+    void sort_by_flux();
+    void truncate( size_t n );
+    size_t length() const { return this->n_stars; }
+
+    sli::mdarray_double x;		/* centroid */
+    sli::mdarray_double y;
+    sli::mdarray_double flux;		/* sum above background */
+
+  private:
+    size_t n_stars;
+
+};
+
+/*
+ * Star extraction from the green channel: pixels brighter than
+ * background + threshold_sigma * sigma (both estimated for each tile) are
+ * grouped by 8-connectivity, and centroids of groups of star-like size
+ * are returned (brightest max_stars stars).  Tiles are processed in
+ * parallel when pool is not NULL.
+ */
+int detect_stars( thread_pool *pool, const sli::mdarray_float &img_buf,
+		  double threshold_sigma, size_t max_stars,
+		  star_list *ret_stars );
+
+#endif	/* _STAR_FUNCS_H */
@@ -0,0 +1,57 @@
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "sys_funcs.h"
+
+using namespace sli;
+
+/* returns size of physical memory in bytes (0 if unknown) */
+uint64_t get_physical_memory_bytes()
+{
+    uint64_t ret_value = 0;
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    long n_pages = sysconf(_SC_PHYS_PAGES);
+    long sz_page = sysconf(_SC_PAGESIZE);
+    if ( 0 < n_pages && 0 < sz_page ) {
+	ret_value = (uint64_t)n_pages * (uint64_t)sz_page;
+    }
+#endif
+    return ret_value;
+}
+
+/* returns number of online processors (1 if unknown) */
+int get_number_of_cpus()
+{
+    int ret_value = 1;
+#if defined(_SC_NPROCESSORS_ONLN)
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if ( 0 < n_cpus ) ret_value = n_cpus;
+#endif
+    return ret_value;
+}
+
+int get_file_key( const char *filename, long long *ret_size,
+		  long long *ret_mtime, long *ret_mtime_nsec )
+{
+    struct stat st;
+    if ( stat(filename, &st) != 0 ) return -1;
+    *ret_size = st.st_size;
+    *ret_mtime = st.st_mtim.tv_sec;
+    *ret_mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+int get_absolute_path( const char *filename, tstring *ret_path )
+{
+    char cwd[PATH_MAX];
+
+    if ( filename[0] == '/' ) {
+	*ret_path = filename;
+	return 0;
+    }
+    if ( getcwd(cwd, sizeof(cwd)) == NULL ) return -1;
+    while ( filename[0] == '.' && filename[1] == '/' ) filename += 2;
+    ret_path->printf("%s/%s", cwd, filename);
+    return 0;
+}
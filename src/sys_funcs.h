@@ -0,0 +1,22 @@
+#ifndef _SYS_FUNCS_H
+#define _SYS_FUNCS_H 1
+
+#include <unistd.h>
+#include <stdint.h>
+#include <sli/tstring.h>
+
+/* returns size of physical memory in bytes (0 if unknown) */
+uint64_t get_physical_memory_bytes();
+
+/* returns number of online processors (1 if unknown) */
+int get_number_of_cpus();
+
+/* size and mtime (seconds and nanoseconds) of file: rewrites within */
+/* a second are detected when the file system has such resolution    */
+int get_file_key( const char *filename, long long *ret_size,
+		  long long *ret_mtime, long *ret_mtime_nsec );
+
+/* filename prefixed by current directory when it is relative */
+int get_absolute_path( const char *filename, sli::tstring *ret_path );
+
+#endif	/* _SYS_FUNCS_H */
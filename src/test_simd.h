@@ -24,4 +24,14 @@
 #endif
 
 
+/* AVX2 and AVX-512F code compiled with __attribute__((target(...))) */
+/* and selected at runtime by __builtin_cpu_supports()              */
+#if defined(USE_SIMD) && (defined(__x86_64__) || defined(__i386__))
+#if (defined(__GNUC__) && __GNUC__ >= 6) || defined(__clang__)
+#define _AVX2_DISPATCH_IS_OK 1
+#define _AVX512F_DISPATCH_IS_OK 1
+// #warning "enabled runtime dispatch of avx2/avx512f"
+#endif
+#endif
+
 #endif
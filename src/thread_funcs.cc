@@ -0,0 +1,152 @@
+#include "thread_funcs.h"
+
+#include <sli/stdstreamio.h>
+using namespace sli;
+
+/* number of bands per thread (for load balancing) */
+static const size_t Bands_per_thread = 4;
+
+static void *thread_pool_worker( void *obj_ptr )
+{
+    ((thread_pool *)obj_ptr)->worker_main();
+    return NULL;
+}
+
+thread_pool::thread_pool()
+  : threads(NULL), n_workers(0), flag_stop(false), generation(0), n_busy(0),
+    func(NULL), user_ptr(NULL), height(0), band_height(0), next_y(0)
+{
+    pthread_mutex_init(&(this->mutex), NULL);
+    pthread_cond_init(&(this->cond_work), NULL);
+    pthread_cond_init(&(this->cond_done), NULL);
+}
+
+thread_pool::~thread_pool()
+{
+    this->stop();
+    pthread_cond_destroy(&(this->cond_done));
+    pthread_cond_destroy(&(this->cond_work));
+    pthread_mutex_destroy(&(this->mutex));
+}
+
+int thread_pool::start( size_t n_threads )
+{
+    stdstreamio sio;
+    size_t i;
+
+    this->stop();
+
+    this->flag_stop = false;
+    if ( n_threads <= 1 ) return 0;
+
+    this->threads = new pthread_t[n_threads - 1];
+    for ( i=0 ; i + 1 < n_threads ; i++ ) {
+	if ( pthread_create(&(this->threads[i]), NULL,
+			    &thread_pool_worker, (void *)this) != 0 ) {
+	    sio.eprintf("[WARNING] pthread_create() failed\n");
+	    break;
+	}
+	this->n_workers ++;
+    }
+
+    return 0;
+}
+
+void thread_pool::stop()
+{
+    size_t i;
+
+    if ( this->threads != NULL ) {
+	pthread_mutex_lock(&(this->mutex));
+	this->flag_stop = true;
+	pthread_cond_broadcast(&(this->cond_work));
+	pthread_mutex_unlock(&(this->mutex));
+	for ( i=0 ; i < this->n_workers ; i++ ) {
+	    pthread_join(this->threads[i], NULL);
+	}
+	delete [] this->threads;
+	this->threads = NULL;
+    }
+    this->n_workers = 0;
+
+    return;
+}
+
+/* called with mutex locked */
+bool thread_pool::get_band( size_t *ret_y_begin, size_t *ret_y_end )
+{
+    if ( this->height <= this->next_y ) return false;
+    *ret_y_begin = this->next_y;
+    this->next_y += this->band_height;
+    if ( this->height < this->next_y ) this->next_y = this->height;
+    *ret_y_end = this->next_y;
+    return true;
+}
+
+void thread_pool::worker_main()
+{
+    unsigned long done_generation = 0;
+
+    pthread_mutex_lock(&(this->mutex));
+    while ( 1 ) {
+	size_t y_begin, y_end;
+
+	while ( this->flag_stop == false &&
+		this->generation == done_generation ) {
+	    pthread_cond_wait(&(this->cond_work), &(this->mutex));
+	}
+	if ( this->flag_stop == true ) break;
+	done_generation = this->generation;
+
+	while ( this->get_band(&y_begin, &y_end) == true ) {
+	    pthread_mutex_unlock(&(this->mutex));
+	    (*(this->func))(y_begin, y_end, this->user_ptr);
+	    pthread_mutex_lock(&(this->mutex));
+	}
+
+	this->n_busy --;
+	if ( this->n_busy == 0 ) pthread_cond_signal(&(this->cond_done));
+    }
+    pthread_mutex_unlock(&(this->mutex));
+
+    return;
+}
+
+void thread_pool::run_row_bands( size_t height, row_band_func_t func,
+				 void *user_ptr )
+{
+    size_t n_bands, y_begin, y_end;
+
+    if ( height == 0 ) return;
+
+    if ( this->n_workers == 0 ) {
+	(*func)(0, height, user_ptr);
+	return;
+    }
+
+    n_bands = (this->n_workers + 1) * Bands_per_thread;
+
+    pthread_mutex_lock(&(this->mutex));
+    this->func = func;
+    this->user_ptr = user_ptr;
+    this->height = height;
+    this->band_height = (height + n_bands - 1) / n_bands;
+    this->next_y = 0;
+    this->n_busy = this->n_workers;
+    this->generation ++;
+    pthread_cond_broadcast(&(this->cond_work));
+
+    /* calling thread also works */
+    while ( this->get_band(&y_begin, &y_end) == true ) {
+	pthread_mutex_unlock(&(this->mutex));
+	(*func)(y_begin, y_end, user_ptr);
+	pthread_mutex_lock(&(this->mutex));
+    }
+
+    while ( 0 < this->n_busy ) {
+	pthread_cond_wait(&(this->cond_done), &(this->mutex));
+    }
+    pthread_mutex_unlock(&(this->mutex));
+
+    return;
+}
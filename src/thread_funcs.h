@@ -0,0 +1,60 @@
+#ifndef _THREAD_FUNCS_H
+#define _THREAD_FUNCS_H 1
+
+#include <unistd.h>
+#include <pthread.h>
+
+/* work function for rows [y_begin, y_end) */
+typedef void (*row_band_func_t)( size_t y_begin, size_t y_end,
+				 void *user_ptr );
+
+/*
+ * Simple pool of worker threads to process an image by row bands.
+ *
+ * run_row_bands() splits rows into bands, lets the workers (and the
+ * calling thread) process them, and returns after all bands are done.
+ * Bands never overlap, so a work function may write its own rows without
+ * locking.
+ */
+class thread_pool {
+
+  public:
+    thread_pool();
+    ~thread_pool();
+
+    /* n_threads includes the calling thread */
+    int start( size_t n_threads );
+    void stop();
+    size_t length() const { return this->n_workers + 1; }
+
+    void run_row_bands( size_t height, row_band_func_t func,
+			void *user_ptr );
+
+    /* used by worker threads */
+    void worker_main();
+
+  private:
+    bool get_band( size_t *ret_y_begin, size_t *ret_y_end );
+
+    pthread_t *threads;
+    size_t n_workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_work;
+    pthread_cond_t cond_done;
+    bool flag_stop;
+    unsigned long generation;		/* incremented for each job */
+    size_t n_busy;			/* workers still in the job */
+    /* current job */
+    row_band_func_t func;
+    void *user_ptr;
+    size_t height;
+    size_t band_height;
+    size_t next_y;
+
+    /* disable copy */
+    thread_pool( const thread_pool & );
+    thread_pool &operator=( const thread_pool & );
+
+};
+
+#endif	/* _THREAD_FUNCS_H */
@@ -5,8 +5,777 @@
 using namespace sli;
 
 #include <tiffio.h>
+#include "convert_funcs.h"
+#include "thread_funcs.h"
+#include "sys_funcs.h"
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "MT.h"
 
+/*
+ * Source of decoded strips or tiles (blocks).  Files written by this
+ * package are not compressed by default, so strips of such files are
+ * taken directly from a mapping of the file without copying.  Other
+ * blocks (compressed, tiled, byte-swapped, etc.) are decoded by libtiff
+ * into a buffer that is valid until the next read.
+ */
+class tiff_strip_reader {
+
+  public:
+    tiff_strip_reader();
+    ~tiff_strip_reader();
+
+    /* tiff_in has to be open until detach() */
+    void attach( TIFF *tiff_in );
+
+    /* number of strips (rows of tiles for tiled files), and their rows */
+    size_t length() const { return this->blocks_down; }
+    size_t strip_rows() const { return this->block_rows; }
+
+    /* width of a block (tile or image) and number of blocks in a row */
+    size_t block_cols() const { return this->block_width; }
+    size_t blocks_in_row() const { return this->blocks_across; }
+
+    /* returns pointer to strip and its length in bytes (< 0: error). */
+    /* Strips of tiled files are assembled from tiles.                */
+    const void *read( size_t strip, ssize_t *ret_len );
+
+    /* returns pointer to a strip or a tile (rows of block_cols() pixels) */
+    /* and its length in bytes (< 0: error)                              */
+    const void *read_block( size_t block, ssize_t *ret_len );
+
+    void detach();
+
+  private:
+    TIFF *tiff_in;
+    bool tiled;
+    void *map_addr;
+    size_t map_bytes;
+    const uint64_t *strip_offsets;		/* owned by libtiff */
+    const uint64_t *strip_bytecounts;
+    size_t n_strips;
+    size_t row_bytes;
+    size_t bytes_per_sample;
+    size_t pixel_bytes;
+    size_t width;
+    size_t height;
+    size_t block_width;
+    size_t block_rows;
+    size_t blocks_across;
+    size_t blocks_down;
+    size_t block_bytes;
+    mdarray_uchar block_buf;		/* decoded block */
+    mdarray_uchar band_buf;		/* strip assembled from tiles */
+
+    /* disable copy */
+    tiff_strip_reader( const tiff_strip_reader & );
+    tiff_strip_reader &operator=( const tiff_strip_reader & );
+
+};
+
+tiff_strip_reader::tiff_strip_reader()
+  : tiff_in(NULL), tiled(false), map_addr(NULL), map_bytes(0),
+    strip_offsets(NULL), strip_bytecounts(NULL), n_strips(0), row_bytes(0),
+    bytes_per_sample(0), pixel_bytes(0), width(0), height(0),
+    block_width(0), block_rows(0), blocks_across(0), blocks_down(0),
+    block_bytes(0), block_buf(false), band_buf(false)
+{
+}
+
+tiff_strip_reader::~tiff_strip_reader()
+{
+    this->detach();
+}
+
+void tiff_strip_reader::attach( TIFF *tiff_in )
+{
+    uint16 compression, fillorder, bps, spp;
+    uint32 width, height, rows_per_strip, tile_width, tile_length;
+    uint64_t *offsets = NULL, *bytecounts = NULL;
+    struct stat st;
+    void *addr;
+    int fd;
+
+    this->detach();
+    this->tiff_in = tiff_in;
+
+    if ( tiff_in == NULL ) return;
+
+    /* geometry of blocks */
+    if ( TIFFGetField(tiff_in, TIFFTAG_IMAGEWIDTH, &width) == 0 ) return;
+    if ( TIFFGetField(tiff_in, TIFFTAG_IMAGELENGTH, &height) == 0 ) return;
+    if ( TIFFGetFieldDefaulted(tiff_in, TIFFTAG_BITSPERSAMPLE, &bps) == 0 ||
+	 TIFFGetFieldDefaulted(tiff_in, TIFFTAG_SAMPLESPERPIXEL,
+			       &spp) == 0 ) return;
+    this->width = width;
+    this->height = height;
+    this->bytes_per_sample = (bps + 7) / 8;
+    this->pixel_bytes = (size_t)spp * this->bytes_per_sample;
+    this->row_bytes = this->width * this->pixel_bytes;
+
+    if ( TIFFIsTiled(tiff_in) != 0 ) {
+	if ( TIFFGetField(tiff_in, TIFFTAG_TILEWIDTH, &tile_width) == 0 ||
+	     TIFFGetField(tiff_in, TIFFTAG_TILELENGTH, &tile_length) == 0 ||
+	     tile_width == 0 || tile_length == 0 ) return;
+	this->tiled = true;
+	this->block_width = tile_width;
+	this->block_rows = tile_length;
+	this->blocks_across = (this->width + tile_width - 1) / tile_width;
+	this->blocks_down = (this->height + tile_length - 1) / tile_length;
+	this->block_bytes = TIFFTileSize(tiff_in);
+    }
+    else {
+	if ( TIFFGetFieldDefaulted(tiff_in, TIFFTAG_ROWSPERSTRIP,
+				   &rows_per_strip) == 0 ||
+	     height < rows_per_strip ) rows_per_strip = height;
+	if ( rows_per_strip == 0 ) return;
+	this->block_width = width;
+	this->block_rows = rows_per_strip;
+	this->blocks_across = 1;
+	this->blocks_down = TIFFNumberOfStrips(tiff_in);
+	this->block_bytes = TIFFStripSize(tiff_in);
+    }
+
+    /* conditions to use mapping */
+    if ( this->tiled == true ) return;
+    if ( TIFFGetFieldDefaulted(tiff_in, TIFFTAG_COMPRESSION,
+			       &compression) == 0 ||
+	 compression != COMPRESSION_NONE ) return;
+    if ( TIFFGetFieldDefaulted(tiff_in, TIFFTAG_FILLORDER, &fillorder) == 0 ||
+	 fillorder != FILLORDER_MSB2LSB ) return;
+    if ( bps != 8 && bps != 16 && bps != 32 ) return;
+    if ( 8 < bps && TIFFIsByteSwapped(tiff_in) != 0 ) return;
+    if ( TIFFGetField(tiff_in, TIFFTAG_STRIPOFFSETS, &offsets) == 0 ||
+	 offsets == NULL ) return;
+    if ( TIFFGetField(tiff_in, TIFFTAG_STRIPBYTECOUNTS, &bytecounts) == 0 ||
+	 bytecounts == NULL ) return;
+
+    fd = TIFFFileno(tiff_in);
+    if ( fd < 0 || fstat(fd, &st) != 0 || st.st_size <= 0 ) return;
+
+    addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if ( addr == MAP_FAILED ) return;
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+    this->map_addr = addr;
+    this->map_bytes = st.st_size;
+    this->strip_offsets = offsets;
+    this->strip_bytecounts = bytecounts;
+    this->n_strips = this->blocks_down;
+
+    return;
+}
+
+const void *tiff_strip_reader::read_block( size_t block, ssize_t *ret_len )
+{
+    unsigned char *block_ptr;
+
+    if ( this->tiff_in == NULL || this->block_bytes == 0 ||
+	 this->blocks_down * this->blocks_across <= block ) {
+	*ret_len = -1;
+	return NULL;
+    }
+
+    if ( this->map_addr != NULL && block < this->n_strips ) {
+	const size_t y = block * this->block_rows;
+	const uint64_t off = this->strip_offsets[block];
+	if ( y < this->height ) {
+	    size_t n_rows = this->height - y;
+	    size_t len;
+	    if ( this->block_rows < n_rows ) n_rows = this->block_rows;
+	    len = n_rows * this->row_bytes;
+	    /* samples have to be aligned in memory */
+	    if ( len <= this->strip_bytecounts[block] &&
+		 off <= this->map_bytes && len <= this->map_bytes - off &&
+		 off % this->bytes_per_sample == 0 ) {
+		*ret_len = len;
+		return (const unsigned char *)(this->map_addr) + off;
+	    }
+	}
+    }
+
+    if ( this->block_buf.length() < this->block_bytes ) {
+	this->block_buf.resize_1d(this->block_bytes);
+    }
+    block_ptr = this->block_buf.array_ptr();
+
+    /* decoded by libtiff */
+    if ( this->tiled == true ) {
+	*ret_len = TIFFReadEncodedTile(this->tiff_in, block, (void *)block_ptr,
+				       this->block_bytes);
+    }
+    else {
+	*ret_len = TIFFReadEncodedStrip(this->tiff_in, block,
+					(void *)block_ptr, this->block_bytes);
+    }
+
+    return block_ptr;
+}
+
+const void *tiff_strip_reader::read( size_t strip, ssize_t *ret_len )
+{
+    const size_t tile_row_bytes = this->block_width * this->pixel_bytes;
+    size_t y, n_rows, i;
+
+    if ( this->tiled == false ) return this->read_block(strip, ret_len);
+
+    if ( this->tiff_in == NULL || this->blocks_down <= strip ) {
+	*ret_len = -1;
+	return NULL;
+    }
+
+    y = strip * this->block_rows;
+    n_rows = this->height - y;
+    if ( this->block_rows < n_rows ) n_rows = this->block_rows;
+    if ( this->band_buf.length() < n_rows * this->row_bytes ) {
+	this->band_buf.resize_1d(n_rows * this->row_bytes);
+    }
+
+    /* tiles in the row are copied into full-width rows */
+    for ( i=0 ; i < this->blocks_across ; i++ ) {
+	const size_t x = i * this->block_width;
+	size_t n_cols = this->width - x;
+	const unsigned char *tile_ptr;
+	ssize_t t_len;
+	size_t r;
+	if ( this->block_width < n_cols ) n_cols = this->block_width;
+	tile_ptr = (const unsigned char *)
+	    this->read_block(strip * this->blocks_across + i, &t_len);
+	if ( t_len < 0 || (size_t)t_len < n_rows * tile_row_bytes ) {
+	    *ret_len = -1;
+	    return NULL;
+	}
+	for ( r=0 ; r < n_rows ; r++ ) {
+	    memcpy(this->band_buf.array_ptr()
+		   + r * this->row_bytes + x * this->pixel_bytes,
+		   tile_ptr + r * tile_row_bytes, n_cols * this->pixel_bytes);
+	}
+    }
+
+    *ret_len = n_rows * this->row_bytes;
+    return this->band_buf.array_ptr();
+}
+
+void tiff_strip_reader::detach()
+{
+    if ( this->map_addr != NULL ) {
+	munmap(this->map_addr, this->map_bytes);
+	this->map_addr = NULL;
+    }
+    this->map_bytes = 0;
+    this->strip_offsets = NULL;
+    this->strip_bytecounts = NULL;
+    this->n_strips = 0;
+    this->tiled = false;
+    this->blocks_across = 0;
+    this->blocks_down = 0;
+    this->block_bytes = 0;
+    this->tiff_in = NULL;
+    return;
+}
+
+/*
+ * Compression and tiling of output
+ */
+
+static int Tiff_compression = TIFF_COMPRESS_NONE;
+static size_t Tiff_tile_size = 0;		/* 0: strips */
+
+/* rows of a strip of compressed files */
+static const size_t Compressed_rows_per_strip = 16;
+
+/* libtiff codec of TIFF_COMPRESS_* (-1: not available) */
+static int get_tiff_codec( int method )
+{
+    if ( method == TIFF_COMPRESS_NONE ) return COMPRESSION_NONE;
+    else if ( method == TIFF_COMPRESS_DEFLATE ) {
+	return COMPRESSION_ADOBE_DEFLATE;
+    }
+#if defined(COMPRESSION_ZSTD)
+    else if ( method == TIFF_COMPRESS_ZSTD ) return COMPRESSION_ZSTD;
+#endif
+    else return -1;
+}
+
+int parse_tiff_compression( const char *str, int *ret_method )
+{
+    if ( str == NULL || ret_method == NULL ) return -1;
+    if ( strcmp(str, "none") == 0 ) *ret_method = TIFF_COMPRESS_NONE;
+    else if ( strcmp(str, "deflate") == 0 ) *ret_method = TIFF_COMPRESS_DEFLATE;
+    else if ( strcmp(str, "zstd") == 0 ) *ret_method = TIFF_COMPRESS_ZSTD;
+    else return -1;
+    return 0;
+}
+
+int set_tiff_compression( int method )
+{
+    const int codec = get_tiff_codec(method);
+
+    if ( codec < 0 || TIFFIsCODECConfigured((uint16)codec) == 0 ) return -1;
+    Tiff_compression = method;
+
+    return 0;
+}
+
+int set_tiff_tiling( size_t tile_size )
+{
+    /* required by TIFF */
+    if ( tile_size % 16 != 0 ) return -1;
+    Tiff_tile_size = tile_size;
+
+    return 0;
+}
+
+/*
+ * File in memory written by a TIFF encoding a strip.  Its capacity is
+ * fixed (enough for encoded data of a strip), so that the buffer is
+ * never moved.
+ */
+typedef struct _mem_tiff_file {
+    unsigned char *buf;
+    size_t capacity;
+    size_t length;
+    size_t pos;
+} mem_tiff_file;
+
+static tmsize_t mem_tiff_read( thandle_t, void *, tmsize_t )
+{
+    return 0;
+}
+
+static tmsize_t mem_tiff_write( thandle_t fd, void *buf, tmsize_t size )
+{
+    mem_tiff_file *f = (mem_tiff_file *)fd;
+
+    if ( size < 0 || f->capacity - f->pos < (size_t)size ) return -1;
+    memcpy(f->buf + f->pos, buf, size);
+    f->pos += size;
+    if ( f->length < f->pos ) f->length = f->pos;
+
+    return size;
+}
+
+static toff_t mem_tiff_seek( thandle_t fd, toff_t off, int whence )
+{
+    mem_tiff_file *f = (mem_tiff_file *)fd;
+    toff_t pos;
+
+    if ( whence == SEEK_SET ) pos = off;
+    else if ( whence == SEEK_CUR ) pos = f->pos + off;
+    else if ( whence == SEEK_END ) pos = f->length + off;
+    else return (toff_t)-1;
+    if ( f->capacity < pos ) return (toff_t)-1;
+    f->pos = pos;
+
+    return pos;
+}
+
+static int mem_tiff_close( thandle_t )
+{
+    return 0;
+}
+
+static toff_t mem_tiff_size( thandle_t fd )
+{
+    return ((mem_tiff_file *)fd)->length;
+}
+
+static int mem_tiff_map( thandle_t, void **, toff_t * )
+{
+    return 0;
+}
+
+static void mem_tiff_unmap( thandle_t, void *, toff_t )
+{
+    return;
+}
+
+/* encoded strip or tile in a memory file */
+typedef struct _encoded_strip {
+    size_t offset;
+    ssize_t length;			/* < 0: error */
+} encoded_strip;
+
+/*
+ * Sink of rows of an output TIFF.  Without compression and tiling, each
+ * row is written as a strip.  With compression, rows are collected into
+ * strips of Compressed_rows_per_strip rows, a band of strips is encoded
+ * by the thread pool (each strip by its own TIFF in memory, so that any
+ * codec and predictor of libtiff can be used), and then the encoded
+ * strips are written in order by TIFFWriteRawStrip().  Tiled files are
+ * written in the same way with rows of tiles: each tile is cut from the
+ * rows (padded with 0) and encoded as a strip of tile_size x tile_size,
+ * which gives the same data as encoding of a tile.
+ */
+class tiff_strip_writer {
+
+  public:
+    tiff_strip_writer();
+    ~tiff_strip_writer();
+
+    /* size, BITSPERSAMPLE, SAMPLESPERPIXEL, SAMPLEFORMAT and PHOTOMETRIC */
+    /* of tiff_out have to be set; this sets COMPRESSION, PREDICTOR and  */
+    /* ROWSPERSTRIP or TILEWIDTH and TILELENGTH.  tiff_out has to be     */
+    /* open until flush().  Strips are encoded by shared_pool (started   */
+    /* by the caller), or by a pool of this object when it is NULL.      */
+    int attach( TIFF *tiff_out, thread_pool *shared_pool = NULL );
+
+    /* append a row of width x spp samples */
+    int write_row( const void *row );
+
+    /* write rows not yet written (after the last row) */
+    int flush();
+
+  private:
+    const unsigned char *get_block( size_t k, size_t *ret_width,
+				    size_t *ret_rows );
+    int write_band();
+    static void encode_strips( size_t k_begin, size_t k_end,
+			       void *user_ptr );
+
+    TIFF *tiff_out;
+    int codec;
+    uint16 predictor;
+    uint32 width;
+    uint32 height;
+    uint16 bps;
+    uint16 spp;
+    uint16 sample_format;
+    uint16 photometric;
+    size_t row_bytes;
+    size_t rows_per_strip;		/* rows of a strip or a tile */
+    size_t tile_size;			/* 0: not tiled */
+    size_t tiles_across;		/* 1 for strips */
+    size_t next_row;			/* rows given by write_row() */
+    size_t band_row;			/* first row in row_buf */
+    size_t band_strips;			/* strips (rows of tiles) of a band */
+    size_t enc_capacity;		/* bytes of a memory file */
+    mdarray_uchar row_buf;		/* rows of a band */
+    mdarray_uchar tile_buf;		/* tiles cut from row_buf */
+    mdarray_uchar enc_buf;		/* memory files of strips */
+    encoded_strip *enc_strips;
+    thread_pool *pool;			/* tpool or shared one */
+    thread_pool tpool;
+
+    /* disable copy */
+    tiff_strip_writer( const tiff_strip_writer & );
+    tiff_strip_writer &operator=( const tiff_strip_writer & );
+
+};
+
+tiff_strip_writer::tiff_strip_writer()
+  : tiff_out(NULL), codec(COMPRESSION_NONE), predictor(PREDICTOR_NONE),
+    width(0), height(0), bps(0), spp(0), sample_format(SAMPLEFORMAT_UINT),
+    photometric(PHOTOMETRIC_RGB), row_bytes(0), rows_per_strip(1),
+    tile_size(0), tiles_across(1), next_row(0), band_row(0),
+    band_strips(0), enc_capacity(0), row_buf(false), tile_buf(false),
+    enc_buf(false), enc_strips(NULL), pool(NULL)
+{
+}
+
+tiff_strip_writer::~tiff_strip_writer()
+{
+    if ( this->enc_strips != NULL ) delete [] this->enc_strips;
+}
+
+int tiff_strip_writer::attach( TIFF *tiff_out, thread_pool *shared_pool )
+{
+    stdstreamio sio;
+    const int codec = get_tiff_codec(Tiff_compression);
+    size_t block_bytes, n_blocks;
+
+    if ( tiff_out == NULL || this->tiff_out != NULL || codec < 0 ) return -1;
+
+    if ( TIFFGetField(tiff_out, TIFFTAG_IMAGEWIDTH, &(this->width)) == 0 ||
+	 TIFFGetField(tiff_out, TIFFTAG_IMAGELENGTH, &(this->height)) == 0 ||
+	 TIFFGetFieldDefaulted(tiff_out, TIFFTAG_BITSPERSAMPLE,
+			       &(this->bps)) == 0 ||
+	 TIFFGetFieldDefaulted(tiff_out, TIFFTAG_SAMPLESPERPIXEL,
+			       &(this->spp)) == 0 ||
+	 TIFFGetFieldDefaulted(tiff_out, TIFFTAG_SAMPLEFORMAT,
+			       &(this->sample_format)) == 0 ||
+	 TIFFGetField(tiff_out, TIFFTAG_PHOTOMETRIC,
+		      &(this->photometric)) == 0 ) {
+	sio.eprintf("[ERROR] fields of output TIFF are not set\n");
+	return -1;
+    }
+
+    this->codec = codec;
+    this->row_bytes = (size_t)(this->width) * this->spp * (this->bps / 8);
+    this->tile_size = Tiff_tile_size;
+    this->next_row = 0;
+    this->band_row = 0;
+
+    if ( codec == COMPRESSION_NONE ) this->predictor = PREDICTOR_NONE;
+    else if ( this->sample_format == SAMPLEFORMAT_IEEEFP ) {
+	this->predictor = PREDICTOR_FLOATINGPOINT;
+    }
+    else this->predictor = PREDICTOR_HORIZONTAL;
+    if ( TIFFSetField(tiff_out, TIFFTAG_COMPRESSION, codec) == 0 ) {
+	sio.eprintf("[ERROR] compression is not supported\n");
+	return -1;
+    }
+    if ( codec != COMPRESSION_NONE ) {
+	TIFFSetField(tiff_out, TIFFTAG_PREDICTOR, this->predictor);
+    }
+    this->tiff_out = tiff_out;
+
+    if ( this->tile_size == 0 ) {
+	this->tiles_across = 1;
+	if ( codec == COMPRESSION_NONE ) {
+	    this->rows_per_strip = 1;
+	    TIFFSetField(tiff_out, TIFFTAG_ROWSPERSTRIP, (uint32)1);
+	    return 0;
+	}
+	this->rows_per_strip = Compressed_rows_per_strip;
+	if ( this->height < this->rows_per_strip ) {
+	    this->rows_per_strip = this->height;
+	}
+	TIFFSetField(tiff_out, TIFFTAG_ROWSPERSTRIP,
+		     (uint32)(this->rows_per_strip));
+	block_bytes = this->rows_per_strip * this->row_bytes;
+    }
+    else {
+	this->rows_per_strip = this->tile_size;
+	this->tiles_across
+	    = (this->width + this->tile_size - 1) / this->tile_size;
+	TIFFSetField(tiff_out, TIFFTAG_TILEWIDTH, (uint32)(this->tile_size));
+	TIFFSetField(tiff_out, TIFFTAG_TILELENGTH, (uint32)(this->tile_size));
+	block_bytes = this->tile_size * this->tile_size
+		      * this->spp * (this->bps / 8);
+    }
+
+    /* works in the calling thread when threads are not available */
+    if ( codec != COMPRESSION_NONE ) {
+	if ( shared_pool != NULL ) this->pool = shared_pool;
+	else {
+	    this->tpool.start(get_number_of_cpus());
+	    this->pool = &(this->tpool);
+	}
+	this->band_strips = (2 * this->pool->length() + this->tiles_across - 1)
+			    / this->tiles_across;
+    }
+    else this->band_strips = 1;
+
+    /* encoded data + header and codec overhead */
+    this->enc_capacity = block_bytes + block_bytes / 64 + 4096;
+    n_blocks = this->band_strips * this->tiles_across;
+
+    this->row_buf.resize_1d(this->band_strips * this->rows_per_strip
+			    * this->row_bytes);
+    if ( 0 < this->tile_size ) {
+	this->tile_buf.resize_1d(n_blocks * block_bytes);
+    }
+    if ( codec != COMPRESSION_NONE ) {
+	this->enc_buf.resize_1d(n_blocks * this->enc_capacity);
+	if ( this->enc_strips != NULL ) delete [] this->enc_strips;
+	this->enc_strips = new encoded_strip[n_blocks];
+    }
+
+    return 0;
+}
+
+int tiff_strip_writer::write_row( const void *row )
+{
+    stdstreamio sio;
+
+    if ( this->tiff_out == NULL || this->height <= this->next_row ) return -1;
+
+    if ( this->codec == COMPRESSION_NONE && this->tile_size == 0 ) {
+	if ( TIFFWriteEncodedStrip(this->tiff_out, this->next_row,
+				   (void *)row, this->row_bytes) < 0 ) {
+	    sio.eprintf("[ERROR] TIFFWriteEncodedStrip() failed\n");
+	    return -1;
+	}
+	this->next_row ++;
+	return 0;
+    }
+
+    memcpy(this->row_buf.array_ptr()
+	   + (this->next_row - this->band_row) * this->row_bytes,
+	   row, this->row_bytes);
+    this->next_row ++;
+
+    if ( this->next_row - this->band_row
+	 == this->band_strips * this->rows_per_strip ) {
+	return this->write_band();
+    }
+
+    return 0;
+}
+
+int tiff_strip_writer::flush()
+{
+    if ( this->tiff_out == NULL ) return -1;
+    if ( (this->codec != COMPRESSION_NONE || 0 < this->tile_size) &&
+	 this->band_row < this->next_row ) {
+	return this->write_band();
+    }
+    return 0;
+}
+
+/* k-th strip or tile of the band: tiles are cut into tile_buf */
+const unsigned char *tiff_strip_writer::get_block( size_t k,
+					size_t *ret_width, size_t *ret_rows )
+{
+    const size_t i_strip = k / this->tiles_across;
+    const size_t y = this->band_row + i_strip * this->rows_per_strip;
+    const size_t pixel_bytes = (size_t)(this->spp) * (this->bps / 8);
+    const unsigned char *src_ptr;
+    unsigned char *tile_ptr;
+    size_t n_rows = this->next_row - y;
+    size_t x, n_cols, tile_row_bytes, r;
+
+    if ( this->rows_per_strip < n_rows ) n_rows = this->rows_per_strip;
+    src_ptr = this->row_buf.array_ptr()
+	      + i_strip * this->rows_per_strip * this->row_bytes;
+
+    if ( this->tile_size == 0 ) {
+	*ret_width = this->width;
+	*ret_rows = n_rows;
+	return src_ptr;
+    }
+
+    x = (k % this->tiles_across) * this->tile_size;
+    n_cols = this->width - x;
+    if ( this->tile_size < n_cols ) n_cols = this->tile_size;
+    tile_row_bytes = this->tile_size * pixel_bytes;
+    tile_ptr = this->tile_buf.array_ptr()
+	       + k * this->tile_size * tile_row_bytes;
+    for ( r=0 ; r < this->tile_size ; r++ ) {
+	unsigned char *dst_ptr = tile_ptr + r * tile_row_bytes;
+	size_t len = 0;
+	if ( r < n_rows ) {
+	    len = n_cols * pixel_bytes;
+	    memcpy(dst_ptr, src_ptr + r * this->row_bytes + x * pixel_bytes,
+		   len);
+	}
+	if ( len < tile_row_bytes ) memset(dst_ptr + len, 0,
+					   tile_row_bytes - len);
+    }
+
+    *ret_width = this->tile_size;
+    *ret_rows = this->tile_size;
+    return tile_ptr;
+}
+
+/* encode strips or tiles [k_begin, k_end) of the band (in worker threads) */
+void tiff_strip_writer::encode_strips( size_t k_begin, size_t k_end,
+				       void *user_ptr )
+{
+    tiff_strip_writer *w = (tiff_strip_writer *)user_ptr;
+    size_t k;
+
+    for ( k=k_begin ; k < k_end ; k++ ) {
+	encoded_strip *ret = &(w->enc_strips[k]);
+	const unsigned char *block_ptr;
+	size_t block_width, n_rows;
+	mem_tiff_file f;
+	TIFF *t;
+	uint64_t *offsets = NULL, *bytecounts = NULL;
+
+	ret->offset = 0;
+	ret->length = -1;
+	block_ptr = w->get_block(k, &block_width, &n_rows);
+
+	f.buf = w->enc_buf.array_ptr() + k * w->enc_capacity;
+	f.capacity = w->enc_capacity;
+	f.length = 0;
+	f.pos = 0;
+	t = TIFFClientOpen("strip", "w", (thandle_t)&f,
+			   &mem_tiff_read, &mem_tiff_write, &mem_tiff_seek,
+			   &mem_tiff_close, &mem_tiff_size,
+			   &mem_tiff_map, &mem_tiff_unmap);
+	if ( t == NULL ) continue;
+
+	TIFFSetField(t, TIFFTAG_IMAGEWIDTH, (uint32)block_width);
+	TIFFSetField(t, TIFFTAG_IMAGELENGTH, (uint32)n_rows);
+	TIFFSetField(t, TIFFTAG_ROWSPERSTRIP, (uint32)n_rows);
+	TIFFSetField(t, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(t, TIFFTAG_PHOTOMETRIC, w->photometric);
+	TIFFSetField(t, TIFFTAG_BITSPERSAMPLE, w->bps);
+	TIFFSetField(t, TIFFTAG_SAMPLESPERPIXEL, w->spp);
+	TIFFSetField(t, TIFFTAG_SAMPLEFORMAT, w->sample_format);
+	TIFFSetField(t, TIFFTAG_COMPRESSION, w->codec);
+	TIFFSetField(t, TIFFTAG_PREDICTOR, w->predictor);
+
+	if ( TIFFWriteEncodedStrip(t, 0, (void *)block_ptr,
+			n_rows * block_width * w->spp * (w->bps / 8)) >= 0 &&
+	     TIFFGetField(t, TIFFTAG_STRIPOFFSETS, &offsets) != 0 &&
+	     TIFFGetField(t, TIFFTAG_STRIPBYTECOUNTS, &bytecounts) != 0 &&
+	     offsets != NULL && bytecounts != NULL &&
+	     offsets[0] + bytecounts[0] <= f.length ) {
+	    ret->offset = offsets[0];
+	    ret->length = bytecounts[0];
+	}
+
+	/* the directory is not written */
+	TIFFCleanup(t);
+    }
+
+    return;
+}
+
+int tiff_strip_writer::write_band()
+{
+    stdstreamio sio;
+    const size_t first_block = (this->band_row / this->rows_per_strip)
+			       * this->tiles_across;
+    const size_t n_blocks = (this->next_row - this->band_row
+			     + this->rows_per_strip - 1) / this->rows_per_strip
+			    * this->tiles_across;
+    size_t k;
+
+    /* tiles without compression */
+    if ( this->codec == COMPRESSION_NONE ) {
+	for ( k=0 ; k < n_blocks ; k++ ) {
+	    size_t block_width, n_rows;
+	    const unsigned char *block_ptr
+		= this->get_block(k, &block_width, &n_rows);
+	    const size_t block_bytes
+		= n_rows * block_width * this->spp * (this->bps / 8);
+	    if ( TIFFWriteEncodedTile(this->tiff_out, first_block + k,
+				      (void *)block_ptr, block_bytes) < 0 ) {
+		sio.eprintf("[ERROR] TIFFWriteEncodedTile() failed\n");
+		return -1;
+	    }
+	}
+	this->band_row = this->next_row;
+	return 0;
+    }
+
+    this->pool->run_row_bands(n_blocks, &encode_strips, (void *)this);
+
+    for ( k=0 ; k < n_blocks ; k++ ) {
+	const encoded_strip *s = &(this->enc_strips[k]);
+	const unsigned char *enc_ptr = this->enc_buf.array_ptr()
+				       + k * this->enc_capacity + s->offset;
+	tmsize_t ret;
+	if ( s->length < 0 ) {
+	    sio.eprintf("[ERROR] encoding block %zd failed\n", first_block + k);
+	    return -1;
+	}
+	if ( this->tile_size == 0 ) {
+	    ret = TIFFWriteRawStrip(this->tiff_out, first_block + k,
+				    (void *)enc_ptr, s->length);
+	}
+	else {
+	    ret = TIFFWriteRawTile(this->tiff_out, first_block + k,
+				   (void *)enc_ptr, s->length);
+	}
+	if ( ret < 0 ) {
+	    sio.eprintf("[ERROR] TIFFWriteRaw%s() failed\n",
+			(this->tile_size == 0) ? "Strip" : "Tile");
+	    return -1;
+	}
+    }
+    this->band_row = this->next_row;
+
+    return 0;
+}
+
 /* test suffix of filename and try opening file with readonly */
 bool test_tiff_file( const char *file )
 {
@@ -131,7 +900,6 @@ int load_tiff( const char *filename_in,
     uint32 width, height, icc_prof_size = 0, camera_calibration1_size = 0;
     void *icc_prof_data = NULL;
     float *camera_calibration1 = NULL;
-    tsize_t strip_size;
     size_t strip_max;
 
     int ret_status = -1;
@@ -183,9 +951,6 @@ int load_tiff( const char *filename_in,
 	goto quit;
     }
 
-    strip_size = TIFFStripSize(tiff_in);		/* in bytes */
-    strip_max = TIFFNumberOfStrips(tiff_in);
-
     if ( TIFFGetField(tiff_in, TIFFTAG_IMAGEWIDTH, &width) == 0 ) {
 	sio.eprintf("[ERROR] TIFFGetField() failed [width]\n");
 	goto quit;
@@ -236,14 +1001,13 @@ int load_tiff( const char *filename_in,
 
     if ( format == SAMPLEFORMAT_UINT && byps == 1 ) {        /* 8-bit mode */
 
-        mdarray_uchar strip_buf(false);
-	unsigned char *strip_buf_ptr = NULL;
+	tiff_strip_reader strip_reader;
+	const unsigned char *strip_buf_ptr = NULL;
 	unsigned char *ret_rgb_img_ptr = NULL;
 	size_t pix_offset, i;
 	
-        strip_buf.resize_1d(strip_size);
-	/* get line buf ptr */
-	strip_buf_ptr = strip_buf.array_ptr();
+	strip_reader.attach(tiff_in);
+	strip_max = strip_reader.length();
 
 	if ( ret_img_buf != NULL ) {
 	    ret_img_buf->init(UCHAR_ZT, false);
@@ -253,9 +1017,8 @@ int load_tiff( const char *filename_in,
 	pix_offset = 0;
 	for ( i=0 ; i < strip_max ; i++ ) {
 	    size_t len_pix, j, jj, ch;
-	    ssize_t s_len = TIFFReadEncodedStrip(tiff_in, i,
-						 (void *)strip_buf_ptr,
-						 strip_size);
+	    ssize_t s_len;
+	    strip_buf_ptr = (const unsigned char *)strip_reader.read(i, &s_len);
 	    if ( s_len < 0 ) {
 		sio.eprintf("[ERROR] TIFFReadEncodedStrip() failed\n");
 		goto quit;
@@ -279,14 +1042,13 @@ int load_tiff( const char *filename_in,
     }
     else if ( format == SAMPLEFORMAT_UINT && byps == 2 ) {    /* 16-bit mode */
 
-        mdarray_uchar strip_buf(false);
-	uint16_t *strip_buf_ptr = NULL;
+	tiff_strip_reader strip_reader;
+	const uint16_t *strip_buf_ptr = NULL;
 	float *ret_rgb_img_ptr = NULL;
 	size_t pix_offset, i;
 
-	strip_buf.resize_1d(strip_size);
-	/* get line buf ptr */
-	strip_buf_ptr = (uint16_t *)strip_buf.data_ptr();
+	strip_reader.attach(tiff_in);
+	strip_max = strip_reader.length();
 
 	if ( ret_img_buf != NULL ) {
 	    ret_img_buf->init(FLOAT_ZT, false);
@@ -295,10 +1057,9 @@ int load_tiff( const char *filename_in,
 
 	pix_offset = 0;
 	for ( i=0 ; i < strip_max ; i++ ) {
-	    size_t len_pix, j, jj, ch;
-	    ssize_t s_len = TIFFReadEncodedStrip(tiff_in, i,
-						 (void *)strip_buf_ptr,
-						 strip_size);
+	    size_t len_pix, jj, ch;
+	    ssize_t s_len;
+	    strip_buf_ptr = (const uint16_t *)strip_reader.read(i, &s_len);
 	    if ( s_len < 0 ) {
 		sio.eprintf("[ERROR] TIFFReadEncodedStrip() failed\n");
 		goto quit;
@@ -311,9 +1072,8 @@ int load_tiff( const char *filename_in,
 		    ret_rgb_img_ptr = (float *)ret_img_buf->data_ptr(0,0,ch);
 		    if ( spp == 3 ) jj = ch;
 		    else jj = 0;
-		    for ( j=0 ; j < len_pix ; j++, jj+=spp ) {
-			ret_rgb_img_ptr[pix_offset+j] = strip_buf_ptr[jj];
-		    }
+		    convert_u16_to_float(strip_buf_ptr + jj, spp, len_pix, 1.0,
+					 ret_rgb_img_ptr + pix_offset);
 		}
 	    }
 	    pix_offset += len_pix;
@@ -321,14 +1081,13 @@ int load_tiff( const char *filename_in,
     }
     else if ( format == SAMPLEFORMAT_IEEEFP && byps == 4 ) {    /* float */
 
-        mdarray_uchar strip_buf(false);
-	float *strip_buf_ptr = NULL;
+	tiff_strip_reader strip_reader;
+	const float *strip_buf_ptr = NULL;
 	float *ret_rgb_img_ptr = NULL;
 	size_t pix_offset, i;
 
-	strip_buf.resize_1d(strip_size);
-	/* get line buf ptr */
-	strip_buf_ptr = (float *)strip_buf.data_ptr();
+	strip_reader.attach(tiff_in);
+	strip_max = strip_reader.length();
 
 	if ( ret_img_buf != NULL ) {
 	    ret_img_buf->init(FLOAT_ZT, false);
@@ -337,10 +1096,9 @@ int load_tiff( const char *filename_in,
 
 	pix_offset = 0;
 	for ( i=0 ; i < strip_max ; i++ ) {
-	    size_t len_pix, j, jj, ch;
-	    ssize_t s_len = TIFFReadEncodedStrip(tiff_in, i,
-						 (void *)strip_buf_ptr,
-						 strip_size);
+	    size_t len_pix, jj, ch;
+	    ssize_t s_len;
+	    strip_buf_ptr = (const float *)strip_reader.read(i, &s_len);
 	    if ( s_len < 0 ) {
 		sio.eprintf("[ERROR] TIFFReadEncodedStrip() failed\n");
 		goto quit;
@@ -353,9 +1111,8 @@ int load_tiff( const char *filename_in,
 		    ret_rgb_img_ptr = (float *)ret_img_buf->data_ptr(0,0,ch);
 		    if ( spp == 3 ) jj = ch;
 		    else jj = 0;
-		    for ( j=0 ; j < len_pix ; j++, jj+=spp ) {
-			ret_rgb_img_ptr[pix_offset+j] = strip_buf_ptr[jj];
-		    }
+		    convert_float_to_float(strip_buf_ptr + jj, spp, len_pix,
+					   1.0, ret_rgb_img_ptr + pix_offset);
 		}
 	    }
 	    pix_offset += len_pix;
@@ -394,6 +1151,141 @@ int load_tiff( const char *filename_in,
 int load_tiff_into_float( const char *filename_in, double scale,
     mdarray_float *ret_img_buf, int *ret_sztype, mdarray_uchar *ret_icc_buf, 
     float camera_calibration1_ret[] )
+{
+    return load_tiff_rows_into_float( filename_in, scale, 0, -1,
+				      ret_img_buf, ret_sztype, ret_icc_buf,
+				      camera_calibration1_ret, NULL, NULL );
+}
+
+/* same as load_tiff_into_float(), but only rows [y_begin, y_begin+n_rows) */
+/* are decoded into ret_img_buf (width x n_rows x 3).  Rows outside of the */
+/* image are filled with 0.  n_rows < 0 means rows until the bottom.      */
+/* Strips outside of the range are not read.                              */
+int load_tiff_rows_into_float( const char *filename_in, double scale,
+    long y_begin, long n_rows,
+    mdarray_float *ret_img_buf, int *ret_sztype, mdarray_uchar *ret_icc_buf, 
+    float camera_calibration1_ret[], size_t *ret_width, size_t *ret_height )
+{
+    return load_tiff_region_into_float( filename_in, scale, 0, -1,
+					y_begin, n_rows, TIFF_CH_RGB,
+					ret_img_buf, ret_sztype, ret_icc_buf,
+					camera_calibration1_ret,
+					ret_width, ret_height );
+}
+
+/* scale given to convert_*_to_float() for samples of a file */
+static double get_float_scale( uint16 format, uint16 byps, double scale )
+{
+    /* 8-bit mode */
+    if ( format == SAMPLEFORMAT_UINT && byps == 1 ) {
+	if ( scale == 65536.0 ) return 256.0;
+	else return scale / 256.0;
+    }
+    /* 16-bit mode */
+    else if ( format == SAMPLEFORMAT_UINT && byps == 2 ) {
+	if ( scale == 65536.0 ) return 1.0;
+	else return scale / 65536.0;
+    }
+    /* 32-bit float */
+    else return scale;
+}
+
+/* region [x_begin, x_end) x [y_begin, y_end) of image is decoded into  */
+/* ret_img_buf (already allocated).  Only strips or tiles overlapping  */
+/* with the region are read, each of them once.                        */
+static int read_region_into_float( tiff_strip_reader *strip_reader,
+    uint16 format, uint16 byps, uint16 spp, double scl,
+    size_t width, size_t height,
+    long x_begin, long x_end, long y_begin, long y_end, int ch_mask,
+    mdarray_float *ret_img_buf )
+{
+    stdstreamio sio;
+    const size_t block_width = strip_reader->block_cols();
+    const size_t block_rows = strip_reader->strip_rows();
+    const size_t n_across = strip_reader->blocks_in_row();
+    const size_t len_row = block_width * spp;		/* in samples */
+    long cx_begin, cx_end, cy_begin, cy_end;
+    size_t bx, by;
+
+    /* rows and columns inside of the image */
+    cx_begin = (x_begin < 0) ? 0 : x_begin;
+    cx_end = ((long)width < x_end) ? (long)width : x_end;
+    cy_begin = (y_begin < 0) ? 0 : y_begin;
+    cy_end = ((long)height < y_end) ? (long)height : y_end;
+    if ( cx_end <= cx_begin || cy_end <= cy_begin ) return 0;
+    if ( block_width == 0 || block_rows == 0 ) {
+	sio.eprintf("[ERROR] invalid strips or tiles\n");
+	return -1;
+    }
+
+    for ( by=cy_begin / block_rows ; (long)(by * block_rows) < cy_end ; by++ ) {
+	const long block_y = by * block_rows;
+	for ( bx=cx_begin / block_width ;
+	      (long)(bx * block_width) < cx_end ; bx++ ) {
+	    const long block_x = bx * block_width;
+	    const void *block_ptr;
+	    long r_begin, r_end, c_begin, c_end, r;
+	    ssize_t b_len;
+	    block_ptr = strip_reader->read_block(by * n_across + bx, &b_len);
+	    if ( b_len < 0 ) {
+		sio.eprintf("[ERROR] cannot decode block %zd\n",
+			    by * n_across + bx);
+		return -1;
+	    }
+	    r_begin = cy_begin - block_y;
+	    if ( r_begin < 0 ) r_begin = 0;
+	    r_end = b_len / (byps * len_row);
+	    if ( cy_end - block_y < r_end ) r_end = cy_end - block_y;
+	    c_begin = cx_begin - block_x;
+	    if ( c_begin < 0 ) c_begin = 0;
+	    c_end = cx_end - block_x;
+	    if ( (long)block_width < c_end ) c_end = block_width;
+	    for ( r=r_begin ; r < r_end ; r++ ) {
+		const size_t out_y = block_y + r - y_begin;
+		const size_t len_pix = c_end - c_begin;
+		size_t jj, ch, l;
+		for ( ch=0, l=0 ; ch < 3 ; ch++ ) {
+		    float *ret_rgb_img_ptr;
+		    if ( (ch_mask & (1 << ch)) == 0 ) continue;
+		    /* get array ptr of each ch */
+		    ret_rgb_img_ptr = ret_img_buf->array_ptr(
+				block_x + c_begin - x_begin, out_y, l);
+		    l ++;
+		    if ( spp == 3 ) jj = ch;
+		    else jj = 0;
+		    jj += r * len_row + c_begin * spp;
+		    if ( format == SAMPLEFORMAT_UINT && byps == 1 ) {
+			convert_u8_to_float(
+				(const unsigned char *)block_ptr + jj,
+				spp, len_pix, scl, ret_rgb_img_ptr);
+		    }
+		    else if ( format == SAMPLEFORMAT_UINT && byps == 2 ) {
+			convert_u16_to_float((const uint16_t *)block_ptr + jj,
+					     spp, len_pix, scl,
+					     ret_rgb_img_ptr);
+		    }
+		    else {
+			convert_float_to_float((const float *)block_ptr + jj,
+					       spp, len_pix, scl,
+					       ret_rgb_img_ptr);
+		    }
+		}
+	    }
+	}
+    }
+
+    return 0;
+}
+
+/* region [x_begin, x_begin+n_cols) x [y_begin, y_begin+n_rows) of      */
+/* channels in ch_mask is decoded into n_cols x n_rows x n_ch buffer    */
+/* (n_ch: number of selected channels; layers are in order of R,G,B).  */
+/* Strips (or tiles) outside of the region are not read, and only      */
+/* selected columns and channels are converted.                        */
+int load_tiff_region_into_float( const char *filename_in, double scale,
+    long x_begin, long n_cols, long y_begin, long n_rows, int ch_mask,
+    mdarray_float *ret_img_buf, int *ret_sztype, mdarray_uchar *ret_icc_buf, 
+    float camera_calibration1_ret[], size_t *ret_width, size_t *ret_height )
 {
     stdstreamio sio;
 
@@ -403,12 +1295,12 @@ int load_tiff_into_float( const char *filename_in, double scale,
     uint32 width, height, icc_prof_size = 0, camera_calibration1_size = 0;
     void *icc_prof_data = NULL;
     float *camera_calibration1 = NULL;
-    tsize_t strip_size;
-    size_t strip_max;
+    size_t n_ch;
 
     int ret_status = -1;
 
     if ( filename_in == NULL ) return -1;	/* ERROR */
+    if ( (ch_mask & TIFF_CH_RGB) == 0 ) return -1;	/* ERROR */
 
     tiff_in = TIFFOpen(filename_in, "r");
     if ( tiff_in == NULL ) {
@@ -455,9 +1347,6 @@ int load_tiff_into_float( const char *filename_in, double scale,
 	goto quit;
     }
 
-    strip_size = TIFFStripSize(tiff_in);		/* in bytes */
-    strip_max = TIFFNumberOfStrips(tiff_in);
-
     if ( TIFFGetField(tiff_in, TIFFTAG_IMAGEWIDTH, &width) == 0 ) {
 	sio.eprintf("[ERROR] TIFFGetField() failed [width]\n");
 	goto quit;
@@ -506,177 +1395,67 @@ int load_tiff_into_float( const char *filename_in, double scale,
 	}
     }
 
-    if ( format == SAMPLEFORMAT_UINT && byps == 1 ) {        /* 8-bit mode */
+    /* range of rows and columns to be decoded */
+    if ( n_rows < 0 ) {
+	n_rows = (long)height - y_begin;
+	if ( n_rows < 0 ) n_rows = 0;
+    }
+    if ( n_cols < 0 ) {
+	n_cols = (long)width - x_begin;
+	if ( n_cols < 0 ) n_cols = 0;
+    }
 
-        mdarray_uchar strip_buf(false);
-	unsigned char *strip_buf_ptr = NULL;
-	float *ret_rgb_img_ptr = NULL;
-	size_t pix_offset, i;
-	double scl;
-	
-        strip_buf.resize_1d(strip_size);
-	/* get line buf ptr */
-	strip_buf_ptr = strip_buf.array_ptr();
+    n_ch = 0;
+    if ( (ch_mask & TIFF_CH_R) != 0 ) n_ch ++;
+    if ( (ch_mask & TIFF_CH_G) != 0 ) n_ch ++;
+    if ( (ch_mask & TIFF_CH_B) != 0 ) n_ch ++;
 
-	if ( ret_img_buf != NULL ) {
-	    if ( /* ret_img_buf->x_length() != width ||
-		 ret_img_buf->y_length() != height ||
-		 ret_img_buf->z_length() != 3 */ 1 ) {
-		ret_img_buf->init(false);
-		ret_img_buf->resize_3d(width,height,3);
-	    }
-	}
+    if ( ret_img_buf != NULL && 0 < n_rows && 0 < n_cols ) {
 
-	if ( scale == 65536.0 ) scl = 256.0;
-	else scl = scale / 256.0;
-	
-	pix_offset = 0;
-	for ( i=0 ; i < strip_max ; i++ ) {
-	    size_t len_pix, j, jj, ch;
-	    ssize_t s_len = TIFFReadEncodedStrip(tiff_in, i,
-						 (void *)strip_buf_ptr,
-						 strip_size);
-	    if ( s_len < 0 ) {
-		sio.eprintf("[ERROR] TIFFReadEncodedStrip() failed\n");
-		goto quit;
-	    }
-	    len_pix = s_len / (byps * spp);
+	tiff_strip_reader strip_reader;
 
-	    if ( ret_img_buf != NULL ) {
-		for ( ch=0 ; ch < 3 ; ch++ ) {
-		    /* get array ptr of each ch */
-		    ret_rgb_img_ptr = ret_img_buf->array_ptr(0,0,ch);
-		    if ( spp == 3 ) jj = ch;
-		    else jj = 0;
-		    for ( j=0 ; j < len_pix ; j++, jj+=spp ) {
-			ret_rgb_img_ptr[pix_offset+j] 
-			    = strip_buf_ptr[jj] * scl;
-		    }
-		}
+	ret_img_buf->init(false);
+	ret_img_buf->resize_3d(n_cols,n_rows,n_ch);
+
+	strip_reader.attach(tiff_in);
+
+	if ( read_region_into_float(&strip_reader, format, byps, spp,
+				    get_float_scale(format, byps, scale),
+				    width, height,
+				    x_begin, x_begin + n_cols,
+				    y_begin, y_begin + n_rows,
+				    ch_mask, ret_img_buf) < 0 ) goto quit;
+
+    }
+    
+    if ( ret_sztype != NULL ) {
+	*ret_sztype = byps;
+	if ( format == SAMPLEFORMAT_IEEEFP ) *ret_sztype *= -1;
+    }
+    if ( ret_width != NULL ) *ret_width = width;
+    if ( ret_height != NULL ) *ret_height = height;
+    if ( camera_calibration1_ret != NULL ) {
+	uint32 i;
+	if ( camera_calibration1 == NULL ) camera_calibration1_size = 0;
+        for ( i=0 ; i < 12 ; i++ ) {
+	    if ( i < camera_calibration1_size ) {
+		camera_calibration1_ret[i] = camera_calibration1[i];
+            }
+	    else {
+		if ( 5 <= i && i <= 10 ) camera_calibration1_ret[i] = 1.0;
+		else camera_calibration1_ret[i] = 0.0;
 	    }
-	    pix_offset += len_pix;
 	}
+    }
 
+    ret_status = 0;
+ quit:
+    if ( tiff_in != NULL ) {
+	TIFFClose(tiff_in);
     }
-    else if ( format == SAMPLEFORMAT_UINT && byps == 2 ) {        /* 16-bit mode */
 
-        mdarray_uchar strip_buf(false);
-	uint16_t *strip_buf_ptr = NULL;
-	float *ret_rgb_img_ptr = NULL;
-	size_t pix_offset, i;
-	double scl;
-	
-	strip_buf.resize_1d(strip_size);
-	/* get line buf ptr */
-	strip_buf_ptr = (uint16_t *)strip_buf.data_ptr();
-
-	if ( ret_img_buf != NULL ) {
-	    ret_img_buf->init(false);
-	    ret_img_buf->resize_3d(width,height,3);
-	}
-
-	if ( scale == 65536.0 ) scl = 1.0;
-	else scl = scale / 65536.0;
-
-	pix_offset = 0;
-	for ( i=0 ; i < strip_max ; i++ ) {
-	    size_t len_pix, j, jj, ch;
-	    ssize_t s_len = TIFFReadEncodedStrip(tiff_in, i,
-						 (void *)strip_buf_ptr,
-						 strip_size);
-	    if ( s_len < 0 ) {
-		sio.eprintf("[ERROR] TIFFReadEncodedStrip() failed\n");
-		goto quit;
-	    }
-	    len_pix = s_len / (byps * spp);
-
-	    if ( ret_img_buf != NULL ) {
-		for ( ch=0 ; ch < 3 ; ch++ ) {
-		    /* get array ptr of each ch */
-		    ret_rgb_img_ptr = ret_img_buf->array_ptr(0,0,ch);
-		    if ( spp == 3 ) jj = ch;
-		    else jj = 0;
-		    for ( j=0 ; j < len_pix ; j++, jj+=spp ) {
-			ret_rgb_img_ptr[pix_offset+j]
-			    = strip_buf_ptr[jj] * scl;
-		    }
-		}
-	    }
-	    pix_offset += len_pix;
-	}
-
-    }
-    else {	/* 32-bit float */
-
-        mdarray_uchar strip_buf(false);
-	float *strip_buf_ptr = NULL;
-	float *ret_rgb_img_ptr = NULL;
-	size_t pix_offset, i;
-
-	strip_buf.resize_1d(strip_size);
-	/* get line buf ptr */
-	strip_buf_ptr = (float *)strip_buf.data_ptr();
-
-	if ( ret_img_buf != NULL ) {
-	    ret_img_buf->init(false);
-	    ret_img_buf->resize_3d(width,height,3);
-	}
-
-	pix_offset = 0;
-	for ( i=0 ; i < strip_max ; i++ ) {
-	    size_t len_pix, j, jj, ch;
-	    ssize_t s_len = TIFFReadEncodedStrip(tiff_in, i,
-						 (void *)strip_buf_ptr,
-						 strip_size);
-	    if ( s_len < 0 ) {
-		sio.eprintf("[ERROR] TIFFReadEncodedStrip() failed\n");
-		goto quit;
-	    }
-	    len_pix = s_len / (byps * spp);
-
-	    if ( ret_img_buf != NULL ) {
-		for ( ch=0 ; ch < 3 ; ch++ ) {
-		    /* get array ptr of each ch */
-		    ret_rgb_img_ptr = ret_img_buf->array_ptr(0,0,ch);
-		    if ( spp == 3 ) jj = ch;
-		    else jj = 0;
-		    for ( j=0 ; j < len_pix ; j++, jj+=spp ) {
-			ret_rgb_img_ptr[pix_offset+j]
-			    = strip_buf_ptr[jj] * scale;
-		    }
-		}
-	    }
-	    pix_offset += len_pix;
-	}
-
-    }
-    
-    if ( ret_sztype != NULL ) {
-	*ret_sztype = byps;
-	if ( format == SAMPLEFORMAT_IEEEFP ) *ret_sztype *= -1;
-    }
-    if ( camera_calibration1_ret != NULL ) {
-	uint32 i;
-	if ( camera_calibration1 == NULL ) camera_calibration1_size = 0;
-        for ( i=0 ; i < 12 ; i++ ) {
-	    if ( i < camera_calibration1_size ) {
-		camera_calibration1_ret[i] = camera_calibration1[i];
-            }
-	    else {
-		if ( 5 <= i && i <= 10 ) camera_calibration1_ret[i] = 1.0;
-		else camera_calibration1_ret[i] = 0.0;
-	    }
-	}
-    }
-
-    ret_status = 0;
- quit:
-    if ( tiff_in != NULL ) {
-	TIFFClose(tiff_in);
-    }
-
-    return ret_status;
-}
+    return ret_status;
+}
 
 
 /* this returns uchar or float array */
@@ -694,7 +1473,6 @@ int load_tiff_into_separate_buffer( const char *filename_in,
     uint32 width, height, icc_prof_size = 0, camera_calibration1_size = 0;
     void *icc_prof_data = NULL;
     float *camera_calibration1 = NULL;
-    tsize_t strip_size;
     size_t strip_max;
 
     int ret_status = -1;
@@ -746,9 +1524,6 @@ int load_tiff_into_separate_buffer( const char *filename_in,
 	goto quit;
     }
 
-    strip_size = TIFFStripSize(tiff_in);		/* in bytes */
-    strip_max = TIFFNumberOfStrips(tiff_in);
-
     if ( TIFFGetField(tiff_in, TIFFTAG_IMAGEWIDTH, &width) == 0 ) {
 	sio.eprintf("[ERROR] TIFFGetField() failed [width]\n");
 	goto quit;
@@ -798,14 +1573,13 @@ int load_tiff_into_separate_buffer( const char *filename_in,
 
     if ( format == SAMPLEFORMAT_UINT && byps == 1 ) {        /* 8-bit mode */
 
-        mdarray_uchar strip_buf(false);
-	unsigned char *strip_buf_ptr = NULL;
+	tiff_strip_reader strip_reader;
+	const unsigned char *strip_buf_ptr = NULL;
 	unsigned char *ret_rgb_img_ptr[3] = {NULL,NULL,NULL};
 	size_t pix_offset, i, ch;
 	
-        strip_buf.resize_1d(strip_size);
-	/* get line buf ptr */
-	strip_buf_ptr = strip_buf.array_ptr();
+	strip_reader.attach(tiff_in);
+	strip_max = strip_reader.length();
 
 	for ( ch=0 ; ch < 3 ; ch++ ) {
 	    if ( ret_img_rgb_buf[ch] != NULL ) {
@@ -820,9 +1594,8 @@ int load_tiff_into_separate_buffer( const char *filename_in,
 	pix_offset = 0;
 	for ( i=0 ; i < strip_max ; i++ ) {
 	    size_t len_pix, j, jj;
-	    ssize_t s_len = TIFFReadEncodedStrip(tiff_in, i,
-						 (void *)strip_buf_ptr,
-						 strip_size);
+	    ssize_t s_len;
+	    strip_buf_ptr = (const unsigned char *)strip_reader.read(i, &s_len);
 	    if ( s_len < 0 ) {
 		sio.eprintf("[ERROR] TIFFReadEncodedStrip() failed\n");
 		goto quit;
@@ -841,14 +1614,13 @@ int load_tiff_into_separate_buffer( const char *filename_in,
     }
     else if ( format == SAMPLEFORMAT_UINT && byps == 2 ) {    /* 16-bit mode */
 
-        mdarray_uchar strip_buf(false);
-	uint16_t *strip_buf_ptr = NULL;
+	tiff_strip_reader strip_reader;
+	const uint16_t *strip_buf_ptr = NULL;
 	float *ret_rgb_img_ptr[3] = {NULL,NULL,NULL};
 	size_t pix_offset, i, ch;
 
-	strip_buf.resize_1d(strip_size);
-	/* get line buf ptr */
-	strip_buf_ptr = (uint16_t *)strip_buf.data_ptr();
+	strip_reader.attach(tiff_in);
+	strip_max = strip_reader.length();
 
 	for ( ch=0 ; ch < 3 ; ch++ ) {
 	    if ( ret_img_rgb_buf[ch] != NULL ) {
@@ -861,10 +1633,9 @@ int load_tiff_into_separate_buffer( const char *filename_in,
 
 	pix_offset = 0;
 	for ( i=0 ; i < strip_max ; i++ ) {
-	    size_t len_pix, j, jj;
-	    ssize_t s_len = TIFFReadEncodedStrip(tiff_in, i,
-						 (void *)strip_buf_ptr,
-						 strip_size);
+	    size_t len_pix;
+	    ssize_t s_len;
+	    strip_buf_ptr = (const uint16_t *)strip_reader.read(i, &s_len);
 	    if ( s_len < 0 ) {
 		sio.eprintf("[ERROR] TIFFReadEncodedStrip() failed\n");
 		goto quit;
@@ -873,9 +1644,8 @@ int load_tiff_into_separate_buffer( const char *filename_in,
 
 	    for ( ch=0 ; ch < 3 ; ch++ ) {
 		if ( ret_rgb_img_ptr[ch] != NULL ) {
-		    for ( j=0, jj=ch ; j < len_pix ; j++, jj+=3 ) {
-			ret_rgb_img_ptr[ch][pix_offset+j] = strip_buf_ptr[jj];
-		    }
+		    convert_u16_to_float(strip_buf_ptr + ch, 3, len_pix, 1.0,
+					 ret_rgb_img_ptr[ch] + pix_offset);
 		}
 	    }
 	    pix_offset += len_pix;
@@ -883,14 +1653,13 @@ int load_tiff_into_separate_buffer( const char *filename_in,
     }
     else if ( format == SAMPLEFORMAT_IEEEFP && byps == 4 ) {    /* float */
 
-        mdarray_uchar strip_buf(false);
-	float *strip_buf_ptr = NULL;
+	tiff_strip_reader strip_reader;
+	const float *strip_buf_ptr = NULL;
 	float *ret_rgb_img_ptr[3] = {NULL,NULL,NULL};
 	size_t pix_offset, i, ch;
 
-	strip_buf.resize_1d(strip_size);
-	/* get line buf ptr */
-	strip_buf_ptr = (float *)strip_buf.data_ptr();
+	strip_reader.attach(tiff_in);
+	strip_max = strip_reader.length();
 
 	for ( ch=0 ; ch < 3 ; ch++ ) {
 	    if ( ret_img_rgb_buf[ch] != NULL ) {
@@ -903,10 +1672,9 @@ int load_tiff_into_separate_buffer( const char *filename_in,
 
 	pix_offset = 0;
 	for ( i=0 ; i < strip_max ; i++ ) {
-	    size_t len_pix, j, jj;
-	    ssize_t s_len = TIFFReadEncodedStrip(tiff_in, i,
-						 (void *)strip_buf_ptr,
-						 strip_size);
+	    size_t len_pix;
+	    ssize_t s_len;
+	    strip_buf_ptr = (const float *)strip_reader.read(i, &s_len);
 	    if ( s_len < 0 ) {
 		sio.eprintf("[ERROR] TIFFReadEncodedStrip() failed\n");
 		goto quit;
@@ -915,9 +1683,8 @@ int load_tiff_into_separate_buffer( const char *filename_in,
 
 	    for ( ch=0 ; ch < 3 ; ch++ ) {
 		if ( ret_rgb_img_ptr[ch] != NULL ) {
-		    for ( j=0, jj=ch ; j < len_pix ; j++, jj+=3 ) {
-			ret_rgb_img_ptr[ch][pix_offset+j] = strip_buf_ptr[jj];
-		    }
+		    convert_float_to_float(strip_buf_ptr + ch, 3, len_pix, 1.0,
+					   ret_rgb_img_ptr[ch] + pix_offset);
 		}
 	    }
 	    pix_offset += len_pix;
@@ -961,6 +1728,7 @@ int save_tiff( const mdarray &img_buf_in, int sztype,
 
     /* TIFF: See http://www.libtiff.org/man/TIFFGetField.3t.html */
     TIFF *tiff_out = NULL;
+    tiff_strip_writer strip_writer;
     uint16 bps, byps, spp;
     uint32 width, height, icc_prof_size;
     
@@ -989,14 +1757,11 @@ int save_tiff( const mdarray &img_buf_in, int sztype,
     TIFFSetField(tiff_out, TIFFTAG_IMAGEWIDTH, width);
     TIFFSetField(tiff_out, TIFFTAG_IMAGELENGTH, height);
 
-    TIFFSetField(tiff_out, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
-    //TIFFSetField(tiff_out, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
     TIFFSetField(tiff_out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
     TIFFSetField(tiff_out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
     TIFFSetField(tiff_out, TIFFTAG_BITSPERSAMPLE, bps);
     TIFFSetField(tiff_out, TIFFTAG_SAMPLESPERPIXEL, spp);
     TIFFSetField(tiff_out, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
-    TIFFSetField(tiff_out, TIFFTAG_ROWSPERSTRIP, (uint32)1);
     
     if ( camera_calibration1 != NULL ) {
 	TIFFSetField(tiff_out, TIFFTAG_CAMERACALIBRATION1, 12, camera_calibration1);
@@ -1007,6 +1772,8 @@ int save_tiff( const mdarray &img_buf_in, int sztype,
 	TIFFSetField(tiff_out, TIFFTAG_ICCPROFILE,
 		     icc_prof_size, icc_buf_in.data_ptr());
     }
+
+    if ( strip_writer.attach(tiff_out) < 0 ) goto quit;
     
     /* write image data */
     if ( img_buf_in.size_type() == UCHAR_ZT ) {
@@ -1031,12 +1798,8 @@ int save_tiff( const mdarray &img_buf_in, int sztype,
 		for ( j=0, jj=ch ; j < width ; j++, jj+=3 ) {
 		    strip_buf_ptr[jj] = rgb_img_in_ptr[pix_offset+j];
 		}
-		if ( TIFFWriteEncodedStrip(tiff_out, i, strip_buf_ptr,
-					   width * byps * spp) == 0 ) {
-		    sio.eprintf("[ERROR] TIFFWriteEncodedStrip() failed\n");
-		    goto quit;
-		}
 	    }
+	    if ( strip_writer.write_row(strip_buf_ptr) < 0 ) goto quit;
 	    pix_offset += width;
 	}
 
@@ -1067,11 +1830,7 @@ int save_tiff( const mdarray &img_buf_in, int sztype,
 		}
 	    }		
 	    
-	    if ( TIFFWriteEncodedStrip(tiff_out, i, strip_buf_ptr,
-				       width * byps * spp) == 0 ) {
-		sio.eprintf("[ERROR] TIFFWriteEncodedStrip() failed\n");
-		goto quit;
-	    }
+	    if ( strip_writer.write_row(strip_buf_ptr) < 0 ) goto quit;
 
 	    pix_offset += width;
 	}
@@ -1082,6 +1841,8 @@ int save_tiff( const mdarray &img_buf_in, int sztype,
     }
     
    
+    if ( strip_writer.flush() < 0 ) goto quit;
+
     ret_status = 0;
  quit:
     if ( tiff_out != NULL ) {
@@ -1102,6 +1863,7 @@ int save_float_to_tiff( const mdarray &img_buf_in,
 
     /* TIFF: See http://www.libtiff.org/man/TIFFGetField.3t.html */
     TIFF *tiff_out = NULL;
+    tiff_strip_writer strip_writer;
     uint16 bps, byps, spp;
     uint32 width, height, icc_prof_size;
     size_t i;
@@ -1131,14 +1893,11 @@ int save_float_to_tiff( const mdarray &img_buf_in,
     TIFFSetField(tiff_out, TIFFTAG_IMAGEWIDTH, width);
     TIFFSetField(tiff_out, TIFFTAG_IMAGELENGTH, height);
 
-    TIFFSetField(tiff_out, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
-    //TIFFSetField(tiff_out, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
     TIFFSetField(tiff_out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
     TIFFSetField(tiff_out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
     TIFFSetField(tiff_out, TIFFTAG_BITSPERSAMPLE, bps);
     TIFFSetField(tiff_out, TIFFTAG_SAMPLESPERPIXEL, spp);
     TIFFSetField(tiff_out, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
-    TIFFSetField(tiff_out, TIFFTAG_ROWSPERSTRIP, (uint32)1);
 
     if ( camera_calibration1 != NULL ) {
 	TIFFSetField(tiff_out, TIFFTAG_CAMERACALIBRATION1, 12, camera_calibration1);
@@ -1150,6 +1909,8 @@ int save_float_to_tiff( const mdarray &img_buf_in,
 		     icc_prof_size, icc_buf_in.data_ptr());
     }
 
+    if ( strip_writer.attach(tiff_out) < 0 ) goto quit;
+
     {
 	mdarray_uchar strip_buf(false);
 	float *strip_buf_ptr;
@@ -1181,16 +1942,14 @@ int save_float_to_tiff( const mdarray &img_buf_in,
 		}
 	    }
 
-	    if ( TIFFWriteEncodedStrip(tiff_out, i, strip_buf_ptr,
-				       width * byps * spp) == 0 ) {
-		sio.eprintf("[ERROR] TIFFWriteEncodedStrip() failed\n");
-		goto quit;
-	    }
+	    if ( strip_writer.write_row(strip_buf_ptr) < 0 ) goto quit;
 
 	    pix_offset += width;
 	}
     }
     
+    if ( strip_writer.flush() < 0 ) goto quit;
+
     ret_status = 0;
  quit:
     if ( tiff_out != NULL ) {
@@ -1200,6 +1959,253 @@ int save_float_to_tiff( const mdarray &img_buf_in,
     return ret_status;
 }
 
+/*
+ * class float_tiff_writer
+ */
+
+float_tiff_writer::float_tiff_writer()
+  : tiff_out(NULL), width(0), height(0), n_ch(0), scale(1.0), next_row(0),
+    strip_buf(false), strip_writer(NULL)
+{
+}
+
+float_tiff_writer::~float_tiff_writer()
+{
+    if ( this->strip_writer != NULL ) {
+	delete (tiff_strip_writer *)(this->strip_writer);
+	this->strip_writer = NULL;
+    }
+    if ( this->tiff_out != NULL ) {
+	TIFFClose((TIFF *)(this->tiff_out));
+	this->tiff_out = NULL;
+    }
+}
+
+int float_tiff_writer::open( const char *filename_out,
+			     size_t width, size_t height, size_t n_ch,
+			     const mdarray_uchar &icc_buf_in, double scale )
+{
+    stdstreamio sio;
+    TIFF *tiff_out;
+    tiff_strip_writer *strip_writer;
+    uint32 icc_prof_size;
+
+    if ( filename_out == NULL ) return -1;
+    if ( this->tiff_out != NULL ) return -1;
+    if ( width == 0 || height == 0 ) return -1;
+    if ( n_ch != 1 && n_ch != 3 ) return -1;
+
+    tiff_out = TIFFOpen(filename_out, "w");
+    if ( tiff_out == NULL ) {
+	sio.eprintf("[ERROR] TIFFOpen() failed\n");
+	return -1;
+    }
+
+    TIFFSetField(tiff_out, TIFFTAG_IMAGEWIDTH, (uint32)width);
+    TIFFSetField(tiff_out, TIFFTAG_IMAGELENGTH, (uint32)height);
+
+    TIFFSetField(tiff_out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tiff_out, TIFFTAG_PHOTOMETRIC,
+		 (n_ch == 3) ? PHOTOMETRIC_RGB : PHOTOMETRIC_MINISBLACK);
+    TIFFSetField(tiff_out, TIFFTAG_BITSPERSAMPLE, (uint16)32);
+    TIFFSetField(tiff_out, TIFFTAG_SAMPLESPERPIXEL, (uint16)n_ch);
+    TIFFSetField(tiff_out, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+
+    if ( n_ch == 3 && 0 < icc_buf_in.length() ) {
+	icc_prof_size = icc_buf_in.length();
+	TIFFSetField(tiff_out, TIFFTAG_ICCPROFILE,
+		     icc_prof_size, icc_buf_in.data_ptr());
+    }
+
+    strip_writer = new tiff_strip_writer;
+    if ( strip_writer->attach(tiff_out) < 0 ) {
+	delete strip_writer;
+	TIFFClose(tiff_out);
+	return -1;
+    }
+
+    this->tiff_out = tiff_out;
+    this->strip_writer = strip_writer;
+    this->width = width;
+    this->height = height;
+    this->n_ch = n_ch;
+    this->scale = scale;
+    this->next_row = 0;
+    this->strip_buf.resize_1d(n_ch * width);
+
+    return 0;
+}
+
+int float_tiff_writer::write_rows( const mdarray_float &img_buf,
+				   size_t n_rows )
+{
+    tiff_strip_writer *strip_writer;
+    float *strip_buf_ptr;
+    size_t i, j, jj, ch;
+
+    if ( this->tiff_out == NULL ) return -1;
+    if ( img_buf.x_length() != this->width ) return -1;
+    if ( img_buf.y_length() < n_rows ) return -1;
+    if ( img_buf.z_length() < this->n_ch ) return -1;
+    if ( this->height < this->next_row + n_rows ) return -1;
+
+    strip_writer = (tiff_strip_writer *)(this->strip_writer);
+    strip_buf_ptr = this->strip_buf.array_ptr();
+
+    for ( i=0 ; i < n_rows ; i++ ) {
+	for ( ch=0 ; ch < this->n_ch ; ch++ ) {
+	    const float *src = img_buf.array_ptr_cs(0, i, ch);
+	    if ( this->scale == 1.0 ) {
+		for ( j=0, jj=ch ; j < this->width ; j++, jj+=this->n_ch ) {
+		    strip_buf_ptr[jj] = src[j];
+		}
+	    }
+	    else {
+		for ( j=0, jj=ch ; j < this->width ; j++, jj+=this->n_ch ) {
+		    strip_buf_ptr[jj] = src[j] / this->scale;
+		}
+	    }
+	}
+	if ( strip_writer->write_row(strip_buf_ptr) < 0 ) return -1;
+	this->next_row ++;
+    }
+
+    return 0;
+}
+
+int float_tiff_writer::close()
+{
+    int ret_status = 0;
+
+    if ( this->tiff_out == NULL ) return 0;
+    if ( this->next_row != this->height ) ret_status = -1;
+
+    if ( ((tiff_strip_writer *)(this->strip_writer))->flush() < 0 ) {
+	ret_status = -1;
+    }
+    delete (tiff_strip_writer *)(this->strip_writer);
+    this->strip_writer = NULL;
+
+    TIFFClose((TIFF *)(this->tiff_out));
+    this->tiff_out = NULL;
+    this->strip_buf.init(false);
+
+    return ret_status;
+}
+
+/*
+ * Quantization of float RGB planes into 16-bit rows of output.  A band
+ * of rows is quantized by all threads, and then its rows are given to
+ * the strip writer in order.  Dithering uses random numbers from the index of
+ * each sample, so that output does not depend on number of threads.
+ */
+
+/* rows quantized at once */
+static const size_t Quantize_band_rows = 256;
+
+typedef struct _quantize_rows_args {
+    const float *src[3];		/* R,G,B planes */
+    size_t width;
+    size_t y_begin;			/* first row of the band */
+    double min_val;
+    double max_val;
+    bool dither;
+    uint32_t seed;
+    size_t y_image;			/* row of src[] in the image */
+    uint16_t *dst;			/* strips of the band */
+} quantize_rows_args;
+
+/* random seed of dither from name of output file */
+static uint32_t get_dither_seed( const char *filename_out )
+{
+    uint32_t rnd_seed = 0;
+    size_t i = 0;
+    while ( filename_out[i] != '\0' ) {
+	rnd_seed += (uint32_t)(filename_out[i]) << (rnd_seed % 25);
+	rnd_seed -= (uint32_t)(filename_out[i]) << (rnd_seed % 19);
+	rnd_seed += (uint32_t)(filename_out[i]) << (rnd_seed % 11);
+	rnd_seed -= (uint32_t)(filename_out[i]) << (rnd_seed % 5);
+	i++;
+    }
+    return rnd_seed;
+}
+
+static void quantize_rows( size_t y_begin, size_t y_end, void *user_ptr )
+{
+    const quantize_rows_args *a = (const quantize_rows_args *)user_ptr;
+    size_t i;
+
+    for ( i=y_begin ; i < y_end ; i++ ) {
+	const size_t pix_offset = (a->y_begin + i) * a->width;
+	uint16_t *dst = a->dst + 3 * a->width * i;
+	if ( a->dither == true ) {
+	    dither_float_to_u16_rgb(a->src[0] + pix_offset,
+				    a->src[1] + pix_offset,
+				    a->src[2] + pix_offset, a->width,
+				    a->min_val, a->max_val, a->seed,
+				    (uint64_t)3 * (a->y_image * a->width
+						   + pix_offset), dst);
+	}
+	else {
+	    quantize_float_to_u16_rgb(a->src[0] + pix_offset,
+				      a->src[1] + pix_offset,
+				      a->src[2] + pix_offset, a->width,
+				      a->min_val, a->max_val, dst);
+	}
+    }
+
+    return;
+}
+
+/* tpool is shared with strip_writer (see attach()).  src[] are rows */
+/* from y_image of the image (for random numbers of dither).          */
+static int write_u16_rgb_strips( tiff_strip_writer *strip_writer,
+				 thread_pool *tpool,
+				 const float *const src[],
+				 size_t width, size_t height,
+				 double min_val, double max_val,
+				 bool dither, uint32_t seed, size_t y_image )
+{
+    mdarray_uchar band_buf(false);
+    quantize_rows_args args;
+    size_t band_rows = Quantize_band_rows;
+    size_t i, k;
+
+    int ret_status = -1;
+
+    if ( height < band_rows ) band_rows = height;
+    if ( band_rows == 0 ) return 0;
+
+    band_buf.resize_1d(sizeof(uint16_t) * 3 * width * band_rows);
+
+    args.src[0] = src[0];
+    args.src[1] = src[1];
+    args.src[2] = src[2];
+    args.width = width;
+    args.min_val = min_val;
+    args.max_val = max_val;
+    args.dither = dither;
+    args.seed = seed;
+    args.y_image = y_image;
+    args.dst = (uint16_t *)band_buf.data_ptr();
+
+    for ( i=0 ; i < height ; i += band_rows ) {
+	const size_t n_rows = (i + band_rows <= height) ?
+			      band_rows : height - i;
+	args.y_begin = i;
+	tpool->run_row_bands(n_rows, &quantize_rows, (void *)&args);
+	for ( k=0 ; k < n_rows ; k++ ) {
+	    if ( strip_writer->write_row(args.dst + 3 * width * k) < 0 ) {
+		goto quit;
+	    }
+	}
+    }
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
+
 int save_float_to_tiff48( const mdarray &img_buf_in,
 			  const mdarray_uchar &icc_buf_in,
 			  const float camera_calibration1[],
@@ -1208,13 +2214,13 @@ int save_float_to_tiff48( const mdarray &img_buf_in,
 			  const char *filename_out )
 {
     stdstreamio sio;
-    double range;
 
     /* TIFF: See http://www.libtiff.org/man/TIFFGetField.3t.html */
     TIFF *tiff_out = NULL;
-    uint16 bps, byps, spp;
+    tiff_strip_writer strip_writer;
+    thread_pool tpool;
+    uint16 bps, spp;
     uint32 width, height, icc_prof_size;
-    size_t i;
     uint32_t rnd_seed = 0;
     
     int ret_status = -1;
@@ -1230,25 +2236,15 @@ int save_float_to_tiff48( const mdarray &img_buf_in,
 	max_val = md_max(img_buf_in);
 	min_val = md_min(img_buf_in);
     }
-    range = max_val - min_val;
 
     bps = 16;
-    byps = (bps + 7) / 8;
     spp = 3;
 
     width = img_buf_in.x_length();
     height = img_buf_in.y_length();
 
     /* set random seed */
-    i = 0;
-    while ( filename_out[i] != '\0' ) {
-	rnd_seed += (uint32_t)(filename_out[i]) << (rnd_seed % 25);
-	rnd_seed -= (uint32_t)(filename_out[i]) << (rnd_seed % 19);
-	rnd_seed += (uint32_t)(filename_out[i]) << (rnd_seed % 11);
-	rnd_seed -= (uint32_t)(filename_out[i]) << (rnd_seed % 5);
-	i++;
-    }
-    init_genrand(rnd_seed);
+    rnd_seed = get_dither_seed(filename_out);
 
     tiff_out = TIFFOpen(filename_out, "w");
     if ( tiff_out == NULL ) {
@@ -1259,14 +2255,11 @@ int save_float_to_tiff48( const mdarray &img_buf_in,
     TIFFSetField(tiff_out, TIFFTAG_IMAGEWIDTH, width);
     TIFFSetField(tiff_out, TIFFTAG_IMAGELENGTH, height);
 
-    TIFFSetField(tiff_out, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
-    //TIFFSetField(tiff_out, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
     TIFFSetField(tiff_out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
     TIFFSetField(tiff_out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
     TIFFSetField(tiff_out, TIFFTAG_BITSPERSAMPLE, bps);
     TIFFSetField(tiff_out, TIFFTAG_SAMPLESPERPIXEL, spp);
     TIFFSetField(tiff_out, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
-    TIFFSetField(tiff_out, TIFFTAG_ROWSPERSTRIP, (uint32)1);
 
     if ( camera_calibration1 != NULL ) {
 	TIFFSetField(tiff_out, TIFFTAG_CAMERACALIBRATION1, 12, camera_calibration1);
@@ -1278,67 +2271,169 @@ int save_float_to_tiff48( const mdarray &img_buf_in,
 		     icc_prof_size, icc_buf_in.data_ptr());
     }
 
+    /* threads for quantization and encoding of strips (works in the */
+    /* calling thread when threads are not available)               */
+    tpool.start(get_number_of_cpus());
+    if ( strip_writer.attach(tiff_out, &tpool) < 0 ) goto quit;
+
     {
-	mdarray_uchar strip_buf(false);
-	uint16_t *strip_buf_ptr;
+	const float *const rgb_img_in_ptr[3] = {
+	    (const float *)img_buf_in.data_ptr_cs(0,0,0),
+	    (const float *)img_buf_in.data_ptr_cs(0,0,1),
+	    (const float *)img_buf_in.data_ptr_cs(0,0,2)
+	};
+	if ( write_u16_rgb_strips(&strip_writer, &tpool, rgb_img_in_ptr,
+				  width, height, min_val, max_val,
+				  dither, rnd_seed, 0) < 0 ) {
+	    goto quit;
+	}
+    }
 
-	const float *rgb_img_in_ptr;
+    
+    if ( strip_writer.flush() < 0 ) goto quit;
 
-	size_t pix_offset;
+    ret_status = 0;
+ quit:
+    if ( tiff_out != NULL ) {
+	TIFFClose(tiff_out);
+    }
 
-	strip_buf.resize_1d(byps * spp * width);
-	strip_buf_ptr = (uint16_t *)strip_buf.data_ptr();
+    return ret_status;
+}
 
-	pix_offset = 0;
-	for ( i=0 ; i < height ; i++ ) {
-	    size_t j, jj, ch;
-	    double v;
+/*
+ * class tiff48_writer
+ */
 
-	    for ( ch=0 ; ch < 3 ; ch++ ) {
-		/* get ptr of each ch */
-		rgb_img_in_ptr = (const float *)img_buf_in.data_ptr_cs(0,0,ch);
+tiff48_writer::tiff48_writer()
+  : tiff_out(NULL), width(0), height(0), min_val(0.0), max_val(0.0),
+    dither(false), seed(0), next_row(0), strip_writer(NULL), tpool(NULL)
+{
+}
 
-		if ( dither == false ) {
-		    if ( min_val == 0.0 && max_val == 65535.0 ) {
-			for ( j=0, jj=ch ; j < width ; j++, jj+=3 ) {
-			    v = rgb_img_in_ptr[pix_offset+j];
-			    strip_buf_ptr[jj] = (uint16_t)(v + 0.5);
-			}
-		    }
-		    else {
-			for ( j=0, jj=ch ; j < width ; j++, jj+=3 ) {
-			    v = ((rgb_img_in_ptr[pix_offset+j] - min_val)/range) * 65535.0;
-			    strip_buf_ptr[jj] = (uint16_t)(v + 0.5);
-			}
-		    }
-		}
-		else {
-		    uint16_t v1;
-		    for ( j=0, jj=ch ; j < width ; j++, jj+=3 ) {
-			v = ((rgb_img_in_ptr[pix_offset+j] - min_val)/range) * 65535.0;
-			v1 = (uint16_t)v;
-			if ( v1 < 65535 && genrand_real2() < v - floor(v) ) v1 ++;
-			strip_buf_ptr[jj] = v1;
-		    }
-		}
-	    }
-	    
-	    if ( TIFFWriteEncodedStrip(tiff_out, i, strip_buf_ptr,
-				       width * byps * spp) == 0 ) {
-		sio.eprintf("[ERROR] TIFFWriteEncodedStrip() failed\n");
-		goto quit;
-	    }
+tiff48_writer::~tiff48_writer()
+{
+    if ( this->strip_writer != NULL ) {
+	delete (tiff_strip_writer *)(this->strip_writer);
+	this->strip_writer = NULL;
+    }
+    if ( this->tpool != NULL ) {
+	delete (thread_pool *)(this->tpool);
+	this->tpool = NULL;
+    }
+    if ( this->tiff_out != NULL ) {
+	TIFFClose((TIFF *)(this->tiff_out));
+	this->tiff_out = NULL;
+    }
+}
 
-	    pix_offset += width;
-	}
+int tiff48_writer::open( const char *filename_out,
+			 size_t width, size_t height,
+			 const mdarray_uchar &icc_buf_in,
+			 double min_val, double max_val, bool dither )
+{
+    stdstreamio sio;
+    TIFF *tiff_out;
+    tiff_strip_writer *strip_writer;
+    thread_pool *tpool;
+    uint32 icc_prof_size;
+
+    if ( filename_out == NULL ) return -1;
+    if ( this->tiff_out != NULL ) return -1;
+    if ( width == 0 || height == 0 ) return -1;
+
+    tiff_out = TIFFOpen(filename_out, "w");
+    if ( tiff_out == NULL ) {
+	sio.eprintf("[ERROR] TIFFOpen() failed\n");
+	return -1;
     }
 
-    
-    ret_status = 0;
- quit:
-    if ( tiff_out != NULL ) {
+    TIFFSetField(tiff_out, TIFFTAG_IMAGEWIDTH, (uint32)width);
+    TIFFSetField(tiff_out, TIFFTAG_IMAGELENGTH, (uint32)height);
+
+    TIFFSetField(tiff_out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tiff_out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    TIFFSetField(tiff_out, TIFFTAG_BITSPERSAMPLE, (uint16)16);
+    TIFFSetField(tiff_out, TIFFTAG_SAMPLESPERPIXEL, (uint16)3);
+    TIFFSetField(tiff_out, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+
+    if ( 0 < icc_buf_in.length() ) {
+	icc_prof_size = icc_buf_in.length();
+	TIFFSetField(tiff_out, TIFFTAG_ICCPROFILE,
+		     icc_prof_size, icc_buf_in.data_ptr());
+    }
+
+    /* threads for quantization and encoding (see save_float_to_tiff48) */
+    tpool = new thread_pool;
+    tpool->start(get_number_of_cpus());
+    strip_writer = new tiff_strip_writer;
+    if ( strip_writer->attach(tiff_out, tpool) < 0 ) {
+	delete strip_writer;
+	delete tpool;
 	TIFFClose(tiff_out);
+	return -1;
+    }
+
+    this->tiff_out = tiff_out;
+    this->strip_writer = strip_writer;
+    this->tpool = tpool;
+    this->width = width;
+    this->height = height;
+    this->min_val = min_val;
+    this->max_val = max_val;
+    this->dither = dither;
+    this->seed = get_dither_seed(filename_out);
+    this->next_row = 0;
+
+    return 0;
+}
+
+int tiff48_writer::write_rows( const mdarray_float &img_buf, size_t n_rows )
+{
+    if ( this->tiff_out == NULL ) return -1;
+    if ( img_buf.x_length() != this->width ) return -1;
+    if ( img_buf.y_length() < n_rows ) return -1;
+    if ( img_buf.z_length() < 3 ) return -1;
+    if ( this->height < this->next_row + n_rows ) return -1;
+    if ( n_rows == 0 ) return 0;
+
+    {
+	const float *const rgb_img_in_ptr[3] = {
+	    img_buf.array_ptr_cs(0,0,0),
+	    img_buf.array_ptr_cs(0,0,1),
+	    img_buf.array_ptr_cs(0,0,2)
+	};
+	const uint32_t rnd_seed = this->seed;
+	if ( write_u16_rgb_strips((tiff_strip_writer *)(this->strip_writer),
+				  (thread_pool *)(this->tpool),
+				  rgb_img_in_ptr, this->width, n_rows,
+				  this->min_val, this->max_val, this->dither,
+				  rnd_seed, this->next_row) < 0 ) {
+	    return -1;
+	}
+    }
+    this->next_row += n_rows;
+
+    return 0;
+}
+
+int tiff48_writer::close()
+{
+    int ret_status = 0;
+
+    if ( this->tiff_out == NULL ) return 0;
+    if ( this->next_row != this->height ) ret_status = -1;
+
+    if ( ((tiff_strip_writer *)(this->strip_writer))->flush() < 0 ) {
+	ret_status = -1;
     }
+    delete (tiff_strip_writer *)(this->strip_writer);
+    this->strip_writer = NULL;
+    delete (thread_pool *)(this->tpool);
+    this->tpool = NULL;
+
+    TIFFClose((TIFF *)(this->tiff_out));
+    this->tiff_out = NULL;
 
     return ret_status;
 }
@@ -1355,9 +2450,10 @@ int save_float_to_tiff24or48( const mdarray_float &img_buf_in,
 
     /* TIFF: See http://www.libtiff.org/man/TIFFGetField.3t.html */
     TIFF *tiff_out = NULL;
+    tiff_strip_writer strip_writer;
+    thread_pool tpool;
     uint16 bps, byps, spp;
     uint32 width, height, icc_prof_size;
-    size_t i;
     uint32_t rnd_seed = 0;
 
     int ret_status = -1;
@@ -1379,14 +2475,7 @@ int save_float_to_tiff24or48( const mdarray_float &img_buf_in,
     height = img_buf_in.y_length();
 
     /* set random seed */
-    i = 0;
-    while ( filename_out[i] != '\0' ) {
-	rnd_seed += (uint32_t)(filename_out[i]) << (rnd_seed % 25);
-	rnd_seed -= (uint32_t)(filename_out[i]) << (rnd_seed % 19);
-	rnd_seed += (uint32_t)(filename_out[i]) << (rnd_seed % 11);
-	rnd_seed -= (uint32_t)(filename_out[i]) << (rnd_seed % 5);
-	i++;
-    }
+    rnd_seed = get_dither_seed(filename_out);
     init_genrand(rnd_seed);
 
     //sio.eprintf("seed=%u\n", (unsigned int)rnd_seed);
@@ -1400,14 +2489,11 @@ int save_float_to_tiff24or48( const mdarray_float &img_buf_in,
     TIFFSetField(tiff_out, TIFFTAG_IMAGEWIDTH, width);
     TIFFSetField(tiff_out, TIFFTAG_IMAGELENGTH, height);
 
-    TIFFSetField(tiff_out, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
-    //TIFFSetField(tiff_out, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
     TIFFSetField(tiff_out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
     TIFFSetField(tiff_out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
     TIFFSetField(tiff_out, TIFFTAG_BITSPERSAMPLE, bps);
     TIFFSetField(tiff_out, TIFFTAG_SAMPLESPERPIXEL, spp);
     TIFFSetField(tiff_out, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
-    TIFFSetField(tiff_out, TIFFTAG_ROWSPERSTRIP, (uint32)1);
 
     if ( camera_calibration1 != NULL ) {
 	TIFFSetField(tiff_out, TIFFTAG_CAMERACALIBRATION1, 12, camera_calibration1);
@@ -1419,58 +2505,24 @@ int save_float_to_tiff24or48( const mdarray_float &img_buf_in,
 		     icc_prof_size, icc_buf_in.data_ptr());
     }
 
-    if ( byps == 2 ) {			/* 16-bit */
-
-	mdarray_uchar strip_buf(false);
-	uint16_t *strip_buf_ptr;
-
-	const float *rgb_img_in_ptr;
-
-	size_t pix_offset;
-
-	strip_buf.resize_1d(byps * spp * width);
-	strip_buf_ptr = (uint16_t *)strip_buf.data_ptr();
-
-	pix_offset = 0;
-	for ( i=0 ; i < height ; i++ ) {
-	    size_t j, jj, ch;
-	    double v;
-
-	    for ( ch=0 ; ch < 3 ; ch++ ) {
-		/* get ptr of each ch */
-		rgb_img_in_ptr = (const float *)img_buf_in.data_ptr_cs(0,0,ch);
+    /* threads for quantization and encoding of 16-bit strips */
+    if ( byps == 2 ) {
+	tpool.start(get_number_of_cpus());
+	if ( strip_writer.attach(tiff_out, &tpool) < 0 ) goto quit;
+    }
+    else if ( strip_writer.attach(tiff_out) < 0 ) goto quit;
 
-		if ( dither == false ) {
-		    if ( min_val == 0.0 && max_val == 65535.0 ) {
-			for ( j=0, jj=ch ; j < width ; j++, jj+=3 ) {
-			    v = rgb_img_in_ptr[pix_offset+j];
-			    strip_buf_ptr[jj] = (uint16_t)(v + 0.5);
-			}
-		    }
-		    else {
-			for ( j=0, jj=ch ; j < width ; j++, jj+=3 ) {
-			    v = ((rgb_img_in_ptr[pix_offset+j] - min_val)/range) * 65535.0;
-			    strip_buf_ptr[jj] = (uint16_t)(v + 0.5);
-			}
-		    }
-		} else {
-		    uint16_t v1;
-		    for ( j=0, jj=ch ; j < width ; j++, jj+=3 ) {
-			v = ((rgb_img_in_ptr[pix_offset+j] - min_val)/range) * 65535.0;
-			v1 = (uint16_t)v;
-			if ( v1 < 65535 && genrand_real2() < v - floor(v) ) v1 ++;
-			strip_buf_ptr[jj] = v1;
-		    }
-		}
-	    }
-	    
-	    if ( TIFFWriteEncodedStrip(tiff_out, i, strip_buf_ptr,
-				       width * byps * spp) == 0 ) {
-		sio.eprintf("[ERROR] TIFFWriteEncodedStrip() failed\n");
-		goto quit;
-	    }
+    if ( byps == 2 ) {			/* 16-bit */
 
-	    pix_offset += width;
+	const float *const rgb_img_in_ptr[3] = {
+	    img_buf_in.array_ptr_cs(0,0,0),
+	    img_buf_in.array_ptr_cs(0,0,1),
+	    img_buf_in.array_ptr_cs(0,0,2)
+	};
+	if ( write_u16_rgb_strips(&strip_writer, &tpool, rgb_img_in_ptr,
+				  width, height, min_val, max_val,
+				  dither, rnd_seed, 0) < 0 ) {
+	    goto quit;
 	}
 
     }
@@ -1521,11 +2573,7 @@ int save_float_to_tiff24or48( const mdarray_float &img_buf_in,
 		}
 	    }
 	    
-	    if ( TIFFWriteEncodedStrip(tiff_out, i, strip_buf_ptr,
-				       width * byps * spp) == 0 ) {
-		sio.eprintf("[ERROR] TIFFWriteEncodedStrip() failed\n");
-		goto quit;
-	    }
+	    if ( strip_writer.write_row(strip_buf_ptr) < 0 ) goto quit;
 
 	    pix_offset += width;
 	}
@@ -1536,6 +2584,8 @@ int save_float_to_tiff24or48( const mdarray_float &img_buf_in,
     }
     
     
+    if ( strip_writer.flush() < 0 ) goto quit;
+
     ret_status = 0;
  quit:
     if ( tiff_out != NULL ) {
@@ -1544,3 +2594,37 @@ int save_float_to_tiff24or48( const mdarray_float &img_buf_in,
 
     return ret_status;
 }
+
+int save_stacked_image( const char *ref_filename, const char *appended_str,
+			const mdarray_float &img_buf,
+			const mdarray_uchar &icc_buf, bool flag_dither )
+{
+    stdstreamio sio;
+    tstring out_filename;
+    int ret_status = -1;
+
+    /* save using float */
+    make_tiff_filename(ref_filename, appended_str, "float", &out_filename);
+    sio.printf("Writing '%s' ...\n", out_filename.cstr());
+    if ( save_float_to_tiff(img_buf, icc_buf, NULL, 
+			    65536.0, out_filename.cstr()) < 0 ) {
+	sio.eprintf("[ERROR] save_float_to_tiff() failed.\n");
+	goto quit;
+    }
+    
+    /* save using 16-bit */
+    make_tiff_filename(ref_filename, appended_str, "16bit", &out_filename);
+    sio.printf("Writing '%s' ", out_filename.cstr());
+    if ( flag_dither == true ) sio.printf("using dither ...\n");
+    else sio.printf("NOT using dither ...\n");
+    sio.printf("[INFO] scale will be changed\n");
+    if ( save_float_to_tiff48(img_buf, icc_buf, NULL,
+			    0.0, 0.0, flag_dither, out_filename.cstr()) < 0 ) {
+	sio.eprintf("[ERROR] save_float_to_tiff48() failed.\n");
+	goto quit;
+    }
+
+    ret_status = 0;
+ quit:
+    return ret_status;
+}
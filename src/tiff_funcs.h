@@ -21,12 +21,61 @@ int load_tiff_into_float( const char *filename_in, double scale,
 			  sli::mdarray_uchar *ret_icc_buf,
 			  float camera_calibration1_ret[] );
 
+/* load rows [y_begin, y_begin+n_rows) into width x n_rows x 3 buffer */
+/* (n_rows < 0: until the bottom; rows outside of image are 0)         */
+int load_tiff_rows_into_float( const char *filename_in, double scale,
+			       long y_begin, long n_rows,
+			       sli::mdarray_float *ret_img_buf, int *ret_sztype,
+			       sli::mdarray_uchar *ret_icc_buf,
+			       float camera_calibration1_ret[],
+			       size_t *ret_width, size_t *ret_height );
+
+/* channels of load_tiff_region_into_float() */
+#define TIFF_CH_R 1
+#define TIFF_CH_G 2
+#define TIFF_CH_B 4
+#define TIFF_CH_RGB (TIFF_CH_R | TIFF_CH_G | TIFF_CH_B)
+
+/* load region [x_begin, x_begin+n_cols) x [y_begin, y_begin+n_rows) of */
+/* channels in ch_mask (TIFF_CH_*) into n_cols x n_rows x n_ch buffer,  */
+/* where n_ch is number of selected channels (in order of R,G,B).       */
+/* (n_cols or n_rows < 0: until the edge; pixels outside of image are 0) */
+/* Only strips (or tiles) of the region are read.  Grey images give    */
+/* the same values for all channels.                                   */
+int load_tiff_region_into_float( const char *filename_in, double scale,
+				 long x_begin, long n_cols,
+				 long y_begin, long n_rows, int ch_mask,
+				 sli::mdarray_float *ret_img_buf,
+				 int *ret_sztype,
+				 sli::mdarray_uchar *ret_icc_buf,
+				 float camera_calibration1_ret[],
+				 size_t *ret_width, size_t *ret_height );
+
 int load_tiff_into_separate_buffer( const char *filename_in,
 	sli::mdarray *ret_img_r_buf, sli::mdarray *ret_img_g_buf,
 	sli::mdarray *ret_img_b_buf,
 	int *ret_sztype, sli::mdarray_uchar *ret_icc_buf,
 	float camera_calibration1_ret[] );
 
+/* compression of files written by save_*() and float_tiff_writer */
+#define TIFF_COMPRESS_NONE 0
+#define TIFF_COMPRESS_DEFLATE 1
+#define TIFF_COMPRESS_ZSTD 2
+
+/* "none", "deflate" or "zstd" */
+int parse_tiff_compression( const char *str, int *ret_method );
+
+/* select compression of output files (default: TIFF_COMPRESS_NONE).   */
+/* Compressed files use horizontal (integer) or floating point          */
+/* predictor, and their strips are encoded by all CPUs.  Returns -1     */
+/* when libtiff does not support the method.                           */
+int set_tiff_compression( int method );
+
+/* write tiles of tile_size x tile_size instead of strips (0: strips;  */
+/* default).  tile_size has to be a multiple of 16.  All load_*()      */
+/* functions read tiled files, and regions are decoded tile by tile.   */
+int set_tiff_tiling( size_t tile_size );
+
 int save_tiff( const sli::mdarray &img_buf_in, int sztype,
 	       const sli::mdarray_uchar &icc_buf_in,
 	       const float camera_calibration1[],	/* [12] */
@@ -38,6 +87,43 @@ int save_float_to_tiff( const sli::mdarray &img_buf_in,
 			double scale,
 			const char *filename_out );
 
+/*
+ * Float TIFF written row by row, for images too large to be held in
+ * memory (e.g. drizzle output).  n_ch is 1 (grey) or 3 (RGB), and
+ * values are divided by scale as save_float_to_tiff().
+ */
+class float_tiff_writer {
+
+  public:
+    float_tiff_writer();
+    ~float_tiff_writer();
+
+    int open( const char *filename_out, size_t width, size_t height,
+	      size_t n_ch, const sli::mdarray_uchar &icc_buf_in,
+	      double scale );
+
+    /* append first n_rows rows of width x n_rows x n_ch buffer */
+    int write_rows( const sli::mdarray_float &img_buf, size_t n_rows );
+
+    /* returns error if not all rows are written */
+    int close();
+
+  private:
+    void *tiff_out;			/* TIFF * */
+    size_t width;
+    size_t height;
+    size_t n_ch;
+    double scale;
+    size_t next_row;
+    sli::mdarray_float strip_buf;
+    void *strip_writer;
+
+    /* disable copy */
+    float_tiff_writer( const float_tiff_writer & );
+    float_tiff_writer &operator=( const float_tiff_writer & );
+
+};
+
 int save_float_to_tiff48( const sli::mdarray &img_buf_in,
 			  const sli::mdarray_uchar &icc_buf_in,
 			  const float camera_calibration1[],
@@ -45,6 +131,45 @@ int save_float_to_tiff48( const sli::mdarray &img_buf_in,
 			  bool dither,
 			  const char *filename_out );
 
+/*
+ * 16-bit RGB TIFF written row by row (see float_tiff_writer).  Values
+ * in [min_val, max_val] are scaled to 0..65535, and the file is the same
+ * as save_float_to_tiff48() of the whole image.
+ */
+class tiff48_writer {
+
+  public:
+    tiff48_writer();
+    ~tiff48_writer();
+
+    int open( const char *filename_out, size_t width, size_t height,
+	      const sli::mdarray_uchar &icc_buf_in,
+	      double min_val, double max_val, bool dither );
+
+    /* append first n_rows rows of width x n_rows x 3 buffer */
+    int write_rows( const sli::mdarray_float &img_buf, size_t n_rows );
+
+    /* returns error if not all rows are written */
+    int close();
+
+  private:
+    void *tiff_out;			/* TIFF * */
+    size_t width;
+    size_t height;
+    double min_val;
+    double max_val;
+    bool dither;
+    unsigned long seed;
+    size_t next_row;
+    void *strip_writer;
+    void *tpool;			/* thread_pool * */
+
+    /* disable copy */
+    tiff48_writer( const tiff48_writer & );
+    tiff48_writer &operator=( const tiff48_writer & );
+
+};
+
 int save_float_to_tiff24or48( const sli::mdarray_float &img_buf_in,
 			      const sli::mdarray_uchar &icc_buf_in,
 			      const float camera_calibration1[],     /* [12] */
@@ -52,6 +177,15 @@ int save_float_to_tiff24or48( const sli::mdarray_float &img_buf_in,
 			      bool dither,
 			      const char *filename_out );
 
+/*
+ * Save averaged image of stacking as float and 16-bit TIFF (scale is
+ * changed) named by make_tiff_filename(ref_filename, appended_str, ...).
+ * Used by stack_images and merge_stacks.
+ */
+int save_stacked_image( const char *ref_filename, const char *appended_str,
+			const sli::mdarray_float &img_buf,
+			const sli::mdarray_uchar &icc_buf, bool flag_dither );
+
 const unsigned char Icc_srgb_profile[] = {
 0x00,0x00,0x0c,0x48,0x4c,0x69,0x6e,0x6f,
 0x02,0x10,0x00,0x00,0x6d,0x6e,0x74,0x72,
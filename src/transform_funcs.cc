@@ -0,0 +1,158 @@
+#include <math.h>
+
+#include "transform_funcs.h"
+
+/* determinant of singular transform or normal equations */
+static const double Min_determinant = 1.0e-12;
+
+void set_translation_transform( double offset_x, double offset_y,
+				frame_transform *ret_tr )
+{
+    ret_tr->m[0] = 1.0;  ret_tr->m[1] = 0.0;  ret_tr->m[2] = offset_x;
+    ret_tr->m[3] = 0.0;  ret_tr->m[4] = 1.0;  ret_tr->m[5] = offset_y;
+    return;
+}
+
+void apply_transform( const frame_transform &tr, double x, double y,
+		      double *ret_x, double *ret_y )
+{
+    *ret_x = tr.m[0] * x + tr.m[1] * y + tr.m[2];
+    *ret_y = tr.m[3] * x + tr.m[4] * y + tr.m[5];
+    return;
+}
+
+int invert_transform( const frame_transform &tr, frame_transform *ret_tr )
+{
+    const double det = tr.m[0] * tr.m[4] - tr.m[1] * tr.m[3];
+    frame_transform inv;
+
+    if ( fabs(det) < Min_determinant ) return -1;
+
+    inv.m[0] = tr.m[4] / det;
+    inv.m[1] = - tr.m[1] / det;
+    inv.m[3] = - tr.m[3] / det;
+    inv.m[4] = tr.m[0] / det;
+    inv.m[2] = - (inv.m[0] * tr.m[2] + inv.m[1] * tr.m[5]);
+    inv.m[5] = - (inv.m[3] * tr.m[2] + inv.m[4] * tr.m[5]);
+
+    *ret_tr = inv;
+    return 0;
+}
+
+void get_transform_center_offset( const frame_transform &tr,
+				  size_t width, size_t height,
+				  double *ret_offset_x, double *ret_offset_y )
+{
+    const double cx = 0.5 * (width - 1.0);
+    const double cy = 0.5 * (height - 1.0);
+    double tx, ty;
+    apply_transform(tr, cx, cy, &tx, &ty);
+    *ret_offset_x = tx - cx;
+    *ret_offset_y = ty - cy;
+    return;
+}
+
+double get_transform_deviation( const frame_transform &tr,
+				size_t width, size_t height )
+{
+    const double cx = 0.5 * (width - 1.0);
+    const double cy = 0.5 * (height - 1.0);
+    double ret = 0.0;
+    int i;
+
+    /* linear part relative to the center is largest at corners */
+    for ( i=0 ; i < 4 ; i++ ) {
+	const double dx = ((i & 1) == 0) ? -cx : cx;
+	const double dy = ((i & 2) == 0) ? -cy : cy;
+	const double ex = (tr.m[0] - 1.0) * dx + tr.m[1] * dy;
+	const double ey = tr.m[3] * dx + (tr.m[4] - 1.0) * dy;
+	const double d = sqrt(ex * ex + ey * ey);
+	if ( ret < d ) ret = d;
+    }
+
+    return ret;
+}
+
+/* solve a[n*n] v = b[n] by Gaussian elimination with partial pivoting */
+static int solve_linear( double a[], double b[], int n, double ret_v[] )
+{
+    int i, j, k;
+
+    for ( k=0 ; k < n ; k++ ) {
+	int p = k;
+	for ( i=k+1 ; i < n ; i++ ) {
+	    if ( fabs(a[n * p + k]) < fabs(a[n * i + k]) ) p = i;
+	}
+	if ( fabs(a[n * p + k]) < Min_determinant ) return -1;
+	if ( p != k ) {
+	    double t;
+	    for ( j=0 ; j < n ; j++ ) {
+		t = a[n * k + j]; a[n * k + j] = a[n * p + j]; a[n * p + j] = t;
+	    }
+	    t = b[k]; b[k] = b[p]; b[p] = t;
+	}
+	for ( i=k+1 ; i < n ; i++ ) {
+	    const double f = a[n * i + k] / a[n * k + k];
+	    for ( j=k ; j < n ; j++ ) a[n * i + j] -= f * a[n * k + j];
+	    b[i] -= f * b[k];
+	}
+    }
+    for ( k=n-1 ; 0 <= k ; k-- ) {
+	double s = b[k];
+	for ( j=k+1 ; j < n ; j++ ) s -= a[n * k + j] * ret_v[j];
+	ret_v[k] = s / a[n * k + k];
+    }
+
+    return 0;
+}
+
+int fit_transform( const double x[], const double y[],
+		   const double X[], const double Y[], size_t n,
+		   bool affine, frame_transform *ret_tr )
+{
+    frame_transform tr;
+    size_t i;
+
+    if ( affine == true ) {
+	/* X = m0 x + m1 y + m2, Y = m3 x + m4 y + m5 */
+	double a[9] = {0,0,0, 0,0,0, 0,0,0};
+	double a1[9], bx[3] = {0,0,0}, by[3] = {0,0,0};
+	if ( n < 3 ) return -1;
+	for ( i=0 ; i < n ; i++ ) {
+	    const double v[3] = {x[i], y[i], 1.0};
+	    int j, k;
+	    for ( j=0 ; j < 3 ; j++ ) {
+		for ( k=0 ; k < 3 ; k++ ) a[3 * j + k] += v[j] * v[k];
+		bx[j] += v[j] * X[i];
+		by[j] += v[j] * Y[i];
+	    }
+	}
+	for ( i=0 ; i < 9 ; i++ ) a1[i] = a[i];
+	if ( solve_linear(a, bx, 3, tr.m) < 0 ) return -1;
+	if ( solve_linear(a1, by, 3, tr.m + 3) < 0 ) return -1;
+    }
+    else {
+	/* X = a x - b y + c, Y = b x + a y + d */
+	double a[16] = {0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,0};
+	double b[4] = {0,0,0,0};
+	double v[4];
+	if ( n < 2 ) return -1;
+	for ( i=0 ; i < n ; i++ ) {
+	    const double r0[4] = {x[i], -y[i], 1.0, 0.0};	/* for X */
+	    const double r1[4] = {y[i], x[i], 0.0, 1.0};	/* for Y */
+	    int j, k;
+	    for ( j=0 ; j < 4 ; j++ ) {
+		for ( k=0 ; k < 4 ; k++ ) {
+		    a[4 * j + k] += r0[j] * r0[k] + r1[j] * r1[k];
+		}
+		b[j] += r0[j] * X[i] + r1[j] * Y[i];
+	    }
+	}
+	if ( solve_linear(a, b, 4, v) < 0 ) return -1;
+	tr.m[0] = v[0];  tr.m[1] = - v[1];  tr.m[2] = v[2];
+	tr.m[3] = v[1];  tr.m[4] = v[0];    tr.m[5] = v[3];
+    }
+
+    *ret_tr = tr;
+    return 0;
+}
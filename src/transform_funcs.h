@@ -0,0 +1,41 @@
+#ifndef _TRANSFORM_FUNCS_H
+#define _TRANSFORM_FUNCS_H 1
+
+#include <unistd.h>
+
+/*
+ * Affine transform of frame coordinates (x,y) to the reference (X,Y):
+ *   X = m[0] * x + m[1] * y + m[2]
+ *   Y = m[3] * x + m[4] * y + m[5]
+ * A translation is the same as offsets of .offset.txt (m[2], m[5]).
+ */
+typedef struct _frame_transform {
+    double m[6];
+} frame_transform;
+
+void set_translation_transform( double offset_x, double offset_y,
+				frame_transform *ret_tr );
+
+void apply_transform( const frame_transform &tr, double x, double y,
+		      double *ret_x, double *ret_y );
+
+int invert_transform( const frame_transform &tr, frame_transform *ret_tr );
+
+/* translation of the center of a width x height frame */
+void get_transform_center_offset( const frame_transform &tr,
+				  size_t width, size_t height,
+				  double *ret_offset_x, double *ret_offset_y );
+
+/* max difference (pixels) between tr and translation of the center */
+/* within a width x height frame                                    */
+double get_transform_deviation( const frame_transform &tr,
+				size_t width, size_t height );
+
+/* least-squares fit of (x[i],y[i]) -> (X[i],Y[i]), i < n           */
+/* similarity (rotation, scale and translation: n >= 2) or affine  */
+/* (n >= 3)                                                         */
+int fit_transform( const double x[], const double y[],
+		   const double X[], const double Y[], size_t n,
+		   bool affine, frame_transform *ret_tr );
+
+#endif	/* _TRANSFORM_FUNCS_H */
@@ -12,6 +12,7 @@
 
 #include "file_io.h"
 #include "tiff_funcs.h"
+#include "frame_stats.h"
 #include "display_image.h"
 #include "gui_base.h"
 #include "loupe_funcs.h"
@@ -1017,7 +1018,19 @@ int main( int argc, char *argv[] )
 		mdarray tmpim(img_buf.size_type(),false);
 		tstring log;
 		size_t ch;
+		frame_stats stats;
+		bool flag_stats = false;
+		double stats_scale = 1.0;	/* to scale of load_tiff() */
 		tmpim.resize_2d(img_buf.x_length(), img_buf.y_length());
+		/* median, min and max are taken from sidecar when exists */
+		if ( sel_file_modified_psf == false &&
+		     load_frame_stats(filenames[sel_file_id].cstr(),
+				      &stats) == 0 ) {
+		    flag_stats = true;
+		    if ( tiff_szt == 1 ) stats_scale = 1.0 / 256.0;
+		    else if ( tiff_szt == 2 ) stats_scale = 1.0;
+		    else stats_scale = 1.0 / 65536.0;
+		}
 		sio.printf("*** Image Statistics ***\n");
 		sio.printf("bps     = %d\n",tiff_szt);
 		sio.printf("width   = %zu\n",img_buf.x_length());
@@ -1030,15 +1043,24 @@ int main( int argc, char *argv[] )
 			  0, img_buf.x_length(), 0, img_buf.y_length(), ch, 1);
 		    imstat_rec.total[ch] = md_total(tmpim);
 		    sio.printf("total   = %g\n",imstat_rec.total[ch]);
-		    imstat_rec.median[ch] = md_median(tmpim);
+		    if ( flag_stats == true ) {
+			imstat_rec.median[ch] = stats.median[ch] * stats_scale;
+		    }
+		    else imstat_rec.median[ch] = md_median(tmpim);
 		    sio.printf("median  = %g\n",imstat_rec.median[ch]);
 		    imstat_rec.mean[ch] = md_mean(tmpim);
 		    sio.printf("mean    = %g\n",imstat_rec.mean[ch]);
 		    imstat_rec.stddev[ch] = md_stddev(tmpim);
 		    sio.printf("stddev  = %g\n",imstat_rec.stddev[ch]);
-		    imstat_rec.min[ch] = md_min(tmpim);
+		    if ( flag_stats == true ) {
+			imstat_rec.min[ch] = stats.min[ch] * stats_scale;
+		    }
+		    else imstat_rec.min[ch] = md_min(tmpim);
 		    sio.printf("min     = %g\n",imstat_rec.min[ch]);
-		    imstat_rec.max[ch] = md_max(tmpim);
+		    if ( flag_stats == true ) {
+			imstat_rec.max[ch] = stats.max[ch] * stats_scale;
+		    }
+		    else imstat_rec.max[ch] = md_max(tmpim);
 		    sio.printf("max     = %g\n",imstat_rec.max[ch]);
 		}
 		sio.printf("-------------------------\n");
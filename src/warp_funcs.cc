@@ -0,0 +1,442 @@
+#include <math.h>
+#include <string.h>
+
+#include "warp_funcs.h"
+
+#include "test_simd.h"
+
+#if defined(_AVX2_DISPATCH_IS_OK)
+#include <immintrin.h>
+#endif
+
+using namespace sli;
+
+/* phases of a pixel in tables of weights (affine transform) */
+static const int Warp_phases = 256;
+/* fractions smaller than this are treated as 0 (no interpolation) */
+static const double Min_warp_fraction = 1.0e-6;
+/* range of results when rounded (8/16-bit frames) */
+static const float Max_rounded_value = 65535.0;
+
+int parse_warp_kernel( const char *str, int *ret_kernel )
+{
+    if ( str == NULL || ret_kernel == NULL ) return -1;
+    if ( strcmp(str, "none") == 0 ) *ret_kernel = WARP_NONE;
+    else if ( strcmp(str, "bilinear") == 0 ) *ret_kernel = WARP_BILINEAR;
+    else if ( strcmp(str, "bicubic") == 0 ) *ret_kernel = WARP_BICUBIC;
+    else if ( strcmp(str, "lanczos3") == 0 ) *ret_kernel = WARP_LANCZOS3;
+    else return -1;
+    return 0;
+}
+
+const char *get_warp_kernel_name( int kernel )
+{
+    if ( kernel == WARP_BILINEAR ) return "bilinear";
+    else if ( kernel == WARP_BICUBIC ) return "bicubic";
+    else if ( kernel == WARP_LANCZOS3 ) return "lanczos3";
+    else return "none";
+}
+
+static int get_kernel_taps( int kernel )
+{
+    if ( kernel == WARP_BILINEAR ) return 2;
+    else if ( kernel == WARP_BICUBIC ) return 4;
+    else if ( kernel == WARP_LANCZOS3 ) return 6;
+    else return 1;
+}
+
+/* value of kernel at distance d (>= 0) */
+static double get_kernel_value( int kernel, double d )
+{
+    if ( kernel == WARP_BILINEAR ) {
+	return (d < 1.0) ? 1.0 - d : 0.0;
+    }
+    else if ( kernel == WARP_BICUBIC ) {
+	const double a = -0.5;
+	if ( d < 1.0 ) return ((a + 2.0) * d - (a + 3.0)) * d * d + 1.0;
+	if ( d < 2.0 ) return ((a * d - 5.0 * a) * d + 8.0 * a) * d - 4.0 * a;
+	return 0.0;
+    }
+    else if ( kernel == WARP_LANCZOS3 ) {
+	if ( d < 1.0e-12 ) return 1.0;
+	if ( d < 3.0 ) {
+	    const double x = M_PI * d;
+	    return 3.0 * sin(x) * sin(x / 3.0) / (x * x);
+	}
+	return 0.0;
+    }
+    return (d < 0.5) ? 1.0 : 0.0;
+}
+
+/* first tap is at (integer part + get_first_tap()) */
+static int get_first_tap( int n_taps )
+{
+    return - ((n_taps - 1) / 2);
+}
+
+/* normalized weights for fraction f (0 <= f < 1) */
+static void get_kernel_weights( int kernel, int n_taps, double f,
+				float ret_w[] )
+{
+    const int first = get_first_tap(n_taps);
+    double w[MAX_WARP_TAPS];
+    double sum = 0.0;
+    int k;
+    for ( k=0 ; k < n_taps ; k++ ) {
+	w[k] = get_kernel_value(kernel, fabs((first + k) - f));
+	sum += w[k];
+    }
+    for ( k=0 ; k < n_taps ; k++ ) ret_w[k] = w[k] / sum;
+    return;
+}
+
+/* tables of weights for phases (initialized in main thread) */
+static float Phase_weights[4][Warp_phases + 1][MAX_WARP_TAPS];
+static bool Phase_weights_ok[4] = {false, false, false, false};
+
+static const float *get_phase_weights( int kernel )
+{
+    int i;
+    if ( Phase_weights_ok[kernel] == false ) {
+	for ( i=0 ; i <= Warp_phases ; i++ ) {
+	    get_kernel_weights(kernel, get_kernel_taps(kernel),
+			       i / (double)Warp_phases,
+			       Phase_weights[kernel][i]);
+	}
+	Phase_weights_ok[kernel] = true;
+    }
+    return &(Phase_weights[kernel][0][0]);
+}
+
+
+/*
+ * Weighted sum of rows:
+ *   dst[i] = w[0]*src[0][i] + w[1]*src[1][i] + ... (in this order)
+ * and rounding to 0..65535 when rounded is true.  The SIMD version uses
+ * the same single-precision operations, so that the results are
+ * identical.  (Do not enable FP contraction: see Makefile.)
+ */
+typedef void (*weighted_sum_func_t)( const float *const src[],
+				     const float w[], int n_taps,
+				     size_t n, bool rounded, float *dst );
+
+static inline float round_value( float v )
+{
+    v = floorf(v + (float)0.5);
+    if ( v < (float)0.0 ) v = 0.0;
+    if ( Max_rounded_value < v ) v = Max_rounded_value;
+    return v;
+}
+
+static void weighted_sum_scalar( const float *const src[], const float w[],
+				 int n_taps, size_t n, bool rounded,
+				 float *dst )
+{
+    size_t i;
+    int k;
+    for ( i=0 ; i < n ; i++ ) {
+	float v = w[0] * src[0][i];
+	for ( k=1 ; k < n_taps ; k++ ) v = v + w[k] * src[k][i];
+	if ( rounded == true ) v = round_value(v);
+	dst[i] = v;
+    }
+    return;
+}
+
+#if defined(_AVX2_DISPATCH_IS_OK)
+
+__attribute__((target("avx2")))
+static void weighted_sum_avx2( const float *const src[], const float w[],
+			       int n_taps, size_t n, bool rounded,
+			       float *dst )
+{
+    const __m256 v_half = _mm256_set1_ps(0.5);
+    const __m256 v_zero = _mm256_setzero_ps();
+    const __m256 v_max = _mm256_set1_ps(Max_rounded_value);
+    __m256 v_w[MAX_WARP_TAPS];
+    size_t i = 0;
+    int k;
+
+    for ( k=0 ; k < n_taps ; k++ ) v_w[k] = _mm256_set1_ps(w[k]);
+
+    for ( ; i + 8 <= n ; i += 8 ) {
+	__m256 v = _mm256_mul_ps(v_w[0], _mm256_loadu_ps(src[0] + i));
+	for ( k=1 ; k < n_taps ; k++ ) {
+	    v = _mm256_add_ps(v, _mm256_mul_ps(v_w[k],
+					       _mm256_loadu_ps(src[k] + i)));
+	}
+	if ( rounded == true ) {
+	    v = _mm256_floor_ps(_mm256_add_ps(v, v_half));
+	    /* max(a,b) and min(a,b) return b when either is NaN: with  */
+	    /* v as b, NaN stays NaN as round_value()                   */
+	    v = _mm256_min_ps(v_max, _mm256_max_ps(v_zero, v));
+	}
+	_mm256_storeu_ps(dst + i, v);
+    }
+
+    if ( i < n ) {
+	const float *src_rest[MAX_WARP_TAPS];
+	for ( k=0 ; k < n_taps ; k++ ) src_rest[k] = src[k] + i;
+	weighted_sum_scalar(src_rest, w, n_taps, n - i, rounded, dst + i);
+    }
+    return;
+}
+
+#endif	/* _AVX2_DISPATCH_IS_OK */
+
+static weighted_sum_func_t Weighted_sum = NULL;
+static const char *Warp_kernel_name = NULL;
+
+/* select kernels by cpuid (called from main thread) */
+static void select_warp_kernels()
+{
+    if ( Warp_kernel_name != NULL ) return;
+
+    Weighted_sum = &weighted_sum_scalar;
+    Warp_kernel_name = "scalar";
+
+#if defined(_AVX2_DISPATCH_IS_OK)
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") ) {
+	Weighted_sum = &weighted_sum_avx2;
+	Warp_kernel_name = "avx2";
+    }
+#endif
+
+    return;
+}
+
+const char *warp_simd_kernel_name()
+{
+    select_warp_kernels();
+    return Warp_kernel_name;
+}
+
+
+/*
+ * class frame_warper
+ */
+
+frame_warper::frame_warper()
+  : img_buf(NULL), kernel(WARP_NONE), rounded(false), translation(true),
+    shift_x(0), shift_y(0), frac_x(0.0), frac_y(0.0),
+    n_taps_x(1), n_taps_y(1), n_taps(1), phase_weights(NULL)
+{
+    set_translation_transform(0.0, 0.0, &(this->inv));
+    this->weight_x[0] = 1.0;
+    this->weight_y[0] = 1.0;
+}
+
+int frame_warper::init( const mdarray_float &img_buf,
+			const frame_transform &tr, int kernel, bool rounded )
+{
+    if ( img_buf.x_length() < 1 || img_buf.y_length() < 1 ) return -1;
+    if ( img_buf.z_length() != 3 ) return -1;
+    if ( invert_transform(tr, &(this->inv)) < 0 ) return -1;
+    if ( kernel < WARP_BILINEAR || WARP_LANCZOS3 < kernel ) return -1;
+
+    select_warp_kernels();
+
+    this->img_buf = &img_buf;
+    this->kernel = kernel;
+    this->rounded = rounded;
+    this->n_taps = get_kernel_taps(kernel);
+    this->phase_weights = get_phase_weights(kernel);
+
+    this->translation = ( this->inv.m[0] == 1.0 && this->inv.m[1] == 0.0 &&
+			  this->inv.m[3] == 0.0 && this->inv.m[4] == 1.0 );
+    if ( this->translation == true ) {
+	/* src = dest + inv.m[2] (or m[5]) */
+	this->shift_x = (long)floor(this->inv.m[2]);
+	this->shift_y = (long)floor(this->inv.m[5]);
+	this->frac_x = this->inv.m[2] - this->shift_x;
+	this->frac_y = this->inv.m[5] - this->shift_y;
+	/* no interpolation for an axis without fraction */
+	if ( this->frac_x < Min_warp_fraction ) {
+	    this->frac_x = 0.0;
+	    this->n_taps_x = 1;
+	    this->weight_x[0] = 1.0;
+	}
+	else {
+	    this->n_taps_x = this->n_taps;
+	    get_kernel_weights(kernel, this->n_taps, this->frac_x,
+			       this->weight_x);
+	}
+	if ( this->frac_y < Min_warp_fraction ) {
+	    this->frac_y = 0.0;
+	    this->n_taps_y = 1;
+	    this->weight_y[0] = 1.0;
+	}
+	else {
+	    this->n_taps_y = this->n_taps;
+	    get_kernel_weights(kernel, this->n_taps, this->frac_y,
+			       this->weight_y);
+	}
+    }
+
+    return 0;
+}
+
+size_t frame_warper::work_length( size_t width ) const
+{
+    return width + MAX_WARP_TAPS;
+}
+
+/* narrow [*io_lo, *io_hi] to x where 0 <= c0 + c1 * x <= len - 1 */
+static void intersect_warp_range( double c0, double c1, double len,
+				  double *io_lo, double *io_hi )
+{
+    double lo, hi;
+    if ( c1 == 0.0 ) {
+	if ( c0 < 0.0 || len - 1.0 < c0 ) *io_hi = -1.0;	/* empty */
+	return;
+    }
+    lo = (0.0 - c0) / c1;
+    hi = (len - 1.0 - c0) / c1;
+    if ( hi < lo ) {
+	double t = lo;  lo = hi;  hi = t;
+    }
+    if ( *io_lo < lo ) *io_lo = lo;
+    if ( hi < *io_hi ) *io_hi = hi;
+    return;
+}
+
+static inline long clamp_index( long i, long len )
+{
+    if ( i < 0 ) return 0;
+    if ( len <= i ) return len - 1;
+    return i;
+}
+
+bool frame_warper::get_rows( size_t width, size_t y, float *work,
+			     float *ret_rows,
+			     size_t *ret_x_begin, size_t *ret_x_end ) const
+{
+    const double *m = this->inv.m;
+    double lo = 0.0, hi = width - 1.0;
+
+    if ( this->img_buf == NULL || width == 0 ) return false;
+
+    intersect_warp_range(m[1] * y + m[2], m[0],
+			 this->img_buf->x_length(), &lo, &hi);
+    intersect_warp_range(m[4] * y + m[5], m[3],
+			 this->img_buf->y_length(), &lo, &hi);
+    if ( hi < lo ) return false;
+    *ret_x_begin = (size_t)ceil(lo);
+    *ret_x_end = (size_t)floor(hi) + 1;
+    if ( *ret_x_end <= *ret_x_begin ) return false;
+
+    if ( this->translation == true ) {
+	return this->get_rows_translation(width, y, work, ret_rows,
+					  ret_x_begin, ret_x_end);
+    }
+    else {
+	return this->get_rows_affine(width, y, ret_rows,
+				     ret_x_begin, ret_x_end);
+    }
+}
+
+bool frame_warper::get_rows_translation( size_t width, size_t y,
+					 float *work, float *ret_rows,
+					 size_t *ret_x_begin,
+					 size_t *ret_x_end ) const
+{
+    const mdarray_float &img = *(this->img_buf);
+    const long src_w = img.x_length();
+    const long src_h = img.y_length();
+    const long x_begin = *ret_x_begin;
+    const long x_end = *ret_x_end;
+    const long first_x = get_first_tap(this->n_taps_x);
+    const long first_y = get_first_tap(this->n_taps_y);
+    /* columns of source used by horizontal pass */
+    const long c_lo = x_begin + this->shift_x + first_x;
+    const long c_hi = x_end - 1 + this->shift_x + first_x + this->n_taps_x;
+    long c_lo_in = c_lo, c_hi_in = c_hi, c;
+    const long iy = (long)y + this->shift_y;
+    int ch, k;
+
+    if ( c_lo_in < 0 ) c_lo_in = 0;
+    if ( src_w < c_hi_in ) c_hi_in = src_w;
+
+    for ( ch=0 ; ch < 3 ; ch++ ) {
+	const float *src[MAX_WARP_TAPS];
+	float *dst = ret_rows + width * ch;
+
+	/* vertical pass into work[c - c_lo] */
+	for ( k=0 ; k < this->n_taps_y ; k++ ) {
+	    src[k] = img.array_ptr_cs(c_lo_in,
+				clamp_index(iy + first_y + k, src_h), ch);
+	}
+	if ( c_lo_in < c_hi_in ) {
+	    (*Weighted_sum)(src, this->weight_y, this->n_taps_y,
+			    c_hi_in - c_lo_in, false, work + (c_lo_in - c_lo));
+	}
+	/* replicate edge pixels for outer taps */
+	for ( c=c_lo ; c < c_lo_in ; c++ ) {
+	    work[c - c_lo] = work[c_lo_in - c_lo];
+	}
+	for ( c=c_hi_in ; c < c_hi ; c++ ) {
+	    work[c - c_lo] = work[c_hi_in - 1 - c_lo];
+	}
+
+	/* horizontal pass */
+	for ( k=0 ; k < this->n_taps_x ; k++ ) src[k] = work + k;
+	(*Weighted_sum)(src, this->weight_x, this->n_taps_x,
+			x_end - x_begin, this->rounded, dst + x_begin);
+    }
+
+    return true;
+}
+
+bool frame_warper::get_rows_affine( size_t width, size_t y, float *ret_rows,
+				    size_t *ret_x_begin,
+				    size_t *ret_x_end ) const
+{
+    const mdarray_float &img = *(this->img_buf);
+    const long src_w = img.x_length();
+    const long src_h = img.y_length();
+    const double *m = this->inv.m;
+    const int n_taps = this->n_taps;
+    const long first = get_first_tap(n_taps);
+    const float *base[3];
+    size_t x;
+    int ch;
+
+    for ( ch=0 ; ch < 3 ; ch++ ) base[ch] = img.array_ptr_cs(0, 0, ch);
+
+    for ( x=*ret_x_begin ; x < *ret_x_end ; x++ ) {
+	const double sx = m[0] * x + m[1] * y + m[2];
+	const double sy = m[3] * x + m[4] * y + m[5];
+	long ix = (long)floor(sx);
+	long iy = (long)floor(sy);
+	long px = (long)((sx - ix) * Warp_phases + 0.5);
+	long py = (long)((sy - iy) * Warp_phases + 0.5);
+	const float *wx, *wy;
+	long cols[MAX_WARP_TAPS], rows[MAX_WARP_TAPS];
+	int j, k;
+	/* tables have (Warp_phases + 1) phases */
+	if ( px < 0 ) px = 0;
+	if ( Warp_phases < px ) px = Warp_phases;
+	if ( py < 0 ) py = 0;
+	if ( Warp_phases < py ) py = Warp_phases;
+	wx = this->phase_weights + MAX_WARP_TAPS * px;
+	wy = this->phase_weights + MAX_WARP_TAPS * py;
+	for ( k=0 ; k < n_taps ; k++ ) {
+	    cols[k] = clamp_index(ix + first + k, src_w);
+	    rows[k] = src_w * clamp_index(iy + first + k, src_h);
+	}
+	for ( ch=0 ; ch < 3 ; ch++ ) {
+	    float v = 0.0;
+	    for ( j=0 ; j < n_taps ; j++ ) {
+		const float *p = base[ch] + rows[j];
+		float h = wx[0] * p[cols[0]];
+		for ( k=1 ; k < n_taps ; k++ ) h = h + wx[k] * p[cols[k]];
+		v = v + wy[j] * h;
+	    }
+	    if ( this->rounded == true ) v = round_value(v);
+	    ret_rows[width * ch + x] = v;
+	}
+    }
+
+    return true;
+}
@@ -0,0 +1,85 @@
+#ifndef _WARP_FUNCS_H
+#define _WARP_FUNCS_H 1
+
+#include <unistd.h>
+#include <sli/mdarray.h>
+
+#include "transform_funcs.h"
+
+/* interpolation kernels of warping */
+#define WARP_NONE 0		/* integer offsets (no interpolation) */
+#define WARP_BILINEAR 1
+#define WARP_BICUBIC 2		/* Keys (a = -0.5) */
+#define WARP_LANCZOS3 3
+
+#define MAX_WARP_TAPS 6		/* taps of a kernel in x or y */
+
+/* "none", "bilinear", "bicubic" or "lanczos3" */
+int parse_warp_kernel( const char *str, int *ret_kernel );
+const char *get_warp_kernel_name( int kernel );
+
+/*
+ * Streaming resampler of a frame for stacking: rows of the frame warped
+ * to the reference are produced one by one, without a warped copy of
+ * the frame.
+ *
+ * For a translation, the fractional offsets are the same for all pixels,
+ * so weights are computed once and rows are resampled separably
+ * (vertical then horizontal pass, SIMD when available).  For an affine
+ * transform, weights are taken from tables of quantized phases.
+ * Pixels near edges use replicated edge pixels for outer taps.
+ *
+ * Objects are copyable and get_rows() is thread safe.
+ */
+class frame_warper {
+
+  public:
+    frame_warper();
+
+    /* tr: frame -> reference; kernel: WARP_BILINEAR or higher;        */
+    /* rounded: results are rounded to integers in 0..65535 (for       */
+    /* integer accumulators)                                            */
+    int init( const sli::mdarray_float &img_buf, const frame_transform &tr,
+	      int kernel, bool rounded );
+
+    /* length of work buffer of get_rows() */
+    size_t work_length( size_t width ) const;
+
+    /* RGB of dest row y into ret_rows[width * ch + x] (valid for x in */
+    /* [*ret_x_begin, *ret_x_end)); returns false when no pixel       */
+    bool get_rows( size_t width, size_t y, float *work, float *ret_rows,
+		   size_t *ret_x_begin, size_t *ret_x_end ) const;
+
+    bool is_translation() const { return this->translation; }
+
+  private:
+    const sli::mdarray_float *img_buf;
+    int kernel;
+    bool rounded;
+    bool translation;
+    frame_transform inv;		/* reference -> frame */
+    /* translation: src = dest + shift + fraction */
+    long shift_x;
+    long shift_y;
+    double frac_x;
+    double frac_y;
+    int n_taps_x;
+    int n_taps_y;
+    float weight_x[MAX_WARP_TAPS];
+    float weight_y[MAX_WARP_TAPS];
+    /* affine */
+    int n_taps;
+    const float *phase_weights;		/* [phase][MAX_WARP_TAPS] */
+
+    bool get_rows_translation( size_t width, size_t y, float *work,
+			       float *ret_rows,
+			       size_t *ret_x_begin, size_t *ret_x_end ) const;
+    bool get_rows_affine( size_t width, size_t y, float *ret_rows,
+			  size_t *ret_x_begin, size_t *ret_x_end ) const;
+
+};
+
+/* name of selected SIMD kernel ("scalar" or "avx2") */
+const char *warp_simd_kernel_name();
+
+#endif	/* _WARP_FUNCS_H */